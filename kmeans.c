@@ -5,19 +5,184 @@
  */
 
 #include "kmeans.h"
+#include "kmeans_pool.h"
+#include "kmeans_internal.h"
 
 #include <stdlib.h>
 #include <assert.h>
+#include <math.h>
 #include <string.h>
 
 
+/* State shared by every thread of a generic clustering run. */
+typedef struct
+{
+    kmeans_meta *meta;
+
+    /* Per-thread member counts: num_threads rows of num_centroids. */
+    size_t *counts;
+
+    /* Whether the accumulate/finalize pair is in use. */
+    int fused;
+
+    /*
+     * Per-thread counts of objects which changed cluster in the latest pass,
+     * and sums of their distances to the centroids they were assigned to.
+     */
+    size_t *changed;
+    double *inertia;
+} generic_run;
+
+
+/* Zero a thread's slice of assignments, so its pages are first touched by it. */
+static
+void
+generic_job_init(void *context,
+                 const size_t thread,
+                 const size_t num_threads)
+{
+    generic_run *run = (generic_run *)context;
+    size_t lo, hi;
+
+    kmeans_pool_slice(run->meta->num_objects, thread, num_threads, &lo, &hi);
+    memset(run->meta->cluster_assignments + lo, 0, sizeof(int) * (hi - lo));
+}
+
+
+/* Update the relation of each object in a thread's slice to its nearest centroid. */
+static
+void
+generic_job_assign(void *context,
+                   const size_t thread,
+                   const size_t num_threads)
+{
+    generic_run *run = (generic_run *)context;
+    kmeans_meta *meta = run->meta;
+    object *accumulators = NULL;
+    size_t *counts = NULL;
+    size_t changed = 0;
+    double inertia = 0.0;
+    size_t lo, hi;
+
+    kmeans_pool_slice(meta->num_objects, thread, num_threads, &lo, &hi);
+
+    /* Each thread owns one row of accumulators and counts. */
+    if (run->fused) {
+        accumulators = meta->accumulators + (thread * meta->num_centroids);
+        counts = run->counts + (thread * meta->num_centroids);
+    }
+
+    for (size_t i = lo; i < hi; ++i) {
+        object o = meta->input_objects[i];
+
+        /* Null objects always get assigned a cluster value of -1. */
+        if (!o) {
+            if (-1 != meta->cluster_assignments[i]) ++changed;
+            meta->cluster_assignments[i] = -1;
+            continue;
+        }
+
+        /* Distance to the first list centroid. */
+        double current_distance =
+            (meta->linear_distance)(o, meta->centroids[0]);
+        int current_cluster = 0;
+
+        /* Check distances to other clusters. */
+        for (int cluster = 1; cluster < meta->num_centroids; ++cluster) {
+            double distance =
+                (meta->linear_distance)(o, meta->centroids[cluster]);
+
+            /*
+             * If the distance to this centroid is the minimum of the set, then
+             * this cluster is the one the object should associate with.
+             */
+            if (distance < current_distance) {
+                current_distance = distance;
+                current_cluster = cluster;
+            }
+        }
+
+        /* Update which cluster this object belongs to, counting any change. */
+        if (current_cluster != meta->cluster_assignments[i]) ++changed;
+        meta->cluster_assignments[i] = current_cluster;
+        inertia += current_distance;
+
+        /* Fold the object into its cluster's running sum while it is hot. */
+        if (run->fused) {
+            (meta->accumulate)(accumulators[current_cluster], o);
+            ++counts[current_cluster];
+        }
+    }
+
+    run->changed[thread] = changed;
+    run->inertia[thread] = inertia;
+}
+
+
+/*
+ * Merge every thread's accumulators into the first row as a pairwise tree. The
+ *  order only depends on the thread count, so results are reproducible.
+ */
+static
+void
+generic_reduce(generic_run *run,
+               size_t num_threads)
+{
+    kmeans_meta *meta = run->meta;
+    const size_t k = meta->num_centroids;
+
+    for (size_t stride = 1; stride < num_threads; stride *= 2) {
+        for (size_t t = 0; t + stride < num_threads; t += 2 * stride) {
+            for (size_t i = 0; i < k; ++i) {
+                (meta->merge)(meta->accumulators[(t * k) + i],
+                              meta->accumulators[((t + stride) * k) + i]);
+                run->counts[(t * k) + i] += run->counts[((t + stride) * k) + i];
+            }
+        }
+    }
+}
+
+
+/*
+ * Gather the statistics of an iteration, summing the per-thread results in
+ *  thread order. Each centroid's shift is measured against its copy taken
+ *  before the update, when there is one.
+ */
+static
+void
+generic_measure(generic_run *run,
+                size_t num_threads,
+                const char *centroids_previous,
+                kmeans_iteration_stats *stats)
+{
+    kmeans_meta *meta = run->meta;
+
+    stats->reassigned = 0;
+    stats->inertia = 0.0;
+    for (size_t t = 0; t < num_threads; ++t) {
+        stats->reassigned += run->changed[t];
+        stats->inertia += run->inertia[t];
+    }
+
+    stats->max_shift = centroids_previous ? 0.0 : NAN;
+    for (size_t c = 0; centroids_previous && c < meta->num_centroids; ++c) {
+        double shift = (meta->linear_distance)(
+            (object)(centroids_previous + (c * meta->centroid_size)),
+            meta->centroids[c]);
+
+        if (shift > stats->max_shift) stats->max_shift = shift;
+    }
+}
+
+
 kmeans_result
 compute_kmeans(kmeans_meta *meta)
 {
     /* Need some basic assertions that guarantee the input structure's integrity. */
     assert(meta);
 
-    assert(meta->get_centroid);
+    assert(meta->get_centroid
+           || (meta->accumulate && meta->finalize && meta->accumulators));
     assert(meta->linear_distance);
     assert(meta->input_objects);
     assert(meta->centroids);
@@ -29,68 +194,123 @@ compute_kmeans(kmeans_meta *meta)
 
     assert(meta->iterations > 0);
 
+    /* Centroid shifts can only be measured on copies of the centroids. */
+    assert(!(meta->shift_tolerance > 0.0) || meta->centroid_size);
+
     /* Local variables. */
     int iterations = 0;
-    int clusters_size = sizeof(int) * meta->num_objects;
-    int *clusters_previous = malloc(clusters_size);
+    size_t num_threads = meta->num_threads ? meta->num_threads : 1;
+    kmeans_pool *pool = NULL;
+    generic_run run = {
+            .meta = meta,
+            .fused = (meta->accumulate && meta->finalize && meta->accumulators),
+    };
+    char *centroids_previous = NULL;
+    kmeans_iteration_stats stats = { 0 };
+    double previous_inertia = HUGE_VAL;
+    unsigned long long start = 0;
     kmeans_result result;
 
+    /* Whether each iteration's statistics are needed at all. */
+    const int measure = meta->observer
+        || meta->reassign_tolerance > 0.0
+        || meta->inertia_tolerance > 0.0
+        || meta->shift_tolerance > 0.0;
+
+    if (num_threads > meta->num_objects) num_threads = meta->num_objects;
+
+    /* Threaded accumulation needs a way to combine the per-thread sums. */
+    assert(!run.fused || num_threads == 1 || meta->merge);
+
+    if (run.fused)
+        run.counts = calloc(num_threads * meta->num_centroids, sizeof(size_t));
+
+    run.changed = calloc(num_threads, sizeof(size_t));
+    run.inertia = calloc(num_threads, sizeof(double));
+
+    if (measure && meta->centroid_size)
+        centroids_previous = malloc(meta->centroid_size * meta->num_centroids);
+
+    if (!run.changed
+        || !run.inertia
+        || (run.fused && !run.counts)
+        || (measure && meta->centroid_size && !centroids_previous)
+        || !(pool = kmeans_pool_create(num_threads))) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
     /* Initialize all cluster assignments to 0. */
-    memset(meta->cluster_assignments, 0, clusters_size);
+    kmeans_pool_run(pool, generic_job_init, &run);
 
     /* Loop until breaking. */
     while (1) {
-        /* Preserve the previous set of cluster assignments. */
-        memcpy(clusters_previous, meta->cluster_assignments, clusters_size);
+        /*
+         * Update the relation of each object to its nearest centroid. The
+         * threads count every object whose cluster changed as they go.
+         */
+        if (meta->observer) start = kmeans_clock_ns();
+        kmeans_pool_run(pool, generic_job_assign, &run);
+        if (meta->observer) stats.assign_ns = kmeans_clock_ns() - start;
 
-        /* Update the relation of each object to its nearest centroid. */
-        for (int i = 0; i < meta->num_objects; ++i) {
-            object o = meta->input_objects[i];
+        for (size_t c = 0; centroids_previous && c < meta->num_centroids; ++c)
+            memcpy(centroids_previous + (c * meta->centroid_size),
+                   meta->centroids[c], meta->centroid_size);
 
-            /* Null objects always get assigned a cluster value of -1. */
-            if (!o) {
-                meta->cluster_assignments[i] = -1;
-                continue;
-            }
+        if (meta->observer) start = kmeans_clock_ns();
 
-            /* Distance to the first list centroid. */
-            double current_distance =
-                (meta->linear_distance)(o, meta->centroids[0]);
-            int current_cluster = 0;
-
-            /* Check distances to other clusters. */
-            for (int cluster = 1; cluster < meta->num_centroids; ++cluster) {
-                double distance =
-                    (meta->linear_distance)(o, meta->centroids[cluster]);
-
-                /*
-                 * If the distance to this centroid is the minimum of the set, then
-                 * this cluster is the one the object should associate with.
-                 */
-                if (distance < current_distance) {
-                    current_distance = distance;
-                    current_cluster = cluster;
-                }
+        /* Update each centroid location. */
+        if (run.fused) {
+            generic_reduce(&run, num_threads);
+
+            for (int i = 0; i < meta->num_centroids; ++i) {
+                (meta->finalize)(meta->centroids[i],
+                                 meta->accumulators[i],
+                                 run.counts[i]);
             }
 
-            /* Update which cluster this object belongs to. */
-            meta->cluster_assignments[i] = current_cluster;
+            memset(run.counts, 0,
+                   sizeof(size_t) * num_threads * meta->num_centroids);
+        } else {
+            for (int i = 0; i < meta->num_centroids; ++i)
+                (meta->get_centroid)(meta, i);
         }
 
-        /* Update each centroid location. */
-        for (int i = 0; i < meta->num_centroids; ++i)
-            (meta->get_centroid)(meta, i);
+        size_t changed = 0;
+        for (size_t t = 0; t < num_threads; ++t) changed += run.changed[t];
+
+        int stop = 0;
+        if (measure) {
+            if (meta->observer) stats.update_ns = kmeans_clock_ns() - start;
+            stats.iteration = iterations;
+            generic_measure(&run, num_threads, centroids_previous, &stats);
+
+            if (meta->observer)
+                stop = (meta->observer)(&stats, meta->observer_context);
+        }
 
         /*
-         * Compare memory. If the previous cluster assignments matches
-         * now, then convergence is confirmed.
+         * If no object changed cluster, the assignments match the previous
+         * iteration and convergence is confirmed. Otherwise the run may still
+         * be close enough to converged by the tolerances.
          */
-        if (0 == memcmp(clusters_previous,
-                        meta->cluster_assignments,
-                        clusters_size)) {
+        if (!changed
+            || (measure && kmeans_tolerance_met(&stats, meta->num_objects,
+                                                previous_inertia,
+                                                meta->reassign_tolerance,
+                                                meta->inertia_tolerance,
+                                                meta->shift_tolerance))) {
             result = KMEANS_OK;
             goto break_out;
         }
+        previous_inertia = stats.inertia;
+
+        /* The observer may end the run before it converges. */
+        if (stop) {
+            ++iterations;
+            result = KMEANS_STOPPED;
+            goto break_out;
+        }
 
         /* Otherwise, increment the iterations count. */
         if (iterations++ > meta->iterations) {
@@ -101,7 +321,11 @@ compute_kmeans(kmeans_meta *meta)
 
     /* No matter the result, always perform these actions. */
 break_out:
-    free(clusters_previous);
+    kmeans_pool_destroy(pool);
+    free(centroids_previous);
+    free(run.counts);
+    free(run.changed);
+    free(run.inertia);
     meta->current_iterations = iterations;
     return result;
 }
\ No newline at end of file
@@ -17,7 +17,10 @@
 /* A simple 'results' enum. */
 typedef enum
 {
-    KMEANS_LIMIT = -4,
+    KMEANS_STOPPED = -7,
+    KMEANS_IO_ERROR,
+    KMEANS_NO_MEMORY,
+    KMEANS_LIMIT,
     KMEANS_MALFORMED_INPUT,
     KMEANS_BAD_LENGTH,
     KMEANS_NO_DATA,
@@ -25,8 +28,83 @@ typedef enum
 } kmeans_result;
 
 
-/* Early, prototypical definition of this type. */
+/* Memory layouts accepted by the dense (contiguous matrix) interface. */
+typedef enum
+{
+    KMEANS_ROW_MAJOR = 0,   /* data[(object * dim) + dimension] */
+    KMEANS_COLUMN_MAJOR     /* data[(dimension * num_objects) + object] */
+} kmeans_layout;
+
+
+/* Element types of a data matrix. */
+typedef enum
+{
+    KMEANS_FLOAT64 = 0,   /* double */
+    KMEANS_FLOAT32,       /* float */
+    KMEANS_INT8,          /* int8_t, quantized by a scale */
+    KMEANS_UINT8          /* uint8_t, quantized by a scale */
+} kmeans_dtype;
+
+
+/*
+ * Assignment strategies for the dense interface. All produce the same clusters,
+ *  except that KMEANS_KDTREE adds whole subtrees to the sums at once: its
+ *  centroids can differ in the last bits, which may settle near-ties apart.
+ */
+typedef enum
+{
+    KMEANS_LLOYD = 0,   /* compare every point against every centroid */
+    KMEANS_HAMERLY,     /* one upper and one lower distance bound per point */
+    KMEANS_ELKAN,       /* one upper and k lower distance bounds per point */
+    KMEANS_AUTO,        /* GEMM for double data once dim * k is large, else Lloyd */
+    KMEANS_YINYANG,     /* one upper and one lower bound per centroid group */
+    KMEANS_KDTREE,      /* filter centroids down a k-d tree, for dim <= ~8 */
+    KMEANS_GEMM         /* tiled matrix products, for dim from about 64 */
+} kmeans_algorithm;
+
+
+/*
+ * Telemetry for one assignment pass and the centroid update that follows it,
+ *  handed to an observer. The dense driver only sums the inertia while an
+ *  observer or an inertia tolerance is set, as it costs an extra pass over
+ *  the objects there. The generic interface always sums it from the
+ *  distances its assignment pass measures anyway. Phases are only timed
+ *  while an observer is installed.
+ */
+typedef struct
+{
+    /* Zero for the first assignment pass. */
+    unsigned long iteration;
+
+    /* How many objects changed cluster in this pass. */
+    size_t reassigned;
+
+    /* Sum of the squared distances from each object to its assigned centroid. */
+    double inertia;
+
+    /* The farthest any centroid moved in the update, or NAN if unknown. */
+    double max_shift;
+
+    /* Wall time of the assignment and of the update phases. */
+    unsigned long long assign_ns;
+    unsigned long long update_ns;
+} kmeans_iteration_stats;
+
+/*
+ * Prototypical method observing a run after every iteration. Returning
+ *  non-zero stops the run early with KMEANS_STOPPED, unless that iteration
+ *  converged anyway. Either way the centroids and assignments stay valid.
+ */
+typedef int (*kmeans_observer_t) (
+    const kmeans_iteration_stats *stats   IN,
+    void                         *context IN OUT   /* the observer's context */
+);
+
+
+/* Early, prototypical definitions of these types. */
 typedef struct _kmeans_meta kmeans_meta;
+typedef struct _kmeans_dense_meta kmeans_dense_meta;
+typedef struct _kmeans_kdtree kmeans_kdtree;
 
 
 /* Primary method for computing K-Means Clustering from an input parcel. */
@@ -35,6 +113,16 @@ compute_kmeans(
     kmeans_meta *meta IN OUT
 );
 
+/*
+ * Compute K-Means Clustering over a contiguous matrix of doubles. This
+ *  avoids the pointer chase and indirect call per distance that the
+ *  generic object interface needs, so the inner loops can be inlined.
+ */
+kmeans_result
+compute_kmeans_dense(
+    kmeans_dense_meta *meta IN OUT
+);
+
 
 /* A void pointer represents a generic object type. */
 typedef void * object;
@@ -45,6 +133,32 @@ typedef void (*func_centroid_t) (
     const int     cluster IN   /* the cluster number being modified */
 );
 
+/* Prototypical method for adding an object into a running per-cluster sum. */
+typedef void (*func_accumulate_t) (
+    object        sum IN OUT,   /* the cluster's accumulator object */
+    const object  o   IN   /* the object being added to the cluster */
+);
+
+/*
+ * Prototypical method for turning an accumulated sum into a new centroid.
+ * When 'count' is non-zero the centroid becomes the mean of the sum. The sum
+ * must be reset to zero afterwards so it is ready for the next iteration.
+ */
+typedef void (*func_finalize_t) (
+    object        centroid OUT,      /* the centroid being updated */
+    object        sum      IN OUT,   /* the cluster's accumulator object */
+    const size_t  count    IN   /* how many objects went into the sum */
+);
+
+/*
+ * Prototypical method for folding one thread's accumulator into another. The
+ * 'from' sum must be reset to zero afterwards, like finalize does.
+ */
+typedef void (*func_merge_t) (
+    object  into IN OUT,   /* the accumulator receiving the sum */
+    object  from IN OUT   /* the accumulator being merged and cleared */
+);
+
 /* Prototypical method for computing linear distance between two objects. */
 typedef double (*func_linear_distance_t) (
     const object left  IN,   /* Point A */
@@ -55,9 +169,24 @@ typedef double (*func_linear_distance_t) (
 /* A meta-structure containing information about the running algorithm. */
 struct _kmeans_meta
 {
-    /* Get the centroid for any collection of objects. */
+    /*
+     * Get the centroid for any collection of objects. This is only used
+     * when the accumulate/finalize pair below is not provided, and costs a
+     * full pass over the input objects per cluster.
+     */
     func_centroid_t get_centroid;
 
+    /*
+     * Optional pair for updating all centroids in a single pass: each object
+     * is accumulated into its cluster's sum as it is assigned, and then every
+     * centroid is finalized once per iteration.
+     */
+    func_accumulate_t accumulate;
+    func_finalize_t finalize;
+
+    /* Combines per-thread accumulators; required when num_threads > 1. */
+    func_merge_t merge;
+
     /* Get the linear distance between any two objects. */
     func_linear_distance_t linear_distance;
 
@@ -82,6 +211,20 @@ struct _kmeans_meta
     /* The length of the centroids array, AKA 'k'. */
     size_t num_centroids;
 
+    /*
+     * An array of zeroed objects used as running sums by the accumulate and
+     * finalize pair: num_centroids of them, times num_threads when running
+     * threaded. User is responsible for this array.
+     */
+    object *accumulators;
+
+    /*
+     * How many threads assign objects in parallel (0 or 1 runs serially).
+     * The linear_distance and accumulate methods must be safe to call from
+     * several threads at once on distinct objects.
+     */
+    size_t num_threads;
+
     /* How many times the algorithm should run to check convergence. */
     unsigned long iterations;
 
@@ -90,6 +233,140 @@ struct _kmeans_meta
 
     /* Array to fill with cluster as assigned to objects. User responsible. */
     int * cluster_assignments;
+
+    /* Optional method called after every iteration, with its context. */
+    kmeans_observer_t observer;
+    void *observer_context;
+
+    /*
+     * Size in bytes of a centroid object. Optional: when set, an observed run
+     * copies the centroids before each update to measure how far they moved,
+     * with linear_distance. The objects must then be flat, copyable structs.
+     * Inertia is likewise the sum of linear_distance to each object's centroid.
+     */
+    size_t centroid_size;
+
+    /*
+     * Optional stopping tolerances, each disabled while zero. The run counts
+     * as converged once any enabled one holds after an iteration: at most
+     * this fraction of the objects changed cluster, the inertia improved by
+     * less than this fraction of itself, or no centroid moved further than
+     * this (measured with linear_distance, which needs centroid_size).
+     */
+    double reassign_tolerance;
+    double inertia_tolerance;
+    double shift_tolerance;
+};
+
+
+/* Meta-structure for clustering a contiguous matrix of real-valued points. */
+struct _kmeans_dense_meta
+{
+    /*
+     * The input matrix of num_objects points with dim values each, of type
+     * 'dtype' and laid out according to 'layout'. The user is responsible
+     * for this memory.
+     */
+    const void *data;
+
+    /* Amount of points in the data matrix. */
+    size_t num_objects;
+
+    /* Dimensionality of each point (and each centroid). */
+    size_t dim;
+
+    /* How the data matrix is ordered in memory. */
+    kmeans_layout layout;
+
+    /*
+     * Element type of the data matrix. Narrower types halve (or better) the
+     * memory traffic of the assignment step, while centroids are still summed
+     * and kept in double precision. The Lloyd engine also compares distances
+     * in single precision then, so near-ties may settle differently than with
+     * double data; the bounded engines widen every point to double instead.
+     */
+    kmeans_dtype dtype;
+
+    /* Value of one quantization step of int8/uint8 data. Zero means 1. */
+    double scale;
+
+    /*
+     * A row-major matrix of num_centroids x dim initial centroid values,
+     * which is updated in place. User is responsible for seeding this with
+     * a reasonable set and for its memory management.
+     */
+    double *centroids;
+
+    /* The amount of centroids, AKA 'k'. */
+    size_t num_centroids;
+
+    /* How many times the algorithm should run to check convergence. */
+    unsigned long iterations;
+
+    /* Current iterations counter. */
+    unsigned long current_iterations;
+
+    /* Amount of point-to-centroid distances the run computed. Output only. */
+    unsigned long long distance_evaluations;
+
+    /* Array to fill with cluster as assigned to objects. User responsible. */
+    int *cluster_assignments;
+
+    /*
+     * How many threads share the assignment step (0 or 1 runs serially). The
+     * threads are kept in a pool for the whole run, each one always handles
+     * the same slice of points, and their partial sums are merged in a fixed
+     * tree order so results are reproducible for a given thread count.
+     */
+    size_t num_threads;
+
+    /*
+     * How points are matched with centroids. The bounded algorithms keep
+     * per-point distance bounds between iterations (Elkan needs k of them
+     * per point), and skip every distance the triangle inequality proves
+     * cannot change an assignment. Late iterations then touch few centroids.
+     */
+    kmeans_algorithm algorithm;
+
+    /*
+     * Amount of centroid groups used by KMEANS_YINYANG, which bounds its
+     * memory at O(num_objects * num_groups). Zero picks about k / 64.
+     */
+    size_t num_groups;
+
+    /*
+     * Optional k-d tree for KMEANS_KDTREE, from kmeans_kdtree_build() over
+     * this same data and thread count, so several runs can share one. When
+     * null or built for anything else, the run builds a tree of its own.
+     */
+    const kmeans_kdtree *kdtree;
+
+    /*
+     * Optional array of num_objects non-negative point weights. Each point
+     * then counts as that many points in the centroid means and the inertia,
+     * while the assignments themselves are unchanged. A cluster whose members
+     * weigh nothing keeps its location. Null weighs every point 1. Only
+     * honoured by compute_kmeans_dense() and the drivers built on it.
+     */
+    const double *weights;
+
+    /*
+     * Optional method called after every iteration, with its context. The
+     * reported centroid shifts are Euclidean distances.
+     */
+    kmeans_observer_t observer;
+    void *observer_context;
+
+    /*
+     * Optional stopping tolerances, each disabled while zero. The run counts
+     * as converged once any enabled one holds after an iteration: at most
+     * this fraction of the points changed cluster, the inertia improved by
+     * less than this fraction of itself, or no centroid moved further than
+     * this Euclidean distance. The inertia check costs an extra O(n) pass.
+     */
+    double reassign_tolerance;
+    double inertia_tolerance;
+    double shift_tolerance;
 };
 
 
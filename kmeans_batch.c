@@ -0,0 +1,404 @@
+/*
+ * kmeans_batch.c
+ *
+ * Implementation of workspace-backed clustering. Each thread of a workspace
+ *  owns a slot of scratch space sized for the largest problem, and solves its
+ *  problems one after the other within it. Nothing is allocated after the
+ *  workspace is created: problem views live on the stack, and the pool
+ *  publishes each batch to threads that are already waiting.
+ */
+
+#include "kmeans_batch.h"
+#include "kmeans_seed.h"
+#include "kmeans_pool.h"
+#include "kmeans_kernels.h"
+#include "kmeans_internal.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+
+/* Scratch space of one thread. */
+typedef struct
+{
+    /* Per-cluster sums and counts. */
+    double *sums;
+    size_t *counts;
+
+    /* The centroids as a transposed kernel block, and before an update. */
+    double *centroids_t;
+    double *previous;
+
+    /* A gathered point, and each point's distance to its nearest pick. */
+    double *row;
+    double *nearest;
+
+    /* The first problem of its run which did not converge, and its result. */
+    size_t failed;
+    kmeans_result failure;
+} workspace_slot;
+
+struct _kmeans_workspace
+{
+    size_t max_objects;
+    size_t max_centroids;
+    size_t max_dim;
+
+    kmeans_pool *pool;
+    workspace_slot *slots;
+    size_t num_threads;
+
+    /* Thread 't' solves the problems [bounds[t], bounds[t + 1]) of a batch. */
+    size_t *bounds;
+};
+
+/* A batch being solved by the threads of a workspace. */
+typedef struct
+{
+    kmeans_batch_meta *meta;
+    kmeans_workspace *workspace;
+} batch_job;
+
+
+kmeans_result
+kmeans_workspace_create(size_t max_objects,
+                        size_t max_centroids,
+                        size_t max_dim,
+                        size_t num_threads,
+                        kmeans_workspace **workspace)
+{
+    assert(workspace);
+    assert(max_objects);
+    assert(max_centroids);
+    assert(max_dim);
+
+    kmeans_workspace *self = calloc(1, sizeof(kmeans_workspace));
+
+    *workspace = NULL;
+    if (!self) return KMEANS_NO_MEMORY;
+
+    self->max_objects = max_objects;
+    self->max_centroids = max_centroids;
+    self->max_dim = max_dim;
+    self->num_threads = num_threads ? num_threads : 1;
+    self->slots = calloc(self->num_threads, sizeof(workspace_slot));
+    self->bounds = malloc(sizeof(size_t) * (self->num_threads + 1));
+
+    if (!self->slots || !self->bounds || !(self->pool = kmeans_pool_create(self->num_threads))) {
+        kmeans_workspace_destroy(self);
+        return KMEANS_NO_MEMORY;
+    }
+
+    for (size_t t = 0; t < self->num_threads; ++t) {
+        workspace_slot *slot = &(self->slots[t]);
+
+        slot->sums = malloc(sizeof(double) * max_centroids * max_dim);
+        slot->counts = malloc(sizeof(size_t) * max_centroids);
+        slot->centroids_t = kmeans_block_alloc(max_centroids, max_dim);
+        slot->previous = malloc(sizeof(double) * max_centroids * max_dim);
+        slot->row = malloc(sizeof(double) * max_dim);
+        slot->nearest = malloc(sizeof(double) * max_objects);
+
+        if (!slot->sums || !slot->counts || !slot->centroids_t
+            || !slot->previous || !slot->row || !slot->nearest) {
+            kmeans_workspace_destroy(self);
+            return KMEANS_NO_MEMORY;
+        }
+    }
+
+    *workspace = self;
+    return KMEANS_OK;
+}
+
+
+void
+kmeans_workspace_destroy(kmeans_workspace *workspace)
+{
+    if (!workspace) return;
+
+    kmeans_pool_destroy(workspace->pool);
+
+    for (size_t t = 0; workspace->slots && t < workspace->num_threads; ++t) {
+        workspace_slot *slot = &(workspace->slots[t]);
+
+        free(slot->sums);
+        free(slot->counts);
+        free(slot->centroids_t);
+        free(slot->previous);
+        free(slot->row);
+        free(slot->nearest);
+    }
+
+    free(workspace->slots);
+    free(workspace->bounds);
+    free(workspace);
+}
+
+
+/*
+ * Lay the centroids out as a kernel block for this problem's k and dim. The
+ *  block was allocated for the largest problem, so the padding lanes of this
+ *  one may hold centroids of an earlier one, and are sent back to infinity.
+ */
+static
+void
+batch_transpose(const kmeans_dense_meta *meta,
+                double *centroids_t)
+{
+    const size_t stride = kmeans_block_stride(meta->num_centroids);
+
+    kmeans_block_transpose(meta->centroids, meta->num_centroids, meta->dim,
+                           centroids_t);
+
+    for (size_t d = 0; d < meta->dim; ++d)
+        for (size_t c = meta->num_centroids; c < stride; ++c)
+            centroids_t[(d * stride) + c] = HUGE_VAL;
+}
+
+
+/* Lloyd's algorithm on the calling thread, within one slot of scratch space. */
+static
+kmeans_result
+batch_solve(kmeans_dense_meta *meta,
+            workspace_slot *slot)
+{
+    const kmeans_kernels *kernels = kmeans_kernels_for(meta->dim);
+    const size_t k = meta->num_centroids;
+    const size_t dim = meta->dim;
+    const size_t stride = kmeans_block_stride(k);
+    kmeans_iteration_stats stats = { 0 };
+    double previous_inertia = HUGE_VAL;
+    unsigned long long start = 0;
+    unsigned long iterations = 0;
+    kmeans_result result;
+
+    const int measure = meta->observer
+        || meta->reassign_tolerance > 0.0
+        || meta->inertia_tolerance > 0.0
+        || meta->shift_tolerance > 0.0;
+
+    meta->distance_evaluations = 0;
+    memset(meta->cluster_assignments, 0, sizeof(int) * meta->num_objects);
+    batch_transpose(meta, slot->centroids_t);
+
+    while (1) {
+        size_t changed = 0;
+        double inertia = 0.0;
+
+        if (meta->observer) start = kmeans_clock_ns();
+
+        memset(slot->sums, 0, sizeof(double) * k * dim);
+        memset(slot->counts, 0, sizeof(size_t) * k);
+
+        for (size_t i = 0; i < meta->num_objects; ++i) {
+            const double *row = kmeans_dense_row(meta, i, slot->row);
+            double distance;
+            int cluster = kernels->nearest(row, slot->centroids_t, stride, dim,
+                                           &distance);
+            double *sum = slot->sums + (cluster * dim);
+
+            if (meta->cluster_assignments[i] != cluster) {
+                meta->cluster_assignments[i] = cluster;
+                ++changed;
+            }
+
+            for (size_t d = 0; d < dim; ++d) sum[d] += row[d];
+            ++slot->counts[cluster];
+            inertia += distance;
+        }
+
+        meta->distance_evaluations += meta->num_objects * k;
+
+        if (meta->observer) {
+            stats.assign_ns = kmeans_clock_ns() - start;
+            start = kmeans_clock_ns();
+        }
+
+        /* Clusters which lost all of their members keep their previous location. */
+        memcpy(slot->previous, meta->centroids, sizeof(double) * k * dim);
+        stats.max_shift = 0.0;
+
+        for (size_t c = 0; c < k; ++c) {
+            double *centroid = meta->centroids + (c * dim);
+
+            if (!slot->counts[c]) continue;
+
+            for (size_t d = 0; d < dim; ++d)
+                centroid[d] = slot->sums[(c * dim) + d] / slot->counts[c];
+
+            const double shift = sqrt(kernels->pair(slot->previous + (c * dim),
+                                                    centroid, dim));
+            if (shift > stats.max_shift) stats.max_shift = shift;
+        }
+
+        batch_transpose(meta, slot->centroids_t);
+
+        int stop = 0;
+        if (measure) {
+            if (meta->observer) stats.update_ns = kmeans_clock_ns() - start;
+
+            stats.iteration = iterations;
+            stats.reassigned = changed;
+            stats.inertia = inertia;
+
+            if (meta->observer)
+                stop = (meta->observer)(&stats, meta->observer_context);
+        }
+
+        if (!changed
+            || (measure && kmeans_tolerance_met(&stats, meta->num_objects,
+                                                previous_inertia,
+                                                meta->reassign_tolerance,
+                                                meta->inertia_tolerance,
+                                                meta->shift_tolerance))) {
+            result = KMEANS_OK;
+            break;
+        }
+        previous_inertia = inertia;
+
+        if (stop) {
+            ++iterations;
+            result = KMEANS_STOPPED;
+            break;
+        }
+
+        if (iterations++ > meta->iterations) {
+            result = KMEANS_LIMIT;
+            break;
+        }
+    }
+
+    meta->current_iterations = iterations;
+    return result;
+}
+
+
+/* Check that a problem fits a workspace. */
+static inline
+int
+batch_fits(const kmeans_workspace *workspace,
+           size_t num_objects,
+           size_t num_centroids,
+           size_t dim)
+{
+    return num_objects <= workspace->max_objects
+        && num_centroids <= workspace->max_centroids
+        && dim <= workspace->max_dim;
+}
+
+
+kmeans_result
+compute_kmeans_small(kmeans_dense_meta *meta,
+                     kmeans_workspace *workspace)
+{
+    assert(meta);
+    assert(workspace);
+
+    assert(meta->data);
+    assert(meta->centroids);
+    assert(meta->cluster_assignments);
+
+    assert(meta->num_objects);
+    assert(meta->dim);
+    assert(meta->num_centroids);
+    assert(meta->num_centroids <= meta->num_objects);
+
+    assert(meta->iterations > 0);
+
+    if (!batch_fits(workspace, meta->num_objects, meta->num_centroids, meta->dim))
+        return KMEANS_BAD_LENGTH;
+
+    return batch_solve(meta, &(workspace->slots[0]));
+}
+
+
+/* Solve one thread's run of problems. */
+static
+void
+batch_job_solve(void *context,
+                const size_t thread,
+                const size_t num_threads)
+{
+    batch_job *job = (batch_job *)context;
+    kmeans_batch_meta *meta = job->meta;
+    workspace_slot *slot = &(job->workspace->slots[thread]);
+    const size_t k = meta->num_centroids;
+    const size_t last = job->workspace->bounds[thread + 1];
+
+    (void)num_threads;
+
+    slot->failed = last;
+    slot->failure = KMEANS_OK;
+
+    for (size_t p = job->workspace->bounds[thread]; p < last; ++p) {
+        const size_t first = meta->offsets[p];
+        kmeans_dense_meta problem = {
+                .data = meta->data + (first * meta->dim),
+                .num_objects = meta->offsets[p + 1] - first,
+                .dim = meta->dim,
+                .centroids = meta->centroids + (p * k * meta->dim),
+                .num_centroids = k,
+                .iterations = meta->iterations,
+                .cluster_assignments = meta->cluster_assignments + first,
+        };
+        kmeans_result result = KMEANS_BAD_LENGTH;
+
+        if (problem.num_objects >= k
+            && batch_fits(job->workspace, problem.num_objects, k, meta->dim)) {
+            if (meta->seed_centroids) {
+                kmeans_rng rng;
+
+                kmeans_rng_seed(&rng, meta->seed + p);
+                kmeans_plusplus(kmeans_kernels_for(meta->dim), problem.data,
+                                NULL, problem.num_objects, meta->dim, k, &rng,
+                                slot->nearest, NULL, problem.centroids);
+            }
+            result = batch_solve(&problem, slot);
+        }
+
+        if (meta->results) meta->results[p] = result;
+        if (meta->current_iterations)
+            meta->current_iterations[p] = problem.current_iterations;
+
+        if (KMEANS_OK != result && slot->failed == last) {
+            slot->failed = p;
+            slot->failure = result;
+        }
+    }
+}
+
+
+kmeans_result
+compute_kmeans_batch(kmeans_batch_meta *meta,
+                     kmeans_workspace *workspace)
+{
+    assert(meta);
+    assert(workspace);
+
+    assert(meta->data);
+    assert(meta->offsets);
+    assert(meta->centroids);
+    assert(meta->cluster_assignments);
+
+    assert(meta->dim);
+    assert(meta->num_centroids);
+    assert(meta->iterations > 0);
+
+    const size_t num_threads = workspace->num_threads;
+    workspace_slot *slots = workspace->slots;
+    batch_job job = { .meta = meta, .workspace = workspace };
+
+    /* Each thread gets a run of problems holding about as many points. */
+    kmeans_pool_partition(meta->offsets, meta->num_problems, num_threads,
+                          workspace->bounds);
+
+    kmeans_pool_run(workspace->pool, batch_job_solve, &job);
+
+    /* Threads own ascending runs, so the first failure found is the first. */
+    for (size_t t = 0; t < num_threads; ++t)
+        if (KMEANS_OK != slots[t].failure) return slots[t].failure;
+
+    return KMEANS_OK;
+}
@@ -0,0 +1,130 @@
+/*
+ * kmeans_batch.h
+ *
+ * Many small K-Means Clustering problems, with every byte of scratch space
+ *  held by a caller-owned workspace. A workspace is sized once for the
+ *  largest problem it will see and reused by every call after, so clustering
+ *  a few dozen points costs no allocations, no thread creation and no setup
+ *  beyond the clustering itself.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_BATCH_H
+#define CIS579_TERMPROJECT_KMEANS_BATCH_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "kmeans.h"
+
+
+/* Opaque workspace type. */
+typedef struct _kmeans_workspace kmeans_workspace;
+
+
+/* Meta-structure for a batch of independent problems packed together. */
+typedef struct
+{
+    /*
+     * The points of every problem back to back, as one row-major matrix
+     * of dim columns. The user is responsible for this memory.
+     */
+    const double *data;
+
+    /*
+     * Problem 'p' owns the points [offsets[p], offsets[p + 1]) of the data.
+     * There are num_problems + 1 offsets, starting at zero.
+     */
+    const size_t *offsets;
+
+    /* Amount of problems. */
+    size_t num_problems;
+
+    /* Dimensionality of every point (and every centroid). */
+    size_t dim;
+
+    /* The amount of centroids of each problem, AKA 'k'. */
+    size_t num_centroids;
+
+    /*
+     * The row-major centroids of every problem back to back: num_problems
+     * x num_centroids x dim values, problem 'p' starting at value p * k *
+     * dim. They are updated in place. User is responsible for this memory,
+     * and for seeding it unless seed_centroids is set.
+     */
+    double *centroids;
+
+    /*
+     * When non-zero, problem 'p' is first seeded with k-means++ from a
+     * generator seeded with seed + p, so results do not depend on which
+     * thread solves which problem.
+     */
+    int seed_centroids;
+    uint64_t seed;
+
+    /* How many times each problem may iterate to check convergence. */
+    unsigned long iterations;
+
+    /* Array of offsets[num_problems] ints to fill with clusters. User responsible. */
+    int *cluster_assignments;
+
+    /* Optional arrays of num_problems results and iteration counts. Output only. */
+    kmeans_result *results;
+    unsigned long *current_iterations;
+} kmeans_batch_meta;
+
+
+/*
+ * Create a workspace for problems of up to max_objects points, max_centroids
+ *  centroids and max_dim dimensions, solved by num_threads threads at once
+ *  (0 or 1 solves them on the calling thread). The threads are started here
+ *  and kept until the workspace is destroyed. A workspace may be used by one
+ *  call at a time.
+ */
+kmeans_result
+kmeans_workspace_create(
+    size_t             max_objects   IN,
+    size_t             max_centroids IN,
+    size_t             max_dim       IN,
+    size_t             num_threads   IN,
+    kmeans_workspace **workspace     OUT
+);
+
+/* Stop the threads of a workspace and free it. */
+void
+kmeans_workspace_destroy(
+    kmeans_workspace *workspace IN
+);
+
+/*
+ * Cluster one small dense problem with Lloyd's algorithm on the calling
+ *  thread, entirely within a workspace. It produces the same clusters as
+ *  compute_kmeans_dense() with the Lloyd engine and one thread over row-major
+ *  double data. Other layouts and dtypes are widened to double like the
+ *  bounded engines do. Its num_threads, algorithm, num_groups and kdtree are
+ *  ignored, while the observer and tolerances are honoured. The inertia it
+ *  reports is that of each assignment pass, against the centroids the points
+ *  were assigned to.
+ *  Returns KMEANS_BAD_LENGTH for a problem larger than the workspace.
+ */
+kmeans_result
+compute_kmeans_small(
+    kmeans_dense_meta *meta      IN OUT,
+    kmeans_workspace  *workspace IN OUT
+);
+
+/*
+ * Cluster every problem of a batch, spread across the threads of the
+ *  workspace in runs of consecutive problems holding about as many points
+ *  each. Each problem is solved as by compute_kmeans_small(). A problem with
+ *  fewer points than centroids, or beyond the workspace, fails alone with
+ *  KMEANS_BAD_LENGTH. Returns KMEANS_OK, or else the result of the first
+ *  problem which did not converge.
+ */
+kmeans_result
+compute_kmeans_batch(
+    kmeans_batch_meta *meta      IN OUT,
+    kmeans_workspace  *workspace IN OUT
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_BATCH_H */
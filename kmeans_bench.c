@@ -0,0 +1,709 @@
+/*
+ * kmeans_bench.c
+ *
+ * Reproducible benchmark suite. Seeded synthetic datasets are generated over
+ *  a grid of sizes, dimensions and cluster counts, every engine variant runs
+ *  on each of them from the same initial centroids, and the timings of each
+ *  phase are reported as CSV or JSON so releases can be compared.
+ */
+
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "kmeans.h"
+#include "kmeans_seed.h"
+#include "kmeans_shard.h"
+
+
+/* The most values accepted in any list option. */
+#define BENCH_MAX_LIST 16
+
+/* Noise of the Gaussian blobs, and room given to each blob's center. */
+#define BENCH_BLOB_SIGMA 1.0
+#define BENCH_BLOB_SPACING 10.0
+
+
+typedef enum
+{
+    DATASET_BLOBS = 0,
+    DATASET_UNIFORM
+} bench_dataset;
+
+static const char *dataset_names[] = { "blobs", "uniform" };
+
+
+/*
+ * Engine variants: the generic object interface, then each dense algorithm,
+ *  then dense algorithms over the same data stored as float32 or int8, then
+ *  Lloyd sharded across one worker process per thread.
+ */
+typedef enum
+{
+    VARIANT_GENERIC = 0,
+    VARIANT_LLOYD,
+    VARIANT_HAMERLY,
+    VARIANT_ELKAN,
+    VARIANT_YINYANG,
+    VARIANT_KDTREE,
+    VARIANT_GEMM,
+    VARIANT_LLOYD_F32,
+    VARIANT_HAMERLY_F32,
+    VARIANT_LLOYD_I8,
+    VARIANT_SHARD_SOCKET,
+    VARIANT_SHARD_SHM,
+    VARIANT_COUNT
+} bench_variant;
+
+static const char *variant_names[] = {
+    "generic", "lloyd", "hamerly", "elkan", "yinyang", "kdtree", "gemm",
+    "lloyd_f32", "hamerly_f32", "lloyd_i8", "shard_socket", "shard_shm"
+};
+
+static const kmeans_algorithm variant_algorithms[] = {
+    KMEANS_LLOYD, KMEANS_LLOYD, KMEANS_HAMERLY, KMEANS_ELKAN, KMEANS_YINYANG,
+    KMEANS_KDTREE, KMEANS_GEMM, KMEANS_LLOYD, KMEANS_HAMERLY, KMEANS_LLOYD,
+    KMEANS_LLOYD, KMEANS_LLOYD
+};
+
+static const kmeans_dtype variant_dtypes[] = {
+    KMEANS_FLOAT64, KMEANS_FLOAT64, KMEANS_FLOAT64, KMEANS_FLOAT64,
+    KMEANS_FLOAT64, KMEANS_FLOAT64, KMEANS_FLOAT64, KMEANS_FLOAT32,
+    KMEANS_FLOAT32, KMEANS_INT8, KMEANS_FLOAT64, KMEANS_FLOAT64
+};
+
+
+typedef struct
+{
+    size_t values[BENCH_MAX_LIST];
+    size_t count;
+} bench_list;
+
+typedef struct
+{
+    bench_list sizes;
+    bench_list dims;
+    bench_list clusters;
+    int variants[VARIANT_COUNT];
+    int datasets[2];
+    size_t num_threads;
+    unsigned long iterations;
+    uint64_t seed;
+    int phases;
+    int json;
+    const char *path;
+} bench_options;
+
+/* Everything measured for one run. */
+typedef struct
+{
+    bench_dataset dataset;
+    bench_variant variant;
+    size_t n, dim, k;
+    kmeans_result result;
+    unsigned long iterations;
+    unsigned long passes;
+    double generate_s;
+    double seed_s;
+    double cluster_s;
+    double assign_s;
+    double update_s;
+    unsigned long long distances;
+    double inertia;
+} bench_record;
+
+
+/* Seconds on the monotonic clock. */
+static
+double
+bench_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec * 1e-9);
+}
+
+
+/* A standard normal value, through the Box-Muller transform. */
+static
+double
+bench_gaussian(kmeans_rng *rng)
+{
+    double u1 = 1.0 - kmeans_rng_uniform(rng);   /* in (0, 1] */
+    double u2 = kmeans_rng_uniform(rng);
+
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+
+/*
+ * Generate a row-major dataset. Blobs have k centers spread over a box which
+ *  grows with k, so blobs stay apart at any dimension, with Gaussian noise
+ *  around them. The uniform dataset fills a box of the same size.
+ */
+static
+double *
+bench_generate(bench_dataset dataset,
+               size_t n,
+               size_t dim,
+               size_t k,
+               uint64_t seed)
+{
+    double side = BENCH_BLOB_SPACING * ceil(pow((double)k, 1.0 / dim));
+    double *data = malloc(sizeof(double) * n * dim);
+    double *centers = malloc(sizeof(double) * k * dim);
+    kmeans_rng rng;
+
+    if (!data || !centers) {
+        free(data);
+        free(centers);
+        return NULL;
+    }
+
+    kmeans_rng_seed(&rng, seed);
+
+    for (size_t i = 0; i < k * dim; ++i)
+        centers[i] = side * kmeans_rng_uniform(&rng);
+
+    for (size_t i = 0; i < n; ++i) {
+        double *row = data + (i * dim);
+
+        if (DATASET_UNIFORM == dataset) {
+            for (size_t d = 0; d < dim; ++d)
+                row[d] = side * kmeans_rng_uniform(&rng);
+        } else {
+            const double *center = centers + (kmeans_rng_below(&rng, k) * dim);
+
+            for (size_t d = 0; d < dim; ++d)
+                row[d] = center[d] + (BENCH_BLOB_SIGMA * bench_gaussian(&rng));
+        }
+    }
+
+    free(centers);
+    return data;
+}
+
+
+/* Callbacks for the generic interface, where an object is one row. */
+static size_t generic_dim;
+
+static
+double
+generic_distance(const object left,
+                 const object right)
+{
+    const double *l = (const double *)left;
+    const double *r = (const double *)right;
+    double sum = 0.0;
+
+    for (size_t d = 0; d < generic_dim; ++d) {
+        double delta = l[d] - r[d];
+        sum += delta * delta;
+    }
+
+    return sum;
+}
+
+static
+void
+generic_accumulate(object sum,
+                   const object o)
+{
+    for (size_t d = 0; d < generic_dim; ++d)
+        ((double *)sum)[d] += ((const double *)o)[d];
+}
+
+static
+void
+generic_finalize(object centroid,
+                 object sum,
+                 const size_t count)
+{
+    if (count)
+        for (size_t d = 0; d < generic_dim; ++d)
+            ((double *)centroid)[d] = ((double *)sum)[d] / count;
+
+    memset(sum, 0, sizeof(double) * generic_dim);
+}
+
+static
+void
+generic_merge(object into,
+              object from)
+{
+    for (size_t d = 0; d < generic_dim; ++d)
+        ((double *)into)[d] += ((double *)from)[d];
+
+    memset(from, 0, sizeof(double) * generic_dim);
+}
+
+
+/* Observer adding up the time of each phase into a record. */
+static
+int
+bench_observe(const kmeans_iteration_stats *stats,
+              void *context)
+{
+    bench_record *record = (bench_record *)context;
+
+    record->assign_s += stats->assign_ns * 1e-9;
+    record->update_s += stats->update_ns * 1e-9;
+    return 0;
+}
+
+
+/* Run the generic object interface over a row-major matrix. */
+static
+kmeans_result
+bench_run_generic(const double *data,
+                  size_t n,
+                  size_t dim,
+                  double *centroids,
+                  size_t k,
+                  int *assignments,
+                  const bench_options *options,
+                  bench_record *record)
+{
+    size_t num_threads = options->num_threads ? options->num_threads : 1;
+    kmeans_result result = KMEANS_NO_MEMORY;
+    kmeans_meta meta = {
+            .accumulate = generic_accumulate,
+            .finalize = generic_finalize,
+            .merge = generic_merge,
+            .linear_distance = generic_distance,
+            .num_objects = n,
+            .num_centroids = k,
+            .num_threads = num_threads,
+            .iterations = options->iterations,
+            .cluster_assignments = assignments,
+            .observer = options->phases ? bench_observe : NULL,
+            .observer_context = record,
+    };
+
+    generic_dim = dim;
+    meta.input_objects = malloc(sizeof(object) * n);
+    meta.centroids = malloc(sizeof(object) * k);
+    meta.accumulators = malloc(sizeof(object) * k * num_threads);
+    double *sums = calloc(k * num_threads * dim, sizeof(double));
+
+    if (meta.input_objects && meta.centroids && meta.accumulators && sums) {
+        for (size_t i = 0; i < n; ++i)
+            meta.input_objects[i] = (object)(data + (i * dim));
+        for (size_t c = 0; c < k; ++c)
+            meta.centroids[c] = centroids + (c * dim);
+        for (size_t a = 0; a < k * num_threads; ++a)
+            meta.accumulators[a] = sums + (a * dim);
+
+        result = compute_kmeans(&meta);
+        record->iterations = meta.current_iterations;
+    }
+
+    free(meta.input_objects);
+    free(meta.centroids);
+    free(meta.accumulators);
+    free(sums);
+    return result;
+}
+
+
+/* Sum of squared distances from every point to its centroid. */
+static
+double
+bench_inertia(const double *data,
+              size_t n,
+              size_t dim,
+              const double *centroids,
+              const int *assignments)
+{
+    double inertia = 0.0;
+
+    for (size_t i = 0; i < n; ++i) {
+        const double *row = data + (i * dim);
+        const double *centroid = centroids + (assignments[i] * dim);
+
+        for (size_t d = 0; d < dim; ++d) {
+            double delta = row[d] - centroid[d];
+            inertia += delta * delta;
+        }
+    }
+
+    return inertia;
+}
+
+
+static
+void
+bench_print_header(FILE *out,
+                   const bench_options *options)
+{
+    if (options->json) {
+        fprintf(out, "[\n");
+        return;
+    }
+
+    fprintf(out, "dataset,variant,n,dim,k,threads,result,iterations,"
+                 "generate_s,seed_s,cluster_s,assign_s,update_s,points_per_s,"
+                 "distances,distances_per_s,inertia\n");
+}
+
+
+static
+void
+bench_print_record(FILE *out,
+                   const bench_options *options,
+                   const bench_record *r,
+                   int first)
+{
+    double points_per_s = r->cluster_s > 0.0
+        ? ((double)r->n * r->passes) / r->cluster_s
+        : 0.0;
+    double distances_per_s = r->cluster_s > 0.0
+        ? (double)r->distances / r->cluster_s
+        : 0.0;
+    size_t threads = options->num_threads ? options->num_threads : 1;
+
+    if (options->json) {
+        fprintf(out,
+                "%s  {\"dataset\": \"%s\", \"variant\": \"%s\", \"n\": %zu,"
+                " \"dim\": %zu, \"k\": %zu, \"threads\": %zu, \"result\": %d,"
+                " \"iterations\": %lu, \"generate_s\": %.6f, \"seed_s\": %.6f,"
+                " \"cluster_s\": %.6f, \"assign_s\": %.6f, \"update_s\": %.6f,"
+                " \"points_per_s\": %.1f,"
+                " \"distances\": %llu, \"distances_per_s\": %.1f,"
+                " \"inertia\": %.6e}",
+                first ? "" : ",\n",
+                dataset_names[r->dataset], variant_names[r->variant],
+                r->n, r->dim, r->k, threads, r->result, r->iterations,
+                r->generate_s, r->seed_s, r->cluster_s, r->assign_s,
+                r->update_s, points_per_s, r->distances, distances_per_s,
+                r->inertia);
+        return;
+    }
+
+    fprintf(out, "%s,%s,%zu,%zu,%zu,%zu,%d,%lu,"
+                 "%.6f,%.6f,%.6f,%.6f,%.6f,%.1f,%llu,%.1f,%.6e\n",
+            dataset_names[r->dataset], variant_names[r->variant],
+            r->n, r->dim, r->k, threads, r->result, r->iterations,
+            r->generate_s, r->seed_s, r->cluster_s, r->assign_s, r->update_s,
+            points_per_s, r->distances, distances_per_s, r->inertia);
+}
+
+
+/*
+ * Store a dataset in a narrower type. Int8 values are quantized symmetrically
+ *  over the largest magnitude, whose step is returned through 'scale'.
+ */
+static
+void *
+bench_narrow(const double *data,
+             size_t length,
+             kmeans_dtype dtype,
+             double *scale)
+{
+    void *narrow = malloc(length * (KMEANS_FLOAT32 == dtype ? sizeof(float) : 1));
+    double largest = 0.0;
+
+    if (!narrow) return NULL;
+
+    if (KMEANS_FLOAT32 == dtype) {
+        for (size_t i = 0; i < length; ++i) ((float *)narrow)[i] = (float)data[i];
+        return narrow;
+    }
+
+    for (size_t i = 0; i < length; ++i)
+        if (fabs(data[i]) > largest) largest = fabs(data[i]);
+
+    *scale = largest > 0.0 ? largest / INT8_MAX : 1.0;
+    for (size_t i = 0; i < length; ++i)
+        ((int8_t *)narrow)[i] = (int8_t)lround(data[i] / *scale);
+
+    return narrow;
+}
+
+
+/* Run every selected variant over one generated dataset. */
+static
+int
+bench_configuration(FILE *out,
+                    const bench_options *options,
+                    bench_dataset dataset,
+                    size_t n,
+                    size_t dim,
+                    size_t k,
+                    int *first)
+{
+    bench_record record = {
+            .dataset = dataset,
+            .n = n,
+            .dim = dim,
+            .k = k,
+    };
+    /* Every configuration gets its own seed, derived from the grid position. */
+    uint64_t seed = options->seed ^ (((uint64_t)dataset << 60)
+                                     ^ ((uint64_t)n << 24)
+                                     ^ ((uint64_t)dim << 12)
+                                     ^ (uint64_t)k);
+    double *seeds = NULL;
+    void *narrow[VARIANT_COUNT] = { NULL };
+    double scale = 0.0;
+    double *centroids = malloc(sizeof(double) * k * dim);
+    int *assignments = malloc(sizeof(int) * n);
+    kmeans_rng rng;
+    int status = 1;
+
+    double start = bench_now();
+    double *data = bench_generate(dataset, n, dim, k, seed);
+    record.generate_s = bench_now() - start;
+
+    if (!data || !centroids || !assignments) goto break_out;
+
+    /* Every variant starts from the very same k-means++ centroids. */
+    kmeans_dense_meta seeding = {
+            .data = data,
+            .num_objects = n,
+            .dim = dim,
+            .num_centroids = k,
+            .num_threads = options->num_threads,
+    };
+
+    kmeans_rng_seed(&rng, seed);
+    start = bench_now();
+    if (KMEANS_OK != kmeans_seed_plusplus(&seeding, &rng, &seeds)) goto break_out;
+    record.seed_s = bench_now() - start;
+
+    for (int v = 0; v < VARIANT_COUNT; ++v) {
+        if (!options->variants[v]) continue;
+
+        memcpy(centroids, seeds, sizeof(double) * k * dim);
+        record.variant = (bench_variant)v;
+        record.assign_s = 0.0;
+        record.update_s = 0.0;
+
+        if (VARIANT_GENERIC == v) {
+            start = bench_now();
+            record.result = bench_run_generic(data, n, dim, centroids, k,
+                                              assignments, options, &record);
+            record.cluster_s = bench_now() - start;
+        } else {
+            const kmeans_dtype dtype = variant_dtypes[v];
+            const void *values = data;
+
+            if (KMEANS_FLOAT64 != dtype) {
+                if (!narrow[dtype]
+                    && !(narrow[dtype] = bench_narrow(data, n * dim, dtype, &scale)))
+                    goto break_out;
+                values = narrow[dtype];
+            }
+
+            kmeans_dense_meta meta = {
+                    .data = values,
+                    .dtype = dtype,
+                    .scale = scale,
+                    .num_objects = n,
+                    .dim = dim,
+                    .centroids = centroids,
+                    .num_centroids = k,
+                    .iterations = options->iterations,
+                    .cluster_assignments = assignments,
+                    .num_threads = options->num_threads,
+                    .algorithm = variant_algorithms[v],
+                    .observer = options->phases ? bench_observe : NULL,
+                    .observer_context = &record,
+            };
+
+            start = bench_now();
+            if (VARIANT_SHARD_SOCKET == v || VARIANT_SHARD_SHM == v)
+                record.result = compute_kmeans_sharded(
+                    &meta, options->num_threads,
+                    (VARIANT_SHARD_SHM == v) ? KMEANS_TRANSPORT_SHM
+                                             : KMEANS_TRANSPORT_SOCKET);
+            else
+                record.result = compute_kmeans_dense(&meta);
+            record.cluster_s = bench_now() - start;
+            record.iterations = meta.current_iterations;
+            record.distances = meta.distance_evaluations;
+        }
+
+        /* A converged run made one more assignment pass than it counted. */
+        record.passes = record.iterations + (KMEANS_OK == record.result);
+        if (VARIANT_GENERIC == v)
+            record.distances = (unsigned long long)n * k * record.passes;
+
+        record.inertia = bench_inertia(data, n, dim, centroids, assignments);
+
+        bench_print_record(out, options, &record, *first);
+        *first = 0;
+        fflush(out);
+    }
+
+    status = 0;
+
+break_out:
+    if (status) fprintf(stderr, "Out of memory at n=%zu dim=%zu k=%zu\n", n, dim, k);
+    for (int v = 0; v < VARIANT_COUNT; ++v) free(narrow[v]);
+    free(data);
+    free(seeds);
+    free(centroids);
+    free(assignments);
+    return status;
+}
+
+
+/* Parse a comma-separated list of positive sizes. */
+static
+int
+bench_parse_list(const char *text,
+                 bench_list *list)
+{
+    char *end;
+
+    list->count = 0;
+    while (*text && list->count < BENCH_MAX_LIST) {
+        size_t value = strtoul(text, &end, 10);
+
+        if (end == text || !value) return 1;
+        list->values[list->count++] = value;
+
+        if (',' != *end) return *end ? 1 : 0;
+        text = end + 1;
+    }
+
+    return list->count ? 0 : 1;
+}
+
+
+/* Enable the comma-separated names found in 'names' out of a table. */
+static
+int
+bench_parse_names(const char *text,
+                  const char **names,
+                  int count,
+                  int *enabled)
+{
+    char buffer[256];
+    char *save = NULL;
+
+    snprintf(buffer, sizeof(buffer), "%s", text);
+    memset(enabled, 0, sizeof(int) * count);
+
+    for (char *name = strtok_r(buffer, ",", &save);
+         name;
+         name = strtok_r(NULL, ",", &save)) {
+        int found = 0;
+
+        for (int i = 0; i < count; ++i) {
+            if (!strcmp(name, names[i])) {
+                enabled[i] = 1;
+                found = 1;
+            }
+        }
+
+        if (!found) return 1;
+    }
+
+    return 0;
+}
+
+
+static
+void
+bench_usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-n sizes] [-d dims] [-k clusters] [-a variants]\n"
+            "          [-g datasets] [-t threads] [-i iterations] [-s seed]\n"
+            "          [-f csv|json] [-o file] [-p]\n"
+            "  Lists are comma-separated, e.g. -n 10000,100000 -a lloyd,elkan\n"
+            "  variants: generic, lloyd, hamerly, elkan, yinyang, kdtree, gemm,\n"
+            "            lloyd_f32, hamerly_f32, lloyd_i8, shard_socket, shard_shm\n"
+            "  (the shard variants fork one worker per thread; they and kdtree,\n"
+            "   which crawls beyond about eight dimensions, only run when\n"
+            "   asked for)\n"
+            "  datasets: blobs, uniform\n"
+            "  -p times the assignment and update phases of every iteration\n",
+            name);
+}
+
+
+int
+main(int argc,
+     char **argv)
+{
+    bench_options options = {
+            .sizes = { .values = { 10000, 100000 }, .count = 2 },
+            .dims = { .values = { 2, 16 }, .count = 2 },
+            .clusters = { .values = { 10, 100 }, .count = 2 },
+            .variants = { 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 0, 0 },
+            .datasets = { 1, 1 },
+            .num_threads = 1,
+            .iterations = 100,
+            .seed = 579,
+    };
+    FILE *out = stdout;
+    int first = 1;
+    int status = 0;
+    int bad = 0;
+    int option;
+
+    while (!bad && -1 != (option = getopt(argc, argv, "n:d:k:a:g:t:i:s:f:o:p"))) {
+        switch (option) {
+            case 'n': bad = bench_parse_list(optarg, &options.sizes); break;
+            case 'd': bad = bench_parse_list(optarg, &options.dims); break;
+            case 'k': bad = bench_parse_list(optarg, &options.clusters); break;
+            case 'a':
+                bad = bench_parse_names(optarg, variant_names, VARIANT_COUNT,
+                                        options.variants);
+                break;
+            case 'g':
+                bad = bench_parse_names(optarg, dataset_names, 2,
+                                        options.datasets);
+                break;
+            case 't': options.num_threads = strtoul(optarg, NULL, 10); break;
+            case 'i': options.iterations = strtoul(optarg, NULL, 10); break;
+            case 's': options.seed = strtoull(optarg, NULL, 10); break;
+            case 'f': options.json = !strcmp(optarg, "json"); break;
+            case 'o': options.path = optarg; break;
+            case 'p': options.phases = 1; break;
+            default: bad = 1; break;
+        }
+    }
+
+    if (bad || !options.iterations) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    if (options.path && !(out = fopen(options.path, "w"))) {
+        fprintf(stderr, "Could not open '%s' for writing.\n", options.path);
+        return 1;
+    }
+
+    bench_print_header(out, &options);
+
+    for (int g = 0; g < 2; ++g) {
+        if (!options.datasets[g]) continue;
+
+        for (size_t i = 0; i < options.sizes.count; ++i)
+            for (size_t j = 0; j < options.dims.count; ++j)
+                for (size_t c = 0; c < options.clusters.count; ++c) {
+                    size_t n = options.sizes.values[i];
+                    size_t k = options.clusters.values[c];
+
+                    if (k > n) continue;
+                    status |= bench_configuration(out, &options,
+                                                  (bench_dataset)g, n,
+                                                  options.dims.values[j],
+                                                  k, &first);
+                }
+    }
+
+    if (options.json) fprintf(out, "\n]\n");
+    if (out != stdout) fclose(out);
+
+    return status;
+}
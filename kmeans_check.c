@@ -0,0 +1,2002 @@
+/*
+ * kmeans_check.c
+ *
+ * Self-checks of the guarantees made throughout the headers. Seeded datasets
+ *  are clustered by every engine, element type, layout and thread count and
+ *  compared with Lloyd's algorithm, and every other driver is compared with
+ *  the in-memory run it claims to reproduce. One line is printed per check,
+ *  and the exit status is non-zero when any of them failed.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <float.h>
+
+#include "kmeans.h"
+#include "kmeans_stream.h"
+#include "kmeans_seed.h"
+#include "kmeans_dataset.h"
+#include "kmeans_output.h"
+#include "kmeans_ooc.h"
+#include "kmeans_shard.h"
+#include "kmeans_restart.h"
+#include "kmeans_state.h"
+#include "kmeans_batch.h"
+#include "kmeans_model.h"
+#include "kmeans_sparse.h"
+#include "kmeans_coreset.h"
+
+
+/* Iterations allowed to every run; runs out of them still have to agree. */
+#define CHECK_ITERATIONS 60
+
+/* Value of one quantization step, a power of two so every product is exact. */
+#define CHECK_SCALE 0.25
+
+/* Noise of the Gaussian blobs, and room given to each blob's center. */
+#define CHECK_BLOB_SIGMA 1.0
+#define CHECK_BLOB_SPACING 10.0
+
+/* Relative difference allowed where a driver sums in another order. */
+#define CHECK_TOLERANCE 1e-9
+
+/* Relative difference allowed between a kept centroid and a fresh mean. */
+#define CHECK_MEAN_TOLERANCE 1e-13
+
+/* Thread counts every comparison runs with. */
+static const size_t check_threads[] = { 1, 3 };
+
+#define CHECK_NUM_THREADS (sizeof(check_threads) / sizeof(check_threads[0]))
+
+static const char *dtype_names[] = { "float64", "float32", "int8", "uint8" };
+static const char *layout_names[] = { "rows", "columns" };
+
+#define CHECK_NUM_DTYPES 4
+
+
+/*
+ * The library is linked with every allocator entry point wrapped, so a check
+ *  can count the allocations made while it runs.
+ */
+static size_t check_allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+int __real_posix_memalign(void **pointer, size_t alignment, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&check_allocations, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t count,
+              size_t size)
+{
+    __atomic_add_fetch(&check_allocations, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void *
+__wrap_realloc(void *pointer,
+               size_t size)
+{
+    __atomic_add_fetch(&check_allocations, 1, __ATOMIC_RELAXED);
+    return __real_realloc(pointer, size);
+}
+
+int
+__wrap_posix_memalign(void **pointer,
+                      size_t alignment,
+                      size_t size)
+{
+    __atomic_add_fetch(&check_allocations, 1, __ATOMIC_RELAXED);
+    return __real_posix_memalign(pointer, alignment, size);
+}
+
+static
+size_t
+check_allocations_now(void)
+{
+    return __atomic_load_n(&check_allocations, __ATOMIC_RELAXED);
+}
+
+
+/* A seeded dataset stored as every element type, in both layouts. */
+typedef struct
+{
+    const char *name;
+    size_t num_objects;
+    size_t dim;
+    size_t num_centroids;
+
+    /* Whether it holds well separated blobs, where no near-ties arise. */
+    int blobs;
+
+    /* The matrix of each element type, row-major then column-major. */
+    void *values[CHECK_NUM_DTYPES][2];
+
+    /* Each element type widened back to a row-major float64 matrix. */
+    double *widened[CHECK_NUM_DTYPES];
+
+    /* Initial centroids for each element type, by k-means++. */
+    double *seeds[CHECK_NUM_DTYPES];
+} check_dataset;
+
+
+/* The outcome of one run, to compare with another. */
+typedef struct
+{
+    kmeans_result result;
+    unsigned long iterations;
+    double *centroids;
+    int *assignments;
+} check_outcome;
+
+
+static size_t check_failures;
+
+
+/* Print the outcome of one check, formatted like printf(). */
+static
+void
+check_report(int passed,
+             const char *format,
+             ...)
+{
+    va_list arguments;
+
+    printf("%s  ", passed ? "ok  " : "FAIL");
+
+    va_start(arguments, format);
+    vprintf(format, arguments);
+    va_end(arguments);
+
+    putchar('\n');
+    if (!passed) ++check_failures;
+}
+
+
+/* Standard normal deviate by the Box-Muller transform. */
+static
+double
+check_gaussian(kmeans_rng *rng)
+{
+    double u1 = kmeans_rng_uniform(rng), u2 = kmeans_rng_uniform(rng);
+
+    if (u1 < 1e-300) u1 = 1e-300;
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+
+/* Squared distance between two points of 'dim' values. */
+static
+double
+check_distance(const double *left,
+               const double *right,
+               size_t dim)
+{
+    double sum = 0.0;
+
+    for (size_t d = 0; d < dim; ++d)
+        sum += (left[d] - right[d]) * (left[d] - right[d]);
+
+    return sum;
+}
+
+
+/*
+ * Find the nearest of k row-major centroids to a point by brute force, the
+ *  lowest index winning ties, and its squared distance.
+ */
+static
+int
+check_nearest(const double *point,
+              const double *centroids,
+              size_t k,
+              size_t dim,
+              double *distance)
+{
+    int nearest = 0;
+
+    *distance = HUGE_VAL;
+    for (size_t c = 0; c < k; ++c) {
+        double candidate = check_distance(point, centroids + (c * dim), dim);
+
+        if (candidate < *distance) {
+            *distance = candidate;
+            nearest = (int)c;
+        }
+    }
+
+    return nearest;
+}
+
+
+/*
+ * Whether a cluster is nearest to a point, to within rounding: the engines
+ *  measure distances in orders of their own, so a near-tie may go either way.
+ */
+static
+int
+check_is_nearest(const double *point,
+                 const double *centroids,
+                 size_t k,
+                 size_t dim,
+                 int cluster)
+{
+    double best;
+
+    if (cluster < 0 || (size_t)cluster >= k) return 0;
+
+    check_nearest(point, centroids, k, dim, &best);
+    return check_distance(point, centroids + ((size_t)cluster * dim), dim)
+        <= best * (1.0 + CHECK_TOLERANCE);
+}
+
+
+/* Store a double in an element type, and get the value it stands for. */
+static
+double
+check_store(kmeans_dtype dtype,
+            double value,
+            void *values,
+            size_t i)
+{
+    long step = lround(value / CHECK_SCALE);
+
+    switch (dtype) {
+        case KMEANS_FLOAT32:
+            ((float *)values)[i] = (float)value;
+            return (double)((float *)values)[i];
+        case KMEANS_INT8:
+            if (step < INT8_MIN) step = INT8_MIN;
+            if (step > INT8_MAX) step = INT8_MAX;
+            ((int8_t *)values)[i] = (int8_t)step;
+            return step * CHECK_SCALE;
+        case KMEANS_UINT8:
+            if (step < 0) step = 0;
+            if (step > UINT8_MAX) step = UINT8_MAX;
+            ((uint8_t *)values)[i] = (uint8_t)step;
+            return step * CHECK_SCALE;
+        case KMEANS_FLOAT64:
+        default:
+            ((double *)values)[i] = value;
+            return value;
+    }
+}
+
+
+/*
+ * Generate a dataset: Gaussian blobs around k centers, or uniform values, all
+ *  within a box small enough for the quantized types. Each element type gets
+ *  its own k-means++ seeding of its widened values.
+ */
+static
+int
+check_generate(check_dataset *dataset,
+               uint64_t seed)
+{
+    const size_t n = dataset->num_objects;
+    const size_t dim = dataset->dim;
+    const size_t k = dataset->num_centroids;
+    const double side = dataset->blobs ? CHECK_BLOB_SPACING * 2.0 : 24.0;
+    double *raw = malloc(sizeof(double) * n * dim);
+    double *centers = malloc(sizeof(double) * k * dim);
+    kmeans_rng rng;
+    int ok = 0;
+
+    if (!raw || !centers) goto break_out;
+
+    kmeans_rng_seed(&rng, seed);
+
+    for (size_t i = 0; i < k * dim; ++i)
+        centers[i] = CHECK_BLOB_SPACING * 0.5 + side * kmeans_rng_uniform(&rng);
+
+    for (size_t i = 0; i < n; ++i) {
+        const double *center = centers + (kmeans_rng_below(&rng, k) * dim);
+
+        for (size_t d = 0; d < dim; ++d)
+            raw[(i * dim) + d] = dataset->blobs
+                ? center[d] + (CHECK_BLOB_SIGMA * check_gaussian(&rng))
+                : side * kmeans_rng_uniform(&rng);
+    }
+
+    for (size_t t = 0; t < CHECK_NUM_DTYPES; ++t) {
+        const size_t size = kmeans_dtype_size((kmeans_dtype)t);
+        unsigned char *rows = malloc(size * n * dim);
+        unsigned char *columns = malloc(size * n * dim);
+        double *widened = malloc(sizeof(double) * n * dim);
+
+        dataset->values[t][KMEANS_ROW_MAJOR] = rows;
+        dataset->values[t][KMEANS_COLUMN_MAJOR] = columns;
+        dataset->widened[t] = widened;
+        if (!rows || !columns || !widened) goto break_out;
+
+        for (size_t i = 0; i < n * dim; ++i)
+            widened[i] = check_store((kmeans_dtype)t, raw[i], rows, i);
+
+        for (size_t i = 0; i < n; ++i)
+            for (size_t d = 0; d < dim; ++d)
+                memcpy(columns + (((d * n) + i) * size),
+                       rows + (((i * dim) + d) * size), size);
+
+        kmeans_dense_meta meta = {
+                .data = widened,
+                .num_objects = n,
+                .dim = dim,
+                .num_centroids = k,
+        };
+
+        kmeans_rng_seed(&rng, seed + 1 + t);
+        if (KMEANS_OK
+            != kmeans_seed_plusplus(&meta, &rng, &(dataset->seeds[t])))
+            goto break_out;
+    }
+
+    ok = 1;
+
+break_out:
+    free(raw);
+    free(centers);
+    return ok;
+}
+
+
+static
+void
+check_dataset_free(check_dataset *dataset)
+{
+    for (size_t t = 0; t < CHECK_NUM_DTYPES; ++t) {
+        free(dataset->values[t][0]);
+        free(dataset->values[t][1]);
+        free(dataset->widened[t]);
+        free(dataset->seeds[t]);
+    }
+}
+
+
+/* Get the row-major double values of a dataset. */
+static
+const double *
+check_rows(const check_dataset *dataset)
+{
+    return dataset->widened[KMEANS_FLOAT64];
+}
+
+
+/* Get a meta-structure over one element type and layout of a dataset. */
+static
+kmeans_dense_meta
+check_meta(const check_dataset *dataset,
+           kmeans_dtype dtype,
+           kmeans_layout layout,
+           kmeans_algorithm algorithm,
+           size_t num_threads)
+{
+    kmeans_dense_meta meta = {
+            .data = dataset->values[dtype][layout],
+            .num_objects = dataset->num_objects,
+            .dim = dataset->dim,
+            .layout = layout,
+            .dtype = dtype,
+            .scale = (KMEANS_INT8 == dtype || KMEANS_UINT8 == dtype)
+                ? CHECK_SCALE
+                : 0.0,
+            .num_centroids = dataset->num_centroids,
+            .iterations = CHECK_ITERATIONS,
+            .num_threads = num_threads,
+            .algorithm = algorithm,
+    };
+
+    return meta;
+}
+
+
+/* Set up an outcome holding a copy of the given initial centroids. */
+static
+int
+check_outcome_init(check_outcome *outcome,
+                   const double *seeds,
+                   size_t num_objects,
+                   size_t num_centroids,
+                   size_t dim)
+{
+    outcome->result = KMEANS_OK;
+    outcome->iterations = 0;
+    outcome->centroids = malloc(sizeof(double) * num_centroids * dim);
+    outcome->assignments = calloc(num_objects, sizeof(int));
+
+    if (!outcome->centroids || !outcome->assignments) return 0;
+
+    memcpy(outcome->centroids, seeds, sizeof(double) * num_centroids * dim);
+    return 1;
+}
+
+
+static
+void
+check_outcome_free(check_outcome *outcome)
+{
+    free(outcome->centroids);
+    free(outcome->assignments);
+    outcome->centroids = NULL;
+    outcome->assignments = NULL;
+}
+
+
+/* Run compute_kmeans_dense() from the given initial centroids. */
+static
+int
+check_dense(kmeans_dense_meta meta,
+            const double *seeds,
+            check_outcome *outcome)
+{
+    if (!check_outcome_init(outcome, seeds, meta.num_objects,
+                            meta.num_centroids, meta.dim))
+        return 0;
+
+    meta.centroids = outcome->centroids;
+    meta.cluster_assignments = outcome->assignments;
+
+    outcome->result = compute_kmeans_dense(&meta);
+    outcome->iterations = meta.current_iterations;
+    return 1;
+}
+
+
+/*
+ * Compare two outcomes: results, iterations and assignments must be equal,
+ *  and so must the centroids, to within a relative 'tolerance'.
+ */
+static
+int
+check_same(const check_outcome *left,
+           const check_outcome *right,
+           size_t num_objects,
+           size_t num_values,
+           double tolerance)
+{
+    if (left->result != right->result || left->iterations != right->iterations)
+        return 0;
+
+    if (memcmp(left->assignments, right->assignments,
+               sizeof(int) * num_objects))
+        return 0;
+
+    for (size_t i = 0; i < num_values; ++i) {
+        const double a = left->centroids[i], b = right->centroids[i];
+
+        if (0.0 == tolerance ? a != b
+                             : fabs(a - b) > tolerance * (1.0 + fabs(a)))
+            return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Every engine must give Lloyd's clusters, from the same centroids and with
+ *  the same thread count, for every element type and layout. The bounded
+ *  engines widen narrow types to double, so Lloyd over the widened values is
+ *  their reference; Lloyd itself compares narrow types in single precision
+ *  and is only held to it on blobs, as is the k-d tree, whose centroids may
+ *  differ in the last bits.
+ */
+static
+void
+check_engines(const check_dataset *dataset)
+{
+    static const struct
+    {
+        const char *name;
+        kmeans_algorithm algorithm;
+        size_t num_groups;
+        int blobs_only;
+    } engines[] = {
+        { "lloyd", KMEANS_LLOYD, 0, 0 },
+        { "hamerly", KMEANS_HAMERLY, 0, 0 },
+        { "elkan", KMEANS_ELKAN, 0, 0 },
+        { "yinyang", KMEANS_YINYANG, 0, 0 },
+        { "yinyang/3", KMEANS_YINYANG, 3, 0 },
+        { "kdtree", KMEANS_KDTREE, 0, 1 },
+        { "gemm", KMEANS_GEMM, 0, 0 },
+        { "auto", KMEANS_AUTO, 0, 0 },
+    };
+    const size_t num_engines = sizeof(engines) / sizeof(engines[0]);
+    const size_t n = dataset->num_objects;
+    const size_t values = dataset->num_centroids * dataset->dim;
+
+    for (size_t t = 0; t < CHECK_NUM_DTYPES; ++t) {
+        const kmeans_dtype dtype = (kmeans_dtype)t;
+
+        for (size_t h = 0; h < CHECK_NUM_THREADS; ++h) {
+            kmeans_dense_meta reference_meta = check_meta(
+                dataset, KMEANS_FLOAT64, KMEANS_ROW_MAJOR, KMEANS_LLOYD,
+                check_threads[h]);
+            check_outcome reference = { 0 };
+
+            reference_meta.data = dataset->widened[t];
+            if (!check_dense(reference_meta, dataset->seeds[t], &reference)) {
+                check_report(0, "%s: out of memory", dataset->name);
+                check_outcome_free(&reference);
+                return;
+            }
+
+            for (size_t l = 0; l < 2; ++l) {
+                for (size_t e = 0; e < num_engines; ++e) {
+                    const int blobs_only = engines[e].blobs_only
+                        || (KMEANS_FLOAT64 != dtype
+                            && (KMEANS_LLOYD == engines[e].algorithm
+                                || KMEANS_AUTO == engines[e].algorithm));
+                    check_outcome outcome = { 0 };
+
+                    if (blobs_only && !dataset->blobs) continue;
+
+                    kmeans_dense_meta meta = check_meta(
+                        dataset, dtype, (kmeans_layout)l,
+                        engines[e].algorithm, check_threads[h]);
+                    meta.num_groups = engines[e].num_groups;
+
+                    int ok = check_dense(meta, dataset->seeds[t], &outcome)
+                        && check_same(&reference, &outcome, n, values,
+                                      KMEANS_KDTREE == engines[e].algorithm
+                                          ? CHECK_TOLERANCE
+                                          : 0.0);
+
+                    check_report(ok, "%s: %s over %s %s, %zu thread(s), "
+                                 "matches lloyd", dataset->name,
+                                 engines[e].name, dtype_names[t],
+                                 layout_names[l], check_threads[h]);
+                    check_outcome_free(&outcome);
+                }
+            }
+
+            check_outcome_free(&reference);
+        }
+    }
+}
+
+
+/*
+ * One pass of mini-batches over well separated blobs must settle on Lloyd's
+ *  clusters: every point joins its own blob, so each centroid ends as the
+ *  running mean of exactly the points Lloyd gives it. The final assignment
+ *  pass must report the inertia of a brute-force sum.
+ */
+static
+void
+check_stream(void)
+{
+    const size_t n = 4000, dim = 3, k = 4, batch = 64;
+    double *points = malloc(sizeof(double) * n * dim);
+    int *labels = malloc(sizeof(int) * n);
+    double seeds[k * dim];
+    check_outcome reference = { 0 };
+    kmeans_stream *stream = NULL;
+    double centroids[k * dim];
+    double inertia = 0.0, brute = 0.0;
+    size_t found = 0;
+    kmeans_rng rng;
+    int ok;
+
+    if (!points || !labels) {
+        check_report(0, "stream: out of memory");
+        goto break_out;
+    }
+
+    kmeans_rng_seed(&rng, 7);
+
+    /* Blob 0 sits at the origin and blob b on axis b - 1; first points seed. */
+    for (size_t i = 0; i < n; ++i) {
+        const size_t blob = kmeans_rng_below(&rng, k);
+        double *point = points + (i * dim);
+
+        for (size_t d = 0; d < dim; ++d)
+            point[d] = (blob == d + 1 ? 40.0 * CHECK_BLOB_SPACING : 0.0)
+                + (CHECK_BLOB_SIGMA * check_gaussian(&rng));
+
+        if (!(found & (1u << blob))) {
+            memcpy(seeds + (blob * dim), point, sizeof(double) * dim);
+            found |= 1u << blob;
+        }
+    }
+
+    kmeans_dense_meta dense = {
+            .data = points,
+            .num_objects = n,
+            .dim = dim,
+            .num_centroids = k,
+            .iterations = CHECK_ITERATIONS,
+    };
+
+    ok = (found == (1u << k) - 1) && check_dense(dense, seeds, &reference);
+
+    kmeans_stream_meta meta = {
+            .centroids = centroids,
+            .num_centroids = k,
+            .dim = dim,
+    };
+
+    memcpy(centroids, seeds, sizeof(centroids));
+    ok = ok && KMEANS_OK == kmeans_stream_create(&meta, &stream);
+
+    for (size_t i = 0; ok && i < n; i += batch)
+        ok = KMEANS_OK == kmeans_stream_push(stream, points + (i * dim),
+                                             (n - i < batch) ? n - i : batch);
+
+    ok = ok
+        && KMEANS_OK == kmeans_stream_assign(stream, points, n, labels,
+                                             &inertia)
+        && !memcmp(labels, reference.assignments, sizeof(int) * n);
+
+    for (size_t i = 0; ok && i < k * dim; ++i) {
+        const double a = reference.centroids[i];
+
+        ok = fabs(a - centroids[i]) <= CHECK_TOLERANCE * (1.0 + fabs(a));
+    }
+
+    check_report(ok, "stream: one pass over blobs matches lloyd");
+
+    for (size_t i = 0; ok && i < n; ++i) {
+        double distance;
+
+        ok = labels[i] == check_nearest(points + (i * dim), centroids, k, dim,
+                                        &distance);
+        brute += distance;
+    }
+
+    check_report(ok && fabs(inertia - brute) <= CHECK_TOLERANCE * brute,
+                 "stream: assignment inertia matches a brute-force sum");
+
+break_out:
+    if (stream) kmeans_stream_destroy(stream);
+    check_outcome_free(&reference);
+    free(points);
+    free(labels);
+}
+
+
+/*
+ * Seeding must only depend on the generator: the same seed gives the same
+ *  centroids with every thread count, and from either layout. k-means++
+ *  picks k distinct points of the data. k-means|| refines its picks with a
+ *  few Lloyd steps over the candidates, so its centroids are only held to be
+ *  distinct and within the bounds of the data.
+ */
+static
+void
+check_seeding(const check_dataset *dataset)
+{
+    typedef kmeans_result (*seeder_t)(const kmeans_dense_meta *, kmeans_rng *,
+                                      double **);
+    static const seeder_t seeders[] = {
+        kmeans_seed_plusplus, kmeans_seed_parallel
+    };
+    static const char *names[] = { "k-means++", "k-means||" };
+    const size_t n = dataset->num_objects;
+    const size_t dim = dataset->dim;
+    const size_t k = dataset->num_centroids;
+    const double *rows = check_rows(dataset);
+
+    for (size_t s = 0; s < 2; ++s) {
+        double *first = NULL;
+        int ok = 1;
+
+        for (size_t h = 0; ok && h < CHECK_NUM_THREADS; ++h) {
+            for (size_t l = 0; ok && l < 2; ++l) {
+                kmeans_dense_meta meta = check_meta(
+                    dataset, KMEANS_FLOAT64, (kmeans_layout)l, KMEANS_LLOYD,
+                    check_threads[h]);
+                double *centroids = NULL;
+                kmeans_rng rng;
+
+                kmeans_rng_seed(&rng, 31);
+                ok = KMEANS_OK == seeders[s](&meta, &rng, &centroids);
+
+                if (!first) first = centroids;
+                else {
+                    ok = ok && !memcmp(first, centroids,
+                                       sizeof(double) * k * dim);
+                    free(centroids);
+                }
+            }
+        }
+
+        for (size_t c = 0; ok && c < k; ++c) {
+            const double *centroid = first + (c * dim);
+            int found = 0;
+
+            for (size_t other = 0; ok && other < c; ++other)
+                ok = !!memcmp(centroid, first + (other * dim),
+                              sizeof(double) * dim);
+
+            for (size_t i = 0; !found && i < n; ++i)
+                found = !memcmp(centroid, rows + (i * dim),
+                                sizeof(double) * dim);
+
+            if (!s) ok = ok && found;
+
+            /* Means of candidates cannot leave the box around the data. */
+            for (size_t d = 0; s && ok && d < dim; ++d) {
+                int below = 0, above = 0;
+
+                for (size_t i = 0; i < n; ++i) {
+                    below |= rows[(i * dim) + d] <= centroid[d];
+                    above |= rows[(i * dim) + d] >= centroid[d];
+                }
+
+                ok = below && above;
+            }
+        }
+
+        check_report(ok, "%s: %s gives %zu distinct centroids, the same with "
+                     "every thread count and layout", dataset->name, names[s],
+                     k);
+        free(first);
+    }
+}
+
+
+/*
+ * Weighted seeding must only depend on the generator as well, and k-means++
+ *  must never pick a point of zero weight.
+ */
+static
+void
+check_seeding_weights(const check_dataset *dataset)
+{
+    typedef kmeans_result (*seeder_t)(const kmeans_dense_meta *, kmeans_rng *,
+                                      double **);
+    static const seeder_t seeders[] = {
+        kmeans_seed_plusplus, kmeans_seed_parallel
+    };
+    static const char *names[] = { "k-means++", "k-means||" };
+    const size_t n = dataset->num_objects;
+    const size_t dim = dataset->dim;
+    const size_t k = dataset->num_centroids;
+    const double *rows = check_rows(dataset);
+    double *weights = malloc(sizeof(double) * n);
+
+    if (!weights) {
+        check_report(0, "%s: out of memory", dataset->name);
+        return;
+    }
+
+    /* Odd points weigh nothing, even ones between 1 and 5. */
+    for (size_t i = 0; i < n; ++i)
+        weights[i] = (i & 1) ? 0.0 : (double)(1 + (i % 5));
+
+    for (size_t s = 0; s < 2; ++s) {
+        double *first = NULL;
+        int ok = 1;
+
+        for (size_t h = 0; ok && h < CHECK_NUM_THREADS; ++h) {
+            kmeans_dense_meta meta = check_meta(
+                dataset, KMEANS_FLOAT64, KMEANS_ROW_MAJOR, KMEANS_LLOYD,
+                check_threads[h]);
+            double *centroids = NULL;
+            kmeans_rng rng;
+
+            meta.weights = weights;
+            kmeans_rng_seed(&rng, 37);
+            ok = KMEANS_OK == seeders[s](&meta, &rng, &centroids);
+
+            if (!first) first = centroids;
+            else {
+                ok = ok && !memcmp(first, centroids, sizeof(double) * k * dim);
+                free(centroids);
+            }
+        }
+
+        for (size_t c = 0; ok && !s && c < k; ++c) {
+            int found = 0;
+
+            for (size_t i = 0; !found && i < n; i += 2)
+                found = !memcmp(first + (c * dim), rows + (i * dim),
+                                sizeof(double) * dim);
+
+            ok = found;
+        }
+
+        check_report(ok, "%s: weighted %s is the same with every thread count"
+                     "%s", dataset->name, names[s],
+                     s ? "" : ", and skips points of zero weight");
+        free(first);
+    }
+
+    free(weights);
+}
+
+
+/* Weighing every point 1 must change nothing at all. */
+static
+void
+check_weights(const check_dataset *dataset)
+{
+    static const kmeans_algorithm algorithms[] = {
+        KMEANS_LLOYD, KMEANS_HAMERLY, KMEANS_ELKAN, KMEANS_YINYANG, KMEANS_GEMM
+    };
+    static const char *names[] = {
+        "lloyd", "hamerly", "elkan", "yinyang", "gemm"
+    };
+    const size_t n = dataset->num_objects;
+    double *weights = malloc(sizeof(double) * n);
+
+    if (!weights) {
+        check_report(0, "%s: out of memory", dataset->name);
+        return;
+    }
+
+    for (size_t i = 0; i < n; ++i) weights[i] = 1.0;
+
+    for (size_t a = 0; a < sizeof(algorithms) / sizeof(algorithms[0]); ++a) {
+        for (size_t h = 0; h < CHECK_NUM_THREADS; ++h) {
+            kmeans_dense_meta meta = check_meta(
+                dataset, KMEANS_FLOAT64, KMEANS_ROW_MAJOR, algorithms[a],
+                check_threads[h]);
+            check_outcome plain = { 0 }, weighted = { 0 };
+
+            int ok = check_dense(meta, dataset->seeds[0], &plain);
+            meta.weights = weights;
+            ok = ok && check_dense(meta, dataset->seeds[0], &weighted)
+                && check_same(&plain, &weighted, n,
+                              dataset->num_centroids * dataset->dim, 0.0);
+
+            check_report(ok, "%s: %s with unit weights, %zu thread(s), "
+                         "matches no weights", dataset->name, names[a],
+                         check_threads[h]);
+            check_outcome_free(&plain);
+            check_outcome_free(&weighted);
+        }
+    }
+
+    free(weights);
+}
+
+
+/* Get a temporary file path, to be unlinked by the caller. */
+static
+int
+check_temporary(char *path)
+{
+    int fd;
+
+    strcpy(path, "/tmp/kmeans_check_XXXXXX");
+    if ((fd = mkstemp(path)) < 0) return 0;
+
+    close(fd);
+    return 1;
+}
+
+
+/* Whether a file holds exactly 'length' bytes, equal to the ones expected. */
+static
+int
+check_contents(const char *path,
+               const void *expected,
+               size_t length)
+{
+    FILE *file = fopen(path, "rb");
+    unsigned char *contents = malloc(length + 1);
+    int ok = file && contents
+        && length == fread(contents, 1, length + 1, file)
+        && !memcmp(contents, expected, length);
+
+    if (file) fclose(file);
+    free(contents);
+    return ok;
+}
+
+
+/* Overwrite a few bytes of a file in place. */
+static
+int
+check_patch(const char *path,
+            size_t offset,
+            const void *bytes,
+            size_t length)
+{
+    int fd = open(path, O_WRONLY);
+    int ok = fd >= 0
+        && (ssize_t)length == pwrite(fd, bytes, length, (off_t)offset);
+
+    if (fd >= 0) close(fd);
+    return ok;
+}
+
+
+/*
+ * A dataset converted from CSV must map back with exactly the values written,
+ *  for every element type and with the scale given. Files cut short or
+ *  misaligned are rejected, and so are int8 and uint8 values which are not
+ *  whole steps within range.
+ */
+static
+void
+check_files(const check_dataset *dataset)
+{
+    static const struct
+    {
+        const char *csv;
+        kmeans_dtype dtype;
+        const char *why;
+    } rejected[] = {
+        { "1, 2\n3, 128\n", KMEANS_INT8, "out of range" },
+        { "1, -2\n", KMEANS_UINT8, "below zero" },
+        { "0.5\n", KMEANS_INT8, "not whole" },
+    };
+    const size_t n = dataset->num_objects;
+    const size_t dim = dataset->dim;
+    const double *rows = check_rows(dataset);
+    kmeans_dataset_header header;
+    char csv[32], path[32];
+    int ok;
+
+    if (!check_temporary(csv) || !check_temporary(path)) {
+        check_report(0, "%s: no temporary files", dataset->name);
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+
+    for (size_t t = 0; t < CHECK_NUM_DTYPES; ++t) {
+        const kmeans_dtype dtype = (kmeans_dtype)t;
+        const void *expected = dataset->values[t][KMEANS_ROW_MAJOR];
+        const double scale = (KMEANS_INT8 == dtype || KMEANS_UINT8 == dtype)
+            ? CHECK_SCALE
+            : 0.0;
+        FILE *file = fopen(csv, "w");
+        kmeans_dataset mapped;
+
+        /* A header line, then steps or values with enough digits. */
+        ok = file && 0 < fprintf(file, "x, y\n");
+        for (size_t i = 0; ok && i < n * dim; ++i) {
+            const char *separator = ((i + 1) % dim) ? ", " : "\n";
+
+            switch (dtype) {
+                case KMEANS_FLOAT32:
+                    fprintf(file, "%.9g%s", ((const float *)expected)[i],
+                            separator);
+                    break;
+                case KMEANS_INT8:
+                    fprintf(file, "%d%s", ((const int8_t *)expected)[i],
+                            separator);
+                    break;
+                case KMEANS_UINT8:
+                    fprintf(file, "%u%s", ((const uint8_t *)expected)[i],
+                            separator);
+                    break;
+                case KMEANS_FLOAT64:
+                default:
+                    fprintf(file, "%.17g%s", ((const double *)expected)[i],
+                            separator);
+                    break;
+            }
+        }
+        if (file && fclose(file)) ok = 0;
+
+        ok = ok && KMEANS_OK == kmeans_dataset_from_csv(csv, path, dtype, scale)
+            && KMEANS_OK == kmeans_dataset_open(path, &mapped);
+        if (ok) {
+            ok = n == mapped.num_objects && dim == mapped.dim
+                && dtype == mapped.dtype && KMEANS_ROW_MAJOR == mapped.layout
+                && scale == mapped.scale
+                && !memcmp(mapped.data, expected,
+                           kmeans_dtype_size(dtype) * n * dim);
+            kmeans_dataset_close(&mapped);
+        }
+
+        check_report(ok, "%s: %s dataset from csv maps back the same",
+                     dataset->name, dtype_names[t]);
+    }
+
+    /* Cut off the last value. */
+    ok = KMEANS_OK == kmeans_dataset_write(path, rows, n, dim, KMEANS_FLOAT64,
+                                           KMEANS_ROW_MAJOR, 0.0);
+    if (ok) {
+        kmeans_dataset mapped;
+        int fd = open(path, O_RDONLY);
+
+        ok = fd >= 0 && sizeof(header) == read(fd, &header, sizeof(header));
+        if (fd >= 0) close(fd);
+
+        ok = ok && !truncate(path, (off_t)(header.data_offset
+                                           + (sizeof(double) * n * dim) - 1))
+            && KMEANS_BAD_LENGTH == kmeans_dataset_open(path, &mapped);
+    }
+
+    check_report(ok, "%s: truncated dataset is rejected", dataset->name);
+
+    /* An alignment which is no power of two, then one the offset misses. */
+    for (size_t bad = 0; bad < 2; ++bad) {
+        kmeans_dataset mapped;
+
+        ok = KMEANS_OK == kmeans_dataset_write(path, rows, n, dim,
+                                               KMEANS_FLOAT64,
+                                               KMEANS_ROW_MAJOR, 0.0);
+
+        header.alignment = bad ? 2 * (uint32_t)header.data_offset : 48;
+        ok = ok && check_patch(path, offsetof(kmeans_dataset_header, alignment),
+                               &(header.alignment), sizeof(header.alignment))
+            && KMEANS_MALFORMED_INPUT == kmeans_dataset_open(path, &mapped);
+
+        check_report(ok, "%s: dataset aligned to %u is rejected",
+                     dataset->name, (unsigned)header.alignment);
+    }
+
+    for (size_t r = 0; r < sizeof(rejected) / sizeof(rejected[0]); ++r) {
+        FILE *file = fopen(csv, "w");
+
+        ok = file && 0 < fputs(rejected[r].csv, file);
+        if (file && fclose(file)) ok = 0;
+
+        ok = ok && KMEANS_MALFORMED_INPUT
+            == kmeans_dataset_from_csv(csv, path, rejected[r].dtype,
+                                       CHECK_SCALE);
+
+        check_report(ok, "%s: %s csv with a step %s is rejected",
+                     dataset->name, dtype_names[rejected[r].dtype],
+                     rejected[r].why);
+    }
+
+    unlink(csv);
+    unlink(path);
+}
+
+
+/*
+ * Write every value formatted like printf("%.*f") to a stream, each row of
+ *  'dim' values ended by its label (if any) and a newline, like the writers.
+ */
+static
+void
+check_print(FILE *stream,
+            const double *values,
+            size_t num_rows,
+            size_t dim,
+            const int *labels,
+            int precision)
+{
+    for (size_t i = 0; i < num_rows; ++i) {
+        for (size_t d = 0; d < dim; ++d)
+            fprintf(stream, "%s%.*f", d ? ", " : "", precision,
+                    values[(i * dim) + d]);
+
+        if (labels) fprintf(stream, ", %d", labels[i]);
+        fputc('\n', stream);
+    }
+}
+
+
+/*
+ * The writers must format every value exactly like printf("%.*f") at every
+ *  precision: halfway cases, negative zero, magnitudes on either side of the
+ *  fast path's limit and non-finite values included. Labels must be written
+ *  as given, and the 16-bit ones must refuse what does not fit.
+ */
+static
+void
+check_output(void)
+{
+    static const double specials[] = {
+        0.0, -0.0, 0.5, 1.5, 2.5, -0.5, -2.5, 0.125, 0.375, -0.625, 2.675,
+        1.005, 0.045, 1e-10, -1e-10, 5e-10, 4.5e-9, 0.9999999995, 9.5,
+        99.5, 1234567.8905, 999999999999999.0, 999999999999999.5,
+        999999999999999.875, 1e15, -1e15, 1e15 + 0.5, 4503599627370495.5,
+        9007199254740993.0, 1e22, 1e300, DBL_MAX, -DBL_MAX, DBL_MIN,
+        DBL_TRUE_MIN, HUGE_VAL, -HUGE_VAL, NAN, -NAN,
+    };
+    const size_t num_specials = sizeof(specials) / sizeof(specials[0]);
+    const size_t dim = 3;
+    const size_t num_rows = 1000;
+    const size_t n = num_rows * dim;
+    double *values = malloc(sizeof(double) * n);
+    double *columns = malloc(sizeof(double) * n);
+    int *labels = malloc(sizeof(int) * num_rows);
+    uint16_t *narrow = malloc(sizeof(uint16_t) * num_rows);
+    char path[32];
+    kmeans_rng rng;
+    int fd, ok;
+
+    if (!values || !columns || !labels || !narrow || !check_temporary(path)) {
+        check_report(0, "output: out of memory");
+        goto break_out;
+    }
+
+    /*
+     * After the special values come halfway cases of every precision, odd
+     *  multiples of powers of one half, and then any magnitude at all.
+     */
+    kmeans_rng_seed(&rng, 11);
+    for (size_t i = 0; i < n; ++i) {
+        const double sign = (i & 1) ? -1.0 : 1.0;
+
+        if (i < num_specials) {
+            values[i] = specials[i];
+        } else if (i < 1000) {
+            const int p = (int)(i % (KMEANS_OUTPUT_MAX_PRECISION + 1));
+
+            values[i] = sign * ((double)kmeans_rng_below(&rng, 100000) + 0.5)
+                / pow(10.0, p);
+        } else if (i < 2000) {
+            values[i] = sign * (double)(2 * kmeans_rng_below(&rng, 1 << 20) + 1)
+                / (double)(1 << (1 + (i % 30)));
+        } else {
+            values[i] = sign
+                * pow(10.0, -12.0 + 28.0 * kmeans_rng_uniform(&rng));
+        }
+    }
+
+    for (size_t i = 0; i < num_rows; ++i) {
+        labels[i] = (int)(i % 37) - 1;
+        for (size_t d = 0; d < dim; ++d)
+            columns[(d * num_rows) + i] = values[(i * dim) + d];
+    }
+
+    for (int precision = 0; precision <= KMEANS_OUTPUT_MAX_PRECISION;
+         ++precision) {
+        for (size_t w = 0; w < 3; ++w) {
+            char *expected = NULL;
+            size_t length = 0;
+            FILE *stream = open_memstream(&expected, &length);
+
+            fd = open(path, O_WRONLY | O_TRUNC);
+
+            ok = stream && fd >= 0;
+            if (ok && !w) fputs("x, y, z, cluster\n", stream);
+            if (ok) check_print(stream, values, num_rows, dim,
+                                (w < 2) ? labels : NULL, precision);
+            if (stream) fclose(stream);
+
+            if (ok && 2 == w)
+                ok = KMEANS_OK == kmeans_output_centroids(fd, values, num_rows,
+                                                          dim, precision);
+            else if (ok)
+                ok = KMEANS_OK == kmeans_output_csv(
+                    fd, w ? NULL : "x, y, z, cluster",
+                    w ? columns : values, num_rows, dim,
+                    w ? KMEANS_COLUMN_MAJOR : KMEANS_ROW_MAJOR, labels,
+                    precision);
+            if (fd >= 0) close(fd);
+
+            check_report(ok && check_contents(path, expected, length),
+                         "output: %s at precision %d matches printf",
+                         (2 == w) ? "centroids"
+                             : w ? "csv over columns" : "csv over rows",
+                         precision);
+            free(expected);
+        }
+    }
+
+    for (size_t i = 0; i < num_rows; ++i) {
+        labels[i] = (int)((i * 7919) % 65536);
+        narrow[i] = (uint16_t)labels[i];
+    }
+
+    for (size_t t = 0; t < 2; ++t) {
+        fd = open(path, O_WRONLY | O_TRUNC);
+        ok = fd >= 0 && KMEANS_OK == kmeans_output_labels(
+            fd, labels, num_rows,
+            t ? KMEANS_LABELS_UINT16 : KMEANS_LABELS_INT32);
+        if (fd >= 0) close(fd);
+
+        check_report(ok && check_contents(path, t ? (void *)narrow
+                                                  : (void *)labels,
+                                          (t ? sizeof(uint16_t) : sizeof(int))
+                                              * num_rows),
+                     "output: %s labels are written as given",
+                     t ? "uint16" : "int32");
+    }
+
+    /* A label which does not fit 16 bits. */
+    labels[num_rows - 1] = 65536;
+    fd = open(path, O_WRONLY | O_TRUNC);
+    ok = fd >= 0 && KMEANS_BAD_LENGTH == kmeans_output_labels(
+        fd, labels, num_rows, KMEANS_LABELS_UINT16);
+    if (fd >= 0) close(fd);
+
+    check_report(ok, "output: uint16 labels refuse cluster 65536");
+
+    unlink(path);
+
+break_out:
+    free(values);
+    free(columns);
+    free(labels);
+    free(narrow);
+}
+
+
+/*
+ * Out-of-core runs must match the in-memory Lloyd run with the same thread
+ *  count, whether the dataset is cached whole or streamed through a small
+ *  budget, and whether the assignments stay in memory or go to a file. The
+ *  quantization scale is left to the dataset header.
+ */
+static
+void
+check_ooc(const check_dataset *dataset)
+{
+    static const kmeans_dtype dtypes[] = { KMEANS_FLOAT64, KMEANS_INT8 };
+    const size_t n = dataset->num_objects;
+    const size_t values = dataset->num_centroids * dataset->dim;
+    char path[32], labels[32];
+
+    if (!check_temporary(path) || !check_temporary(labels)) {
+        check_report(0, "%s: no temporary files", dataset->name);
+        return;
+    }
+
+    for (size_t t = 0; t < sizeof(dtypes) / sizeof(dtypes[0]); ++t) {
+        const kmeans_dtype dtype = dtypes[t];
+
+        if (KMEANS_OK != kmeans_dataset_write(
+                path, dataset->values[dtype][KMEANS_ROW_MAJOR], n,
+                dataset->dim, dtype, KMEANS_ROW_MAJOR,
+                KMEANS_FLOAT64 == dtype ? 0.0 : CHECK_SCALE)) {
+            check_report(0, "%s: cannot write a dataset", dataset->name);
+            break;
+        }
+
+        for (size_t h = 0; h < CHECK_NUM_THREADS; ++h) {
+            check_outcome reference = { 0 };
+
+            if (!check_dense(check_meta(dataset, dtype, KMEANS_ROW_MAJOR,
+                                        KMEANS_LLOYD, check_threads[h]),
+                             dataset->seeds[dtype], &reference))
+                break;
+
+            for (size_t mode = 0; mode < 3; ++mode) {
+                check_outcome outcome = { 0 };
+                int ok = check_outcome_init(&outcome, dataset->seeds[dtype], n,
+                                            dataset->num_centroids,
+                                            dataset->dim);
+
+                kmeans_ooc_meta meta = {
+                        .path = path,
+                        .centroids = outcome.centroids,
+                        .num_centroids = dataset->num_centroids,
+                        .iterations = CHECK_ITERATIONS,
+                        .cluster_assignments = outcome.assignments,
+                        .assignments_path = (2 == mode) ? labels : NULL,
+                        .num_threads = check_threads[h],
+                        .memory_budget = mode ? 4 << 10 : 0,
+                };
+
+                /* Streaming gets the smallest budget doubling up from 4 KiB. */
+                while (ok) {
+                    memcpy(outcome.centroids, dataset->seeds[dtype],
+                           sizeof(double) * values);
+                    outcome.result = compute_kmeans_ooc(&meta);
+                    outcome.iterations = meta.current_iterations;
+
+                    if (KMEANS_NO_MEMORY != outcome.result || !mode) break;
+                    meta.memory_budget *= 2;
+                }
+
+                /* A cached dataset is read once, a streamed one every pass. */
+                const unsigned long long bytes = (unsigned long long)n
+                    * dataset->dim * kmeans_dtype_size(dtype);
+                ok = ok && (mode ? meta.bytes_read >= 2 * bytes
+                                 : meta.bytes_read < 2 * bytes);
+
+                /* Spilled labels are raw int32 values, as many as points. */
+                if (ok && 2 == mode) {
+                    FILE *file = fopen(labels, "rb");
+                    ok = file && n == fread(outcome.assignments, sizeof(int),
+                                            n, file);
+                    if (file) fclose(file);
+                }
+
+                ok = ok && check_same(&reference, &outcome, n, values, 0.0);
+                check_report(ok, "%s: out of core over %s, %s, %zu thread(s), "
+                             "matches lloyd", dataset->name, dtype_names[dtype],
+                             (0 == mode) ? "cached"
+                                 : (1 == mode) ? "streamed"
+                                               : "labels spilled",
+                             check_threads[h]);
+                check_outcome_free(&outcome);
+            }
+
+            check_outcome_free(&reference);
+        }
+    }
+
+    unlink(path);
+    unlink(labels);
+}
+
+
+/* Sharded runs must match Lloyd with one thread per worker. */
+static
+void
+check_shard(const check_dataset *dataset)
+{
+    static const kmeans_transport transports[] = {
+        KMEANS_TRANSPORT_SOCKET, KMEANS_TRANSPORT_SHM
+    };
+    static const char *names[] = { "socket", "shm" };
+    const size_t workers = 3;
+
+    for (size_t t = 0; t < 2; ++t) {
+        kmeans_dense_meta meta = check_meta(dataset, KMEANS_FLOAT32,
+                                            KMEANS_ROW_MAJOR, KMEANS_LLOYD,
+                                            workers);
+        check_outcome reference = { 0 }, outcome = { 0 };
+
+        int ok = check_dense(meta, dataset->seeds[KMEANS_FLOAT32], &reference)
+            && check_outcome_init(&outcome, dataset->seeds[KMEANS_FLOAT32],
+                                  dataset->num_objects, dataset->num_centroids,
+                                  dataset->dim);
+
+        if (ok) {
+            meta.centroids = outcome.centroids;
+            meta.cluster_assignments = outcome.assignments;
+            outcome.result =
+                compute_kmeans_sharded(&meta, workers, transports[t]);
+            outcome.iterations = meta.current_iterations;
+
+            ok = check_same(&reference, &outcome, dataset->num_objects,
+                            dataset->num_centroids * dataset->dim, 0.0);
+        }
+
+        check_report(ok, "%s: sharded over %s, %zu workers, matches lloyd",
+                     dataset->name, names[t], workers);
+        check_outcome_free(&reference);
+        check_outcome_free(&outcome);
+    }
+}
+
+
+/*
+ * The best of several restarts must be exactly the run seeded the same way
+ *  on its own: k-means++ from a generator seeded with seed + r.
+ */
+static
+void
+check_restart(const check_dataset *dataset)
+{
+    const size_t n = dataset->num_objects;
+    const size_t values = dataset->num_centroids * dataset->dim;
+    kmeans_dense_meta meta = check_meta(dataset, KMEANS_FLOAT64,
+                                        KMEANS_ROW_MAJOR, KMEANS_HAMERLY, 1);
+    check_outcome best = { 0 }, alone = { 0 };
+    double *seeds = NULL;
+    kmeans_rng rng;
+
+    int ok = check_outcome_init(&best, dataset->seeds[0], n,
+                                dataset->num_centroids, dataset->dim);
+
+    if (ok) {
+        kmeans_dense_meta template = meta;
+        template.centroids = best.centroids;
+        template.cluster_assignments = best.assignments;
+
+        kmeans_restart_meta restart = {
+                .dense = &template,
+                .num_runs = 4,
+                .seed = 17,
+        };
+
+        best.result = compute_kmeans_restarts(&restart);
+        best.iterations = template.current_iterations;
+
+        kmeans_rng_seed(&rng, restart.seed + restart.best_run);
+        ok = KMEANS_OK == kmeans_seed_plusplus(&meta, &rng, &seeds)
+            && check_dense(meta, seeds, &alone)
+            && check_same(&best, &alone, n, values, 0.0);
+    }
+
+    check_report(ok, "%s: best of four restarts matches its run alone",
+                 dataset->name);
+    check_outcome_free(&best);
+    check_outcome_free(&alone);
+    free(seeds);
+}
+
+
+/*
+ * A state kept up to date through appends and removals must end where the
+ *  invariants of Lloyd's algorithm hold: every point at its nearest centroid
+ *  and every centroid at the mean of its points. Removed ids report -1 until
+ *  an append hands them out again.
+ */
+static
+void
+check_state(void)
+{
+    const size_t k = 20, dim = 4;
+    const size_t first = 20000, removed = 3000, second = 2500;
+    const size_t total = first + second;
+    double *points = malloc(sizeof(double) * total * dim);
+    size_t *ids = malloc(sizeof(size_t) * total);
+    size_t *gone = malloc(sizeof(size_t) * removed);
+    size_t *owner = malloc(sizeof(size_t) * total);
+    double *sums = malloc(sizeof(double) * k * dim);
+    double *counts = malloc(sizeof(double) * k);
+    double centroids[k * dim], centers[k * dim];
+    kmeans_state *state = NULL;
+    kmeans_rng rng;
+    int ok;
+
+    if (!points || !ids || !gone || !owner || !sums || !counts) {
+        check_report(0, "state: out of memory");
+        goto break_out;
+    }
+
+    kmeans_rng_seed(&rng, 13);
+    for (size_t i = 0; i < k * dim; ++i)
+        centers[i] = 4.0 * CHECK_BLOB_SPACING * kmeans_rng_uniform(&rng);
+
+    for (size_t i = 0; i < total; ++i) {
+        const double *center = centers + (kmeans_rng_below(&rng, k) * dim);
+
+        for (size_t d = 0; d < dim; ++d)
+            points[(i * dim) + d] = center[d]
+                + (CHECK_BLOB_SIGMA * check_gaussian(&rng));
+    }
+
+    kmeans_state_meta meta = {
+            .centroids = centroids,
+            .num_centroids = k,
+            .dim = dim,
+            .iterations = 1000,
+    };
+
+    memcpy(centroids, points, sizeof(centroids));
+    ok = KMEANS_OK == kmeans_state_create(&meta, &state)
+        && KMEANS_OK == kmeans_state_append(state, points, first, ids)
+        && KMEANS_OK == kmeans_state_update(state);
+
+    /* Take out every (first / removed)-th point, and check they are gone. */
+    for (size_t r = 0; r < removed; ++r) gone[r] = ids[(r * first) / removed];
+
+    ok = ok && KMEANS_OK == kmeans_state_remove(state, gone, removed);
+    for (size_t r = 0; ok && r < removed; ++r)
+        ok = -1 == kmeans_state_cluster(state, gone[r]);
+
+    check_report(ok, "state: %zu removed ids report -1", removed);
+
+    ok = ok
+        && KMEANS_OK == kmeans_state_append(state, points + (first * dim),
+                                            second, ids + first)
+        && KMEANS_OK == kmeans_state_update(state)
+        && first - removed + second == meta.num_objects;
+
+    /* Find the point behind every id still held, in the order of events. */
+    for (size_t id = 0; id < total; ++id) owner[id] = SIZE_MAX;
+    for (size_t i = 0; ok && i < total; ++i) {
+        ok = ids[i] < total;
+        if (ok && first == i)
+            for (size_t r = 0; r < removed; ++r) owner[gone[r]] = SIZE_MAX;
+        if (ok) owner[ids[i]] = i;
+    }
+
+    size_t num_ids = 0, num_free = 0, far = 0;
+    const int *assignments = ok ? kmeans_state_assignments(state, &num_ids)
+                                : NULL;
+
+    memset(sums, 0, sizeof(double) * k * dim);
+    memset(counts, 0, sizeof(double) * k);
+
+    for (size_t id = 0; ok && id < num_ids; ++id) {
+        const int cluster = assignments[id];
+
+        if (SIZE_MAX == owner[id]) {
+            ok = -1 == cluster;
+            ++num_free;
+            continue;
+        }
+
+        const double *point = points + (owner[id] * dim);
+
+        ok = cluster == kmeans_state_cluster(state, id);
+        far += ok && !check_is_nearest(point, centroids, k, dim, cluster);
+        if (!ok || far) break;
+
+        for (size_t d = 0; d < dim; ++d)
+            sums[(cluster * dim) + d] += point[d];
+        counts[cluster] += 1.0;
+    }
+
+    check_report(ok && !far && num_ids - meta.num_objects == num_free,
+                 "state: after removing %zu and appending %zu, every point "
+                 "is at its nearest centroid", removed, second);
+
+    for (size_t c = 0; ok && c < k; ++c) {
+        for (size_t d = 0; ok && d < dim && counts[c] > 0.0; ++d) {
+            const double mean = sums[(c * dim) + d] / counts[c];
+
+            ok = fabs(centroids[(c * dim) + d] - mean)
+                <= CHECK_MEAN_TOLERANCE * (1.0 + fabs(mean));
+        }
+    }
+
+    check_report(ok, "state: every centroid is the mean of its points");
+
+break_out:
+    if (state) kmeans_state_destroy(state);
+    free(points);
+    free(ids);
+    free(gone);
+    free(owner);
+    free(sums);
+    free(counts);
+}
+
+
+/*
+ * A batch of small problems must match compute_kmeans_dense() on each of
+ *  them, and a workspace in use must not allocate anything.
+ */
+static
+void
+check_batch(const check_dataset *dataset)
+{
+    const size_t dim = dataset->dim;
+    const size_t k = 4;
+    const size_t max_objects = 40;
+    size_t num_problems = 0;
+    size_t offsets[256];
+
+    /* Problems of varied sizes, a few of them too small for k. */
+    offsets[0] = 0;
+    while (num_problems < 255) {
+        size_t size = (num_problems % 17) ? 10 + (num_problems % 31) : 3;
+
+        if (offsets[num_problems] + size > dataset->num_objects) break;
+        offsets[num_problems + 1] = offsets[num_problems] + size;
+        ++num_problems;
+    }
+
+    const size_t n = offsets[num_problems];
+    double *centroids = malloc(sizeof(double) * num_problems * k * dim);
+    int *assignments = malloc(sizeof(int) * n);
+    kmeans_result *results = malloc(sizeof(kmeans_result) * num_problems);
+    unsigned long *iterations = malloc(sizeof(unsigned long) * num_problems);
+
+    for (size_t h = 0; h < CHECK_NUM_THREADS; ++h) {
+        kmeans_workspace *workspace = NULL;
+        int ok = centroids && assignments && results && iterations
+            && KMEANS_OK == kmeans_workspace_create(max_objects, k, dim,
+                                                    check_threads[h],
+                                                    &workspace);
+
+        kmeans_batch_meta batch = {
+                .data = dataset->widened[0],
+                .offsets = offsets,
+                .num_problems = num_problems,
+                .dim = dim,
+                .num_centroids = k,
+                .centroids = centroids,
+                .seed_centroids = 1,
+                .seed = 5,
+                .iterations = CHECK_ITERATIONS,
+                .cluster_assignments = assignments,
+                .results = results,
+                .current_iterations = iterations,
+        };
+
+        /* The second call runs on a workspace which has already been used. */
+        size_t allocations = 0;
+        if (ok) {
+            compute_kmeans_batch(&batch, workspace);
+
+            allocations = check_allocations_now();
+            compute_kmeans_batch(&batch, workspace);
+            allocations = check_allocations_now() - allocations;
+        }
+
+        check_report(ok && !allocations, "%s: batch of %zu problems, "
+                     "%zu thread(s), allocates nothing", dataset->name,
+                     num_problems, check_threads[h]);
+
+        /* Solve every problem again on its own, from the batch's centroids. */
+        size_t mismatches = 0;
+        for (size_t p = 0; ok && p < num_problems; ++p) {
+            const size_t count = offsets[p + 1] - offsets[p];
+            check_outcome small = { 0 }, dense = { 0 };
+            double seeds[k * dim];
+
+            if (KMEANS_OK != results[p]) continue;
+
+            /* The first k points of a problem seed both runs. */
+            memcpy(seeds, dataset->widened[0] + (offsets[p] * dim),
+                   sizeof(seeds));
+
+            kmeans_dense_meta meta = {
+                    .data = dataset->widened[0] + (offsets[p] * dim),
+                    .num_objects = count,
+                    .dim = dim,
+                    .num_centroids = k,
+                    .iterations = CHECK_ITERATIONS,
+            };
+
+            ok = check_outcome_init(&small, seeds, count, k, dim);
+            if (ok) {
+                meta.centroids = small.centroids;
+                meta.cluster_assignments = small.assignments;
+
+                allocations = check_allocations_now();
+                small.result = compute_kmeans_small(&meta, workspace);
+                small.iterations = meta.current_iterations;
+                mismatches += check_allocations_now() != allocations;
+            }
+
+            ok = ok && check_dense(meta, seeds, &dense);
+            if (ok) {
+                mismatches += !check_same(&dense, &small, count, k * dim, 0.0);
+                check_outcome_free(&dense);
+            }
+            check_outcome_free(&small);
+        }
+
+        check_report(ok && !mismatches, "%s: small problems on a workspace, "
+                     "%zu thread(s), match dense lloyd without allocating",
+                     dataset->name, check_threads[h]);
+        if (workspace) kmeans_workspace_destroy(workspace);
+    }
+
+    free(centroids);
+    free(assignments);
+    free(results);
+    free(iterations);
+}
+
+
+/*
+ * A model file whose padding lanes are no longer infinite must be refused,
+ *  as they would let a prediction name a cluster past k. The first infinite
+ *  value of a file is in the centroid block, and the last one in the leaves
+ *  of the tree when there is one.
+ */
+static
+int
+check_model_padding(const kmeans_model *model,
+                    const char *path,
+                    int last)
+{
+    kmeans_model *mapped = NULL;
+    FILE *file = NULL;
+    long offset = -1;
+    double value;
+    int ok = KMEANS_OK == kmeans_model_save(model, path)
+        && (file = fopen(path, "rb"));
+
+    for (long at = 0; ok && 1 == fread(&value, sizeof(double), 1, file);
+         at += sizeof(double))
+        if (isinf(value) && value > 0.0 && (last || offset < 0)) offset = at;
+
+    if (file) fclose(file);
+
+    value = 0.0;
+    ok = ok && offset >= 0
+        && check_patch(path, (size_t)offset, &value, sizeof(double))
+        && KMEANS_MALFORMED_INPUT == kmeans_model_open(path, &mapped);
+
+    if (mapped) kmeans_model_destroy(mapped);
+    return ok;
+}
+
+
+/*
+ * A model must answer like the assignment step of the Lloyd engine, before
+ *  and after a round trip through a file, and so must a coreset's final pass.
+ */
+static
+void
+check_model(const check_dataset *dataset)
+{
+    const size_t n = dataset->num_objects;
+    const size_t dim = dataset->dim;
+    const size_t k = dataset->num_centroids;
+    kmeans_dense_meta meta = check_meta(dataset, KMEANS_FLOAT64,
+                                        KMEANS_ROW_MAJOR, KMEANS_LLOYD, 3);
+    kmeans_model *model = NULL, *mapped = NULL;
+    check_outcome trained = { 0 };
+    int *labels = malloc(sizeof(int) * n);
+    int *reference = malloc(sizeof(int) * n);
+    char path[32];
+    double inertia = 0.0;
+
+    int ok = labels && reference && check_temporary(path)
+        && check_dense(meta, dataset->seeds[0], &trained);
+    if (!ok) {
+        check_report(0, "%s: cannot train a model", dataset->name);
+        free(labels);
+        free(reference);
+        return;
+    }
+
+    kmeans_model_info info = {
+            .num_centroids = k,
+            .dim = dim,
+            .num_objects = n,
+            .iterations = trained.iterations,
+    };
+
+    ok = KMEANS_OK == kmeans_model_create(trained.centroids, &info, &model);
+    if (ok)
+        kmeans_model_predict_batch(model, check_rows(dataset), n, reference,
+                                   NULL);
+
+    /* A run out of iterations last assigned against older centroids. */
+    for (size_t i = 0; ok && i < n; ++i)
+        ok = check_is_nearest(check_rows(dataset) + (i * dim),
+                              trained.centroids, k, dim, reference[i]);
+    ok = ok && (KMEANS_OK != trained.result
+                || !memcmp(reference, trained.assignments, sizeof(int) * n));
+
+    /* Assign every point to the trained centroids, without moving them. */
+    meta.centroids = trained.centroids;
+    meta.cluster_assignments = labels;
+    ok = ok && KMEANS_OK == kmeans_coreset_assign(&meta, &inertia)
+        && !memcmp(labels, reference, sizeof(int) * n);
+
+    check_report(ok, "%s: model and coreset assignment match lloyd",
+                 dataset->name);
+
+    ok = ok && KMEANS_OK == kmeans_model_save(model, path)
+        && KMEANS_OK == kmeans_model_open(path, &mapped);
+    if (ok)
+        kmeans_model_predict_batch(mapped, check_rows(dataset), n, labels,
+                                   NULL);
+
+    check_report(ok && !memcmp(labels, reference, sizeof(int) * n),
+                 "%s: saved model predicts the same", dataset->name);
+
+    /* The twelve centroids of the blobs leave padding lanes in the block. */
+    if (dataset->blobs)
+        check_report(model && check_model_padding(model, path, 0),
+                     "%s: model with corrupt block padding is rejected",
+                     dataset->name);
+
+    if (model) kmeans_model_destroy(model);
+    if (mapped) kmeans_model_destroy(mapped);
+    unlink(path);
+    check_outcome_free(&trained);
+    free(labels);
+    free(reference);
+}
+
+
+/*
+ * Many centroids in few dimensions get a k-d tree, which must answer like a
+ *  brute-force search, and whose leaf padding is checked like the block's.
+ */
+static
+void
+check_model_tree(void)
+{
+    const size_t k = 1000, dim = 2, n = 20000;
+    double *centroids = malloc(sizeof(double) * k * dim);
+    double *points = malloc(sizeof(double) * n * dim);
+    kmeans_model *model = NULL;
+    char path[32];
+    kmeans_rng rng;
+    int ok = centroids && points && check_temporary(path);
+
+    if (!ok) {
+        check_report(0, "tree: out of memory");
+        goto break_out;
+    }
+
+    kmeans_rng_seed(&rng, 19);
+    for (size_t i = 0; i < k * dim; ++i)
+        centroids[i] = 100.0 * kmeans_rng_uniform(&rng);
+    for (size_t i = 0; i < n * dim; ++i)
+        points[i] = -10.0 + 120.0 * kmeans_rng_uniform(&rng);
+
+    kmeans_model_info info = { .num_centroids = k, .dim = dim };
+
+    ok = KMEANS_OK == kmeans_model_create(centroids, &info, &model);
+    for (size_t i = 0; ok && i < n; ++i)
+        ok = check_is_nearest(points + (i * dim), centroids, k, dim,
+                              kmeans_model_predict(model, points + (i * dim),
+                                                   NULL));
+
+    check_report(ok, "tree: model over %zu centroids matches brute force", k);
+
+    check_report(ok && check_model_padding(model, path, 0),
+                 "tree: model with corrupt block padding is rejected");
+    check_report(ok && check_model_padding(model, path, 1),
+                 "tree: model with corrupt leaf padding is rejected");
+    unlink(path);
+
+break_out:
+    if (model) kmeans_model_destroy(model);
+    free(centroids);
+    free(points);
+}
+
+
+/*
+ * A CSR copy of the data must settle on Lloyd's clusters; the centroids are
+ *  computed from expanded distances, so they only agree to within rounding.
+ *  A column repeated within a point is rejected.
+ */
+static
+void
+check_sparse(const check_dataset *dataset)
+{
+    const size_t n = dataset->num_objects;
+    const size_t dim = dataset->dim;
+    size_t *offsets = malloc(sizeof(size_t) * (n + 1));
+    uint32_t *indices = malloc(sizeof(uint32_t) * n * dim);
+    double *values = malloc(sizeof(double) * n * dim);
+
+    if (!offsets || !indices || !values) {
+        check_report(0, "%s: out of memory", dataset->name);
+        goto break_out;
+    }
+
+    offsets[0] = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t nnz = offsets[i];
+
+        for (size_t d = 0; d < dim; ++d) {
+            const double value = dataset->widened[0][(i * dim) + d];
+
+            if (0.0 == value) continue;
+            indices[nnz] = d;
+            values[nnz++] = value;
+        }
+
+        offsets[i + 1] = nnz;
+    }
+
+    for (size_t h = 0; h < CHECK_NUM_THREADS; ++h) {
+        check_outcome reference = { 0 }, outcome = { 0 };
+
+        int ok = check_dense(check_meta(dataset, KMEANS_FLOAT64,
+                                        KMEANS_ROW_MAJOR, KMEANS_LLOYD,
+                                        check_threads[h]),
+                             dataset->seeds[0], &reference)
+            && check_outcome_init(&outcome, dataset->seeds[0], n,
+                                  dataset->num_centroids, dim);
+
+        kmeans_sparse_meta meta = {
+                .offsets = offsets,
+                .indices = indices,
+                .values = values,
+                .num_objects = n,
+                .dim = dim,
+                .centroids = outcome.centroids,
+                .num_centroids = dataset->num_centroids,
+                .iterations = CHECK_ITERATIONS,
+                .cluster_assignments = outcome.assignments,
+                .num_threads = check_threads[h],
+        };
+
+        if (ok) {
+            outcome.result = compute_kmeans_sparse(&meta);
+            outcome.iterations = meta.current_iterations;
+            ok = check_same(&reference, &outcome, n,
+                            dataset->num_centroids * dim, CHECK_TOLERANCE);
+        }
+
+        check_report(ok, "%s: sparse copy, %zu thread(s), matches lloyd",
+                     dataset->name, check_threads[h]);
+
+        /* Repeat the first column of the first point. */
+        if (ok && offsets[1] > 1) {
+            const uint32_t second = indices[1];
+
+            indices[1] = indices[0];
+            check_report(KMEANS_MALFORMED_INPUT == compute_kmeans_sparse(&meta),
+                         "%s: sparse point repeating a column, %zu thread(s), "
+                         "is rejected", dataset->name, check_threads[h]);
+            indices[1] = second;
+        }
+
+        check_outcome_free(&reference);
+        check_outcome_free(&outcome);
+    }
+
+break_out:
+    free(offsets);
+    free(indices);
+    free(values);
+}
+
+
+/* A coreset must only depend on the generator and the thread count. */
+static
+void
+check_coreset(const check_dataset *dataset)
+{
+    kmeans_dense_meta meta = check_meta(dataset, KMEANS_FLOAT64,
+                                        KMEANS_ROW_MAJOR, KMEANS_LLOYD, 3);
+    kmeans_coreset *first = NULL, *second = NULL;
+    kmeans_rng rng;
+    int ok;
+
+    kmeans_rng_seed(&rng, 23);
+    ok = KMEANS_OK == kmeans_coreset_build(&meta, 500, &rng, &first);
+    kmeans_rng_seed(&rng, 23);
+    ok = ok && KMEANS_OK == kmeans_coreset_build(&meta, 500, &rng, &second);
+
+    ok = ok && first->num_points == second->num_points
+        && !memcmp(first->points, second->points,
+                   sizeof(double) * first->num_points * first->dim)
+        && !memcmp(first->weights, second->weights,
+                   sizeof(double) * first->num_points)
+        && !memcmp(first->indices, second->indices,
+                   sizeof(size_t) * first->num_points);
+
+    check_report(ok, "%s: coreset is reproducible", dataset->name);
+    if (first) kmeans_coreset_destroy(first);
+    if (second) kmeans_coreset_destroy(second);
+}
+
+
+int
+main(void)
+{
+    /*
+     * Blobs in few dimensions cover the k-d tree and Lloyd over narrow types,
+     *  and uniform points in many dimensions hold near-ties and lead the
+     *  automatic choice to GEMM.
+     */
+    check_dataset datasets[] = {
+        { .name = "blobs", .num_objects = 2400, .dim = 5, .num_centroids = 12,
+          .blobs = 1 },
+        { .name = "uniform", .num_objects = 1000, .dim = 66, .num_centroids = 32,
+          .blobs = 0 },
+    };
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    for (size_t s = 0; s < sizeof(datasets) / sizeof(datasets[0]); ++s) {
+        check_dataset *dataset = &(datasets[s]);
+
+        if (!check_generate(dataset, 1000 + s)) {
+            check_report(0, "%s: cannot generate the dataset", dataset->name);
+            check_dataset_free(dataset);
+            continue;
+        }
+
+        check_engines(dataset);
+        check_seeding(dataset);
+        check_seeding_weights(dataset);
+        check_weights(dataset);
+        check_ooc(dataset);
+        check_shard(dataset);
+        check_restart(dataset);
+        check_model(dataset);
+
+        if (dataset->blobs) {
+            check_files(dataset);
+            check_batch(dataset);
+            check_sparse(dataset);
+            check_coreset(dataset);
+        }
+
+        check_dataset_free(dataset);
+    }
+
+    check_stream();
+    check_output();
+    check_model_tree();
+    check_state();
+
+    if (check_failures) {
+        printf("\n%zu check(s) failed.\n", check_failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("\nAll checks passed.\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,62 @@
+/*
+ * kmeans_convert.c
+ *
+ * Converts CSV files into the binary dataset format, which the executables
+ *  can then map straight into memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kmeans.h"
+#include "kmeans_dataset.h"
+
+
+int
+main(int argc,
+     char **argv)
+{
+    kmeans_dtype dtype = KMEANS_FLOAT64;
+    kmeans_result result;
+    double scale = 0.0;
+    int first = 1;
+
+    if (argc > 1 && !strcmp(argv[1], "-f32")) {
+        dtype = KMEANS_FLOAT32;
+        first = 2;
+    } else if (argc > 1 && !strcmp(argv[1], "-i8")) {
+        dtype = KMEANS_INT8;
+        first = 2;
+    } else if (argc > 1 && !strcmp(argv[1], "-u8")) {
+        dtype = KMEANS_UINT8;
+        first = 2;
+    }
+
+    /* The value of one quantization step, for -i8 and -u8. */
+    if (KMEANS_FLOAT64 != dtype && KMEANS_FLOAT32 != dtype
+        && argc > first + 1 && !strcmp(argv[first], "-s")) {
+        char *end = NULL;
+
+        scale = strtod(argv[first + 1], &end);
+        if (!*argv[first + 1] || *end || !(scale > 0.0)) {
+            fprintf(stderr, "Invalid scale: %s\n", argv[first + 1]);
+            return 1;
+        }
+        first += 2;
+    }
+
+    if (argc - first != 2) {
+        fprintf(stderr, "Usage: %s [-f32|-i8 [-s scale]|-u8 [-s scale]]"
+                " input.csv output.kmd\n", argv[0]);
+        return 1;
+    }
+
+    result = kmeans_dataset_from_csv(argv[first], argv[first + 1], dtype, scale);
+    if (KMEANS_OK != result) {
+        fprintf(stderr, "Conversion failed with code: %d\n", result);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,570 @@
+/*
+ * kmeans_coreset.c
+ *
+ * Implementation of coreset construction. The sensitivity of a point bounds
+ *  its share of the cost of any clustering; with the rough seeding B it is
+ *  estimated as
+ *
+ *      s(x) = a d(x, B)² / c + 2a cost(B_x) / (|B_x| c) + 4n / |B_x|
+ *
+ *  where B_x is the rough cluster of x, cost(B_x) the squared distances within
+ *  it, c the mean squared distance and a = 16 (log k + 2). Points are drawn
+ *  with probability s(x) / S and weighted S / (m s(x)), for m draws summing
+ *  to S, which keeps the weighted cost of any centroids unbiased.
+ *
+ * Every term is known after one pass, so the second pass can walk the running
+ *  sum of s(x) past sorted thresholds without ever keeping anything per point.
+ */
+
+#include "kmeans_coreset.h"
+#include "kmeans_pool.h"
+#include "kmeans_kernels.h"
+#include "kmeans_internal.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+
+/* Points per rough centroid in the uniform sample the rough seeding uses. */
+#define CORESET_ROUGH_SAMPLE 32
+
+
+/* State shared by every thread of both passes. */
+typedef struct
+{
+    const kmeans_dense_meta *meta;
+    const kmeans_kernels *kernels;
+
+    /* The rough seeding, transposed for the kernels. */
+    double *rough_t;
+    size_t stride;
+
+    /* One row of scratch space per thread. */
+    double *rows;
+
+    /* Per thread, how many points and how much cost each rough cluster got. */
+    size_t *counts;
+    double *costs;
+
+    /* Factor of d(x, B)², and the part of s(x) every member of a cluster shares. */
+    double scale;
+    double *terms;
+
+    /* Where the running sum of s(x) starts for each thread, and the total. */
+    double *starts;
+    double total;
+
+    /* Sorted thresholds, of which thread 't' draws [first[t], first[t + 1]). */
+    double *thresholds;
+    size_t *first;
+    size_t num_draws;
+
+    /* Each thread writes its draws from index first[t] on. */
+    kmeans_coreset *coreset;
+    size_t *filled;
+} coreset_context;
+
+
+/* Measure one thread's points against the rough seeding. */
+static
+void
+coreset_job_measure(void *context,
+                    const size_t thread,
+                    const size_t num_threads)
+{
+    coreset_context *c = (coreset_context *)context;
+    const kmeans_dense_meta *meta = c->meta;
+    const size_t k = meta->num_centroids;
+    double *scratch = c->rows + (thread * meta->dim);
+    size_t *counts = c->counts + (thread * k);
+    double *costs = c->costs + (thread * k);
+    size_t lo, hi;
+
+    kmeans_pool_slice(meta->num_objects, thread, num_threads, &lo, &hi);
+
+    for (size_t i = lo; i < hi; ++i) {
+        const double *row = kmeans_dense_row(meta, i, scratch);
+        double distance;
+        const int cluster =
+            c->kernels->nearest(row, c->rough_t, c->stride, meta->dim, &distance);
+
+        ++counts[cluster];
+        costs[cluster] += distance;
+    }
+}
+
+
+/* Draw point 'i' once more, merging it with the previous draw if it was 'i'. */
+static inline
+void
+coreset_take(coreset_context *c,
+             size_t thread,
+             size_t i,
+             const double *row,
+             double weight)
+{
+    kmeans_coreset *coreset = c->coreset;
+    const size_t dim = coreset->dim;
+    const size_t slot = c->first[thread] + c->filled[thread];
+
+    if (c->filled[thread] && coreset->indices[slot - 1] == i) {
+        coreset->weights[slot - 1] += weight;
+        return;
+    }
+
+    memcpy(coreset->points + (slot * dim), row, sizeof(double) * dim);
+    coreset->weights[slot] = weight;
+    coreset->indices[slot] = i;
+    ++c->filled[thread];
+}
+
+
+/*
+ * Walk one thread's points along the running sum of their sensitivities, and
+ *  draw each point once per threshold it steps over. The walk ends with the
+ *  thread's last threshold; any left over by rounding go to the last point.
+ */
+static
+void
+coreset_job_draw(void *context,
+                 const size_t thread,
+                 const size_t num_threads)
+{
+    coreset_context *c = (coreset_context *)context;
+    const kmeans_dense_meta *meta = c->meta;
+    double *scratch = c->rows + (thread * meta->dim);
+    const size_t end = c->first[thread + 1];
+    size_t next = c->first[thread];
+    double running = c->starts[thread];
+    double sensitivity = 0.0;
+    size_t lo, hi, i;
+
+    kmeans_pool_slice(meta->num_objects, thread, num_threads, &lo, &hi);
+
+    c->filled[thread] = 0;
+    if (next == end || lo == hi) return;
+
+    for (i = lo; i < hi && next < end; ++i) {
+        const double *row = kmeans_dense_row(meta, i, scratch);
+        double distance;
+        const int cluster =
+            c->kernels->nearest(row, c->rough_t, c->stride, meta->dim, &distance);
+
+        sensitivity = (c->scale * distance) + c->terms[cluster];
+        running += sensitivity;
+
+        for (; next < end && c->thresholds[next] < running; ++next)
+            coreset_take(c, thread, i, row,
+                         c->total / (c->num_draws * sensitivity));
+    }
+
+    if (next < end) {
+        const double *row = kmeans_dense_row(meta, hi - 1, scratch);
+
+        for (; next < end; ++next)
+            coreset_take(c, thread, hi - 1, row,
+                         c->total / (c->num_draws * sensitivity));
+    }
+}
+
+
+/* Order doubles ascending for qsort(). */
+static
+int
+coreset_compare(const void *left,
+                const void *right)
+{
+    const double a = *(const double *)left;
+    const double b = *(const double *)right;
+
+    return (a > b) - (a < b);
+}
+
+
+/*
+ * Sum up the first pass into the terms of s(x), the total S, and where each
+ *  thread's walk starts. The per-thread counts and costs are folded into the
+ *  spare last row, in thread order, so the result only depends on the thread
+ *  count.
+ */
+static
+void
+coreset_sensitivities(coreset_context *c,
+                      size_t num_threads)
+{
+    const size_t k = c->meta->num_centroids;
+    const double n = (double)c->meta->num_objects;
+    const double alpha = 16.0 * (log((double)k) + 2.0);
+    size_t *counts = c->counts + (num_threads * k);
+    double *costs = c->costs + (num_threads * k);
+    double cost = 0.0;
+
+    for (size_t t = 0; t < num_threads; ++t) {
+        for (size_t b = 0; b < k; ++b) {
+            counts[b] += c->counts[(t * k) + b];
+            costs[b] += c->costs[(t * k) + b];
+        }
+    }
+    for (size_t b = 0; b < k; ++b) cost += costs[b];
+
+    /* Data sitting right on the seeding leaves only the cluster sizes. */
+    c->scale = (cost > 0.0) ? alpha * n / cost : 0.0;
+
+    for (size_t b = 0; b < k; ++b) {
+        c->terms[b] = counts[b]
+            ? ((2.0 * c->scale * costs[b]) + (4.0 * n)) / counts[b]
+            : 0.0;
+    }
+
+    c->total = 0.0;
+    for (size_t t = 0; t < num_threads; ++t) {
+        c->starts[t] = c->total;
+
+        for (size_t b = 0; b < k; ++b) {
+            c->total += c->scale * c->costs[(t * k) + b];
+            c->total += c->terms[b] * c->counts[(t * k) + b];
+        }
+    }
+}
+
+
+kmeans_result
+kmeans_coreset_build(const kmeans_dense_meta *meta,
+                     size_t size,
+                     kmeans_rng *rng,
+                     kmeans_coreset **coreset)
+{
+    assert(meta);
+    assert(rng);
+    assert(coreset);
+
+    assert(meta->data);
+    assert(meta->num_objects);
+    assert(meta->dim);
+    assert(meta->num_centroids);
+    assert(meta->num_centroids <= meta->num_objects);
+    assert(size);
+
+    const size_t n = meta->num_objects;
+    const size_t dim = meta->dim;
+    const size_t k = meta->num_centroids;
+    size_t num_threads = meta->num_threads ? meta->num_threads : 1;
+    size_t sample_size = CORESET_ROUGH_SAMPLE * k;
+    kmeans_pool *pool = NULL;
+    double *sample = NULL;
+    double *rough = NULL;
+    coreset_context c = {
+            .meta = meta,
+            .kernels = kmeans_kernels_for(dim),
+            .stride = kmeans_block_stride(k),
+            .num_draws = size,
+    };
+    kmeans_result result;
+
+    if (num_threads > n) num_threads = n;
+    if (sample_size > n) sample_size = n;
+
+    *coreset = calloc(1, sizeof(kmeans_coreset));
+    sample = malloc(sizeof(double) * sample_size * dim);
+    c.rough_t = kmeans_block_alloc(k, dim);
+    c.rows = malloc(sizeof(double) * num_threads * dim);
+    c.counts = calloc((num_threads + 1) * k, sizeof(size_t));
+    c.costs = calloc((num_threads + 1) * k, sizeof(double));
+    c.terms = malloc(sizeof(double) * k);
+    c.starts = malloc(sizeof(double) * num_threads);
+    c.thresholds = malloc(sizeof(double) * size);
+    c.first = malloc(sizeof(size_t) * (num_threads + 1));
+    c.filled = malloc(sizeof(size_t) * num_threads);
+
+    if (!*coreset || !sample || !c.rough_t || !c.rows || !c.counts
+        || !c.costs || !c.terms || !c.starts || !c.thresholds || !c.first
+        || !c.filled) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    c.coreset = *coreset;
+    c.coreset->dim = dim;
+    c.coreset->points = malloc(sizeof(double) * size * dim);
+    c.coreset->weights = malloc(sizeof(double) * size);
+    c.coreset->indices = malloc(sizeof(size_t) * size);
+
+    if (!c.coreset->points || !c.coreset->weights || !c.coreset->indices
+        || !(pool = kmeans_pool_create(num_threads))) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    /* The rough seeding: k-means++ over a uniform sample, read at random. */
+    for (size_t j = 0; j < sample_size; ++j) {
+        double *target = sample + (j * dim);
+        const double *row = kmeans_dense_row(meta, kmeans_rng_below(rng, n), target);
+
+        if (row != target) memcpy(target, row, sizeof(double) * dim);
+    }
+
+    kmeans_dense_meta sampled = {
+            .data = sample,
+            .num_objects = sample_size,
+            .dim = dim,
+            .layout = KMEANS_ROW_MAJOR,
+            .dtype = KMEANS_FLOAT64,
+            .num_centroids = k,
+            .num_threads = num_threads,
+    };
+
+    if (KMEANS_OK != (result = kmeans_seed_plusplus(&sampled, rng, &rough)))
+        goto break_out;
+    kmeans_block_transpose(rough, k, dim, c.rough_t);
+
+    /* First pass: how far each point lies from the seeding. */
+    kmeans_pool_run(pool, coreset_job_measure, &c);
+    coreset_sensitivities(&c, num_threads);
+
+    /* The thresholds, and which of them fall within each thread's share. */
+    for (size_t j = 0; j < size; ++j)
+        c.thresholds[j] = kmeans_rng_uniform(rng) * c.total;
+    qsort(c.thresholds, size, sizeof(double), coreset_compare);
+
+    c.first[0] = 0;
+    for (size_t t = 1; t < num_threads; ++t) {
+        size_t j = c.first[t - 1];
+
+        while (j < size && c.thresholds[j] < c.starts[t]) ++j;
+        c.first[t] = j;
+    }
+    c.first[num_threads] = size;
+
+    /* Second pass: draw the coreset, then close the gaps between threads. */
+    kmeans_pool_run(pool, coreset_job_draw, &c);
+
+    for (size_t t = 0; t < num_threads; ++t) {
+        kmeans_coreset *out = c.coreset;
+
+        for (size_t from = c.first[t]; from < c.first[t] + c.filled[t]; ++from) {
+            if (from != out->num_points) {
+                memmove(out->points + (out->num_points * dim),
+                        out->points + (from * dim), sizeof(double) * dim);
+                out->weights[out->num_points] = out->weights[from];
+                out->indices[out->num_points] = out->indices[from];
+            }
+            ++out->num_points;
+        }
+    }
+
+    result = KMEANS_OK;
+
+break_out:
+    if (KMEANS_OK != result) {
+        kmeans_coreset_destroy(*coreset);
+        *coreset = NULL;
+    }
+    kmeans_pool_destroy(pool);
+    free(sample);
+    free(rough);
+    free(c.rough_t);
+    free(c.rows);
+    free(c.counts);
+    free(c.costs);
+    free(c.terms);
+    free(c.starts);
+    free(c.thresholds);
+    free(c.first);
+    free(c.filled);
+    return result;
+}
+
+
+void
+kmeans_coreset_destroy(kmeans_coreset *coreset)
+{
+    if (!coreset) return;
+
+    free(coreset->points);
+    free(coreset->weights);
+    free(coreset->indices);
+    free(coreset);
+}
+
+
+/* State shared by every thread of the final pass. */
+typedef struct
+{
+    kmeans_dense_meta *meta;
+    const kmeans_kernels *kernels;
+    double *centroids_t;
+    size_t stride;
+
+    /* One row of scratch space and one inertia per thread. */
+    double *rows;
+    double *inertia;
+} coreset_pass;
+
+
+static
+void
+coreset_job_assign(void *context,
+                   const size_t thread,
+                   const size_t num_threads)
+{
+    coreset_pass *pass = (coreset_pass *)context;
+    kmeans_dense_meta *meta = pass->meta;
+    double *scratch = pass->rows + (thread * meta->dim);
+    double inertia = 0.0;
+    size_t lo, hi;
+
+    kmeans_pool_slice(meta->num_objects, thread, num_threads, &lo, &hi);
+
+    for (size_t i = lo; i < hi; ++i) {
+        const double *row = kmeans_dense_row(meta, i, scratch);
+        double distance;
+
+        meta->cluster_assignments[i] = pass->kernels->nearest(
+            row, pass->centroids_t, pass->stride, meta->dim, &distance);
+        inertia += meta->weights ? meta->weights[i] * distance : distance;
+    }
+
+    pass->inertia[thread] = inertia;
+}
+
+
+kmeans_result
+kmeans_coreset_assign(kmeans_dense_meta *meta,
+                      double *inertia)
+{
+    assert(meta);
+    assert(inertia);
+
+    assert(meta->data);
+    assert(meta->centroids);
+    assert(meta->cluster_assignments);
+    assert(meta->num_objects);
+    assert(meta->dim);
+    assert(meta->num_centroids);
+
+    size_t num_threads = meta->num_threads ? meta->num_threads : 1;
+    kmeans_pool *pool = NULL;
+    coreset_pass pass = {
+            .meta = meta,
+            .kernels = kmeans_kernels_for(meta->dim),
+            .stride = kmeans_block_stride(meta->num_centroids),
+    };
+    kmeans_result result;
+
+    if (num_threads > meta->num_objects) num_threads = meta->num_objects;
+
+    pass.centroids_t = kmeans_block_alloc(meta->num_centroids, meta->dim);
+    pass.rows = malloc(sizeof(double) * num_threads * meta->dim);
+    pass.inertia = malloc(sizeof(double) * num_threads);
+
+    if (!pass.centroids_t || !pass.rows || !pass.inertia
+        || !(pool = kmeans_pool_create(num_threads))) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    kmeans_block_transpose(meta->centroids, meta->num_centroids,
+                           meta->dim, pass.centroids_t);
+    kmeans_pool_run(pool, coreset_job_assign, &pass);
+
+    *inertia = 0.0;
+    for (size_t t = 0; t < num_threads; ++t) *inertia += pass.inertia[t];
+
+    result = KMEANS_OK;
+
+break_out:
+    kmeans_pool_destroy(pool);
+    free(pass.centroids_t);
+    free(pass.rows);
+    free(pass.inertia);
+    return result;
+}
+
+
+kmeans_result
+compute_kmeans_coreset(kmeans_coreset_meta *meta)
+{
+    assert(meta);
+    assert(meta->dense);
+    assert(meta->coreset_size >= meta->dense->num_centroids);
+
+    kmeans_dense_meta *dense = meta->dense;
+    kmeans_coreset *coreset = NULL;
+    int *assignments = NULL;
+    double *nearest = NULL;
+    double *scores = NULL;
+    unsigned long long evaluations = 0;
+    kmeans_rng rng;
+    kmeans_result result, solved;
+
+    kmeans_rng_seed(&rng, meta->seed);
+    meta->coreset_points = 0;
+    meta->inertia = NAN;
+
+    if (KMEANS_OK != (result = kmeans_coreset_build(dense, meta->coreset_size,
+                                                    &rng, &coreset)))
+        goto break_out;
+
+    /* Both passes compare every point with every rough centroid. */
+    evaluations = 2ULL * dense->num_objects * dense->num_centroids;
+    meta->coreset_points = coreset->num_points;
+
+    if (coreset->num_points < dense->num_centroids) {
+        result = KMEANS_BAD_LENGTH;
+        goto break_out;
+    }
+
+    assignments = malloc(sizeof(int) * coreset->num_points);
+    nearest = malloc(sizeof(double) * coreset->num_points);
+    scores = malloc(sizeof(double) * coreset->num_points);
+
+    if (!assignments || !nearest || !scores) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    kmeans_plusplus(kmeans_kernels_for(dense->dim), coreset->points,
+                    coreset->weights, coreset->num_points, dense->dim,
+                    dense->num_centroids, &rng, nearest, scores, dense->centroids);
+
+    kmeans_dense_meta view = *dense;
+    view.data = coreset->points;
+    view.num_objects = coreset->num_points;
+    view.layout = KMEANS_ROW_MAJOR;
+    view.dtype = KMEANS_FLOAT64;
+    view.scale = 0.0;
+    view.cluster_assignments = assignments;
+    view.weights = coreset->weights;
+    view.kdtree = NULL;
+
+    solved = compute_kmeans_dense(&view);
+    dense->current_iterations = view.current_iterations;
+    evaluations += view.distance_evaluations;
+
+    if (KMEANS_OK != solved && KMEANS_LIMIT != solved
+        && KMEANS_STOPPED != solved) {
+        result = solved;
+        goto break_out;
+    }
+
+    /* The final pass over the whole dataset, against the centroids found. */
+    kmeans_dense_meta whole = *dense;
+    whole.weights = NULL;
+
+    if (KMEANS_OK != (result = kmeans_coreset_assign(&whole, &(meta->inertia))))
+        goto break_out;
+
+    evaluations += (unsigned long long)dense->num_objects * dense->num_centroids;
+    result = solved;
+
+break_out:
+    /* No matter the result, always perform these actions. */
+    dense->distance_evaluations = evaluations;
+    kmeans_coreset_destroy(coreset);
+    free(assignments);
+    free(nearest);
+    free(scores);
+    return result;
+}
@@ -0,0 +1,119 @@
+/*
+ * kmeans_coreset.h
+ *
+ * K-Means Clustering of a weighted summary of the data rather than the data
+ *  itself. A coreset is drawn by sensitivity sampling around a rough seeding:
+ *  points far from the seeding, or in its small clusters, are drawn more often
+ *  and weigh less, so every part of the data stays represented. Building one
+ *  takes two streaming passes, clustering its few thousand weighted points
+ *  costs next to nothing after them, and a last pass assigns every point.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_CORESET_H
+#define CIS579_TERMPROJECT_KMEANS_CORESET_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "kmeans.h"
+#include "kmeans_seed.h"
+
+
+/* A weighted sample of a dataset. */
+typedef struct
+{
+    /* Amount of distinct points drawn, and their dimensionality. */
+    size_t num_points;
+    size_t dim;
+
+    /* A row-major matrix of num_points x dim values. */
+    double *points;
+
+    /* The weight of each point, summing to about the size of the dataset. */
+    double *weights;
+
+    /* Index of each point in the dataset it was drawn from, ascending. */
+    size_t *indices;
+} kmeans_coreset;
+
+
+/* Meta-structure for clustering a dataset through a coreset of it. */
+typedef struct
+{
+    /*
+     * The dataset: its data and shape, num_centroids, iterations, algorithm,
+     * num_groups, observer and stopping tolerances drive the clustering of
+     * the coreset, while num_threads is used by every pass. Its centroids
+     * (num_centroids x dim, row-major) receive the result and need not be
+     * seeded, and its cluster_assignments receive the final pass. Its weights
+     * and kdtree are not used.
+     *
+     * Afterwards, current_iterations is that of the coreset run, while
+     * distance_evaluations also counts the passes over the dataset.
+     */
+    kmeans_dense_meta *dense;
+
+    /* How many points to draw; duplicate draws merge into one point. */
+    size_t coreset_size;
+
+    /* Seed of the generator behind the rough seeding, sample and k-means++. */
+    uint64_t seed;
+
+    /* Distinct points in the coreset. Output only. */
+    size_t coreset_points;
+
+    /* Sum of squared distances of the whole dataset. Output only. */
+    double inertia;
+} kmeans_coreset_meta;
+
+
+/*
+ * Draw a coreset of 'size' samples from a dense matrix. The rough seeding is
+ *  k-means++ over a small uniform sample, with meta->num_centroids centroids.
+ *  The first pass measures every point against it, and the second draws the
+ *  coreset with one sorted set of thresholds, stopping each thread as soon as
+ *  its share is drawn. Only O(size + num_threads * k) memory is used beyond
+ *  the coreset itself. Uses meta->data, num_objects, dim, layout, dtype,
+ *  scale, num_centroids and num_threads. The sample only depends on the
+ *  generator and the thread count.
+ */
+kmeans_result
+kmeans_coreset_build(
+    const kmeans_dense_meta  *meta    IN,
+    size_t                    size    IN,
+    kmeans_rng               *rng     IN OUT,
+    kmeans_coreset          **coreset OUT
+);
+
+/* Free a coreset. */
+void
+kmeans_coreset_destroy(
+    kmeans_coreset *coreset IN
+);
+
+/*
+ * Assign every point of a dense matrix to the nearest of meta->centroids in
+ *  one threaded pass, without moving them. Ties go to the lowest cluster
+ *  index, as in the Lloyd engine over double data. The sum of squared
+ *  distances, weighted when meta->weights is set, goes to 'inertia'.
+ */
+kmeans_result
+kmeans_coreset_assign(
+    kmeans_dense_meta *meta    IN OUT,
+    double            *inertia OUT
+);
+
+/*
+ * Cluster meta->dense through a coreset: build it, seed it with weighted
+ *  k-means++, cluster it with compute_kmeans_dense() and its weights, then
+ *  assign the whole dataset to the centroids found. Returns the result of the
+ *  coreset run, or KMEANS_BAD_LENGTH when the coreset holds fewer distinct
+ *  points than centroids, which only happens for data about as degenerate.
+ */
+kmeans_result
+compute_kmeans_coreset(
+    kmeans_coreset_meta *meta IN OUT
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_CORESET_H */
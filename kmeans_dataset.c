@@ -0,0 +1,400 @@
+/*
+ * kmeans_dataset.c
+ *
+ * Implementation of the binary dataset format: the memory-mapped loader, the
+ *  writer, and the streaming CSV converter.
+ */
+
+#include "kmeans_dataset.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* Size of the stdio buffer used when writing dataset files. */
+#define DATASET_WRITE_BUFFER (1 << 20)
+
+
+/* Fill in a header for a matrix, with the data placed right after it. */
+static
+void
+dataset_header(kmeans_dataset_header *header,
+               size_t num_objects,
+               size_t dim,
+               kmeans_dtype dtype,
+               kmeans_layout layout,
+               double scale)
+{
+    memset(header, 0, sizeof(kmeans_dataset_header));
+    memcpy(header->magic, KMEANS_DATASET_MAGIC, sizeof(header->magic));
+
+    header->version = KMEANS_DATASET_VERSION;
+    header->byte_order = KMEANS_DATASET_BYTE_ORDER;
+    header->dtype = dtype;
+    header->layout = layout;
+    header->alignment = KMEANS_DATASET_ALIGNMENT;
+    header->num_objects = num_objects;
+    header->dim = dim;
+    header->scale = scale;
+    header->data_offset =
+        ((sizeof(kmeans_dataset_header) + KMEANS_DATASET_ALIGNMENT - 1)
+         / KMEANS_DATASET_ALIGNMENT) * KMEANS_DATASET_ALIGNMENT;
+}
+
+
+/* Write a header followed by zeroes up to its data offset. */
+static
+kmeans_result
+dataset_write_header(FILE *file,
+                     const kmeans_dataset_header *header)
+{
+    static const char zeroes[KMEANS_DATASET_ALIGNMENT] = { 0 };
+    size_t padding = header->data_offset - sizeof(kmeans_dataset_header);
+
+    if (1 != fwrite(header, sizeof(kmeans_dataset_header), 1, file))
+        return KMEANS_IO_ERROR;
+
+    for (; padding > 0; ) {
+        size_t length = padding < sizeof(zeroes) ? padding : sizeof(zeroes);
+
+        if (length != fwrite(zeroes, 1, length, file)) return KMEANS_IO_ERROR;
+        padding -= length;
+    }
+
+    return KMEANS_OK;
+}
+
+
+/* Check a mapped header against the size of its file. */
+static
+kmeans_result
+dataset_validate(const kmeans_dataset_header *header,
+                 size_t file_size)
+{
+    if (memcmp(header->magic, KMEANS_DATASET_MAGIC, sizeof(header->magic))
+        || KMEANS_DATASET_VERSION != header->version
+        || KMEANS_DATASET_BYTE_ORDER != header->byte_order
+        || header->dtype > KMEANS_UINT8
+        || header->layout > KMEANS_COLUMN_MAJOR
+        || !(header->scale >= 0.0 && isfinite(header->scale)))
+        return KMEANS_MALFORMED_INPUT;
+
+    /* The alignment must be a power of two which the data offset respects. */
+    if (!header->alignment
+        || (header->alignment & (header->alignment - 1))
+        || (header->data_offset % header->alignment)
+        || header->data_offset < sizeof(kmeans_dataset_header))
+        return KMEANS_MALFORMED_INPUT;
+
+    if (!header->num_objects || !header->dim) return KMEANS_NO_DATA;
+
+    /* Guard the size computation against overflow before trusting it. */
+    uint64_t element = kmeans_dtype_size(header->dtype);
+    if (header->num_objects > (SIZE_MAX / element) / header->dim)
+        return KMEANS_BAD_LENGTH;
+
+    uint64_t length = header->num_objects * header->dim * element;
+    if (header->data_offset > file_size
+        || length > file_size - header->data_offset)
+        return KMEANS_BAD_LENGTH;
+
+    return KMEANS_OK;
+}
+
+
+kmeans_result
+kmeans_dataset_open(const char *path,
+                    kmeans_dataset *dataset)
+{
+    struct stat info;
+    kmeans_result result;
+    int fd;
+
+    memset(dataset, 0, sizeof(kmeans_dataset));
+
+    if ((fd = open(path, O_RDONLY)) < 0) return KMEANS_IO_ERROR;
+
+    if (fstat(fd, &info) < 0) {
+        close(fd);
+        return KMEANS_IO_ERROR;
+    }
+
+    if ((size_t)info.st_size < sizeof(kmeans_dataset_header)) {
+        close(fd);
+        return KMEANS_MALFORMED_INPUT;
+    }
+
+    /* The mapping keeps the file referenced, so the descriptor can go now. */
+    void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == mapping) return KMEANS_IO_ERROR;
+
+    const kmeans_dataset_header *header = (const kmeans_dataset_header *)mapping;
+
+    if (KMEANS_OK != (result = dataset_validate(header, info.st_size))) {
+        munmap(mapping, info.st_size);
+        return result;
+    }
+
+    dataset->data = (const char *)mapping + header->data_offset;
+    dataset->num_objects = header->num_objects;
+    dataset->dim = header->dim;
+    dataset->dtype = (kmeans_dtype)header->dtype;
+    dataset->layout = (kmeans_layout)header->layout;
+    dataset->scale = header->scale;
+    dataset->mapping = mapping;
+    dataset->mapping_length = info.st_size;
+
+    return KMEANS_OK;
+}
+
+
+kmeans_result
+kmeans_dataset_read_header(int fd,
+                           kmeans_dataset_header *header)
+{
+    struct stat info;
+
+    if (fstat(fd, &info) < 0) return KMEANS_IO_ERROR;
+
+    if ((size_t)info.st_size < sizeof(kmeans_dataset_header))
+        return KMEANS_MALFORMED_INPUT;
+
+    if (sizeof(kmeans_dataset_header)
+        != pread(fd, header, sizeof(kmeans_dataset_header), 0))
+        return KMEANS_IO_ERROR;
+
+    return dataset_validate(header, info.st_size);
+}
+
+
+void
+kmeans_dataset_close(kmeans_dataset *dataset)
+{
+    if (!dataset || !dataset->mapping) return;
+
+    munmap(dataset->mapping, dataset->mapping_length);
+    memset(dataset, 0, sizeof(kmeans_dataset));
+}
+
+
+kmeans_result
+kmeans_dataset_write(const char *path,
+                     const void *data,
+                     size_t num_objects,
+                     size_t dim,
+                     kmeans_dtype dtype,
+                     kmeans_layout layout,
+                     double scale)
+{
+    kmeans_dataset_header header;
+    kmeans_result result;
+    FILE *file;
+
+    if (!data || !num_objects || !dim) return KMEANS_NO_DATA;
+    if (!(file = fopen(path, "wb"))) return KMEANS_IO_ERROR;
+
+    dataset_header(&header, num_objects, dim, dtype, layout, scale);
+
+    result = dataset_write_header(file, &header);
+    if (KMEANS_OK == result
+        && num_objects != fwrite(data, kmeans_dtype_size(dtype) * dim,
+                                 num_objects, file))
+        result = KMEANS_IO_ERROR;
+
+    if (fclose(file) && KMEANS_OK == result) result = KMEANS_IO_ERROR;
+    if (KMEANS_OK != result) remove(path);
+
+    return result;
+}
+
+
+/* Characters which separate the values of a CSV line. */
+static inline
+int
+dataset_is_separator(char c)
+{
+    return ',' == c || ' ' == c || '\t' == c || '\r' == c || '\n' == c;
+}
+
+
+/*
+ * Parse every value of a CSV line into 'values', growing it as needed.
+ *  Returns the amount of values, or -1 when some field is not a number.
+ */
+static
+long
+dataset_parse_line(char *line,
+                   double **values,
+                   size_t *capacity)
+{
+    size_t count = 0;
+    char *cursor = line;
+
+    while (1) {
+        while (*cursor && dataset_is_separator(*cursor)) ++cursor;
+        if (!*cursor) break;
+
+        char *end;
+        double value = strtod(cursor, &end);
+
+        if (end == cursor || (*end && !dataset_is_separator(*end))) return -1;
+
+        if (count == *capacity) {
+            size_t grown_capacity = *capacity ? 2 * *capacity : 16;
+            double *grown = realloc(*values, sizeof(double) * grown_capacity);
+
+            if (!grown) return -1;
+            *values = grown;
+            *capacity = grown_capacity;
+        }
+
+        (*values)[count++] = value;
+        cursor = end;
+    }
+
+    return (long)count;
+}
+
+
+/*
+ * Narrow a parsed row into 'narrow' for any type but float64. Quantized types
+ *  take the steps themselves, so their values must be whole and in range.
+ */
+static
+kmeans_result
+dataset_narrow(const double *values,
+               size_t dim,
+               kmeans_dtype dtype,
+               void *narrow)
+{
+    const double low = (KMEANS_INT8 == dtype) ? INT8_MIN : 0;
+    const double high = (KMEANS_INT8 == dtype) ? INT8_MAX : UINT8_MAX;
+
+    for (size_t d = 0; d < dim; ++d) {
+        switch (dtype) {
+            case KMEANS_FLOAT32:
+                ((float *)narrow)[d] = (float)values[d];
+                break;
+            case KMEANS_INT8:
+            case KMEANS_UINT8:
+                if (values[d] != floor(values[d])
+                    || values[d] < low || values[d] > high)
+                    return KMEANS_MALFORMED_INPUT;
+
+                if (KMEANS_INT8 == dtype)
+                    ((int8_t *)narrow)[d] = (int8_t)values[d];
+                else
+                    ((uint8_t *)narrow)[d] = (uint8_t)values[d];
+                break;
+            case KMEANS_FLOAT64:
+            default:
+                break;
+        }
+    }
+
+    return KMEANS_OK;
+}
+
+
+kmeans_result
+kmeans_dataset_from_csv(const char *csv_path,
+                        const char *path,
+                        kmeans_dtype dtype,
+                        double scale)
+{
+    kmeans_dataset_header header;
+    kmeans_result result = KMEANS_OK;
+    FILE *csv = NULL;
+    FILE *file = NULL;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    double *values = NULL;
+    size_t capacity = 0;
+    void *narrow = NULL;
+    size_t element = kmeans_dtype_size(dtype);
+    size_t num_objects = 0;
+    size_t dim = 0;
+    size_t line_number = 0;
+
+    if (!(csv = fopen(csv_path, "r")) || !(file = fopen(path, "wb"))) {
+        result = KMEANS_IO_ERROR;
+        goto break_out;
+    }
+
+    setvbuf(file, NULL, _IOFBF, DATASET_WRITE_BUFFER);
+
+    /* Reserve the header now; its sizes are only known at the end. */
+    dataset_header(&header, 0, 0, dtype, KMEANS_ROW_MAJOR, scale);
+    if (KMEANS_OK != (result = dataset_write_header(file, &header)))
+        goto break_out;
+
+    while (getline(&line, &line_capacity, csv) >= 0) {
+        long count = dataset_parse_line(line, &values, &capacity);
+        ++line_number;
+
+        if (count < 0 && 1 == line_number) continue;   /* a header line */
+        if (count < 0) {
+            result = KMEANS_MALFORMED_INPUT;
+            goto break_out;
+        }
+        if (0 == count) continue;
+
+        if (!dim) {
+            dim = count;
+            if (KMEANS_FLOAT64 != dtype && !(narrow = malloc(element * dim))) {
+                result = KMEANS_NO_MEMORY;
+                goto break_out;
+            }
+        } else if ((size_t)count != dim) {
+            result = KMEANS_BAD_LENGTH;
+            goto break_out;
+        }
+
+        if (KMEANS_OK != (result = dataset_narrow(values, dim, dtype, narrow)))
+            goto break_out;
+
+        size_t written = fwrite(narrow ? narrow : (void *)values,
+                                element, dim, file);
+
+        if (written != dim) {
+            result = KMEANS_IO_ERROR;
+            goto break_out;
+        }
+
+        ++num_objects;
+    }
+
+    if (ferror(csv)) {
+        result = KMEANS_IO_ERROR;
+        goto break_out;
+    }
+
+    if (!num_objects) {
+        result = KMEANS_NO_DATA;
+        goto break_out;
+    }
+
+    /* Go back and fill in the real sizes. */
+    header.num_objects = num_objects;
+    header.dim = dim;
+    if (fseek(file, 0, SEEK_SET)
+        || 1 != fwrite(&header, sizeof(kmeans_dataset_header), 1, file))
+        result = KMEANS_IO_ERROR;
+
+break_out:
+    if (csv) fclose(csv);
+    if (file && fclose(file) && KMEANS_OK == result) result = KMEANS_IO_ERROR;
+    if (file && KMEANS_OK != result) remove(path);
+    free(line);
+    free(values);
+    free(narrow);
+    return result;
+}
@@ -0,0 +1,148 @@
+/*
+ * kmeans_dataset.h
+ *
+ * A simple versioned binary format for data matrices, which is memory-mapped
+ *  read-only and handed to the clustering engines without any copy or parse.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_DATASET_H
+#define CIS579_TERMPROJECT_KMEANS_DATASET_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "kmeans.h"
+
+
+/* The first bytes of every dataset file. The CR LF pair catches text-mode copies. */
+#define KMEANS_DATASET_MAGIC "KMDATA\r\n"
+
+/* Current version of the format. */
+#define KMEANS_DATASET_VERSION 1
+
+/* Alignment of the matrix within the file (and therefore within the mapping). */
+#define KMEANS_DATASET_ALIGNMENT 64
+
+/* Written as-is, so a reader on a host of the other byte order can tell. */
+#define KMEANS_DATASET_BYTE_ORDER 0x01020304
+
+
+/*
+ * The 64-byte header at the start of a dataset file. Every field is stored
+ *  in the byte order of the host which wrote it, and the matrix itself starts
+ *  at data_offset, which is a multiple of the alignment.
+ */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t dtype;         /* a kmeans_dtype */
+    uint32_t layout;        /* a kmeans_layout */
+    uint32_t alignment;
+    uint32_t reserved;
+    uint64_t num_objects;
+    uint64_t dim;
+    uint64_t data_offset;
+    double scale;           /* one step of int8/uint8 values, zero meaning 1 */
+} kmeans_dataset_header;
+
+
+/* A dataset opened with kmeans_dataset_open(). */
+typedef struct
+{
+    /* The matrix, pointing straight into the read-only mapping. */
+    const void *data;
+
+    size_t num_objects;
+    size_t dim;
+    kmeans_dtype dtype;
+    kmeans_layout layout;
+
+    /* Value of one quantization step of int8/uint8 data. Zero means 1. */
+    double scale;
+
+    /* The whole mapped file. */
+    void *mapping;
+    size_t mapping_length;
+} kmeans_dataset;
+
+
+/* Get the size in bytes of one element of a matrix. */
+static inline
+size_t
+kmeans_dtype_size(kmeans_dtype dtype)
+{
+    switch (dtype) {
+        case KMEANS_FLOAT32:
+            return sizeof(float);
+        case KMEANS_INT8:
+        case KMEANS_UINT8:
+            return sizeof(uint8_t);
+        case KMEANS_FLOAT64:
+        default:
+            return sizeof(double);
+    }
+}
+
+
+/*
+ * Map a dataset file read-only and validate its header. Nothing is read
+ *  besides the header, so pages of the matrix are only faulted in as the
+ *  engines first touch them.
+ */
+kmeans_result
+kmeans_dataset_open(
+    const char     *path    IN,
+    kmeans_dataset *dataset OUT
+);
+
+/*
+ * Read and validate the header of an open dataset file, for readers which
+ *  stream the matrix with pread() instead of mapping it.
+ */
+kmeans_result
+kmeans_dataset_read_header(
+    int                    fd     IN,
+    kmeans_dataset_header *header OUT
+);
+
+/* Unmap a dataset. Its data pointer is no longer valid afterwards. */
+void
+kmeans_dataset_close(
+    kmeans_dataset *dataset IN OUT
+);
+
+/*
+ * Write a matrix of num_objects x dim elements into a new dataset file. The
+ *  scale of int8/uint8 data is stored alongside, zero meaning 1.
+ */
+kmeans_result
+kmeans_dataset_write(
+    const char    *path        IN,
+    const void    *data        IN,
+    size_t         num_objects IN,
+    size_t         dim         IN,
+    kmeans_dtype   dtype       IN,
+    kmeans_layout  layout      IN,
+    double         scale       IN
+);
+
+/*
+ * Convert a CSV file (one point per line, values separated by commas and/or
+ *  blanks) into a row-major dataset file of the given element type. A first
+ *  line which does not start with a number is taken as a header and skipped.
+ *  Rows are streamed through, so the CSV is never held in memory. For int8 and
+ *  uint8 files the values are the quantization steps, and must fit the type;
+ *  'scale' is the value of one step, stored in the header (zero meaning 1).
+ */
+kmeans_result
+kmeans_dataset_from_csv(
+    const char   *csv_path IN,
+    const char   *path     IN,
+    kmeans_dtype  dtype    IN,
+    double        scale    IN
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_DATASET_H */
@@ -0,0 +1,689 @@
+/*
+ * kmeans_dense.c
+ *
+ * Implementation of K-Means Clustering over contiguous matrices of doubles.
+ *  This file holds the driver shared by every assignment engine, and the
+ *  plain Lloyd engine itself.
+ */
+
+#include "kmeans.h"
+#include "kmeans_pool.h"
+#include "kmeans_kernels.h"
+#include "kmeans_internal.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+
+/* How many column-major points are evaluated together against each centroid. */
+#define DENSE_COLUMN_BLOCK 256
+
+/*
+ * The automatic choice picks GEMM over Lloyd from this many dimensions, once
+ *  dim * k reaches the work below. Both come from kmeans_bench runs on blobs
+ *  and uniform data, where the bounded engines only paid off on the blobs.
+ */
+#define DENSE_AUTO_GEMM_MIN_DIM 64
+#define DENSE_AUTO_GEMM_MIN_WORK 2048
+
+
+/*
+ * Assign each row of a row-major matrix to its nearest centroid, and add the
+ *  row into that centroid's running sum. The nearest centroid is found with
+ *  one call to the vectorized kernel for this CPU.
+ */
+static
+void
+lloyd_assign_rows(const kmeans_run *run,
+                  size_t lo,
+                  size_t hi,
+                  kmeans_partial *partial)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    const func_block_nearest_t nearest = run->kernels->nearest;
+    const size_t dim = meta->dim;
+
+    partial->evaluations += (hi - lo) * meta->num_centroids;
+
+    for (size_t i = lo; i < hi; ++i) {
+        const double *row = (const double *)meta->data + (i * dim);
+
+        int current_cluster =
+            nearest(row, run->centroids_t, run->stride, dim, NULL);
+
+        kmeans_partial_assign(partial, &(meta->cluster_assignments[i]),
+                              current_cluster);
+        kmeans_partial_add(partial, row, current_cluster, dim);
+    }
+}
+
+
+/*
+ * Assign each point of a column-major matrix to its nearest centroid. Points
+ *  are taken in blocks so the innermost loop walks down contiguous columns,
+ *  and each block is then added into the running sums column by column.
+ */
+static
+void
+lloyd_assign_columns(const kmeans_run *run,
+                     size_t lo,
+                     size_t hi,
+                     kmeans_partial *partial)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    const double *data = (const double *)meta->data;
+    const size_t n = meta->num_objects;
+    const size_t dim = meta->dim;
+
+    double distances[DENSE_COLUMN_BLOCK];
+    double best_distances[DENSE_COLUMN_BLOCK];
+    int best_clusters[DENSE_COLUMN_BLOCK];
+
+    partial->evaluations += (hi - lo) * meta->num_centroids;
+
+    for (size_t base = lo; base < hi; base += DENSE_COLUMN_BLOCK) {
+        size_t count = hi - base;
+        if (count > DENSE_COLUMN_BLOCK) count = DENSE_COLUMN_BLOCK;
+
+        for (size_t cluster = 0; cluster < meta->num_centroids; ++cluster) {
+            const double *centroid = meta->centroids + (cluster * dim);
+
+            memset(distances, 0, sizeof(double) * count);
+            for (size_t d = 0; d < dim; ++d) {
+                const double *column = data + (d * n) + base;
+                const double value = centroid[d];
+
+                for (size_t j = 0; j < count; ++j) {
+                    double delta = column[j] - value;
+                    distances[j] += delta * delta;
+                }
+            }
+
+            for (size_t j = 0; j < count; ++j) {
+                if (0 == cluster || distances[j] < best_distances[j]) {
+                    best_distances[j] = distances[j];
+                    best_clusters[j] = cluster;
+                }
+            }
+        }
+
+        for (size_t j = 0; j < count; ++j) {
+            kmeans_partial_assign(partial,
+                                  &(meta->cluster_assignments[base + j]),
+                                  best_clusters[j]);
+            ++partial->counts[best_clusters[j]];
+        }
+
+        for (size_t d = 0; d < dim; ++d) {
+            const double *column = data + (d * n) + base;
+
+            for (size_t j = 0; j < count; ++j)
+                partial->sums[(best_clusters[j] * dim) + d] += column[j];
+        }
+    }
+}
+
+
+/*
+ * Get point 'i' of a float32 or quantized matrix as a contiguous row of
+ *  floats. Row-major float32 data is used in place.
+ */
+static inline
+const float *
+lloyd_row_f32(const kmeans_dense_meta *meta,
+              size_t i,
+              float *scratch)
+{
+    const size_t dim = meta->dim;
+    const int rows = (KMEANS_ROW_MAJOR == meta->layout);
+    const size_t first = rows ? (i * dim) : i;
+    const size_t step = rows ? 1 : meta->num_objects;
+    const float scale = meta->scale ? (float)meta->scale : 1.0f;
+
+    if (KMEANS_INT8 == meta->dtype) {
+        const int8_t *values = (const int8_t *)meta->data + first;
+        for (size_t d = 0; d < dim; ++d) scratch[d] = values[d * step] * scale;
+        return scratch;
+    }
+
+    if (KMEANS_UINT8 == meta->dtype) {
+        const uint8_t *values = (const uint8_t *)meta->data + first;
+        for (size_t d = 0; d < dim; ++d) scratch[d] = values[d * step] * scale;
+        return scratch;
+    }
+
+    const float *values = (const float *)meta->data + first;
+    if (rows) return values;
+
+    for (size_t d = 0; d < dim; ++d) scratch[d] = values[d * step];
+    return scratch;
+}
+
+
+/*
+ * Assign each point of a float32 or quantized matrix with the single
+ *  precision kernel, which fits twice the centroids into every vector. The
+ *  running sums stay in double precision, so the means keep their accuracy.
+ */
+static
+void
+lloyd_assign_narrow(const kmeans_run *run,
+                    size_t lo,
+                    size_t hi,
+                    kmeans_partial *partial)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    const func_block_nearest_f32_t nearest = run->kernels->nearest_f32;
+    const size_t dim = meta->dim;
+
+    partial->evaluations += (hi - lo) * meta->num_centroids;
+
+    for (size_t i = lo; i < hi; ++i) {
+        const float *row = lloyd_row_f32(meta, i, partial->row_f);
+
+        int current_cluster =
+            nearest(row, run->centroids_f, run->stride, dim, NULL);
+
+        kmeans_partial_assign(partial, &(meta->cluster_assignments[i]),
+                              current_cluster);
+
+        double *sum = partial->sums + (current_cluster * dim);
+        for (size_t d = 0; d < dim; ++d) sum[d] += row[d];
+        ++partial->counts[current_cluster];
+    }
+}
+
+
+static
+void
+lloyd_assign(kmeans_run *run,
+             size_t thread,
+             size_t lo,
+             size_t hi,
+             kmeans_partial *partial)
+{
+    if (KMEANS_FLOAT64 != run->meta->dtype)
+        lloyd_assign_narrow(run, lo, hi, partial);
+    else if (KMEANS_ROW_MAJOR == run->meta->layout)
+        lloyd_assign_rows(run, lo, hi, partial);
+    else
+        lloyd_assign_columns(run, lo, hi, partial);
+}
+
+
+const kmeans_engine kmeans_engine_lloyd = {
+    .assign = lloyd_assign,
+};
+
+
+kmeans_result
+kmeans_partial_create(kmeans_partial *partial,
+                      size_t num_centroids,
+                      size_t dim,
+                      size_t stride)
+{
+    partial->sums = malloc(sizeof(double) * num_centroids * dim);
+    partial->counts = malloc(sizeof(size_t) * num_centroids);
+    partial->row = malloc(sizeof(double) * dim);
+    partial->row_f = malloc(sizeof(float) * dim);
+    partial->distances = malloc(sizeof(double) * stride);
+
+    if (!partial->sums
+        || !partial->counts
+        || !partial->row
+        || !partial->row_f
+        || !partial->distances) {
+        kmeans_partial_destroy(partial);
+        return KMEANS_NO_MEMORY;
+    }
+
+    return KMEANS_OK;
+}
+
+
+void
+kmeans_partial_reset(kmeans_partial *partial,
+                     size_t num_centroids,
+                     size_t dim)
+{
+    memset(partial->sums, 0, sizeof(double) * num_centroids * dim);
+    memset(partial->counts, 0, sizeof(size_t) * num_centroids);
+    partial->changed = 0;
+    partial->evaluations = 0;
+}
+
+
+void
+kmeans_partial_destroy(kmeans_partial *partial)
+{
+    free(partial->sums);
+    free(partial->counts);
+    free(partial->row);
+    free(partial->row_f);
+    free(partial->distances);
+    free(partial->masses);
+
+    partial->sums = NULL;
+    partial->counts = NULL;
+    partial->row = NULL;
+    partial->row_f = NULL;
+    partial->distances = NULL;
+    partial->masses = NULL;
+}
+
+
+void
+kmeans_run_separation(const kmeans_run *run,
+                      double *half,
+                      double *nearest_half)
+{
+    const size_t k = run->meta->num_centroids;
+    const size_t dim = run->meta->dim;
+    const double *centroids = run->meta->centroids;
+
+    for (size_t c = 0; c < k; ++c) nearest_half[c] = HUGE_VAL;
+
+    for (size_t a = 0; a < k; ++a) {
+        if (half) half[(a * k) + a] = 0.0;
+
+        for (size_t b = a + 1; b < k; ++b) {
+            double distance = 0.5 * sqrt(run->kernels->pair(
+                centroids + (a * dim), centroids + (b * dim), dim));
+            distance *= (1.0 - KMEANS_BOUND_SLACK);
+
+            if (half) {
+                half[(a * k) + b] = distance;
+                half[(b * k) + a] = distance;
+            }
+
+            if (distance < nearest_half[a]) nearest_half[a] = distance;
+            if (distance < nearest_half[b]) nearest_half[b] = distance;
+        }
+    }
+}
+
+
+/*
+ * Allocate a thread's partial sums and scratch space from within that thread,
+ *  and zero its slice of the assignments. Both are first touched here by their
+ *  owner, so on NUMA systems the pages land on the node of the thread that
+ *  keeps using them.
+ */
+static
+void
+dense_job_init(void *context,
+               const size_t thread,
+               const size_t num_threads)
+{
+    kmeans_run *run = (kmeans_run *)context;
+    kmeans_dense_meta *meta = run->meta;
+    kmeans_partial *partial = &(run->partials[thread]);
+    size_t lo, hi;
+
+    kmeans_pool_slice(meta->num_objects, thread, num_threads, &lo, &hi);
+    memset(meta->cluster_assignments + lo, 0, sizeof(int) * (hi - lo));
+
+    if (KMEANS_OK != kmeans_partial_create(partial, meta->num_centroids,
+                                           meta->dim, run->stride))
+        return;
+
+    if (meta->weights
+        && !(partial->masses = malloc(sizeof(double) * meta->num_centroids)))
+        kmeans_partial_destroy(partial);
+}
+
+
+/*
+ * Sum one thread's points again with their weights, over the sums the engine
+ *  gathered. Engines only ever add whole points, so this keeps every engine
+ *  usable with weights for the price of one more pass over the slice.
+ */
+static
+void
+dense_weigh(const kmeans_run *run,
+            size_t lo,
+            size_t hi,
+            kmeans_partial *partial)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    const size_t dim = meta->dim;
+
+    memset(partial->sums, 0, sizeof(double) * meta->num_centroids * dim);
+    memset(partial->masses, 0, sizeof(double) * meta->num_centroids);
+
+    for (size_t i = lo; i < hi; ++i) {
+        const int cluster = meta->cluster_assignments[i];
+        const double weight = meta->weights[i];
+        const double *row = kmeans_run_row(run, i, partial->row);
+        double *sum = partial->sums + (cluster * dim);
+
+        for (size_t d = 0; d < dim; ++d) sum[d] += weight * row[d];
+        partial->masses[cluster] += weight;
+    }
+}
+
+
+/* Assign one thread's slice of the points and gather its partial sums. */
+static
+void
+dense_job_assign(void *context,
+                 const size_t thread,
+                 const size_t num_threads)
+{
+    kmeans_run *run = (kmeans_run *)context;
+    const kmeans_dense_meta *meta = run->meta;
+    kmeans_partial *partial = &(run->partials[thread]);
+    size_t lo, hi;
+
+    kmeans_pool_slice(meta->num_objects, thread, num_threads, &lo, &hi);
+
+    kmeans_partial_reset(partial, meta->num_centroids, meta->dim);
+    (run->engine->assign)(run, thread, lo, hi, partial);
+
+    if (meta->weights) dense_weigh(run, lo, hi, partial);
+}
+
+
+/*
+ * Sum the squared distances from one thread's points to the centroids they
+ *  were just assigned to, which the update has moved into run->previous.
+ */
+static
+void
+dense_job_inertia(void *context,
+                  const size_t thread,
+                  const size_t num_threads)
+{
+    kmeans_run *run = (kmeans_run *)context;
+    const kmeans_dense_meta *meta = run->meta;
+    kmeans_partial *partial = &(run->partials[thread]);
+    double inertia = 0.0;
+    size_t lo, hi;
+
+    kmeans_pool_slice(meta->num_objects, thread, num_threads, &lo, &hi);
+
+    for (size_t i = lo; i < hi; ++i) {
+        const double *row = kmeans_run_row(run, i, partial->row);
+        const double *centroid =
+            run->previous + (meta->cluster_assignments[i] * meta->dim);
+
+        const double distance = run->kernels->pair(row, centroid, meta->dim);
+
+        inertia += meta->weights ? meta->weights[i] * distance : distance;
+    }
+
+    partial->inertia = inertia;
+}
+
+
+void
+kmeans_run_reduce(kmeans_run *run)
+{
+    const size_t length = run->meta->num_centroids * run->meta->dim;
+
+    for (size_t stride = 1; stride < run->num_threads; stride *= 2) {
+        for (size_t t = 0; t + stride < run->num_threads; t += 2 * stride) {
+            kmeans_partial *into = &(run->partials[t]);
+            const kmeans_partial *from = &(run->partials[t + stride]);
+
+            for (size_t i = 0; i < length; ++i)
+                into->sums[i] += from->sums[i];
+            for (size_t i = 0; i < run->meta->num_centroids; ++i)
+                into->counts[i] += from->counts[i];
+            if (into->masses)
+                for (size_t i = 0; i < run->meta->num_centroids; ++i)
+                    into->masses[i] += from->masses[i];
+            into->changed += from->changed;
+            into->evaluations += from->evaluations;
+        }
+    }
+}
+
+
+void
+kmeans_run_update(kmeans_run *run)
+{
+    kmeans_dense_meta *meta = run->meta;
+    const double *sums = run->partials[0].sums;
+    const size_t *counts = run->partials[0].counts;
+    const double *masses = run->partials[0].masses;
+    const size_t dim = meta->dim;
+
+    memcpy(run->previous, meta->centroids,
+           sizeof(double) * meta->num_centroids * dim);
+
+    for (size_t cluster = 0; cluster < meta->num_centroids; ++cluster) {
+        double *centroid = meta->centroids + (cluster * dim);
+
+        const double mass = masses ? masses[cluster] : (double)counts[cluster];
+
+        /* Clusters which lost all of their members keep their previous location. */
+        if (!(mass > 0.0)) {
+            run->shifts[cluster] = 0.0;
+            continue;
+        }
+
+        for (size_t d = 0; d < dim; ++d)
+            centroid[d] = sums[(cluster * dim) + d] / mass;
+
+        run->shifts[cluster] = sqrt(run->kernels->pair(
+            run->previous + (cluster * dim), centroid, dim));
+    }
+
+    kmeans_block_transpose(meta->centroids, meta->num_centroids,
+                           dim, run->centroids_t);
+    if (run->centroids_f)
+        kmeans_block_transpose_f32(meta->centroids, meta->num_centroids,
+                                   dim, run->centroids_f);
+}
+
+
+/*
+ * Gather the statistics of an iteration. The inertia takes a pass of its own
+ *  and is only summed, in thread order, when someone needs it.
+ */
+static
+void
+dense_measure(kmeans_run *run,
+              kmeans_pool *pool,
+              kmeans_iteration_stats *stats)
+{
+    const kmeans_dense_meta *meta = run->meta;
+
+    stats->iteration = run->iteration;
+    stats->reassigned = run->partials[0].changed;
+    stats->inertia = NAN;
+    stats->max_shift = 0.0;
+
+    if (meta->observer || meta->inertia_tolerance > 0.0) {
+        kmeans_pool_run(pool, dense_job_inertia, run);
+
+        stats->inertia = 0.0;
+        for (size_t t = 0; t < run->num_threads; ++t)
+            stats->inertia += run->partials[t].inertia;
+    }
+
+    for (size_t c = 0; c < meta->num_centroids; ++c)
+        if (run->shifts[c] > stats->max_shift) stats->max_shift = run->shifts[c];
+}
+
+
+/* Pick the engine for the requested algorithm. */
+static
+const kmeans_engine *
+dense_engine(const kmeans_dense_meta *meta)
+{
+    switch (meta->algorithm) {
+        case KMEANS_HAMERLY:
+            return &kmeans_engine_hamerly;
+        case KMEANS_ELKAN:
+            return &kmeans_engine_elkan;
+        case KMEANS_YINYANG:
+            return &kmeans_engine_yinyang;
+        case KMEANS_KDTREE:
+            return &kmeans_engine_kdtree;
+        case KMEANS_GEMM:
+            return &kmeans_engine_gemm;
+        case KMEANS_AUTO:
+            /* Narrow data keeps Lloyd's single precision kernel. */
+            if (KMEANS_FLOAT64 == meta->dtype
+                && meta->dim >= DENSE_AUTO_GEMM_MIN_DIM
+                && meta->dim * meta->num_centroids >= DENSE_AUTO_GEMM_MIN_WORK)
+                return &kmeans_engine_gemm;
+            return &kmeans_engine_lloyd;
+        case KMEANS_LLOYD:
+        default:
+            return &kmeans_engine_lloyd;
+    }
+}
+
+
+kmeans_result
+compute_kmeans_dense(kmeans_dense_meta *meta)
+{
+    /* Same integrity guarantees as the generic object interface. */
+    assert(meta);
+
+    assert(meta->data);
+    assert(meta->centroids);
+    assert(meta->cluster_assignments);
+
+    assert(meta->num_objects);
+    assert(meta->dim);
+    assert(meta->num_centroids);
+    assert(meta->num_centroids <= meta->num_objects);
+
+    assert(meta->iterations > 0);
+
+    /* Local variables. */
+    kmeans_pool *pool = NULL;
+    kmeans_run run = {
+            .meta = meta,
+            .engine = dense_engine(meta),
+            .num_threads = meta->num_threads ? meta->num_threads : 1,
+            .kernels = kmeans_kernels_for(meta->dim),
+            .stride = kmeans_block_stride(meta->num_centroids),
+    };
+    kmeans_iteration_stats stats = { 0 };
+    double previous_inertia = HUGE_VAL;
+    unsigned long long start = 0;
+    kmeans_result result;
+
+    /* Whether each iteration's statistics are needed at all. */
+    const int measure = meta->observer
+        || meta->reassign_tolerance > 0.0
+        || meta->inertia_tolerance > 0.0
+        || meta->shift_tolerance > 0.0;
+
+    meta->distance_evaluations = 0;
+
+    if (run.num_threads > meta->num_objects)
+        run.num_threads = meta->num_objects;
+
+    run.partials = calloc(run.num_threads, sizeof(kmeans_partial));
+    run.centroids_t = kmeans_block_alloc(meta->num_centroids, meta->dim);
+    run.previous = malloc(sizeof(double) * meta->num_centroids * meta->dim);
+    run.shifts = malloc(sizeof(double) * meta->num_centroids);
+    if (KMEANS_FLOAT64 != meta->dtype)
+        run.centroids_f = kmeans_block_alloc_f32(meta->num_centroids, meta->dim);
+
+    if (!run.partials
+        || !run.centroids_t
+        || (KMEANS_FLOAT64 != meta->dtype && !run.centroids_f)
+        || !run.previous
+        || !run.shifts
+        || !(pool = kmeans_pool_create(run.num_threads))) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    /* Zero the assignments and set up each thread's partial sums. */
+    kmeans_pool_run(pool, dense_job_init, &run);
+    for (size_t t = 0; t < run.num_threads; ++t) {
+        if (!run.partials[t].sums) {
+            result = KMEANS_NO_MEMORY;
+            goto break_out;
+        }
+    }
+
+    if (run.engine->create && KMEANS_OK != (result = run.engine->create(&run)))
+        goto break_out;
+
+    kmeans_block_transpose(meta->centroids, meta->num_centroids,
+                           meta->dim, run.centroids_t);
+    if (run.centroids_f)
+        kmeans_block_transpose_f32(meta->centroids, meta->num_centroids,
+                                   meta->dim, run.centroids_f);
+
+    while (1) {
+        /*
+         * Count reassignments as they happen. When nothing moved, the
+         * assignments match the previous iteration and have converged.
+         * Each point is added to its cluster's sum in the same pass, so the
+         * centroid update afterwards only costs O(k * dim).
+         */
+        if (meta->observer) start = kmeans_clock_ns();
+
+        kmeans_pool_run(pool, dense_job_assign, &run);
+        kmeans_run_reduce(&run);
+
+        if (meta->observer) {
+            stats.assign_ns = kmeans_clock_ns() - start;
+            start = kmeans_clock_ns();
+        }
+
+        kmeans_run_update(&run);
+        meta->distance_evaluations += run.partials[0].evaluations;
+
+        int stop = 0;
+        if (measure) {
+            if (meta->observer) stats.update_ns = kmeans_clock_ns() - start;
+            dense_measure(&run, pool, &stats);
+
+            if (meta->observer)
+                stop = (meta->observer)(&stats, meta->observer_context);
+        }
+
+        if (!run.partials[0].changed
+            || (measure && kmeans_tolerance_met(&stats, meta->num_objects,
+                                                previous_inertia,
+                                                meta->reassign_tolerance,
+                                                meta->inertia_tolerance,
+                                                meta->shift_tolerance))) {
+            result = KMEANS_OK;
+            goto break_out;
+        }
+        previous_inertia = stats.inertia;
+
+        if (stop) {
+            ++run.iteration;
+            result = KMEANS_STOPPED;
+            goto break_out;
+        }
+
+        if (run.iteration++ > meta->iterations) {
+            result = KMEANS_LIMIT;
+            goto break_out;
+        }
+
+        if (run.engine->moved) run.engine->moved(&run);
+    }
+
+break_out:
+    if (run.engine->destroy) run.engine->destroy(&run);
+    kmeans_pool_destroy(pool);
+    if (run.partials) {
+        for (size_t t = 0; t < run.num_threads; ++t)
+            kmeans_partial_destroy(&(run.partials[t]));
+        free(run.partials);
+    }
+    free(run.centroids_t);
+    free(run.centroids_f);
+    free(run.previous);
+    free(run.shifts);
+    meta->current_iterations = run.iteration;
+    return result;
+}
@@ -0,0 +1,251 @@
+/*
+ * kmeans_elkan.c
+ *
+ * Elkan's accelerated assignment engine. Each point keeps an upper bound on
+ *  the distance to its own centroid and one lower bound per centroid. Along
+ *  with the distances between centroids, these rule out most individual
+ *  centroids without evaluating their distance. The centroids are also kept
+ *  in transposed tiles of KMEANS_BLOCK_WIDTH, and any tile holding a centroid
+ *  the bounds cannot rule out is measured whole by the block kernel, which
+ *  tightens the bounds of its other centroids for free. The k lower bounds
+ *  per point make this the better choice for moderate k, at O(N * k) extra
+ *  memory.
+ */
+
+#include "kmeans_internal.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+
+typedef struct
+{
+    /* Per-point upper bounds, and num_centroids lower bounds per point. */
+    double *upper;
+    double *lower;
+
+    /* Half the distance between every pair of centroids, as a k x k matrix. */
+    double *half;
+
+    /* Half the distance from each centroid to its nearest neighbour. */
+    double *nearest_half;
+
+    /* The centroids as transposed tiles. */
+    double *tiles;
+} elkan_state;
+
+
+static
+kmeans_result
+elkan_create(kmeans_run *run)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    const size_t k = meta->num_centroids;
+    elkan_state *state = calloc(1, sizeof(elkan_state));
+
+    if (!state) return KMEANS_NO_MEMORY;
+    run->state = state;
+
+    /* Bounds are first written by the thread owning each point. */
+    state->upper = malloc(sizeof(double) * meta->num_objects);
+    state->lower = malloc(sizeof(double) * meta->num_objects * k);
+    state->half = malloc(sizeof(double) * k * k);
+    state->nearest_half = malloc(sizeof(double) * k);
+    state->tiles = kmeans_block_alloc(k, meta->dim);
+
+    if (!state->upper
+        || !state->lower
+        || !state->half
+        || !state->nearest_half
+        || !state->tiles)
+        return KMEANS_NO_MEMORY;
+
+    /* The tiles are first filled once the centroids have moved. */
+    return KMEANS_OK;
+}
+
+
+/* Measure every centroid once, when nothing is known about a point yet. */
+static inline
+int
+elkan_full(const kmeans_run *run,
+           elkan_state *state,
+           size_t i,
+           const double *row,
+           double *distances)
+{
+    const size_t k = run->meta->num_centroids;
+    double *lower = state->lower + (i * k);
+    int nearest = 0;
+
+    run->kernels->distances(row, run->centroids_t, run->stride,
+                            run->meta->dim, distances);
+
+    for (size_t c = 0; c < k; ++c) {
+        lower[c] = sqrt(distances[c]) * (1.0 - KMEANS_BOUND_SLACK);
+        if (distances[c] < distances[nearest]) nearest = c;
+    }
+
+    state->upper[i] = sqrt(distances[nearest]) * (1.0 + KMEANS_BOUND_SLACK);
+    return nearest;
+}
+
+
+/*
+ * Find the nearest centroid of a point whose bounds have been loosened by the
+ *  latest centroid shifts. Tiles whose every centroid is ruled out by the
+ *  bounds are skipped, and each other tile is measured at once into
+ *  'distances' (KMEANS_BLOCK_WIDTH values).
+ */
+static inline
+int
+elkan_search(const kmeans_run *run,
+             elkan_state *state,
+             size_t i,
+             const double *row,
+             int cluster,
+             double *distances,
+             size_t *evaluations)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    const size_t k = meta->num_centroids;
+    const size_t dim = meta->dim;
+    double *lower = state->lower + (i * k);
+    double upper = state->upper[i];
+    double current = 0.0;
+    int tight = 0;
+
+    if (upper < state->nearest_half[cluster]) return cluster;
+
+    for (size_t base = 0; base < k; base += KMEANS_BLOCK_WIDTH) {
+        const double *half = state->half + (cluster * k);
+        const size_t end = (base + KMEANS_BLOCK_WIDTH < k)
+            ? base + KMEANS_BLOCK_WIDTH
+            : k;
+        int candidates = 0;
+
+        for (size_t c = base; c < end; ++c)
+            candidates |= ((int)c != cluster
+                           && !(upper < lower[c])
+                           && !(upper < half[c]));
+        if (!candidates) continue;
+
+        /* The upper bound may be loose; make it exact once and re-check. */
+        if (!tight) {
+            current = run->kernels->pair(
+                row, meta->centroids + (cluster * dim), dim);
+            upper = sqrt(current) * (1.0 + KMEANS_BOUND_SLACK);
+            lower[cluster] = sqrt(current) * (1.0 - KMEANS_BOUND_SLACK);
+            tight = 1;
+            ++*evaluations;
+
+            candidates = 0;
+            for (size_t c = base; c < end; ++c)
+                candidates |= ((int)c != cluster
+                               && !(upper < lower[c])
+                               && !(upper < half[c]));
+            if (!candidates) continue;
+        }
+
+        run->kernels->distances(row, state->tiles + (base * dim),
+                                KMEANS_BLOCK_WIDTH, dim, distances);
+        *evaluations += end - base;
+
+        const int previous = cluster;
+        for (size_t c = base; c < end; ++c) {
+            const double distance = distances[c - base];
+            lower[c] = sqrt(distance) * (1.0 - KMEANS_BOUND_SLACK);
+
+            /* Equal distances go to the lower index, as in the Lloyd loop. */
+            if (distance < current
+                || (distance == current && (int)c < cluster)) {
+                cluster = c;
+                current = distance;
+            }
+        }
+
+        if (cluster != previous)
+            upper = sqrt(current) * (1.0 + KMEANS_BOUND_SLACK);
+    }
+
+    state->upper[i] = upper;
+    return cluster;
+}
+
+
+static
+void
+elkan_assign(kmeans_run *run,
+             size_t thread,
+             size_t lo,
+             size_t hi,
+             kmeans_partial *partial)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    elkan_state *state = (elkan_state *)run->state;
+    const size_t k = meta->num_centroids;
+
+    for (size_t i = lo; i < hi; ++i) {
+        const double *row = kmeans_run_row(run, i, partial->row);
+        int cluster = meta->cluster_assignments[i];
+
+        if (0 == run->iteration) {
+            cluster = elkan_full(run, state, i, row, partial->distances);
+            partial->evaluations += k;
+        } else {
+            /* Loosen the bounds by how far the centroids just moved. */
+            double *lower = state->lower + (i * k);
+
+            state->upper[i] = (state->upper[i] + run->shifts[cluster])
+                * (1.0 + KMEANS_BOUND_SLACK);
+            for (size_t c = 0; c < k; ++c)
+                lower[c] = (lower[c] - run->shifts[c])
+                    * (1.0 - KMEANS_BOUND_SLACK);
+
+            cluster = elkan_search(run, state, i, row, cluster,
+                                   partial->distances,
+                                   &(partial->evaluations));
+        }
+
+        kmeans_partial_assign(partial, &(meta->cluster_assignments[i]), cluster);
+        kmeans_partial_add(partial, row, cluster, meta->dim);
+    }
+}
+
+
+static
+void
+elkan_moved(kmeans_run *run)
+{
+    elkan_state *state = (elkan_state *)run->state;
+
+    kmeans_run_separation(run, state->half, state->nearest_half);
+    kmeans_block_tile(run->meta->centroids, NULL, run->meta->num_centroids,
+                      run->meta->dim, state->tiles);
+}
+
+
+static
+void
+elkan_destroy(kmeans_run *run)
+{
+    elkan_state *state = (elkan_state *)run->state;
+
+    if (!state) return;
+
+    free(state->upper);
+    free(state->lower);
+    free(state->half);
+    free(state->nearest_half);
+    free(state->tiles);
+    free(state);
+    run->state = NULL;
+}
+
+
+const kmeans_engine kmeans_engine_elkan = {
+    .create = elkan_create,
+    .assign = elkan_assign,
+    .moved = elkan_moved,
+    .destroy = elkan_destroy,
+};
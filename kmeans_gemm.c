@@ -0,0 +1,315 @@
+/*
+ * kmeans_gemm.c
+ *
+ * An assignment engine computing distances the way a matrix product would.
+ *  The squared distance expands into ||x||² - 2 x·c + ||c||², and the dot
+ *  products of a chunk of points with all centroids are one small GEMM: the
+ *  points and centroids are packed into panels, the dimensions are split into
+ *  blocks which keep a panel of centroids in cache, and a register-tiled
+ *  kernel multiplies KMEANS_TILE_POINTS points by KMEANS_BLOCK_WIDTH centroids
+ *  at a time. Each value loaded then feeds several multiply-adds, where the
+ *  plain kernels use every centroid value once per point.
+ *
+ * The nearest centroid is picked in the epilogue of each chunk, so only a
+ *  chunk of scores ever exists. Rounding of the expanded form can swap near
+ *  ties, so any centroid within its error bound of the best one is compared
+ *  again with the pair kernel, which leaves the same clusters as Lloyd.
+ */
+
+#include "kmeans_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+
+/* Points per chunk, whose scores against every centroid are kept at once. */
+#define GEMM_CHUNK 32
+
+/* Dimensions per block, so a block's panel of centroids stays in L1. */
+#define GEMM_DEPTH 128
+
+
+typedef struct
+{
+    /*
+     * The centroids packed for the tile kernels: block 'b' of
+     * KMEANS_BLOCK_WIDTH centroids holds its values dimension by dimension
+     * at panel + (b * dim * KMEANS_BLOCK_WIDTH). Padding lanes are zero.
+     */
+    double *panel;
+
+    /* Squared norms of the centroids, and the largest of them. */
+    double *norms;
+    double max_norm;
+
+    /* Squared norms of the points, taken during the first pass. */
+    double *point_norms;
+
+    /* Per thread, the packed points of a chunk and their scores. */
+    double **packed;
+    double **scores;
+} gemm_state;
+
+
+/* Allocate a 64-byte aligned array of doubles, or NULL. */
+static
+double *
+gemm_alloc(size_t count)
+{
+    void *block = NULL;
+
+    if (0 != posix_memalign(&block, 64, sizeof(double) * count)) return NULL;
+    return (double *)block;
+}
+
+
+/* Pack the current centroids into the panel, and take their norms. */
+static
+void
+gemm_pack_centroids(kmeans_run *run)
+{
+    gemm_state *state = (gemm_state *)run->state;
+    const kmeans_dense_meta *meta = run->meta;
+    const size_t dim = meta->dim;
+
+    state->max_norm = 0.0;
+
+    for (size_t c = 0; c < meta->num_centroids; ++c) {
+        const double *centroid = meta->centroids + (c * dim);
+        double *lanes = state->panel
+            + ((c / KMEANS_BLOCK_WIDTH) * dim * KMEANS_BLOCK_WIDTH)
+            + (c % KMEANS_BLOCK_WIDTH);
+        double norm = 0.0;
+
+        for (size_t d = 0; d < dim; ++d) {
+            lanes[d * KMEANS_BLOCK_WIDTH] = centroid[d];
+            norm += centroid[d] * centroid[d];
+        }
+
+        state->norms[c] = norm;
+        if (norm > state->max_norm) state->max_norm = norm;
+    }
+}
+
+
+static
+kmeans_result
+gemm_create(kmeans_run *run)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    gemm_state *state = calloc(1, sizeof(gemm_state));
+
+    if (!state) return KMEANS_NO_MEMORY;
+    run->state = state;
+
+    state->panel = gemm_alloc(run->stride * meta->dim);
+    state->norms = malloc(sizeof(double) * meta->num_centroids);
+    state->point_norms = malloc(sizeof(double) * meta->num_objects);
+    state->packed = calloc(run->num_threads, sizeof(double *));
+    state->scores = calloc(run->num_threads, sizeof(double *));
+
+    if (!state->panel || !state->norms || !state->point_norms
+        || !state->packed || !state->scores)
+        return KMEANS_NO_MEMORY;
+
+    for (size_t t = 0; t < run->num_threads; ++t) {
+        state->packed[t] = gemm_alloc(GEMM_CHUNK * meta->dim);
+        state->scores[t] = gemm_alloc(GEMM_CHUNK * run->stride);
+
+        if (!state->packed[t] || !state->scores[t]) return KMEANS_NO_MEMORY;
+    }
+
+    memset(state->panel, 0, sizeof(double) * run->stride * meta->dim);
+    gemm_pack_centroids(run);
+    return KMEANS_OK;
+}
+
+
+/*
+ * Pack 'count' points starting at 'first' into tiles, padding the last tile
+ *  with zeros. The first pass also takes the norms of the points.
+ */
+static
+void
+gemm_pack_points(const kmeans_run *run,
+                 size_t first,
+                 size_t count,
+                 double *packed,
+                 double *scratch)
+{
+    gemm_state *state = (gemm_state *)run->state;
+    const size_t dim = run->meta->dim;
+    const size_t padded = (count + KMEANS_TILE_POINTS - 1)
+        & ~((size_t)KMEANS_TILE_POINTS - 1);
+
+    for (size_t p = 0; p < padded; ++p) {
+        double *lanes = packed + ((p / KMEANS_TILE_POINTS) * dim * KMEANS_TILE_POINTS)
+            + (p % KMEANS_TILE_POINTS);
+
+        if (p >= count) {
+            for (size_t d = 0; d < dim; ++d) lanes[d * KMEANS_TILE_POINTS] = 0.0;
+            continue;
+        }
+
+        const double *row = kmeans_run_row(run, first + p, scratch);
+
+        for (size_t d = 0; d < dim; ++d) lanes[d * KMEANS_TILE_POINTS] = row[d];
+        if (run->iteration) continue;
+
+        double norm = 0.0;
+
+        for (size_t d = 0; d < dim; ++d) norm += row[d] * row[d];
+        state->point_norms[first + p] = norm;
+    }
+}
+
+
+/*
+ * Pick the nearest centroid of one point from its dot products, turning them
+ *  into squared distances less the point's norm along the way. Centroids
+ *  within the rounding error of the expanded form from the best one are
+ *  compared again in full, in ascending order like the Lloyd kernels.
+ */
+static inline
+int
+gemm_nearest(const kmeans_run *run,
+             size_t i,
+             double *scores,
+             kmeans_partial *partial)
+{
+    const gemm_state *state = (const gemm_state *)run->state;
+    const kmeans_dense_meta *meta = run->meta;
+    const size_t k = meta->num_centroids;
+    double best = HUGE_VAL;
+    int nearest = 0;
+
+    for (size_t c = 0; c < k; ++c) {
+        scores[c] = state->norms[c] - (2.0 * scores[c]);
+
+        if (scores[c] < best) {
+            best = scores[c];
+            nearest = c;
+        }
+    }
+
+    /* Each term rounds within a few ulps per dimension of the norms' sum. */
+    const double slack = 8.0 * (meta->dim + 2) * DBL_EPSILON
+        * (state->point_norms[i] + state->max_norm);
+    size_t close = 0;
+
+    for (size_t c = 0; c < k; ++c) close += (scores[c] <= best + slack);
+    if (1 == close) return nearest;
+
+    const double *row = kmeans_run_row(run, i, partial->row);
+    double exact = HUGE_VAL;
+
+    for (size_t c = 0; c < k; ++c) {
+        if (scores[c] > best + slack) continue;
+
+        const double distance =
+            run->kernels->pair(row, meta->centroids + (c * meta->dim), meta->dim);
+
+        ++partial->evaluations;
+        if (distance < exact) {
+            exact = distance;
+            nearest = c;
+        }
+    }
+
+    return nearest;
+}
+
+
+static
+void
+gemm_assign(kmeans_run *run,
+            size_t thread,
+            size_t lo,
+            size_t hi,
+            kmeans_partial *partial)
+{
+    gemm_state *state = (gemm_state *)run->state;
+    kmeans_dense_meta *meta = run->meta;
+    const func_tile_dot_t tile = run->kernels->tile;
+    const size_t dim = meta->dim;
+    const size_t stride = run->stride;
+    double *packed = state->packed[thread];
+    double *scores = state->scores[thread];
+
+    partial->evaluations += (hi - lo) * meta->num_centroids;
+
+    for (size_t first = lo; first < hi; first += GEMM_CHUNK) {
+        const size_t count = (hi - first < GEMM_CHUNK) ? hi - first : GEMM_CHUNK;
+        const size_t tiles = (count + KMEANS_TILE_POINTS - 1) / KMEANS_TILE_POINTS;
+
+        gemm_pack_points(run, first, count, packed, partial->row);
+        memset(scores, 0, sizeof(double) * tiles * KMEANS_TILE_POINTS * stride);
+
+        /* One block of dimensions at a time, across every centroid and tile. */
+        for (size_t d = 0; d < dim; d += GEMM_DEPTH) {
+            const size_t depth = (dim - d < GEMM_DEPTH) ? dim - d : GEMM_DEPTH;
+
+            for (size_t b = 0; b < stride; b += KMEANS_BLOCK_WIDTH) {
+                const double *panel = state->panel + (b * dim) + (d * KMEANS_BLOCK_WIDTH);
+
+                for (size_t t = 0; t < tiles; ++t)
+                    tile(packed + (t * dim * KMEANS_TILE_POINTS) + (d * KMEANS_TILE_POINTS),
+                         panel,
+                         depth,
+                         scores + (t * KMEANS_TILE_POINTS * stride) + b,
+                         stride);
+            }
+        }
+
+        /* The epilogue: pick each point's centroid, and add it to the sums. */
+        for (size_t p = 0; p < count; ++p) {
+            const size_t i = first + p;
+            const int cluster = gemm_nearest(run, i, scores + (p * stride), partial);
+
+            kmeans_partial_assign(partial, &(meta->cluster_assignments[i]), cluster);
+            kmeans_partial_add(partial, kmeans_run_row(run, i, partial->row),
+                               cluster, dim);
+        }
+    }
+}
+
+
+static
+void
+gemm_moved(kmeans_run *run)
+{
+    gemm_pack_centroids(run);
+}
+
+
+static
+void
+gemm_destroy(kmeans_run *run)
+{
+    gemm_state *state = (gemm_state *)run->state;
+
+    if (!state) return;
+
+    for (size_t t = 0; t < run->num_threads; ++t) {
+        if (state->packed) free(state->packed[t]);
+        if (state->scores) free(state->scores[t]);
+    }
+
+    free(state->panel);
+    free(state->norms);
+    free(state->point_norms);
+    free(state->packed);
+    free(state->scores);
+    free(state);
+    run->state = NULL;
+}
+
+
+const kmeans_engine kmeans_engine_gemm = {
+    .create = gemm_create,
+    .assign = gemm_assign,
+    .moved = gemm_moved,
+    .destroy = gemm_destroy,
+};
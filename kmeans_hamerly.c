@@ -0,0 +1,187 @@
+/*
+ * kmeans_hamerly.c
+ *
+ * Hamerly's accelerated assignment engine. Each point keeps an upper bound on
+ *  the distance to its own centroid and a single lower bound on the distance
+ *  to every other centroid. When the upper bound is below both the lower bound
+ *  and half the distance from its centroid to the nearest other centroid, the
+ *  point provably keeps its cluster and no distance is evaluated at all.
+ */
+
+#include "kmeans_internal.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+
+typedef struct
+{
+    /* Per-point bounds. */
+    double *upper;
+    double *lower;
+
+    /* Half the distance from each centroid to its nearest neighbour. */
+    double *nearest_half;
+
+    /* The largest centroid shift, its cluster, and the second largest shift. */
+    double max_shift;
+    double second_shift;
+    size_t max_shift_cluster;
+} hamerly_state;
+
+
+static
+kmeans_result
+hamerly_create(kmeans_run *run)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    hamerly_state *state = calloc(1, sizeof(hamerly_state));
+
+    if (!state) return KMEANS_NO_MEMORY;
+    run->state = state;
+
+    /* Bounds are first written by the thread owning each point. */
+    state->upper = malloc(sizeof(double) * meta->num_objects);
+    state->lower = malloc(sizeof(double) * meta->num_objects);
+    state->nearest_half = malloc(sizeof(double) * meta->num_centroids);
+
+    if (!state->upper || !state->lower || !state->nearest_half)
+        return KMEANS_NO_MEMORY;
+
+    return KMEANS_OK;
+}
+
+
+/* Compare a point against every centroid, and reset both of its bounds. */
+static inline
+int
+hamerly_full(const kmeans_run *run,
+             hamerly_state *state,
+             size_t i,
+             const double *row,
+             double *distances)
+{
+    const size_t k = run->meta->num_centroids;
+    int nearest = 0;
+    double second = HUGE_VAL;
+
+    run->kernels->distances(row, run->centroids_t, run->stride,
+                            run->meta->dim, distances);
+
+    for (size_t c = 1; c < k; ++c) {
+        if (distances[c] < distances[nearest]) {
+            second = distances[nearest];
+            nearest = c;
+        } else if (distances[c] < second) {
+            second = distances[c];
+        }
+    }
+
+    state->upper[i] = sqrt(distances[nearest]) * (1.0 + KMEANS_BOUND_SLACK);
+    state->lower[i] = sqrt(second) * (1.0 - KMEANS_BOUND_SLACK);
+
+    return nearest;
+}
+
+
+static
+void
+hamerly_assign(kmeans_run *run,
+               size_t thread,
+               size_t lo,
+               size_t hi,
+               kmeans_partial *partial)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    hamerly_state *state = (hamerly_state *)run->state;
+    const size_t dim = meta->dim;
+
+    for (size_t i = lo; i < hi; ++i) {
+        const double *row = kmeans_run_row(run, i, partial->row);
+        int cluster = meta->cluster_assignments[i];
+
+        if (0 == run->iteration) {
+            cluster = hamerly_full(run, state, i, row, partial->distances);
+            partial->evaluations += meta->num_centroids;
+        } else {
+            /* Loosen the bounds by how far the centroids just moved. */
+            double other_shift = ((size_t)cluster == state->max_shift_cluster)
+                ? state->second_shift
+                : state->max_shift;
+
+            state->upper[i] = (state->upper[i] + run->shifts[cluster])
+                * (1.0 + KMEANS_BOUND_SLACK);
+            state->lower[i] = (state->lower[i] - other_shift)
+                * (1.0 - KMEANS_BOUND_SLACK);
+
+            double bound = fmax(state->nearest_half[cluster], state->lower[i]);
+
+            if (!(state->upper[i] < bound)) {
+                /* Tighten the upper bound before giving up on the point. */
+                state->upper[i] = sqrt(run->kernels->pair(
+                    row, meta->centroids + (cluster * dim), dim))
+                    * (1.0 + KMEANS_BOUND_SLACK);
+                ++partial->evaluations;
+
+                if (!(state->upper[i] < bound)) {
+                    cluster = hamerly_full(run, state, i, row,
+                                           partial->distances);
+                    partial->evaluations += meta->num_centroids;
+                }
+            }
+        }
+
+        kmeans_partial_assign(partial, &(meta->cluster_assignments[i]), cluster);
+        kmeans_partial_add(partial, row, cluster, dim);
+    }
+}
+
+
+static
+void
+hamerly_moved(kmeans_run *run)
+{
+    hamerly_state *state = (hamerly_state *)run->state;
+
+    state->max_shift = 0.0;
+    state->second_shift = 0.0;
+    state->max_shift_cluster = 0;
+
+    for (size_t c = 0; c < run->meta->num_centroids; ++c) {
+        double shift = run->shifts[c] * (1.0 + KMEANS_BOUND_SLACK);
+
+        if (shift > state->max_shift) {
+            state->second_shift = state->max_shift;
+            state->max_shift = shift;
+            state->max_shift_cluster = c;
+        } else if (shift > state->second_shift) {
+            state->second_shift = shift;
+        }
+    }
+
+    kmeans_run_separation(run, NULL, state->nearest_half);
+}
+
+
+static
+void
+hamerly_destroy(kmeans_run *run)
+{
+    hamerly_state *state = (hamerly_state *)run->state;
+
+    if (!state) return;
+
+    free(state->upper);
+    free(state->lower);
+    free(state->nearest_half);
+    free(state);
+    run->state = NULL;
+}
+
+
+const kmeans_engine kmeans_engine_hamerly = {
+    .create = hamerly_create,
+    .assign = hamerly_assign,
+    .moved = hamerly_moved,
+    .destroy = hamerly_destroy,
+};
@@ -0,0 +1,352 @@
+/*
+ * kmeans_internal.h
+ *
+ * Definitions shared between the clustering drivers and the dense engines.
+ *  Nothing in here is part of the public interface.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_INTERNAL_H
+#define CIS579_TERMPROJECT_KMEANS_INTERNAL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "kmeans.h"
+#include "kmeans_seed.h"
+#include "kmeans_kernels.h"
+
+
+/*
+ * Relative slack applied to every distance bound, so the rounding error of
+ *  computed distances can never make a bound skip a centroid that the plain
+ *  Lloyd loop would have chosen.
+ */
+#define KMEANS_BOUND_SLACK 1e-10
+
+/* Points per block of the sums which let kmeans_draw() skip whole blocks. */
+#define KMEANS_DRAW_BLOCK 4096
+
+
+/* Running per-cluster sums, counts and scratch space owned by a single thread. */
+typedef struct
+{
+    double *sums;
+    size_t *counts;
+    size_t changed;
+
+    /* Point-to-centroid distances computed in this pass. */
+    size_t evaluations;
+
+    /* Summed point weights per cluster, only held by weighted runs. */
+    double *masses;
+
+    /* Squared distances of this thread's points to their centroids, if observed. */
+    double inertia;
+
+    /* A gathered or widened copy of the current point, when it needs one. */
+    double *row;
+
+    /* The current point in single precision, for data narrower than double. */
+    float *row_f;
+
+    /* One distance per (padded) centroid. */
+    double *distances;
+} kmeans_partial;
+
+
+typedef struct _kmeans_run kmeans_run;
+
+/*
+ * An assignment engine. The driver owns the iteration loop, threading and the
+ *  centroid update, while each engine decides how points find their nearest
+ *  centroid. Every engine must add each point to its cluster's partial sums in
+ *  ascending point order, which keeps centroids identical across engines. The
+ *  k-d tree engine is the one exception: it adds the cached sums of whole
+ *  subtrees, so its centroids can differ from the others' in the last bits.
+ */
+typedef struct
+{
+    /* Allocate any per-run state. Optional. */
+    kmeans_result (*create)(kmeans_run *run);
+
+    /* Assign the points [lo, hi) owned by one thread. */
+    void (*assign)(kmeans_run *run,
+                   size_t thread,
+                   size_t lo,
+                   size_t hi,
+                   kmeans_partial *partial);
+
+    /* React to the centroids having moved by run->shifts. Optional. */
+    void (*moved)(kmeans_run *run);
+
+    /* Free any per-run state. Optional. */
+    void (*destroy)(kmeans_run *run);
+} kmeans_engine;
+
+
+/* State shared by every thread of a dense clustering run. */
+struct _kmeans_run
+{
+    kmeans_dense_meta *meta;
+    const kmeans_engine *engine;
+
+    /* Engine specific state. */
+    void *state;
+
+    /* One partial per thread. */
+    kmeans_partial *partials;
+    size_t num_threads;
+
+    /* The distance kernels for this CPU, and the centroids in their layout. */
+    const kmeans_kernels *kernels;
+    double *centroids_t;
+    size_t stride;
+
+    /* The same centroids in single precision, for data narrower than double. */
+    float *centroids_f;
+
+    /* Centroid positions before the latest update, and how far each moved. */
+    double *previous;
+    double *shifts;
+
+    /* Zero during the first assignment pass. */
+    unsigned long iteration;
+};
+
+
+/* Nanoseconds on the monotonic clock, for iteration telemetry. */
+static inline
+unsigned long long
+kmeans_clock_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((unsigned long long)now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+
+/*
+ * Check an iteration against the optional stopping tolerances, each disabled
+ *  while zero. 'previous_inertia' is HUGE_VAL after the first iteration.
+ */
+static inline
+int
+kmeans_tolerance_met(const kmeans_iteration_stats *stats,
+                     size_t num_objects,
+                     double previous_inertia,
+                     double reassign_tolerance,
+                     double inertia_tolerance,
+                     double shift_tolerance)
+{
+    if (reassign_tolerance > 0.0
+        && stats->reassigned <= reassign_tolerance * num_objects)
+        return 1;
+
+    if (inertia_tolerance > 0.0 && previous_inertia < HUGE_VAL
+        && stats->inertia >= previous_inertia * (1.0 - inertia_tolerance))
+        return 1;
+
+    return shift_tolerance > 0.0 && stats->max_shift <= shift_tolerance;
+}
+
+
+extern const kmeans_engine kmeans_engine_lloyd;
+extern const kmeans_engine kmeans_engine_hamerly;
+extern const kmeans_engine kmeans_engine_elkan;
+extern const kmeans_engine kmeans_engine_yinyang;
+extern const kmeans_engine kmeans_engine_kdtree;
+extern const kmeans_engine kmeans_engine_gemm;
+
+
+/*
+ * Get point 'i' of a dense matrix as a contiguous row of doubles. Only
+ *  row-major float64 data is returned in place; anything else is gathered
+ *  and widened into 'scratch', with quantized values scaled back.
+ */
+static inline
+const double *
+kmeans_dense_row(const kmeans_dense_meta *meta,
+                 size_t i,
+                 double *scratch)
+{
+    const size_t dim = meta->dim;
+    const int rows = (KMEANS_ROW_MAJOR == meta->layout);
+    const size_t first = rows ? (i * dim) : i;
+    const size_t step = rows ? 1 : meta->num_objects;
+    const double scale = meta->scale ? meta->scale : 1.0;
+
+    switch (meta->dtype) {
+        case KMEANS_FLOAT32: {
+            const float *values = (const float *)meta->data + first;
+            for (size_t d = 0; d < dim; ++d) scratch[d] = values[d * step];
+            return scratch;
+        }
+        case KMEANS_INT8: {
+            const int8_t *values = (const int8_t *)meta->data + first;
+            for (size_t d = 0; d < dim; ++d)
+                scratch[d] = values[d * step] * scale;
+            return scratch;
+        }
+        case KMEANS_UINT8: {
+            const uint8_t *values = (const uint8_t *)meta->data + first;
+            for (size_t d = 0; d < dim; ++d)
+                scratch[d] = values[d * step] * scale;
+            return scratch;
+        }
+        case KMEANS_FLOAT64:
+        default:
+            break;
+    }
+
+    const double *values = (const double *)meta->data + first;
+    if (rows) return values;
+
+    for (size_t d = 0; d < dim; ++d) scratch[d] = values[d * step];
+    return scratch;
+}
+
+
+/* Get point 'i' as a contiguous row, gathering it into 'scratch' if needed. */
+static inline
+const double *
+kmeans_run_row(const kmeans_run *run,
+               size_t i,
+               double *scratch)
+{
+    return kmeans_dense_row(run->meta, i, scratch);
+}
+
+
+/* Add a point into its cluster's running sum. */
+static inline
+void
+kmeans_partial_add(kmeans_partial *partial,
+                   const double *row,
+                   int cluster,
+                   size_t dim)
+{
+    double *sum = partial->sums + (cluster * dim);
+
+    for (size_t d = 0; d < dim; ++d) sum[d] += row[d];
+    ++partial->counts[cluster];
+}
+
+
+/* Record a point's new cluster, counting it when it differs from the last one. */
+static inline
+void
+kmeans_partial_assign(kmeans_partial *partial,
+                      int *assignment,
+                      int cluster)
+{
+    if (*assignment != cluster) {
+        *assignment = cluster;
+        ++partial->changed;
+    }
+}
+
+
+/*
+ * Allocate the sums and scratch space of a partial for k centroids of 'dim'
+ *  values, with room for 'stride' distances. On failure nothing is kept and
+ *  the partial's sums stay null.
+ */
+kmeans_result
+kmeans_partial_create(
+    kmeans_partial *partial       OUT,
+    size_t          num_centroids IN,
+    size_t          dim           IN,
+    size_t          stride        IN
+);
+
+/* Zero the sums, counts and tallies of a partial before an assignment pass. */
+void
+kmeans_partial_reset(
+    kmeans_partial *partial       IN OUT,
+    size_t          num_centroids IN,
+    size_t          dim           IN
+);
+
+/* Free everything a partial holds, including its masses. */
+void
+kmeans_partial_destroy(
+    kmeans_partial *partial IN OUT
+);
+
+
+/*
+ * Merge every thread's partials into the first one as a pairwise tree. The
+ *  merge order only depends on the thread count, so the floating point sums
+ *  (and therefore the results) are identical between runs with equal counts.
+ */
+void
+kmeans_run_reduce(
+    kmeans_run *run IN OUT
+);
+
+/*
+ * Move every centroid to the mean of the members summed into the first
+ *  partial, weighted by its masses when it has them, record how far each one
+ *  moved, and refresh the kernel layouts.
+ */
+void
+kmeans_run_update(
+    kmeans_run *run IN OUT
+);
+
+
+/*
+ * Compute half of the distance between every pair of centroids into the
+ *  k x k matrix 'half' (optional), and half the distance from each centroid to
+ *  its nearest neighbour into 'nearest_half'. Both are shrunk by the bound
+ *  slack so they are safe to prune with.
+ */
+void
+kmeans_run_separation(
+    const kmeans_run *run          IN,
+    double           *half         OUT,
+    double           *nearest_half OUT
+);
+
+
+/*
+ * Draw an index in [0, n) with probability proportional to scores[i], or
+ *  uniformly when every score is zero. When given, 'block_sums' holds the
+ *  scores summed per KMEANS_DRAW_BLOCK points, which lets the draw skip
+ *  whole blocks and fixes the order of the total.
+ */
+size_t
+kmeans_draw(
+    kmeans_rng   *rng        IN OUT,
+    const double *scores     IN,
+    size_t        n          IN,
+    const double *block_sums IN   /* optional */
+);
+
+/*
+ * Pick k of m row-major points with serial k-means++: each pick is drawn in
+ *  proportion to its weight times its squared distance to the closest pick so
+ *  far, and the first by weight alone. Without weights every point weighs 1,
+ *  the first pick is uniform and 'scores' is unused. 'nearest' and 'scores'
+ *  are scratch space of m values each, so nothing is allocated here.
+ */
+void
+kmeans_plusplus(
+    const kmeans_kernels *kernels   IN,
+    const double         *points    IN,
+    const double         *weights   IN,   /* optional */
+    size_t                m         IN,
+    size_t                dim       IN,
+    size_t                k         IN,
+    kmeans_rng           *rng       IN OUT,
+    double               *nearest   OUT,
+    double               *scores    OUT,
+    double               *centroids OUT
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_INTERNAL_H */
@@ -0,0 +1,644 @@
+/*
+ * kmeans_kdtree.c
+ *
+ * Kanungo's filtering algorithm as an assignment engine. Each thread owns a
+ *  tree over its slice of the points. Walking it, the candidates of a node are
+ *  the centroids which may be nearest to some point in its box: the one nearest
+ *  to the box centre, plus every other one that is not farther than it from
+ *  the box corner lying furthest in its direction.
+ *
+ * Assigning a subtree at once only adds its cached sum. Its points need to be
+ *  visited just when their cluster changes, which each run tracks per node as
+ *  the cluster every point below it is known to have.
+ */
+
+#include "kmeans_kdtree.h"
+#include "kmeans_pool.h"
+#include "kmeans_internal.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+
+/* The most points in a leaf of the tree. */
+#define KDTREE_LEAF_SIZE 16
+
+/* Marks a node whose points are not known to share a cluster. */
+#define KDTREE_MIXED -1
+
+
+typedef struct
+{
+    /* Children, and one past the last node of the subtree, in preorder. */
+    uint32_t left;
+    uint32_t right;
+    uint32_t end;
+    uint32_t leaf;
+
+    /* The points of the subtree, in the tree order of the slice. */
+    size_t first;
+    size_t count;
+} kdtree_node;
+
+/* The tree of one thread's slice of the points. */
+typedef struct
+{
+    size_t lo;
+    size_t hi;
+
+    /* Point indices in tree order. */
+    size_t *order;
+
+    kdtree_node *nodes;
+    size_t num_nodes;
+
+    /* Per node, the low and high corners of its box, then its sum. */
+    double *boxes;
+    double *sums;
+
+    /* How deep the tree goes, counting the root as 1. */
+    size_t depth;
+
+    kmeans_result result;
+} kdtree_slice;
+
+struct _kmeans_kdtree
+{
+    const kmeans_dense_meta *meta;
+
+    /* What the trees were built for. */
+    const void *data;
+    size_t num_objects;
+    size_t dim;
+    kmeans_layout layout;
+    kmeans_dtype dtype;
+    double scale;
+
+    kdtree_slice *slices;
+    size_t num_slices;
+};
+
+
+/* Nodes a median split makes for 'count' points. */
+static
+size_t
+kdtree_count_nodes(size_t count)
+{
+    if (count <= KDTREE_LEAF_SIZE) return 1;
+    return 1 + kdtree_count_nodes(count / 2) + kdtree_count_nodes(count - (count / 2));
+}
+
+
+/* Sort key of a point for the dimension being split. */
+#define KDTREE_KEY(p) (rows[(((p) - slice->lo) * dim) + d])
+
+/*
+ * Reorder 'count' point indices so the one at 'nth' is where sorting on
+ *  dimension 'd' would put it, with a three-way partition for runs of equal
+ *  values.
+ */
+static
+void
+kdtree_select(const kdtree_slice *slice,
+              const double *rows,
+              size_t dim,
+              size_t d,
+              size_t *order,
+              size_t count,
+              size_t nth)
+{
+    size_t lo = 0, hi = count;
+
+    while (hi - lo > 1) {
+        const double pivot = KDTREE_KEY(order[lo + ((hi - lo) / 2)]);
+        size_t lt = lo, i = lo, gt = hi;
+
+        while (i < gt) {
+            const double key = KDTREE_KEY(order[i]);
+            size_t swap = order[i];
+
+            if (key < pivot) {
+                order[i++] = order[lt];
+                order[lt++] = swap;
+            } else if (key > pivot) {
+                order[i] = order[--gt];
+                order[gt] = swap;
+            } else {
+                ++i;
+            }
+        }
+
+        if (nth < lt) hi = lt;
+        else if (nth >= gt) lo = gt;
+        else return;
+    }
+}
+
+#undef KDTREE_KEY
+
+
+/*
+ * Build the subtree over positions [first, first + count) of the tree order,
+ *  splitting its box at the median of its widest side. 'rows' holds the
+ *  slice's points as doubles. Returns the index of the subtree's root.
+ */
+static
+uint32_t
+kdtree_build_node(kdtree_slice *slice,
+                  const double *rows,
+                  size_t dim,
+                  size_t first,
+                  size_t count,
+                  size_t depth)
+{
+    const uint32_t index = slice->num_nodes++;
+    kdtree_node *node = &(slice->nodes[index]);
+    double *low = slice->boxes + (2 * index * dim);
+    double *high = low + dim;
+    double *sum = slice->sums + (index * dim);
+    size_t widest = 0;
+
+    node->first = first;
+    node->count = count;
+    if (depth > slice->depth) slice->depth = depth;
+
+    for (size_t d = 0; d < dim; ++d) {
+        low[d] = HUGE_VAL;
+        high[d] = -HUGE_VAL;
+    }
+
+    for (size_t p = first; p < first + count; ++p) {
+        const double *row = rows + ((slice->order[p] - slice->lo) * dim);
+
+        for (size_t d = 0; d < dim; ++d) {
+            if (row[d] < low[d]) low[d] = row[d];
+            if (row[d] > high[d]) high[d] = row[d];
+        }
+    }
+
+    if (count <= KDTREE_LEAF_SIZE) {
+        memset(sum, 0, sizeof(double) * dim);
+        for (size_t p = first; p < first + count; ++p) {
+            const double *row = rows + ((slice->order[p] - slice->lo) * dim);
+            for (size_t d = 0; d < dim; ++d) sum[d] += row[d];
+        }
+
+        node->leaf = 1;
+        node->end = index + 1;
+        return index;
+    }
+
+    for (size_t d = 1; d < dim; ++d)
+        if (high[d] - low[d] > high[widest] - low[widest]) widest = d;
+
+    kdtree_select(slice, rows, dim, widest, slice->order + first, count, count / 2);
+
+    /* The node array was sized up front, so the node stays put. */
+    node->leaf = 0;
+    node->left = kdtree_build_node(slice, rows, dim, first, count / 2, depth + 1);
+    node->right = kdtree_build_node(slice, rows, dim, first + (count / 2),
+                                    count - (count / 2), depth + 1);
+    node->end = slice->num_nodes;
+
+    const double *left = slice->sums + (node->left * dim);
+    const double *right = slice->sums + (node->right * dim);
+    for (size_t d = 0; d < dim; ++d) sum[d] = left[d] + right[d];
+
+    return index;
+}
+
+
+/* Build the tree of one thread's slice. */
+static
+void
+kdtree_job_build(void *context,
+                 const size_t thread,
+                 const size_t num_threads)
+{
+    kmeans_kdtree *tree = (kmeans_kdtree *)context;
+    kdtree_slice *slice = &(tree->slices[thread]);
+    const size_t dim = tree->dim;
+    double *rows = NULL;
+    double *scratch = malloc(sizeof(double) * dim);
+
+    kmeans_pool_slice(tree->num_objects, thread, num_threads, &(slice->lo), &(slice->hi));
+
+    const size_t count = slice->hi - slice->lo;
+    const size_t num_nodes = count ? kdtree_count_nodes(count) : 0;
+
+    slice->result = KMEANS_NO_MEMORY;
+    if (num_nodes > UINT32_MAX) {
+        slice->result = KMEANS_BAD_LENGTH;
+        goto break_out;
+    }
+
+    rows = malloc(sizeof(double) * count * dim);
+    slice->order = malloc(sizeof(size_t) * count);
+    slice->nodes = malloc(sizeof(kdtree_node) * num_nodes);
+    slice->boxes = malloc(sizeof(double) * 2 * num_nodes * dim);
+    slice->sums = malloc(sizeof(double) * num_nodes * dim);
+
+    if (!scratch || !rows || !slice->order || !slice->nodes
+        || !slice->boxes || !slice->sums)
+        goto break_out;
+
+    /* Gather the slice as doubles once, rather than per visit. */
+    for (size_t i = slice->lo; i < slice->hi; ++i) {
+        memcpy(rows + ((i - slice->lo) * dim),
+               kmeans_dense_row(tree->meta, i, scratch), sizeof(double) * dim);
+        slice->order[i - slice->lo] = i;
+    }
+
+    if (count) kdtree_build_node(slice, rows, dim, 0, count, 1);
+    slice->result = KMEANS_OK;
+
+break_out:
+    /* No matter the result, always perform these actions. */
+    free(rows);
+    free(scratch);
+}
+
+
+kmeans_result
+kmeans_kdtree_build(const kmeans_dense_meta *meta,
+                    kmeans_kdtree **tree)
+{
+    size_t num_slices = meta->num_threads ? meta->num_threads : 1;
+    kmeans_kdtree *self = calloc(1, sizeof(kmeans_kdtree));
+    kmeans_pool *pool = NULL;
+    kmeans_result result = KMEANS_NO_MEMORY;
+
+    *tree = NULL;
+    if (!self) return KMEANS_NO_MEMORY;
+
+    /* Threads are clipped to the points, like the dense driver does. */
+    if (num_slices > meta->num_objects) num_slices = meta->num_objects;
+
+    self->meta = meta;
+    self->data = meta->data;
+    self->num_objects = meta->num_objects;
+    self->dim = meta->dim;
+    self->layout = meta->layout;
+    self->dtype = meta->dtype;
+    self->scale = meta->scale;
+    self->num_slices = num_slices;
+    self->slices = calloc(num_slices, sizeof(kdtree_slice));
+
+    if (!self->slices || !(pool = kmeans_pool_create(num_slices))) goto break_out;
+
+    kmeans_pool_run(pool, kdtree_job_build, self);
+
+    result = KMEANS_OK;
+    for (size_t s = 0; s < num_slices && KMEANS_OK == result; ++s)
+        result = self->slices[s].result;
+
+    /* The meta may not outlive this call; only what it describes is kept. */
+    self->meta = NULL;
+
+break_out:
+    kmeans_pool_destroy(pool);
+    if (KMEANS_OK != result) kmeans_kdtree_destroy(self);
+    else *tree = self;
+    return result;
+}
+
+
+int
+kmeans_kdtree_fits(const kmeans_kdtree *tree,
+                   const kmeans_dense_meta *meta)
+{
+    size_t num_slices = meta->num_threads ? meta->num_threads : 1;
+
+    if (num_slices > meta->num_objects) num_slices = meta->num_objects;
+
+    return tree->data == meta->data
+        && tree->num_objects == meta->num_objects
+        && tree->dim == meta->dim
+        && tree->layout == meta->layout
+        && tree->dtype == meta->dtype
+        && tree->scale == meta->scale
+        && tree->num_slices == num_slices;
+}
+
+
+void
+kmeans_kdtree_destroy(kmeans_kdtree *tree)
+{
+    if (!tree) return;
+
+    if (tree->slices) {
+        for (size_t s = 0; s < tree->num_slices; ++s) {
+            free(tree->slices[s].order);
+            free(tree->slices[s].nodes);
+            free(tree->slices[s].boxes);
+            free(tree->slices[s].sums);
+        }
+        free(tree->slices);
+    }
+
+    free(tree);
+}
+
+
+/* Per-run state of the engine. */
+typedef struct
+{
+    const kmeans_kdtree *tree;
+
+    /* The tree built for this run, when none fitting was handed in. */
+    kmeans_kdtree *own;
+
+    /* Per slice, the cluster every point under each node has, or mixed. */
+    int **owners;
+
+    /* Per thread, a list of candidates for every depth, and two rows. */
+    int **candidates;
+    double **corners;
+} kdtree_state;
+
+
+/* What one thread needs while walking its tree. */
+typedef struct
+{
+    kmeans_run *run;
+    const kdtree_slice *slice;
+    int *owners;
+    kmeans_partial *partial;
+    double *centre;
+    double *corner;
+} kdtree_walk;
+
+
+/* Squared distance between two rows, like one lane of the kernels. */
+static inline
+double
+kdtree_distance(const kmeans_run *run,
+                const double *a,
+                const double *b)
+{
+    return run->kernels->pair(a, b, run->meta->dim);
+}
+
+
+/* Assign every point under a node to one cluster through its cached sum. */
+static
+void
+kdtree_take(kdtree_walk *walk,
+            uint32_t index,
+            int cluster)
+{
+    kmeans_dense_meta *meta = walk->run->meta;
+    const size_t dim = meta->dim;
+    const kdtree_node *node = &(walk->slice->nodes[index]);
+    const double *sum = walk->slice->sums + (index * dim);
+    double *into = walk->partial->sums + (cluster * dim);
+
+    for (size_t d = 0; d < dim; ++d) into[d] += sum[d];
+    walk->partial->counts[cluster] += node->count;
+
+    if (walk->owners[index] == cluster) return;
+
+    /* Only a subtree changing cluster needs its points touched. */
+    for (size_t p = node->first; p < node->first + node->count; ++p)
+        kmeans_partial_assign(walk->partial,
+                              &(meta->cluster_assignments[walk->slice->order[p]]),
+                              cluster);
+
+    for (uint32_t n = index; n < node->end; ++n) walk->owners[n] = cluster;
+}
+
+
+/*
+ * Filter the candidates of a node, in ascending order, down to the ones which
+ *  may be nearest to some point of its box. A candidate is dropped when even
+ *  the box corner furthest towards it is closer to the centre's nearest
+ *  candidate, by more than the bound slack. Returns how many are left.
+ */
+static
+size_t
+kdtree_prune(kdtree_walk *walk,
+             uint32_t index,
+             const int *candidates,
+             size_t num_candidates,
+             int *kept)
+{
+    const kmeans_run *run = walk->run;
+    const size_t dim = run->meta->dim;
+    const double *low = walk->slice->boxes + (2 * index * dim);
+    const double *high = low + dim;
+    const double *centroids = run->meta->centroids;
+    size_t num_kept = 0;
+    int best = candidates[0];
+    double best_distance;
+
+    for (size_t d = 0; d < dim; ++d) walk->centre[d] = 0.5 * (low[d] + high[d]);
+
+    best_distance = kdtree_distance(run, walk->centre, centroids + (best * dim));
+    for (size_t j = 1; j < num_candidates; ++j) {
+        const double distance = kdtree_distance(
+            run, walk->centre, centroids + (candidates[j] * dim));
+
+        if (distance < best_distance) {
+            best_distance = distance;
+            best = candidates[j];
+        }
+    }
+
+    const double *nearest = centroids + (best * dim);
+
+    for (size_t j = 0; j < num_candidates; ++j) {
+        const double *centroid = centroids + (candidates[j] * dim);
+
+        if (candidates[j] != best) {
+            for (size_t d = 0; d < dim; ++d)
+                walk->corner[d] = (centroid[d] > nearest[d]) ? high[d] : low[d];
+
+            if (kdtree_distance(run, walk->corner, centroid)
+                > kdtree_distance(run, walk->corner, nearest)
+                    * (1.0 + (2.0 * KMEANS_BOUND_SLACK)))
+                continue;
+        }
+
+        kept[num_kept++] = candidates[j];
+    }
+
+    walk->partial->evaluations += num_candidates + (2 * (num_candidates - 1));
+    return num_kept;
+}
+
+
+/* Assign the points under a node, given the candidates left for it. */
+static
+void
+kdtree_filter(kdtree_walk *walk,
+              uint32_t index,
+              const int *candidates,
+              size_t num_candidates,
+              int *scratch)
+{
+    kmeans_dense_meta *meta = walk->run->meta;
+    const size_t dim = meta->dim;
+    const kdtree_node *node = &(walk->slice->nodes[index]);
+
+    if (num_candidates > 1) {
+        num_candidates = kdtree_prune(walk, index, candidates, num_candidates, scratch);
+        candidates = scratch;
+        scratch += meta->num_centroids;
+    }
+
+    if (1 == num_candidates) {
+        kdtree_take(walk, index, candidates[0]);
+        return;
+    }
+
+    if (!node->leaf) {
+        kdtree_filter(walk, node->left, candidates, num_candidates, scratch);
+        kdtree_filter(walk, node->right, candidates, num_candidates, scratch);
+
+        walk->owners[index] = (walk->owners[node->left] == walk->owners[node->right])
+            ? walk->owners[node->left]
+            : KDTREE_MIXED;
+        return;
+    }
+
+    /* A leaf still in dispute compares each of its points. */
+    int owner = KDTREE_MIXED;
+
+    for (size_t p = node->first; p < node->first + node->count; ++p) {
+        const size_t i = walk->slice->order[p];
+        const double *row = kmeans_run_row(walk->run, i, walk->partial->row);
+        int nearest = candidates[0];
+        double best = kdtree_distance(walk->run, row, meta->centroids + (nearest * dim));
+
+        for (size_t j = 1; j < num_candidates; ++j) {
+            const double distance = kdtree_distance(
+                walk->run, row, meta->centroids + (candidates[j] * dim));
+
+            if (distance < best) {
+                best = distance;
+                nearest = candidates[j];
+            }
+        }
+
+        walk->partial->evaluations += num_candidates;
+        kmeans_partial_assign(walk->partial, &(meta->cluster_assignments[i]), nearest);
+        kmeans_partial_add(walk->partial, row, nearest, dim);
+
+        if (p == node->first) owner = nearest;
+        else if (owner != nearest) owner = KDTREE_MIXED;
+    }
+
+    walk->owners[index] = owner;
+}
+
+
+static
+kmeans_result
+kdtree_create(kmeans_run *run)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    kdtree_state *state = calloc(1, sizeof(kdtree_state));
+    kmeans_result result;
+
+    if (!state) return KMEANS_NO_MEMORY;
+    run->state = state;
+
+    if (meta->kdtree && kmeans_kdtree_fits(meta->kdtree, meta)) {
+        state->tree = meta->kdtree;
+    } else {
+        kmeans_dense_meta shape = *meta;
+
+        shape.num_threads = run->num_threads;
+        if (KMEANS_OK != (result = kmeans_kdtree_build(&shape, &(state->own))))
+            return result;
+        state->tree = state->own;
+    }
+
+    state->owners = calloc(run->num_threads, sizeof(int *));
+    state->candidates = calloc(run->num_threads, sizeof(int *));
+    state->corners = calloc(run->num_threads, sizeof(double *));
+    if (!state->owners || !state->candidates || !state->corners)
+        return KMEANS_NO_MEMORY;
+
+    for (size_t t = 0; t < run->num_threads; ++t) {
+        const kdtree_slice *slice = &(state->tree->slices[t]);
+
+        /* One list per level, below the full list at the root. */
+        state->owners[t] = malloc(sizeof(int) * (slice->num_nodes + 1));
+        state->candidates[t] =
+            malloc(sizeof(int) * meta->num_centroids * (slice->depth + 1));
+        state->corners[t] = malloc(sizeof(double) * 2 * meta->dim);
+
+        if (!state->owners[t] || !state->candidates[t] || !state->corners[t])
+            return KMEANS_NO_MEMORY;
+
+        /* The assignments start at zero, which no node vouches for yet. */
+        for (size_t n = 0; n < slice->num_nodes; ++n)
+            state->owners[t][n] = KDTREE_MIXED;
+        for (size_t c = 0; c < meta->num_centroids; ++c)
+            state->candidates[t][c] = c;
+    }
+
+    return KMEANS_OK;
+}
+
+
+static
+void
+kdtree_assign(kmeans_run *run,
+              size_t thread,
+              size_t lo,
+              size_t hi,
+              kmeans_partial *partial)
+{
+    kdtree_state *state = (kdtree_state *)run->state;
+    const kdtree_slice *slice = &(state->tree->slices[thread]);
+    kdtree_walk walk = {
+            .run = run,
+            .slice = slice,
+            .owners = state->owners[thread],
+            .partial = partial,
+            .centre = state->corners[thread],
+            .corner = state->corners[thread] + run->meta->dim,
+    };
+
+    (void)lo;
+    (void)hi;
+
+    if (!slice->num_nodes) return;
+
+    kdtree_filter(&walk, 0, state->candidates[thread], run->meta->num_centroids,
+                  state->candidates[thread] + run->meta->num_centroids);
+}
+
+
+static
+void
+kdtree_destroy(kmeans_run *run)
+{
+    kdtree_state *state = (kdtree_state *)run->state;
+
+    if (!state) return;
+
+    for (size_t t = 0; t < run->num_threads; ++t) {
+        if (state->owners) free(state->owners[t]);
+        if (state->candidates) free(state->candidates[t]);
+        if (state->corners) free(state->corners[t]);
+    }
+
+    free(state->owners);
+    free(state->candidates);
+    free(state->corners);
+    kmeans_kdtree_destroy(state->own);
+    free(state);
+    run->state = NULL;
+}
+
+
+const kmeans_engine kmeans_engine_kdtree = {
+    .create = kdtree_create,
+    .assign = kdtree_assign,
+    .destroy = kdtree_destroy,
+};
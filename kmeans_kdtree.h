@@ -0,0 +1,50 @@
+/*
+ * kmeans_kdtree.h
+ *
+ * K-d trees over a dense matrix for the KMEANS_KDTREE filtering engine of
+ *  Kanungo et al. Every node caches the bounding box, sum and count of its
+ *  points, so each iteration narrows the candidate centroids on the way down
+ *  and assigns whole subtrees at once when a single candidate is left. This
+ *  pays off for low dimensionalities, about eight and below.
+ *
+ * Sums of whole subtrees are added at once, rather than point by point in
+ *  ascending order like the other engines do, so centroids can differ from
+ *  theirs in the last bits. Assignments match them given the same centroids.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_KDTREE_H
+#define CIS579_TERMPROJECT_KMEANS_KDTREE_H
+
+#include <stdlib.h>
+
+#include "kmeans.h"
+
+
+/*
+ * Build the trees for meta->data: one per slice of the points a thread owns,
+ *  for meta->num_threads threads, built in parallel. Uses data, num_objects,
+ *  dim, layout, dtype, scale and num_threads. The tree refers to the data, and
+ *  can be handed to any number of runs over it through meta->kdtree, as long
+ *  as the data outlives it.
+ */
+kmeans_result
+kmeans_kdtree_build(
+    const kmeans_dense_meta  *meta IN,
+    kmeans_kdtree           **tree OUT
+);
+
+/* Check whether a tree was built for the data and thread count of 'meta'. */
+int
+kmeans_kdtree_fits(
+    const kmeans_kdtree     *tree IN,
+    const kmeans_dense_meta *meta IN
+);
+
+/* Free a tree. */
+void
+kmeans_kdtree_destroy(
+    kmeans_kdtree *tree IN
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_KDTREE_H */
@@ -0,0 +1,1124 @@
+/*
+ * kmeans_kernels.c
+ *
+ * Implementation of the vectorized distance kernels and their runtime dispatch.
+ *
+ * Every kernel walks the transposed centroid block one dimension at a time,
+ *  broadcasting the point's value and accumulating KMEANS_BLOCK_WIDTH squared
+ *  differences in registers. Because lanes are centroids rather than
+ *  dimensions, no horizontal sums are needed and any dimensionality works.
+ *  The nearest-centroid kernels keep a running (distance, index) minimum per
+ *  lane and only reduce across lanes once per point. Cluster indices are
+ *  carried as doubles so they can be blended with the same masks.
+ *
+ * The tile kernels are the register-tiled core of a matrix product instead:
+ *  each broadcasts one value per point and multiplies it into a row of
+ *  centroid lanes, so every loaded value is used KMEANS_TILE_POINTS or
+ *  KMEANS_BLOCK_WIDTH times.
+ */
+
+#include "kmeans_kernels.h"
+
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# define KMEANS_KERNELS_X86 1
+# include <immintrin.h>
+#endif
+
+
+/*
+ * Kernel bodies are always inlined into their callers, so each wrapper which
+ *  fixes 'dim' at compile time below gets a fully specialized copy.
+ */
+#define KERNEL_BODY __attribute__((always_inline)) static inline
+
+/*
+ * Dimensionalities with kernels of their own. The X-macro expands 'X' once per
+ *  entry, passing the extra arguments first and the dimensionality last.
+ */
+#define KERNELS_FIXED_DIMS(X, ...) \
+    X(__VA_ARGS__, 1)  X(__VA_ARGS__, 2)  X(__VA_ARGS__, 3)  X(__VA_ARGS__, 4)  \
+    X(__VA_ARGS__, 5)  X(__VA_ARGS__, 6)  X(__VA_ARGS__, 7)  X(__VA_ARGS__, 8)  \
+    X(__VA_ARGS__, 9)  X(__VA_ARGS__, 10) X(__VA_ARGS__, 11) X(__VA_ARGS__, 12) \
+    X(__VA_ARGS__, 13) X(__VA_ARGS__, 14) X(__VA_ARGS__, 15) X(__VA_ARGS__, 16) \
+    X(__VA_ARGS__, 17) X(__VA_ARGS__, 18) X(__VA_ARGS__, 19) X(__VA_ARGS__, 20) \
+    X(__VA_ARGS__, 21) X(__VA_ARGS__, 22) X(__VA_ARGS__, 23) X(__VA_ARGS__, 24) \
+    X(__VA_ARGS__, 25) X(__VA_ARGS__, 26) X(__VA_ARGS__, 27) X(__VA_ARGS__, 28) \
+    X(__VA_ARGS__, 29) X(__VA_ARGS__, 30) X(__VA_ARGS__, 31) X(__VA_ARGS__, 32) \
+    X(__VA_ARGS__, 64) X(__VA_ARGS__, 128)
+
+/* How many entries KERNELS_FIXED_DIMS has. */
+#define KERNELS_FIXED_COUNT 34
+
+
+/* Squared distances from a point to the block of centroids starting at 'values'. */
+KERNEL_BODY
+void
+scalar_block(const double *point,
+             const double *values,
+             size_t stride,
+             size_t dim,
+             double *acc)
+{
+    memset(acc, 0, sizeof(double) * KMEANS_BLOCK_WIDTH);
+
+    for (size_t d = 0; d < dim; ++d) {
+        const double *row = values + (d * stride);
+        const double p = point[d];
+
+        for (size_t j = 0; j < KMEANS_BLOCK_WIDTH; ++j) {
+            double delta = row[j] - p;
+            acc[j] += delta * delta;
+        }
+    }
+}
+
+
+KERNEL_BODY
+void
+block_distance_scalar(const double *point,
+                      const double *centroids_t,
+                      const size_t stride,
+                      const size_t dim,
+                      double *distances)
+{
+    for (size_t c = 0; c < stride; c += KMEANS_BLOCK_WIDTH)
+        scalar_block(point, centroids_t + c, stride, dim, distances + c);
+}
+
+
+KERNEL_BODY
+int
+block_nearest_scalar(const double *point,
+                     const double *centroids_t,
+                     const size_t stride,
+                     const size_t dim,
+                     double *nearest_distance)
+{
+    double acc[KMEANS_BLOCK_WIDTH];
+    double best = HUGE_VAL;
+    int nearest = 0;
+
+    for (size_t c = 0; c < stride; c += KMEANS_BLOCK_WIDTH) {
+        scalar_block(point, centroids_t + c, stride, dim, acc);
+
+        /* Written to compile into conditional moves rather than branches. */
+        for (size_t j = 0; j < KMEANS_BLOCK_WIDTH; ++j) {
+            int closer = acc[j] < best;
+
+            best = closer ? acc[j] : best;
+            nearest = closer ? (int)(c + j) : nearest;
+        }
+    }
+
+    if (nearest_distance) *nearest_distance = best;
+    return nearest;
+}
+
+
+KERNEL_BODY
+int
+block_nearest_f32_scalar(const float *point,
+                         const float *centroids_t,
+                         const size_t stride,
+                         const size_t dim,
+                         float *nearest_distance)
+{
+    float acc[KMEANS_BLOCK_WIDTH];
+    float best = HUGE_VALF;
+    int nearest = 0;
+
+    for (size_t c = 0; c < stride; c += KMEANS_BLOCK_WIDTH) {
+        memset(acc, 0, sizeof(acc));
+
+        for (size_t d = 0; d < dim; ++d) {
+            const float *row = centroids_t + (d * stride) + c;
+            const float p = point[d];
+
+            for (size_t j = 0; j < KMEANS_BLOCK_WIDTH; ++j) {
+                float delta = row[j] - p;
+                acc[j] += delta * delta;
+            }
+        }
+
+        for (size_t j = 0; j < KMEANS_BLOCK_WIDTH; ++j) {
+            int closer = acc[j] < best;
+
+            best = closer ? acc[j] : best;
+            nearest = closer ? (int)(c + j) : nearest;
+        }
+    }
+
+    if (nearest_distance) *nearest_distance = best;
+    return nearest;
+}
+
+
+KERNEL_BODY
+double
+pair_distance_scalar(const double *left,
+                     const double *right,
+                     const size_t dim)
+{
+    double acc = 0.0;
+
+    for (size_t d = 0; d < dim; ++d) {
+        double delta = right[d] - left[d];
+        acc += delta * delta;
+    }
+
+    return acc;
+}
+
+
+/* Tiles accumulate in a local array the compiler can keep in registers. */
+static
+void
+tile_dot_scalar(const double *points_p,
+                const double *panel,
+                const size_t depth,
+                double *scores,
+                const size_t ld)
+{
+    double acc[KMEANS_TILE_POINTS][KMEANS_BLOCK_WIDTH] = { { 0.0 } };
+
+    for (size_t d = 0; d < depth; ++d) {
+        const double *values = panel + (d * KMEANS_BLOCK_WIDTH);
+
+        for (size_t r = 0; r < KMEANS_TILE_POINTS; ++r) {
+            const double p = points_p[(d * KMEANS_TILE_POINTS) + r];
+
+            for (size_t j = 0; j < KMEANS_BLOCK_WIDTH; ++j)
+                acc[r][j] += p * values[j];
+        }
+    }
+
+    for (size_t r = 0; r < KMEANS_TILE_POINTS; ++r)
+        for (size_t j = 0; j < KMEANS_BLOCK_WIDTH; ++j)
+            scores[(r * ld) + j] += acc[r][j];
+}
+
+
+#ifdef KMEANS_KERNELS_X86
+
+/* The FMA block kernels round once per dimension, and so must this. */
+__attribute__((target("avx2,fma")))
+KERNEL_BODY
+double
+pair_distance_fma(const double *left,
+                  const double *right,
+                  const size_t dim)
+{
+    double acc = 0.0;
+
+    for (size_t d = 0; d < dim; ++d) {
+        double delta = right[d] - left[d];
+        acc = __builtin_fma(delta, delta, acc);
+    }
+
+    return acc;
+}
+
+
+/* SSE2: eight 2-lane accumulators per block. */
+__attribute__((target("sse2")))
+KERNEL_BODY
+void
+sse2_block(const double *point,
+           const double *values,
+           size_t stride,
+           size_t dim,
+           __m128d acc[8])
+{
+    for (int j = 0; j < 8; ++j) acc[j] = _mm_setzero_pd();
+
+    for (size_t d = 0; d < dim; ++d) {
+        const double *row = values + (d * stride);
+        const __m128d p = _mm_set1_pd(point[d]);
+
+        for (int j = 0; j < 8; ++j) {
+            __m128d delta = _mm_sub_pd(_mm_load_pd(row + (2 * j)), p);
+            acc[j] = _mm_add_pd(acc[j], _mm_mul_pd(delta, delta));
+        }
+    }
+}
+
+
+__attribute__((target("sse2")))
+KERNEL_BODY
+void
+block_distance_sse2(const double *point,
+                    const double *centroids_t,
+                    const size_t stride,
+                    const size_t dim,
+                    double *distances)
+{
+    __m128d acc[8];
+
+    for (size_t c = 0; c < stride; c += KMEANS_BLOCK_WIDTH) {
+        sse2_block(point, centroids_t + c, stride, dim, acc);
+
+        for (int j = 0; j < 8; ++j)
+            _mm_storeu_pd(distances + c + (2 * j), acc[j]);
+    }
+}
+
+
+/* SSE2 has no blend instruction, so the lane minimum is finished in scalar code. */
+__attribute__((target("sse2")))
+KERNEL_BODY
+int
+block_nearest_sse2(const double *point,
+                   const double *centroids_t,
+                   const size_t stride,
+                   const size_t dim,
+                   double *nearest_distance)
+{
+    __m128d acc[8];
+    double lanes[KMEANS_BLOCK_WIDTH];
+    double best = HUGE_VAL;
+    int nearest = 0;
+
+    for (size_t c = 0; c < stride; c += KMEANS_BLOCK_WIDTH) {
+        sse2_block(point, centroids_t + c, stride, dim, acc);
+
+        for (int j = 0; j < 8; ++j)
+            _mm_storeu_pd(lanes + (2 * j), acc[j]);
+
+        for (size_t j = 0; j < KMEANS_BLOCK_WIDTH; ++j) {
+            int closer = lanes[j] < best;
+
+            best = closer ? lanes[j] : best;
+            nearest = closer ? (int)(c + j) : nearest;
+        }
+    }
+
+    if (nearest_distance) *nearest_distance = best;
+    return nearest;
+}
+
+
+/* SSE2 single precision: four 4-lane accumulators per block. */
+__attribute__((target("sse2")))
+KERNEL_BODY
+int
+block_nearest_f32_sse2(const float *point,
+                       const float *centroids_t,
+                       const size_t stride,
+                       const size_t dim,
+                       float *nearest_distance)
+{
+    __m128 acc[4];
+    float lanes[KMEANS_BLOCK_WIDTH];
+    float best = HUGE_VALF;
+    int nearest = 0;
+
+    for (size_t c = 0; c < stride; c += KMEANS_BLOCK_WIDTH) {
+        for (int j = 0; j < 4; ++j) acc[j] = _mm_setzero_ps();
+
+        for (size_t d = 0; d < dim; ++d) {
+            const float *row = centroids_t + (d * stride) + c;
+            const __m128 p = _mm_set1_ps(point[d]);
+
+            for (int j = 0; j < 4; ++j) {
+                __m128 delta = _mm_sub_ps(_mm_load_ps(row + (4 * j)), p);
+                acc[j] = _mm_add_ps(acc[j], _mm_mul_ps(delta, delta));
+            }
+        }
+
+        for (int j = 0; j < 4; ++j)
+            _mm_storeu_ps(lanes + (4 * j), acc[j]);
+
+        for (size_t j = 0; j < KMEANS_BLOCK_WIDTH; ++j) {
+            int closer = lanes[j] < best;
+
+            best = closer ? lanes[j] : best;
+            nearest = closer ? (int)(c + j) : nearest;
+        }
+    }
+
+    if (nearest_distance) *nearest_distance = best;
+    return nearest;
+}
+
+
+/* AVX2: four 4-lane accumulators per block, using fused multiply-adds. */
+__attribute__((target("avx2,fma")))
+KERNEL_BODY
+void
+avx2_block(const double *point,
+           const double *values,
+           size_t stride,
+           size_t dim,
+           __m256d acc[4])
+{
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    __m256d acc2 = _mm256_setzero_pd(), acc3 = _mm256_setzero_pd();
+
+    for (size_t d = 0; d < dim; ++d) {
+        const double *row = values + (d * stride);
+        const __m256d p = _mm256_set1_pd(point[d]);
+        __m256d delta;
+
+        delta = _mm256_sub_pd(_mm256_load_pd(row + 0), p);
+        acc0 = _mm256_fmadd_pd(delta, delta, acc0);
+        delta = _mm256_sub_pd(_mm256_load_pd(row + 4), p);
+        acc1 = _mm256_fmadd_pd(delta, delta, acc1);
+        delta = _mm256_sub_pd(_mm256_load_pd(row + 8), p);
+        acc2 = _mm256_fmadd_pd(delta, delta, acc2);
+        delta = _mm256_sub_pd(_mm256_load_pd(row + 12), p);
+        acc3 = _mm256_fmadd_pd(delta, delta, acc3);
+    }
+
+    acc[0] = acc0;
+    acc[1] = acc1;
+    acc[2] = acc2;
+    acc[3] = acc3;
+}
+
+
+/* Keep the lexicographically smaller (distance, index) pair of each lane. */
+__attribute__((target("avx2,fma")))
+static inline
+void
+avx2_pair_min(__m256d *best,
+              __m256d *index,
+              __m256d other_best,
+              __m256d other_index)
+{
+    __m256d take = _mm256_or_pd(
+        _mm256_cmp_pd(other_best, *best, _CMP_LT_OQ),
+        _mm256_and_pd(_mm256_cmp_pd(other_best, *best, _CMP_EQ_OQ),
+                      _mm256_cmp_pd(other_index, *index, _CMP_LT_OQ)));
+
+    *best = _mm256_blendv_pd(*best, other_best, take);
+    *index = _mm256_blendv_pd(*index, other_index, take);
+}
+
+
+__attribute__((target("avx2,fma")))
+KERNEL_BODY
+void
+block_distance_avx2(const double *point,
+                    const double *centroids_t,
+                    const size_t stride,
+                    const size_t dim,
+                    double *distances)
+{
+    __m256d acc[4];
+
+    for (size_t c = 0; c < stride; c += KMEANS_BLOCK_WIDTH) {
+        avx2_block(point, centroids_t + c, stride, dim, acc);
+
+        for (int j = 0; j < 4; ++j)
+            _mm256_storeu_pd(distances + c + (4 * j), acc[j]);
+    }
+}
+
+
+__attribute__((target("avx2,fma")))
+KERNEL_BODY
+int
+block_nearest_avx2(const double *point,
+                   const double *centroids_t,
+                   const size_t stride,
+                   const size_t dim,
+                   double *nearest_distance)
+{
+    __m256d acc[4], best[4], index[4], lane[4];
+    const __m256d step = _mm256_set1_pd(KMEANS_BLOCK_WIDTH);
+
+    for (int j = 0; j < 4; ++j) {
+        best[j] = _mm256_set1_pd(HUGE_VAL);
+        lane[j] = _mm256_setr_pd(4 * j, (4 * j) + 1, (4 * j) + 2, (4 * j) + 3);
+        index[j] = lane[j];
+    }
+
+    for (size_t c = 0; c < stride; c += KMEANS_BLOCK_WIDTH) {
+        avx2_block(point, centroids_t + c, stride, dim, acc);
+
+        /* Strictly closer only, so earlier blocks win ties within a lane. */
+        for (int j = 0; j < 4; ++j) {
+            __m256d closer = _mm256_cmp_pd(acc[j], best[j], _CMP_LT_OQ);
+
+            best[j] = _mm256_blendv_pd(best[j], acc[j], closer);
+            index[j] = _mm256_blendv_pd(index[j], lane[j], closer);
+            lane[j] = _mm256_add_pd(lane[j], step);
+        }
+    }
+
+    /* Fold the accumulators together, then the lanes of the last one. */
+    avx2_pair_min(&best[0], &index[0], best[1], index[1]);
+    avx2_pair_min(&best[2], &index[2], best[3], index[3]);
+    avx2_pair_min(&best[0], &index[0], best[2], index[2]);
+
+    avx2_pair_min(&best[0], &index[0],
+                  _mm256_permute2f128_pd(best[0], best[0], 0x01),
+                  _mm256_permute2f128_pd(index[0], index[0], 0x01));
+    avx2_pair_min(&best[0], &index[0],
+                  _mm256_permute_pd(best[0], 0x5),
+                  _mm256_permute_pd(index[0], 0x5));
+
+    if (nearest_distance) *nearest_distance = _mm256_cvtsd_f64(best[0]);
+    return (int)_mm256_cvtsd_f64(index[0]);
+}
+
+
+/* Keep the lexicographically smaller (distance, index) pair of each lane. */
+__attribute__((target("avx2,fma")))
+static inline
+void
+avx2_pair_min_ps(__m256 *best,
+                 __m256 *index,
+                 __m256 other_best,
+                 __m256 other_index)
+{
+    __m256 take = _mm256_or_ps(
+        _mm256_cmp_ps(other_best, *best, _CMP_LT_OQ),
+        _mm256_and_ps(_mm256_cmp_ps(other_best, *best, _CMP_EQ_OQ),
+                      _mm256_cmp_ps(other_index, *index, _CMP_LT_OQ)));
+
+    *best = _mm256_blendv_ps(*best, other_best, take);
+    *index = _mm256_blendv_ps(*index, other_index, take);
+}
+
+
+/*
+ * AVX2 single precision: two 8-lane accumulators per block. Cluster indices
+ *  are carried as floats, which hold every index below 2^24 exactly.
+ */
+__attribute__((target("avx2,fma")))
+KERNEL_BODY
+int
+block_nearest_f32_avx2(const float *point,
+                       const float *centroids_t,
+                       const size_t stride,
+                       const size_t dim,
+                       float *nearest_distance)
+{
+    __m256 best0 = _mm256_set1_ps(HUGE_VALF), best1 = best0;
+    __m256 lane0 = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 lane1 = _mm256_setr_ps(8, 9, 10, 11, 12, 13, 14, 15);
+    __m256 index0 = lane0, index1 = lane1;
+    const __m256 step = _mm256_set1_ps(KMEANS_BLOCK_WIDTH);
+
+    for (size_t c = 0; c < stride; c += KMEANS_BLOCK_WIDTH) {
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+
+        for (size_t d = 0; d < dim; ++d) {
+            const float *row = centroids_t + (d * stride) + c;
+            const __m256 p = _mm256_set1_ps(point[d]);
+            __m256 delta;
+
+            delta = _mm256_sub_ps(_mm256_load_ps(row + 0), p);
+            acc0 = _mm256_fmadd_ps(delta, delta, acc0);
+            delta = _mm256_sub_ps(_mm256_load_ps(row + 8), p);
+            acc1 = _mm256_fmadd_ps(delta, delta, acc1);
+        }
+
+        /* Strictly closer only, so earlier blocks win ties within a lane. */
+        __m256 closer0 = _mm256_cmp_ps(acc0, best0, _CMP_LT_OQ);
+        __m256 closer1 = _mm256_cmp_ps(acc1, best1, _CMP_LT_OQ);
+
+        best0 = _mm256_blendv_ps(best0, acc0, closer0);
+        index0 = _mm256_blendv_ps(index0, lane0, closer0);
+        best1 = _mm256_blendv_ps(best1, acc1, closer1);
+        index1 = _mm256_blendv_ps(index1, lane1, closer1);
+
+        lane0 = _mm256_add_ps(lane0, step);
+        lane1 = _mm256_add_ps(lane1, step);
+    }
+
+    /* Fold the accumulators together, then halve the lanes until one is left. */
+    avx2_pair_min_ps(&best0, &index0, best1, index1);
+    avx2_pair_min_ps(&best0, &index0,
+                     _mm256_permute2f128_ps(best0, best0, 0x01),
+                     _mm256_permute2f128_ps(index0, index0, 0x01));
+    avx2_pair_min_ps(&best0, &index0,
+                     _mm256_permute_ps(best0, 0x4E),
+                     _mm256_permute_ps(index0, 0x4E));
+    avx2_pair_min_ps(&best0, &index0,
+                     _mm256_permute_ps(best0, 0xB1),
+                     _mm256_permute_ps(index0, 0xB1));
+
+    if (nearest_distance) *nearest_distance = _mm256_cvtss_f32(best0);
+    return (int)_mm256_cvtss_f32(index0);
+}
+
+
+/* AVX-512: two 8-lane accumulators per block, using fused multiply-adds. */
+__attribute__((target("avx512f")))
+KERNEL_BODY
+void
+avx512_block(const double *point,
+             const double *values,
+             size_t stride,
+             size_t dim,
+             __m512d *out0,
+             __m512d *out1)
+{
+    __m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+
+    for (size_t d = 0; d < dim; ++d) {
+        const double *row = values + (d * stride);
+        const __m512d p = _mm512_set1_pd(point[d]);
+        __m512d delta;
+
+        delta = _mm512_sub_pd(_mm512_load_pd(row + 0), p);
+        acc0 = _mm512_fmadd_pd(delta, delta, acc0);
+        delta = _mm512_sub_pd(_mm512_load_pd(row + 8), p);
+        acc1 = _mm512_fmadd_pd(delta, delta, acc1);
+    }
+
+    *out0 = acc0;
+    *out1 = acc1;
+}
+
+
+/* Keep the lexicographically smaller (distance, index) pair of each lane. */
+__attribute__((target("avx512f")))
+static inline
+void
+avx512_pair_min(__m512d *best,
+                __m512d *index,
+                __m512d other_best,
+                __m512d other_index)
+{
+    __mmask8 take =
+        _mm512_cmp_pd_mask(other_best, *best, _CMP_LT_OQ)
+        | (_mm512_cmp_pd_mask(other_best, *best, _CMP_EQ_OQ)
+           & _mm512_cmp_pd_mask(other_index, *index, _CMP_LT_OQ));
+
+    *best = _mm512_mask_blend_pd(take, *best, other_best);
+    *index = _mm512_mask_blend_pd(take, *index, other_index);
+}
+
+
+__attribute__((target("avx512f")))
+KERNEL_BODY
+void
+block_distance_avx512(const double *point,
+                      const double *centroids_t,
+                      const size_t stride,
+                      const size_t dim,
+                      double *distances)
+{
+    __m512d acc0, acc1;
+
+    for (size_t c = 0; c < stride; c += KMEANS_BLOCK_WIDTH) {
+        avx512_block(point, centroids_t + c, stride, dim, &acc0, &acc1);
+
+        _mm512_storeu_pd(distances + c + 0, acc0);
+        _mm512_storeu_pd(distances + c + 8, acc1);
+    }
+}
+
+
+__attribute__((target("avx512f")))
+KERNEL_BODY
+int
+block_nearest_avx512(const double *point,
+                     const double *centroids_t,
+                     const size_t stride,
+                     const size_t dim,
+                     double *nearest_distance)
+{
+    __m512d acc0, acc1;
+    __m512d best0 = _mm512_set1_pd(HUGE_VAL), best1 = best0;
+    __m512d lane0 = _mm512_setr_pd(0, 1, 2, 3, 4, 5, 6, 7);
+    __m512d lane1 = _mm512_setr_pd(8, 9, 10, 11, 12, 13, 14, 15);
+    __m512d index0 = lane0, index1 = lane1;
+    const __m512d step = _mm512_set1_pd(KMEANS_BLOCK_WIDTH);
+
+    for (size_t c = 0; c < stride; c += KMEANS_BLOCK_WIDTH) {
+        avx512_block(point, centroids_t + c, stride, dim, &acc0, &acc1);
+
+        /* Strictly closer only, so earlier blocks win ties within a lane. */
+        __mmask8 closer0 = _mm512_cmp_pd_mask(acc0, best0, _CMP_LT_OQ);
+        __mmask8 closer1 = _mm512_cmp_pd_mask(acc1, best1, _CMP_LT_OQ);
+
+        best0 = _mm512_mask_blend_pd(closer0, best0, acc0);
+        index0 = _mm512_mask_blend_pd(closer0, index0, lane0);
+        best1 = _mm512_mask_blend_pd(closer1, best1, acc1);
+        index1 = _mm512_mask_blend_pd(closer1, index1, lane1);
+
+        lane0 = _mm512_add_pd(lane0, step);
+        lane1 = _mm512_add_pd(lane1, step);
+    }
+
+    /* Fold the accumulators together, then halve the lanes until one is left. */
+    avx512_pair_min(&best0, &index0, best1, index1);
+    avx512_pair_min(&best0, &index0,
+                    _mm512_shuffle_f64x2(best0, best0, 0x4E),
+                    _mm512_shuffle_f64x2(index0, index0, 0x4E));
+    avx512_pair_min(&best0, &index0,
+                    _mm512_shuffle_f64x2(best0, best0, 0xB1),
+                    _mm512_shuffle_f64x2(index0, index0, 0xB1));
+    avx512_pair_min(&best0, &index0,
+                    _mm512_permute_pd(best0, 0x55),
+                    _mm512_permute_pd(index0, 0x55));
+
+    if (nearest_distance) *nearest_distance = _mm512_cvtsd_f64(best0);
+    return (int)_mm512_cvtsd_f64(index0);
+}
+
+
+
+/* Keep the lexicographically smaller (distance, index) pair of each lane. */
+__attribute__((target("avx512f")))
+static inline
+void
+avx512_pair_min_ps(__m512 *best,
+                   __m512 *index,
+                   __m512 other_best,
+                   __m512 other_index)
+{
+    __mmask16 take =
+        _mm512_cmp_ps_mask(other_best, *best, _CMP_LT_OQ)
+        | (_mm512_cmp_ps_mask(other_best, *best, _CMP_EQ_OQ)
+           & _mm512_cmp_ps_mask(other_index, *index, _CMP_LT_OQ));
+
+    *best = _mm512_mask_blend_ps(take, *best, other_best);
+    *index = _mm512_mask_blend_ps(take, *index, other_index);
+}
+
+
+/* AVX-512 single precision: one 16-lane accumulator per block. */
+__attribute__((target("avx512f")))
+KERNEL_BODY
+int
+block_nearest_f32_avx512(const float *point,
+                         const float *centroids_t,
+                         const size_t stride,
+                         const size_t dim,
+                         float *nearest_distance)
+{
+    __m512 best = _mm512_set1_ps(HUGE_VALF);
+    __m512 lane = _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7,
+                                 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512 index = lane;
+    const __m512 step = _mm512_set1_ps(KMEANS_BLOCK_WIDTH);
+
+    for (size_t c = 0; c < stride; c += KMEANS_BLOCK_WIDTH) {
+        __m512 acc = _mm512_setzero_ps();
+
+        for (size_t d = 0; d < dim; ++d) {
+            __m512 delta = _mm512_sub_ps(
+                _mm512_load_ps(centroids_t + (d * stride) + c),
+                _mm512_set1_ps(point[d]));
+            acc = _mm512_fmadd_ps(delta, delta, acc);
+        }
+
+        /* Strictly closer only, so earlier blocks win ties within a lane. */
+        __mmask16 closer = _mm512_cmp_ps_mask(acc, best, _CMP_LT_OQ);
+
+        best = _mm512_mask_blend_ps(closer, best, acc);
+        index = _mm512_mask_blend_ps(closer, index, lane);
+        lane = _mm512_add_ps(lane, step);
+    }
+
+    /* Halve the lanes until one is left. */
+    avx512_pair_min_ps(&best, &index,
+                       _mm512_shuffle_f32x4(best, best, 0x4E),
+                       _mm512_shuffle_f32x4(index, index, 0x4E));
+    avx512_pair_min_ps(&best, &index,
+                       _mm512_shuffle_f32x4(best, best, 0xB1),
+                       _mm512_shuffle_f32x4(index, index, 0xB1));
+    avx512_pair_min_ps(&best, &index,
+                       _mm512_permute_ps(best, 0x4E),
+                       _mm512_permute_ps(index, 0x4E));
+    avx512_pair_min_ps(&best, &index,
+                       _mm512_permute_ps(best, 0xB1),
+                       _mm512_permute_ps(index, 0xB1));
+
+    if (nearest_distance) *nearest_distance = _mm512_cvtss_f32(best);
+    return (int)_mm512_cvtss_f32(index);
+}
+
+
+/*
+ * SSE2 tiles: a quarter of the centroids at a time, in eight 2-lane
+ *  accumulators, since a whole tile would not fit in sixteen registers.
+ */
+__attribute__((target("sse2")))
+static
+void
+tile_dot_sse2(const double *points_p,
+              const double *panel,
+              const size_t depth,
+              double *scores,
+              const size_t ld)
+{
+    for (size_t q = 0; q < KMEANS_BLOCK_WIDTH; q += 4) {
+        __m128d acc[KMEANS_TILE_POINTS][2];
+
+        for (int r = 0; r < KMEANS_TILE_POINTS; ++r)
+            acc[r][0] = acc[r][1] = _mm_setzero_pd();
+
+        for (size_t d = 0; d < depth; ++d) {
+            const double *values = panel + (d * KMEANS_BLOCK_WIDTH) + q;
+            const __m128d b0 = _mm_load_pd(values);
+            const __m128d b1 = _mm_load_pd(values + 2);
+
+            for (int r = 0; r < KMEANS_TILE_POINTS; ++r) {
+                const __m128d p = _mm_set1_pd(points_p[(d * KMEANS_TILE_POINTS) + r]);
+
+                acc[r][0] = _mm_add_pd(acc[r][0], _mm_mul_pd(p, b0));
+                acc[r][1] = _mm_add_pd(acc[r][1], _mm_mul_pd(p, b1));
+            }
+        }
+
+        for (int r = 0; r < KMEANS_TILE_POINTS; ++r) {
+            double *out = scores + (r * ld) + q;
+
+            _mm_storeu_pd(out, _mm_add_pd(_mm_loadu_pd(out), acc[r][0]));
+            _mm_storeu_pd(out + 2, _mm_add_pd(_mm_loadu_pd(out + 2), acc[r][1]));
+        }
+    }
+}
+
+
+/* AVX2 tiles: half of the centroids at a time, in eight 4-lane accumulators. */
+__attribute__((target("avx2,fma")))
+static
+void
+tile_dot_avx2(const double *points_p,
+              const double *panel,
+              const size_t depth,
+              double *scores,
+              const size_t ld)
+{
+    for (size_t h = 0; h < KMEANS_BLOCK_WIDTH; h += 8) {
+        __m256d acc[KMEANS_TILE_POINTS][2];
+
+        for (int r = 0; r < KMEANS_TILE_POINTS; ++r)
+            acc[r][0] = acc[r][1] = _mm256_setzero_pd();
+
+        for (size_t d = 0; d < depth; ++d) {
+            const double *values = panel + (d * KMEANS_BLOCK_WIDTH) + h;
+            const __m256d b0 = _mm256_load_pd(values);
+            const __m256d b1 = _mm256_load_pd(values + 4);
+
+            for (int r = 0; r < KMEANS_TILE_POINTS; ++r) {
+                const __m256d p =
+                    _mm256_broadcast_sd(points_p + (d * KMEANS_TILE_POINTS) + r);
+
+                acc[r][0] = _mm256_fmadd_pd(p, b0, acc[r][0]);
+                acc[r][1] = _mm256_fmadd_pd(p, b1, acc[r][1]);
+            }
+        }
+
+        for (int r = 0; r < KMEANS_TILE_POINTS; ++r) {
+            double *out = scores + (r * ld) + h;
+
+            _mm256_storeu_pd(out, _mm256_add_pd(_mm256_loadu_pd(out), acc[r][0]));
+            _mm256_storeu_pd(out + 4,
+                             _mm256_add_pd(_mm256_loadu_pd(out + 4), acc[r][1]));
+        }
+    }
+}
+
+
+/* AVX-512 tiles: all of the centroids at once, in eight 8-lane accumulators. */
+__attribute__((target("avx512f")))
+static
+void
+tile_dot_avx512(const double *points_p,
+                const double *panel,
+                const size_t depth,
+                double *scores,
+                const size_t ld)
+{
+    __m512d acc[KMEANS_TILE_POINTS][2];
+
+    for (int r = 0; r < KMEANS_TILE_POINTS; ++r)
+        acc[r][0] = acc[r][1] = _mm512_setzero_pd();
+
+    for (size_t d = 0; d < depth; ++d) {
+        const double *values = panel + (d * KMEANS_BLOCK_WIDTH);
+        const __m512d b0 = _mm512_load_pd(values);
+        const __m512d b1 = _mm512_load_pd(values + 8);
+
+        for (int r = 0; r < KMEANS_TILE_POINTS; ++r) {
+            const __m512d p = _mm512_set1_pd(points_p[(d * KMEANS_TILE_POINTS) + r]);
+
+            acc[r][0] = _mm512_fmadd_pd(p, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_pd(p, b1, acc[r][1]);
+        }
+    }
+
+    for (int r = 0; r < KMEANS_TILE_POINTS; ++r) {
+        double *out = scores + (r * ld);
+
+        _mm512_storeu_pd(out, _mm512_add_pd(_mm512_loadu_pd(out), acc[r][0]));
+        _mm512_storeu_pd(out + 8, _mm512_add_pd(_mm512_loadu_pd(out + 8), acc[r][1]));
+    }
+}
+
+#endif   /* KMEANS_KERNELS_X86 */
+
+
+/*
+ * Wrappers running the block kernels of one instruction set with a constant
+ *  dimensionality. Every loop over the dimensions then has a known trip count,
+ *  so the compiler unrolls it and keeps the point's values in registers.
+ */
+#define KERNELS_SPECIALIZE(attributes, isa, D)                                \
+    attributes static void                                                    \
+    block_distance_##isa##_d##D(const double *point,                          \
+                                const double *centroids_t,                    \
+                                const size_t stride,                          \
+                                const size_t dim,                             \
+                                double *distances)                            \
+    {                                                                         \
+        block_distance_##isa(point, centroids_t, stride, D, distances);       \
+    }                                                                         \
+                                                                              \
+    attributes static int                                                     \
+    block_nearest_##isa##_d##D(const double *point,                           \
+                               const double *centroids_t,                     \
+                               const size_t stride,                           \
+                               const size_t dim,                              \
+                               double *nearest_distance)                      \
+    {                                                                         \
+        return block_nearest_##isa(point, centroids_t, stride, D,             \
+                                   nearest_distance);                         \
+    }                                                                         \
+                                                                              \
+    attributes static int                                                     \
+    block_nearest_f32_##isa##_d##D(const float *point,                        \
+                                   const float *centroids_t,                  \
+                                   const size_t stride,                       \
+                                   const size_t dim,                          \
+                                   float *nearest_distance)                   \
+    {                                                                         \
+        return block_nearest_f32_##isa(point, centroids_t, stride, D,         \
+                                       nearest_distance);                     \
+    }
+
+/* The same for the pair kernels, which are shared between instruction sets. */
+#define KERNELS_SPECIALIZE_PAIR(attributes, pair, D)                          \
+    attributes static double                                                  \
+    pair_distance_##pair##_d##D(const double *left,                           \
+                                const double *right,                          \
+                                const size_t dim)                             \
+    {                                                                         \
+        return pair_distance_##pair(left, right, D);                          \
+    }
+
+/* One table entry of specialized kernels. */
+#define KERNELS_ENTRY(id, isa, pair, D)                                       \
+    { id, block_distance_##isa##_d##D, block_nearest_##isa##_d##D,            \
+      pair_distance_##pair##_d##D, block_nearest_f32_##isa##_d##D,           \
+      tile_dot_##isa },
+
+KERNELS_FIXED_DIMS(KERNELS_SPECIALIZE, , scalar)
+KERNELS_FIXED_DIMS(KERNELS_SPECIALIZE_PAIR, , scalar)
+
+static const kmeans_kernels kernels_scalar_fixed[KERNELS_FIXED_COUNT] = {
+    KERNELS_FIXED_DIMS(KERNELS_ENTRY, KMEANS_ISA_SCALAR, scalar, scalar)
+};
+
+#ifdef KMEANS_KERNELS_X86
+KERNELS_FIXED_DIMS(KERNELS_SPECIALIZE, __attribute__((target("sse2"))), sse2)
+KERNELS_FIXED_DIMS(KERNELS_SPECIALIZE, __attribute__((target("avx2,fma"))), avx2)
+KERNELS_FIXED_DIMS(KERNELS_SPECIALIZE, __attribute__((target("avx512f"))), avx512)
+KERNELS_FIXED_DIMS(KERNELS_SPECIALIZE_PAIR, __attribute__((target("avx2,fma"))), fma)
+
+static const kmeans_kernels kernels_sse2_fixed[KERNELS_FIXED_COUNT] = {
+    KERNELS_FIXED_DIMS(KERNELS_ENTRY, KMEANS_ISA_SSE2, sse2, scalar)
+};
+
+static const kmeans_kernels kernels_avx2_fixed[KERNELS_FIXED_COUNT] = {
+    KERNELS_FIXED_DIMS(KERNELS_ENTRY, KMEANS_ISA_AVX2, avx2, fma)
+};
+
+static const kmeans_kernels kernels_avx512_fixed[KERNELS_FIXED_COUNT] = {
+    KERNELS_FIXED_DIMS(KERNELS_ENTRY, KMEANS_ISA_AVX512, avx512, fma)
+};
+#endif
+
+
+static const kmeans_kernels kernels_scalar = {
+    KMEANS_ISA_SCALAR, block_distance_scalar, block_nearest_scalar,
+    pair_distance_scalar, block_nearest_f32_scalar, tile_dot_scalar
+};
+
+#ifdef KMEANS_KERNELS_X86
+static const kmeans_kernels kernels_sse2 = {
+    KMEANS_ISA_SSE2, block_distance_sse2, block_nearest_sse2,
+    pair_distance_scalar, block_nearest_f32_sse2, tile_dot_sse2
+};
+
+static const kmeans_kernels kernels_avx2 = {
+    KMEANS_ISA_AVX2, block_distance_avx2, block_nearest_avx2,
+    pair_distance_fma, block_nearest_f32_avx2, tile_dot_avx2
+};
+
+static const kmeans_kernels kernels_avx512 = {
+    KMEANS_ISA_AVX512, block_distance_avx512, block_nearest_avx512,
+    pair_distance_fma, block_nearest_f32_avx512, tile_dot_avx512
+};
+#endif
+
+/* The kernels chosen for this process, and their specializations, resolved once. */
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static const kmeans_kernels *kernels_selected = &kernels_scalar;
+static const kmeans_kernels *kernels_selected_fixed = kernels_scalar_fixed;
+
+static const char *const isa_names[] = {
+    [KMEANS_ISA_SCALAR] = "scalar",
+    [KMEANS_ISA_SSE2] = "sse2",
+    [KMEANS_ISA_AVX2] = "avx2",
+    [KMEANS_ISA_AVX512] = "avx512",
+};
+
+
+static
+void
+kernels_select(void)
+{
+    kmeans_isa limit = KMEANS_ISA_AVX512;
+    const char *requested = getenv("KMEANS_ISA");
+
+    if (requested) {
+        for (int isa = KMEANS_ISA_SCALAR; isa <= KMEANS_ISA_AVX512; ++isa)
+            if (0 == strcasecmp(requested, isa_names[isa])) limit = isa;
+    }
+
+#ifdef KMEANS_KERNELS_X86
+    __builtin_cpu_init();
+
+    if (limit >= KMEANS_ISA_AVX512 && __builtin_cpu_supports("avx512f")) {
+        kernels_selected = &kernels_avx512;
+        kernels_selected_fixed = kernels_avx512_fixed;
+    } else if (limit >= KMEANS_ISA_AVX2
+               && __builtin_cpu_supports("avx2")
+               && __builtin_cpu_supports("fma")) {
+        kernels_selected = &kernels_avx2;
+        kernels_selected_fixed = kernels_avx2_fixed;
+    } else if (limit >= KMEANS_ISA_SSE2 && __builtin_cpu_supports("sse2")) {
+        kernels_selected = &kernels_sse2;
+        kernels_selected_fixed = kernels_sse2_fixed;
+    }
+#else
+    (void)limit;
+#endif
+}
+
+
+const kmeans_kernels *
+kmeans_kernels_get(void)
+{
+    pthread_once(&kernels_once, kernels_select);
+    return kernels_selected;
+}
+
+
+const kmeans_kernels *
+kmeans_kernels_for(size_t dim)
+{
+    pthread_once(&kernels_once, kernels_select);
+
+    if (dim >= 1 && dim <= 32) return &kernels_selected_fixed[dim - 1];
+    if (64 == dim) return &kernels_selected_fixed[32];
+    if (128 == dim) return &kernels_selected_fixed[33];
+
+    return kernels_selected;
+}
+
+
+const char *
+kmeans_isa_name(kmeans_isa isa)
+{
+    if (isa < KMEANS_ISA_SCALAR || isa > KMEANS_ISA_AVX512) return "unknown";
+    return isa_names[isa];
+}
+
+
+double *
+kmeans_block_alloc(size_t num_centroids,
+                   size_t dim)
+{
+    void *block = NULL;
+    const size_t stride = kmeans_block_stride(num_centroids);
+
+    if (0 != posix_memalign(&block, 64, sizeof(double) * stride * dim))
+        return NULL;
+
+    /* Padding centroids are infinitely far away from every point. */
+    double *centroids_t = (double *)block;
+    for (size_t i = 0; i < stride * dim; ++i)
+        centroids_t[i] = HUGE_VAL;
+
+    return centroids_t;
+}
+
+
+void
+kmeans_block_transpose(const double *centroids,
+                       size_t num_centroids,
+                       size_t dim,
+                       double *centroids_t)
+{
+    const size_t stride = kmeans_block_stride(num_centroids);
+
+    for (size_t c = 0; c < num_centroids; ++c)
+        for (size_t d = 0; d < dim; ++d)
+            centroids_t[(d * stride) + c] = centroids[(c * dim) + d];
+}
+
+
+void
+kmeans_block_tile(const double *centroids,
+                  const int *order,
+                  size_t num_centroids,
+                  size_t dim,
+                  double *tiles)
+{
+    for (size_t j = 0; j < num_centroids; ++j) {
+        const size_t c = order ? (size_t)order[j] : j;
+        const size_t lane = j % KMEANS_BLOCK_WIDTH;
+        double *tile = tiles + ((j - lane) * dim);
+
+        for (size_t d = 0; d < dim; ++d)
+            tile[(d * KMEANS_BLOCK_WIDTH) + lane] = centroids[(c * dim) + d];
+    }
+}
+
+
+float *
+kmeans_block_alloc_f32(size_t num_centroids,
+                       size_t dim)
+{
+    void *block = NULL;
+    const size_t stride = kmeans_block_stride(num_centroids);
+
+    if (0 != posix_memalign(&block, 64, sizeof(float) * stride * dim))
+        return NULL;
+
+    float *centroids_t = (float *)block;
+    for (size_t i = 0; i < stride * dim; ++i)
+        centroids_t[i] = HUGE_VALF;
+
+    return centroids_t;
+}
+
+
+void
+kmeans_block_transpose_f32(const double *centroids,
+                           size_t num_centroids,
+                           size_t dim,
+                           float *centroids_t)
+{
+    const size_t stride = kmeans_block_stride(num_centroids);
+
+    for (size_t c = 0; c < num_centroids; ++c)
+        for (size_t d = 0; d < dim; ++d)
+            centroids_t[(d * stride) + c] = (float)centroids[(c * dim) + d];
+}
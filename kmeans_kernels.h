@@ -0,0 +1,208 @@
+/*
+ * kmeans_kernels.h
+ *
+ * Vectorized squared-euclidean distance kernels, selected at runtime for the
+ *  instruction sets supported by the running CPU.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_KERNELS_H
+#define CIS579_TERMPROJECT_KMEANS_KERNELS_H
+
+#include <stdlib.h>
+
+#include "kmeans.h"
+
+
+/*
+ * Centroid blocks are padded to a multiple of this many centroids, so every
+ *  kernel can process whole vectors without a remainder loop.
+ */
+#define KMEANS_BLOCK_WIDTH 16
+
+/* Points per tile of the dot product kernels. */
+#define KMEANS_TILE_POINTS 4
+
+
+/* Instruction sets with a dedicated kernel, from least to most capable. */
+typedef enum
+{
+    KMEANS_ISA_SCALAR = 0,
+    KMEANS_ISA_SSE2,
+    KMEANS_ISA_AVX2,
+    KMEANS_ISA_AVX512
+} kmeans_isa;
+
+
+/*
+ * Kernels work on a transposed block of centroids: value 'd' of centroid 'c'
+ *  lives at centroids_t[(d * stride) + c], where the stride is the padded size
+ *  returned by kmeans_block_stride(). Padding centroids sit at infinity, so
+ *  they never win a comparison.
+ */
+
+/* Prototypical kernel for the squared distances from one point to all centroids. */
+typedef void (*func_block_distance_t) (
+    const double *point       IN,
+    const double *centroids_t IN,
+    const size_t  stride      IN,
+    const size_t  dim         IN,
+    double       *distances   OUT   /* 'stride' values */
+);
+
+/*
+ * Prototypical kernel for the nearest of all centroids to a point. The search
+ *  stays in vector registers, and ties go to the lowest cluster index like
+ *  the scalar loops.
+ */
+typedef int (*func_block_nearest_t) (
+    const double *point            IN,
+    const double *centroids_t      IN,
+    const size_t  stride           IN,
+    const size_t  dim              IN,
+    double       *nearest_distance OUT   /* optional */
+);
+
+/*
+ * Single precision variant of the nearest-centroid kernel, for data stored as
+ *  float. Each vector holds twice the lanes of the double kernels.
+ */
+typedef int (*func_block_nearest_f32_t) (
+    const float  *point            IN,
+    const float  *centroids_t      IN,
+    const size_t  stride           IN,
+    const size_t  dim              IN,
+    float        *nearest_distance OUT   /* optional */
+);
+
+/*
+ * Prototypical kernel for the squared distance between two rows. It performs
+ *  exactly the same arithmetic as one lane of the block kernels of its set,
+ *  so results from either can be compared against each other.
+ */
+typedef double (*func_pair_distance_t) (
+    const double *left  IN,
+    const double *right IN,
+    const size_t  dim   IN
+);
+
+/*
+ * Prototypical kernel for one tile of a matrix product: adds the dot product
+ *  of point 'r' and centroid 'j' over 'depth' dimensions to scores[(r * ld) +
+ *  j], for KMEANS_TILE_POINTS points and KMEANS_BLOCK_WIDTH centroids. Both
+ *  operands are packed, one dimension after the other: value 'd' of point 'r'
+ *  at points_p[(d * KMEANS_TILE_POINTS) + r], and of centroid 'j' at
+ *  panel[(d * KMEANS_BLOCK_WIDTH) + j], 64-byte aligned. The whole tile stays
+ *  in vector registers until it is added to the scores.
+ */
+typedef void (*func_tile_dot_t) (
+    const double *points_p IN,
+    const double *panel    IN,
+    const size_t  depth    IN,
+    double       *scores   IN OUT,
+    const size_t  ld       IN
+);
+
+/* One set of kernels for a specific instruction set. */
+typedef struct
+{
+    kmeans_isa isa;
+    func_block_distance_t distances;
+    func_block_nearest_t nearest;
+    func_pair_distance_t pair;
+    func_block_nearest_f32_t nearest_f32;
+    func_tile_dot_t tile;
+} kmeans_kernels;
+
+
+/*
+ * Get the kernels for the best instruction set of this CPU. Detection runs
+ *  once; setting the KMEANS_ISA environment variable to scalar, sse2, avx2
+ *  or avx512 caps the selection, which is useful for comparisons.
+ */
+const kmeans_kernels *
+kmeans_kernels_get(void);
+
+/*
+ * Get the same kernels specialized for 'dim', when it is one of 1-32, 64 or
+ *  128. Their loops over the dimensions are unrolled at compile time, and
+ *  they ignore the dim argument they are passed. Any other dimensionality
+ *  gets the generic kernels. Results are identical either way.
+ */
+const kmeans_kernels *
+kmeans_kernels_for(
+    size_t dim IN
+);
+
+/* Get a printable name for an instruction set. */
+const char *
+kmeans_isa_name(
+    kmeans_isa isa IN
+);
+
+
+/* Get the padded amount of centroids stored per transposed dimension. */
+static inline
+size_t
+kmeans_block_stride(size_t num_centroids)
+{
+    return (num_centroids + KMEANS_BLOCK_WIDTH - 1)
+        & ~((size_t)KMEANS_BLOCK_WIDTH - 1);
+}
+
+/*
+ * Allocate a 64-byte aligned transposed centroid block for 'num_centroids'
+ *  centroids of 'dim' values, with the padding already in place. Free with
+ *  free().
+ */
+double *
+kmeans_block_alloc(
+    size_t num_centroids IN,
+    size_t dim           IN
+);
+
+/* Copy a row-major matrix of centroids into a transposed centroid block. */
+void
+kmeans_block_transpose(
+    const double *centroids     IN,
+    size_t        num_centroids IN,
+    size_t        dim           IN,
+    double       *centroids_t   OUT
+);
+
+/*
+ * Copy centroids into consecutive transposed tiles of KMEANS_BLOCK_WIDTH
+ *  centroids, each of which the block kernels can measure on its own with a
+ *  stride of KMEANS_BLOCK_WIDTH. Centroid order[j], or j when 'order' is NULL,
+ *  goes to lane j % KMEANS_BLOCK_WIDTH of tile j / KMEANS_BLOCK_WIDTH. The
+ *  space comes from kmeans_block_alloc(), whose padding lanes are left alone.
+ */
+void
+kmeans_block_tile(
+    const double *centroids     IN,
+    const int    *order         IN,   /* optional */
+    size_t        num_centroids IN,
+    size_t        dim           IN,
+    double       *tiles         OUT
+);
+
+
+/*
+ * Single precision counterparts of kmeans_block_alloc() and
+ *  kmeans_block_transpose().
+ */
+float *
+kmeans_block_alloc_f32(
+    size_t num_centroids IN,
+    size_t dim           IN
+);
+
+void
+kmeans_block_transpose_f32(
+    const double *centroids     IN,
+    size_t        num_centroids IN,
+    size_t        dim           IN,
+    float        *centroids_t   OUT
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_KERNELS_H */
@@ -0,0 +1,727 @@
+/*
+ * kmeans_model.c
+ *
+ * Implementation of trained models. A model lives in one image laid out
+ *  exactly like its file: a header, then 64-byte aligned sections for the
+ *  centroids, their kernel block, and the optional k-d tree. Building a model
+ *  fills an image in memory, saving writes it out, and opening maps it back.
+ */
+
+#include "kmeans_model.h"
+#include "kmeans_kernels.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* Written as-is, so a reader on a host of the other byte order can tell. */
+#define MODEL_BYTE_ORDER 0x01020304
+
+/* Alignment of every section within the image. */
+#define MODEL_ALIGNMENT 64
+
+/*
+ * The k-d tree only pays off while a few leaves hold the answer, which stops
+ *  being true as dimensions grow. One vectorized pass over all centroids wins
+ *  until there are about this many of them per dimension.
+ */
+#define MODEL_TREE_MAX_DIM 8
+#define MODEL_TREE_MIN_K 512
+
+/*
+ * The most centroids in one leaf of the tree. Each leaf is a transposed block
+ *  of its own, so it is measured with one call to the nearest kernel.
+ */
+#define MODEL_LEAF_SIZE KMEANS_BLOCK_WIDTH
+
+/* The deepest tree a search can walk; median splits stay far below this. */
+#define MODEL_MAX_DEPTH 64
+
+/*
+ * Plane bounds are exact while leaf distances are rounded, so a subtree is
+ *  only skipped when its bound beats the best distance by more than that.
+ */
+#define MODEL_PRUNE_SLACK (1.0 + 1e-12)
+
+/* Marks a leaf in the dimension field of a node. */
+#define MODEL_LEAF UINT32_MAX
+
+
+/* The 128-byte header at the start of a model image. */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t block_width;   /* KMEANS_BLOCK_WIDTH of the block and leaves */
+    uint32_t reserved;
+    uint64_t num_centroids;
+    uint64_t dim;
+    uint64_t num_objects;
+    uint64_t iterations;
+    double inertia;
+    uint64_t num_nodes;   /* zero without a tree */
+    uint64_t num_leaves;
+    uint64_t centroids_offset;
+    uint64_t block_offset;
+    uint64_t nodes_offset;
+    uint64_t order_offset;
+    uint64_t leaves_offset;
+    uint64_t padding;
+} model_header;
+
+/*
+ * A node of the k-d tree. An inner node sends points with values up to
+ *  'split' in dimension 'dim' left and the rest right; children always come
+ *  after their parent. A leaf holds 'right' centroids in block 'left' of the
+ *  leaves.
+ */
+typedef struct
+{
+    double split;
+    uint32_t dim;
+    uint32_t left;
+    uint32_t right;
+    uint32_t reserved;
+} model_node;
+
+
+struct _kmeans_model
+{
+    kmeans_model_info info;
+
+    const double *centroids;
+
+    /* The centroids in the layout of the distance kernels. */
+    const kmeans_kernels *kernels;
+    const double *centroids_t;
+    size_t stride;
+
+    /*
+     * The tree, its leaves as transposed blocks of MODEL_LEAF_SIZE centroids,
+     * and the centroid index of every lane of those blocks. Lanes are sorted
+     * by index, so the lowest lane of a tie is also the lowest centroid.
+     */
+    const model_node *nodes;
+    size_t num_nodes;
+    const double *leaves;
+    const uint32_t *order;
+
+    /* The image, either allocated or mapped from a file. */
+    void *image;
+    size_t image_length;
+    int mapped;
+
+    /* A block of our own, when the file was padded for other kernels. */
+    double *block;
+};
+
+
+/* Round a size up to the section alignment. */
+static inline
+size_t
+model_align(size_t size)
+{
+    return (size + MODEL_ALIGNMENT - 1) & ~(size_t)(MODEL_ALIGNMENT - 1);
+}
+
+
+/* Sort key of a centroid for the dimension being split. */
+#define MODEL_KEY(c) (centroids[((size_t)(c) * dim) + d])
+
+/*
+ * Reorder 'count' centroid indices so the one at 'nth' is where sorting on
+ *  dimension 'd' would put it, with no larger key before it and no smaller
+ *  one after it. Runs of equal keys are partitioned in three ways, so they
+ *  cannot make this quadratic.
+ */
+static
+void
+model_select(const double *centroids,
+             size_t dim,
+             size_t d,
+             uint32_t *order,
+             size_t count,
+             size_t nth)
+{
+    size_t lo = 0, hi = count;
+
+    while (hi - lo > 1) {
+        const double pivot = MODEL_KEY(order[lo + ((hi - lo) / 2)]);
+        size_t lt = lo, i = lo, gt = hi;
+
+        while (i < gt) {
+            const double key = MODEL_KEY(order[i]);
+            uint32_t swap = order[i];
+
+            if (key < pivot) {
+                order[i++] = order[lt];
+                order[lt++] = swap;
+            } else if (key > pivot) {
+                order[i] = order[--gt];
+                order[gt] = swap;
+            } else {
+                ++i;
+            }
+        }
+
+        if (nth < lt) hi = lt;
+        else if (nth >= gt) lo = gt;
+        else return;
+    }
+}
+
+
+/* State of a tree being built. */
+typedef struct
+{
+    const double *centroids;
+    size_t dim;
+    uint32_t *order;
+    model_node *nodes;
+    size_t num_nodes;
+
+    /* Where each leaf starts in the tree order. */
+    size_t *firsts;
+    size_t num_leaves;
+} model_builder;
+
+/*
+ * Build the subtree over positions [first, first + count) of the tree order,
+ *  splitting at the median of the dimension with the widest spread. Returns
+ *  the index of its root.
+ */
+static
+uint32_t
+model_build(model_builder *builder,
+            size_t first,
+            size_t count)
+{
+    const double *centroids = builder->centroids;
+    const size_t dim = builder->dim;
+    uint32_t *order = builder->order + first;
+    const uint32_t index = builder->num_nodes++;
+    model_node *node = &(builder->nodes[index]);
+    size_t d, widest = 0;
+    double widest_spread = 0.0;
+
+    for (d = 0; count > MODEL_LEAF_SIZE && d < dim; ++d) {
+        double low = MODEL_KEY(order[0]), high = low;
+
+        for (size_t i = 1; i < count; ++i) {
+            const double key = MODEL_KEY(order[i]);
+            if (key < low) low = key;
+            if (key > high) high = key;
+        }
+
+        if (high - low > widest_spread) {
+            widest_spread = high - low;
+            widest = d;
+        }
+    }
+
+    /* Small or degenerate sets of centroids become leaves. */
+    if (count <= MODEL_LEAF_SIZE) {
+        builder->firsts[builder->num_leaves] = first;
+        node->dim = MODEL_LEAF;
+        node->left = builder->num_leaves++;
+        node->right = count;
+        return index;
+    }
+
+    /* Too many identical centroids to split still get split down to leaves. */
+    if (!(widest_spread > 0.0)) widest = 0;
+
+    d = widest;
+    model_select(centroids, dim, d, order, count, count / 2);
+
+    node->dim = d;
+    node->split = MODEL_KEY(order[count / 2]);
+
+    node->left = model_build(builder, first, count / 2);
+    node->right = model_build(builder, first + (count / 2), count - (count / 2));
+    return index;
+}
+
+#undef MODEL_KEY
+
+
+/*
+ * Whether lanes [first, width) of a transposed block are padding: infinitely
+ *  far in every dimension, so the nearest kernel can never pick them.
+ */
+static
+int
+model_padded(const double *block,
+             size_t width,
+             size_t first,
+             size_t dim)
+{
+    for (size_t d = 0; d < dim; ++d)
+        for (size_t lane = first; lane < width; ++lane)
+            if (HUGE_VAL != block[(d * width) + lane]) return 0;
+
+    return 1;
+}
+
+
+/*
+ * Validate an image and point a model at its sections. Anything read from a
+ *  file is checked before it is trusted, including every link of the tree.
+ */
+static
+kmeans_result
+model_bind(kmeans_model *model,
+           void *image,
+           size_t length)
+{
+    const model_header *header = (const model_header *)image;
+    const char *base = (const char *)image;
+
+    if (length < sizeof(model_header)
+        || memcmp(header->magic, KMEANS_MODEL_MAGIC, sizeof(header->magic))
+        || KMEANS_MODEL_VERSION != header->version
+        || MODEL_BYTE_ORDER != header->byte_order)
+        return KMEANS_MALFORMED_INPUT;
+
+    const size_t k = header->num_centroids;
+    const size_t dim = header->dim;
+    const size_t width = header->block_width;
+    const size_t num_leaves = header->num_leaves;
+
+    if (!k || !dim) return KMEANS_NO_DATA;
+    if (!width || (width & (width - 1)) || width > 1024) return KMEANS_MALFORMED_INPUT;
+
+    /* Guard the size computations against overflow before trusting them. */
+    if (k > INT_MAX
+        || k + width > (SIZE_MAX / sizeof(double)) / dim
+        || header->num_nodes > 2 * k
+        || num_leaves > k
+        || (header->num_nodes && (!num_leaves || dim > MODEL_TREE_MAX_DIM)))
+        return KMEANS_BAD_LENGTH;
+
+    const size_t file_stride = (k + width - 1) & ~(width - 1);
+    const struct {
+        uint64_t offset;
+        size_t length;
+    } sections[] = {
+        { header->centroids_offset, sizeof(double) * k * dim },
+        { header->block_offset, sizeof(double) * file_stride * dim },
+        { header->nodes_offset, sizeof(model_node) * header->num_nodes },
+        { header->leaves_offset, sizeof(double) * num_leaves * width * dim },
+        { header->order_offset, sizeof(uint32_t) * num_leaves * width },
+    };
+
+    for (size_t s = 0; s < sizeof(sections) / sizeof(sections[0]); ++s) {
+        if (!sections[s].length) continue;
+
+        if (sections[s].offset % MODEL_ALIGNMENT
+            || sections[s].offset < sizeof(model_header)
+            || sections[s].offset > length
+            || sections[s].length > length - sections[s].offset)
+            return KMEANS_BAD_LENGTH;
+    }
+
+    model->info.num_centroids = k;
+    model->info.dim = dim;
+    model->info.num_objects = header->num_objects;
+    model->info.iterations = header->iterations;
+    model->info.inertia = header->inertia;
+
+    model->centroids = (const double *)(base + header->centroids_offset);
+    model->kernels = kmeans_kernels_for(dim);
+    model->stride = kmeans_block_stride(k);
+
+    if (KMEANS_BLOCK_WIDTH == width) {
+        model->centroids_t = (const double *)(base + header->block_offset);
+
+        /* A finite padding lane would be answered as a centroid past k. */
+        if (!model_padded(model->centroids_t, model->stride, k, dim))
+            return KMEANS_MALFORMED_INPUT;
+    } else {
+        if (!(model->block = kmeans_block_alloc(k, dim))) return KMEANS_NO_MEMORY;
+        kmeans_block_transpose(model->centroids, k, dim, model->block);
+        model->centroids_t = model->block;
+    }
+
+    /*
+     * Leaves padded for other kernels would be read wrong, so such a model
+     *  answers through the block alone, with the same results.
+     */
+    if (!header->num_nodes || MODEL_LEAF_SIZE != width) return KMEANS_OK;
+
+    const model_node *nodes = (const model_node *)(base + header->nodes_offset);
+    const double *leaves = (const double *)(base + header->leaves_offset);
+    const uint32_t *order = (const uint32_t *)(base + header->order_offset);
+
+    /* Children come after their parents, so depths are known in one pass. */
+    uint8_t *depths = calloc(header->num_nodes, sizeof(uint8_t));
+    kmeans_result result = KMEANS_OK;
+
+    if (!depths) return KMEANS_NO_MEMORY;
+
+    for (size_t n = 0; n < header->num_nodes && KMEANS_OK == result; ++n) {
+        const model_node *node = &(nodes[n]);
+
+        if (MODEL_LEAF == node->dim) {
+            const size_t leaf = (size_t)node->left * MODEL_LEAF_SIZE;
+
+            if (node->left >= num_leaves || !node->right || node->right > MODEL_LEAF_SIZE
+                || !model_padded(leaves + (leaf * dim), MODEL_LEAF_SIZE,
+                                 node->right, dim)) {
+                result = KMEANS_MALFORMED_INPUT;
+                continue;
+            }
+
+            /* Padding lanes are checked too, so no lane maps past k. */
+            for (size_t lane = 0; KMEANS_OK == result && lane < MODEL_LEAF_SIZE; ++lane)
+                if (order[leaf + lane] >= k)
+                    result = KMEANS_MALFORMED_INPUT;
+            continue;
+        }
+
+        if (node->dim >= dim
+            || node->left <= n || node->left >= header->num_nodes
+            || node->right <= n || node->right >= header->num_nodes
+            || depths[n] + 1 >= MODEL_MAX_DEPTH) {
+            result = KMEANS_MALFORMED_INPUT;
+            continue;
+        }
+
+        depths[node->left] = depths[n] + 1;
+        depths[node->right] = depths[n] + 1;
+    }
+
+    free(depths);
+    if (KMEANS_OK != result) return result;
+
+    model->nodes = nodes;
+    model->num_nodes = header->num_nodes;
+    model->leaves = leaves;
+    model->order = order;
+    return KMEANS_OK;
+}
+
+
+kmeans_result
+kmeans_model_create(const double *centroids,
+                    const kmeans_model_info *info,
+                    kmeans_model **model)
+{
+    const size_t k = info->num_centroids;
+    const size_t dim = info->dim;
+    const int tree = (dim <= MODEL_TREE_MAX_DIM && k >= MODEL_TREE_MIN_K * dim);
+    model_builder builder = { .centroids = centroids, .dim = dim };
+    kmeans_result result = KMEANS_NO_MEMORY;
+    void *image = NULL;
+
+    *model = NULL;
+
+    if (!k || !dim) return KMEANS_NO_DATA;
+    if (k > INT_MAX || k > (SIZE_MAX / sizeof(double)) / dim) return KMEANS_BAD_LENGTH;
+
+    kmeans_model *self = calloc(1, sizeof(kmeans_model));
+    if (!self) return KMEANS_NO_MEMORY;
+
+    if (tree) {
+        builder.order = malloc(sizeof(uint32_t) * k);
+        builder.nodes = calloc(2 * k, sizeof(model_node));
+        builder.firsts = malloc(sizeof(size_t) * k);
+        if (!builder.order || !builder.nodes || !builder.firsts) goto break_out;
+
+        for (size_t c = 0; c < k; ++c) builder.order[c] = c;
+        model_build(&builder, 0, k);
+    }
+
+    /* Lay the sections out one after the other. */
+    const size_t stride = kmeans_block_stride(k);
+    model_header header = {
+            .version = KMEANS_MODEL_VERSION,
+            .byte_order = MODEL_BYTE_ORDER,
+            .block_width = KMEANS_BLOCK_WIDTH,
+            .num_centroids = k,
+            .dim = dim,
+            .num_objects = info->num_objects,
+            .iterations = info->iterations,
+            .inertia = info->inertia,
+            .num_nodes = builder.num_nodes,
+            .num_leaves = builder.num_leaves,
+    };
+    size_t length = model_align(sizeof(model_header));
+
+    memcpy(header.magic, KMEANS_MODEL_MAGIC, sizeof(header.magic));
+
+    header.centroids_offset = length;
+    length += model_align(sizeof(double) * k * dim);
+    header.block_offset = length;
+    length += model_align(sizeof(double) * stride * dim);
+
+    if (tree) {
+        header.nodes_offset = length;
+        length += model_align(sizeof(model_node) * builder.num_nodes);
+        header.leaves_offset = length;
+        length += model_align(sizeof(double) * builder.num_leaves * MODEL_LEAF_SIZE * dim);
+        header.order_offset = length;
+        length += model_align(sizeof(uint32_t) * builder.num_leaves * MODEL_LEAF_SIZE);
+    }
+
+    if (0 != posix_memalign(&image, MODEL_ALIGNMENT, length)) goto break_out;
+    memset(image, 0, length);
+
+    char *base = (char *)image;
+    double *block = (double *)(base + header.block_offset);
+
+    memcpy(base, &header, sizeof(header));
+    memcpy(base + header.centroids_offset, centroids, sizeof(double) * k * dim);
+
+    /* Padding centroids are infinitely far away from every point. */
+    for (size_t i = 0; i < stride * dim; ++i) block[i] = HUGE_VAL;
+    kmeans_block_transpose(centroids, k, dim, block);
+
+    if (tree) {
+        double *leaves = (double *)(base + header.leaves_offset);
+        uint32_t *order = (uint32_t *)(base + header.order_offset);
+
+        memcpy(base + header.nodes_offset, builder.nodes,
+               sizeof(model_node) * builder.num_nodes);
+
+        for (size_t n = 0; n < builder.num_nodes; ++n) {
+            const model_node *node = &(builder.nodes[n]);
+            if (MODEL_LEAF != node->dim) continue;
+
+            double *leaf = leaves + ((size_t)node->left * MODEL_LEAF_SIZE * dim);
+            uint32_t *lanes = order + ((size_t)node->left * MODEL_LEAF_SIZE);
+
+            /* Sort the lanes by centroid index, for the tie-break. */
+            memcpy(lanes, builder.order + builder.firsts[node->left],
+                   sizeof(uint32_t) * node->right);
+            for (size_t i = 1; i < node->right; ++i)
+                for (size_t j = i; j && lanes[j - 1] > lanes[j]; --j) {
+                    uint32_t swap = lanes[j];
+                    lanes[j] = lanes[j - 1];
+                    lanes[j - 1] = swap;
+                }
+
+            for (size_t lane = 0; lane < MODEL_LEAF_SIZE; ++lane)
+                for (size_t d = 0; d < dim; ++d)
+                    leaf[(d * MODEL_LEAF_SIZE) + lane] = (lane < node->right)
+                        ? centroids[((size_t)lanes[lane] * dim) + d]
+                        : HUGE_VAL;
+        }
+    }
+
+    self->image = image;
+    self->image_length = length;
+    image = NULL;
+
+    if (KMEANS_OK != (result = model_bind(self, self->image, length))) goto break_out;
+
+    *model = self;
+    self = NULL;
+
+break_out:
+    kmeans_model_destroy(self);
+    free(image);
+    free(builder.order);
+    free(builder.nodes);
+    free(builder.firsts);
+    return result;
+}
+
+
+kmeans_result
+kmeans_model_save(const kmeans_model *model,
+                  const char *path)
+{
+    FILE *file = fopen(path, "wb");
+
+    if (!file) return KMEANS_IO_ERROR;
+
+    /* A mapped image is written back as-is, whatever block width it has. */
+    size_t written = fwrite(model->image, 1, model->image_length, file);
+
+    if (fclose(file) || written != model->image_length) return KMEANS_IO_ERROR;
+    return KMEANS_OK;
+}
+
+
+kmeans_result
+kmeans_model_open(const char *path,
+                  kmeans_model **model)
+{
+    struct stat info;
+    kmeans_result result;
+    int fd;
+
+    *model = NULL;
+
+    if ((fd = open(path, O_RDONLY)) < 0) return KMEANS_IO_ERROR;
+
+    if (fstat(fd, &info) < 0) {
+        close(fd);
+        return KMEANS_IO_ERROR;
+    }
+
+    if ((size_t)info.st_size < sizeof(model_header)) {
+        close(fd);
+        return KMEANS_MALFORMED_INPUT;
+    }
+
+    /* The mapping keeps the file referenced, so the descriptor can go now. */
+    void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == mapping) return KMEANS_IO_ERROR;
+
+    kmeans_model *self = calloc(1, sizeof(kmeans_model));
+    if (!self) {
+        munmap(mapping, info.st_size);
+        return KMEANS_NO_MEMORY;
+    }
+
+    self->image = mapping;
+    self->image_length = info.st_size;
+    self->mapped = 1;
+
+    if (KMEANS_OK != (result = model_bind(self, mapping, info.st_size))) {
+        kmeans_model_destroy(self);
+        return result;
+    }
+
+    *model = self;
+    return KMEANS_OK;
+}
+
+
+void
+kmeans_model_destroy(kmeans_model *model)
+{
+    if (!model) return;
+
+    if (model->mapped) munmap(model->image, model->image_length);
+    else free(model->image);
+
+    free(model->block);
+    free(model);
+}
+
+
+const kmeans_model_info *
+kmeans_model_describe(const kmeans_model *model)
+{
+    return &(model->info);
+}
+
+
+const double *
+kmeans_model_centroids(const kmeans_model *model)
+{
+    return model->centroids;
+}
+
+
+/*
+ * Find the nearest centroid through the tree. The near side of every split
+ *  is walked first, and the far side is only visited while the distance to
+ *  its cell does not exceed the best distance so far. That distance is kept
+ *  up incrementally from the offsets of the point past each side of the cell,
+ *  one dimension changing per split (Arya and Mount). Leaves are measured by
+ *  the same kernel as the whole block, so distances round identically, and
+ *  ties go to the lower index like they do there.
+ */
+static
+int
+model_search(const kmeans_model *model,
+             const double *point,
+             double *distance)
+{
+    const size_t dim = model->info.dim;
+    struct
+    {
+        uint32_t node;
+        double bound;
+        double offsets[MODEL_TREE_MAX_DIM];
+    } stack[MODEL_MAX_DEPTH];
+    size_t top = 0;
+    double best = HUGE_VAL;
+    uint32_t nearest = model->info.num_centroids;
+
+    memset(&(stack[top]), 0, sizeof(stack[top]));
+    ++top;
+
+    while (top) {
+        --top;
+        if (stack[top].bound > best * MODEL_PRUNE_SLACK) continue;
+
+        const model_node *node = &(model->nodes[stack[top].node]);
+        double offsets[MODEL_TREE_MAX_DIM];
+        double bound = stack[top].bound;
+
+        memcpy(offsets, stack[top].offsets, sizeof(double) * dim);
+
+        while (MODEL_LEAF != node->dim) {
+            const uint32_t d = node->dim;
+            const double delta = point[d] - node->split;
+            const double far = bound - (offsets[d] * offsets[d]) + (delta * delta);
+            const int left = (delta <= 0.0);
+
+            if (far <= best * MODEL_PRUNE_SLACK) {
+                stack[top].node = left ? node->right : node->left;
+                stack[top].bound = far;
+                memcpy(stack[top].offsets, offsets, sizeof(double) * dim);
+                stack[top++].offsets[d] = delta;
+            }
+
+            node = &(model->nodes[left ? node->left : node->right]);
+        }
+
+        const size_t leaf = (size_t)node->left * MODEL_LEAF_SIZE;
+        double d;
+        const int lane = model->kernels->nearest(point, model->leaves + (leaf * dim),
+                                                 MODEL_LEAF_SIZE, dim, &d);
+        const uint32_t c = model->order[leaf + lane];
+
+        if (d < best || (d == best && c < nearest)) {
+            best = d;
+            nearest = c;
+        }
+    }
+
+    if (distance) *distance = best;
+    return nearest;
+}
+
+
+int
+kmeans_model_predict(const kmeans_model *model,
+                     const double *point,
+                     double *distance)
+{
+    if (model->nodes) return model_search(model, point, distance);
+
+    return model->kernels->nearest(point, model->centroids_t, model->stride,
+                                   model->info.dim, distance);
+}
+
+
+void
+kmeans_model_predict_batch(const kmeans_model *model,
+                           const double *points,
+                           size_t n,
+                           int *labels,
+                           double *distances)
+{
+    const size_t dim = model->info.dim;
+
+    for (size_t i = 0; i < n; ++i)
+        labels[i] = kmeans_model_predict(model, points + (i * dim),
+                                         distances ? &(distances[i]) : NULL);
+}
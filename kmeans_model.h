@@ -0,0 +1,120 @@
+/*
+ * kmeans_model.h
+ *
+ * Trained models for answering "which cluster is this point in" lookups after
+ *  clustering, without the data. A model holds the centroids in the layout of
+ *  the distance kernels, plus a k-d tree over them for low dimensionalities,
+ *  and can be saved to a file which is memory-mapped back as-is, so a serving
+ *  process is ready as soon as it opens one.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_MODEL_H
+#define CIS579_TERMPROJECT_KMEANS_MODEL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "kmeans.h"
+
+
+/* The first bytes of every model file. */
+#define KMEANS_MODEL_MAGIC "KMMODL\r\n"
+
+/* Current version of the model format. */
+#define KMEANS_MODEL_VERSION 1
+
+
+/* Opaque model type. */
+typedef struct _kmeans_model kmeans_model;
+
+/* Shape of a model, and what is known of its training. */
+typedef struct
+{
+    size_t num_centroids;
+    size_t dim;
+
+    /* Points the model was trained on, and the iterations it took. Optional. */
+    size_t num_objects;
+    unsigned long iterations;
+
+    /* Sum of squared distances of the training points, or zero if unknown. */
+    double inertia;
+} kmeans_model_info;
+
+
+/*
+ * Build a model from a row-major matrix of info->num_centroids x info->dim
+ *  centroids, which are copied. A k-d tree is built over them when the
+ *  dimensionality is low enough for it to beat comparing every centroid.
+ */
+kmeans_result
+kmeans_model_create(
+    const double             *centroids IN,
+    const kmeans_model_info  *info      IN,
+    kmeans_model            **model     OUT
+);
+
+/* Write a model to a new file. */
+kmeans_result
+kmeans_model_save(
+    const kmeans_model *model IN,
+    const char         *path  IN
+);
+
+/*
+ * Map a model file read-only and validate it. The centroids, kernel layout
+ *  and tree are all used straight from the mapping.
+ */
+kmeans_result
+kmeans_model_open(
+    const char    *path  IN,
+    kmeans_model **model OUT
+);
+
+/* Free a model, or unmap it if it was opened from a file. */
+void
+kmeans_model_destroy(
+    kmeans_model *model IN
+);
+
+
+/* Get the shape and training details of a model. */
+const kmeans_model_info *
+kmeans_model_describe(
+    const kmeans_model *model IN
+);
+
+/* Get the row-major centroids of a model. */
+const double *
+kmeans_model_centroids(
+    const kmeans_model *model IN
+);
+
+/*
+ * Get the cluster of one point of 'dim' values, and optionally its squared
+ *  distance to that centroid. Ties go to the lowest cluster index, so every
+ *  answer matches the assignment step of the Lloyd engine exactly. Safe to
+ *  call from any number of threads at once.
+ */
+int
+kmeans_model_predict(
+    const kmeans_model *model    IN,
+    const double       *point    IN,
+    double             *distance OUT   /* optional */
+);
+
+/*
+ * Get the clusters of a row-major batch of n points, and optionally their
+ *  squared distances to those centroids.
+ */
+void
+kmeans_model_predict_batch(
+    const kmeans_model *model     IN,
+    const double       *points    IN,
+    size_t              n         IN,
+    int                *labels    OUT,
+    double             *distances OUT   /* optional */
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_MODEL_H */
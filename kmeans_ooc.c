@@ -0,0 +1,722 @@
+/*
+ * kmeans_ooc.c
+ *
+ * Implementation of out-of-core clustering. The dataset file is read with
+ *  pread() into two chunk buffers in turn: while the pool runs the Lloyd
+ *  engine over one, a reader thread writes back the assignments the other one
+ *  held (when spilling) and fills it with the next chunk.
+ */
+
+#include "kmeans_ooc.h"
+#include "kmeans_pool.h"
+#include "kmeans_kernels.h"
+#include "kmeans_internal.h"
+#include "kmeans_dataset.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+
+/* One of the two chunk buffers. */
+typedef struct
+{
+    /* num_threads stretches of up to 'span' points, one per thread. */
+    char *data;
+
+    /* The assignments of the same stretches, when spilling to a file. */
+    int *assignments;
+
+    /* Which chunk the buffer holds. */
+    size_t chunk;
+
+    /* Whether its assignments changed since they were read. */
+    int dirty;
+} ooc_slot;
+
+
+/* State shared by every thread of an out-of-core clustering run. */
+typedef struct
+{
+    kmeans_ooc_meta *meta;
+    kmeans_dataset_header header;
+
+    int fd;
+    int assignments_fd;   /* -1 unless spilling */
+
+    size_t num_threads;
+    size_t row_size;   /* bytes of one point */
+
+    /*
+     * Chunk 'c' holds points [lo + (c * span), lo + ((c + 1) * span)) of the
+     * slice [lo, hi) each thread would own in memory, clipped to that slice.
+     */
+    size_t span;
+    size_t num_chunks;
+
+    ooc_slot slots[2];
+    ooc_slot *current;
+
+    /*
+     * The Lloyd engine runs on one small dense matrix per thread: the
+     * thread's stretch of the current chunk. Each thread gets its own copy
+     * of the run, pointing at its own view of the chunk, while the shared
+     * run describes the whole dataset for the centroid update.
+     */
+    kmeans_dense_meta whole;
+    kmeans_run lloyd;
+    kmeans_run *lloyds;
+    kmeans_dense_meta *views;
+} ooc_run;
+
+
+/* A chunk being written back and read in by the reader thread. */
+typedef struct
+{
+    ooc_run *run;
+    ooc_slot *slot;
+    size_t chunk;
+    kmeans_result result;
+
+    pthread_t thread;
+    int joinable;
+} ooc_io;
+
+
+/* Get the stretch of a chunk which belongs to one thread. */
+static inline
+void
+ooc_stretch(const ooc_run *run,
+            size_t chunk,
+            size_t thread,
+            size_t *first,
+            size_t *count)
+{
+    size_t lo, hi;
+
+    kmeans_pool_slice(run->meta->num_objects, thread, run->num_threads, &lo, &hi);
+
+    *first = lo + (chunk * run->span);
+    *count = 0;
+    if (*first < hi) *count = (hi - *first < run->span) ? hi - *first : run->span;
+}
+
+
+/* Read exactly 'length' bytes at 'offset', across short reads and signals. */
+static
+kmeans_result
+ooc_read(int fd,
+         void *buffer,
+         size_t length,
+         off_t offset,
+         unsigned long long *bytes_read)
+{
+    char *cursor = (char *)buffer;
+
+    while (length) {
+        ssize_t got = pread(fd, cursor, length, offset);
+
+        if (got < 0) {
+            if (EINTR == errno) continue;
+            return KMEANS_IO_ERROR;
+        }
+
+        /* The header promised more data than the file holds. */
+        if (!got) return KMEANS_BAD_LENGTH;
+
+        cursor += got;
+        length -= got;
+        offset += got;
+        *bytes_read += got;
+    }
+
+    return KMEANS_OK;
+}
+
+
+/* Write exactly 'length' bytes at 'offset'. */
+static
+kmeans_result
+ooc_write(int fd,
+          const void *buffer,
+          size_t length,
+          off_t offset)
+{
+    const char *cursor = (const char *)buffer;
+
+    while (length) {
+        ssize_t put = pwrite(fd, cursor, length, offset);
+
+        if (put < 0) {
+            if (EINTR == errno) continue;
+            return KMEANS_IO_ERROR;
+        }
+
+        cursor += put;
+        length -= put;
+        offset += put;
+    }
+
+    return KMEANS_OK;
+}
+
+
+/*
+ * Read one thread's stretch of points from the dataset. A column-major file
+ *  takes one read per dimension, and the stretch is kept column-major.
+ */
+static
+kmeans_result
+ooc_read_points(ooc_run *run,
+                char *data,
+                size_t first,
+                size_t count)
+{
+    const kmeans_dataset_header *header = &(run->header);
+    const size_t element = run->row_size / header->dim;
+    kmeans_result result = KMEANS_OK;
+
+    if (KMEANS_ROW_MAJOR == header->layout)
+        return ooc_read(run->fd, data, count * run->row_size,
+                        header->data_offset + (first * run->row_size),
+                        &(run->meta->bytes_read));
+
+    for (size_t d = 0; d < header->dim && KMEANS_OK == result; ++d)
+        result = ooc_read(run->fd, data + (d * count * element),
+                          count * element,
+                          header->data_offset
+                            + (((d * header->num_objects) + first) * element),
+                          &(run->meta->bytes_read));
+
+    return result;
+}
+
+
+/* Fill a slot with a chunk, and with its assignments when spilling. */
+static
+kmeans_result
+ooc_load(ooc_run *run,
+         ooc_slot *slot,
+         size_t chunk)
+{
+    kmeans_result result = KMEANS_OK;
+
+    for (size_t t = 0; t < run->num_threads && KMEANS_OK == result; ++t) {
+        size_t first, count;
+
+        ooc_stretch(run, chunk, t, &first, &count);
+        if (!count) continue;
+
+        result = ooc_read_points(run, slot->data + (t * run->span * run->row_size),
+                                 first, count);
+
+        if (KMEANS_OK == result && run->assignments_fd >= 0)
+            result = ooc_read(run->assignments_fd,
+                              slot->assignments + (t * run->span),
+                              count * sizeof(int), first * sizeof(int),
+                              &(run->meta->bytes_read));
+    }
+
+    slot->chunk = chunk;
+    return result;
+}
+
+
+/* Write the assignments of a slot back to the spill file. */
+static
+kmeans_result
+ooc_flush(ooc_run *run,
+          ooc_slot *slot)
+{
+    kmeans_result result = KMEANS_OK;
+
+    for (size_t t = 0; t < run->num_threads && KMEANS_OK == result; ++t) {
+        size_t first, count;
+
+        ooc_stretch(run, slot->chunk, t, &first, &count);
+        if (count)
+            result = ooc_write(run->assignments_fd,
+                               slot->assignments + (t * run->span),
+                               count * sizeof(int), first * sizeof(int));
+    }
+
+    slot->dirty = 0;
+    return result;
+}
+
+
+/* Body of the reader thread. */
+static
+void *
+ooc_io_job(void *context)
+{
+    ooc_io *io = (ooc_io *)context;
+
+    io->result = KMEANS_OK;
+    if (io->slot->dirty) io->result = ooc_flush(io->run, io->slot);
+    if (KMEANS_OK == io->result)
+        io->result = ooc_load(io->run, io->slot, io->chunk);
+
+    return NULL;
+}
+
+
+/*
+ * Start filling a slot with a chunk in the background. Should no thread be
+ *  available, the chunk is read right away instead.
+ */
+static
+void
+ooc_io_start(ooc_io *io,
+             ooc_run *run,
+             ooc_slot *slot,
+             size_t chunk)
+{
+    io->run = run;
+    io->slot = slot;
+    io->chunk = chunk;
+    io->joinable = !pthread_create(&(io->thread), NULL, ooc_io_job, io);
+
+    if (!io->joinable) ooc_io_job(io);
+}
+
+
+/* Wait for the latest chunk started, if any, and get how reading it went. */
+static
+kmeans_result
+ooc_io_finish(ooc_io *io)
+{
+    if (io->joinable) pthread_join(io->thread, NULL);
+    io->joinable = 0;
+
+    return io->result;
+}
+
+
+/* Assign one thread's stretch of the current chunk with the Lloyd engine. */
+static
+void
+ooc_job_assign(void *context,
+               const size_t thread,
+               const size_t num_threads)
+{
+    ooc_run *run = (ooc_run *)context;
+    const ooc_slot *slot = run->current;
+    kmeans_dense_meta *view = &(run->views[thread]);
+    size_t first, count;
+
+    ooc_stretch(run, slot->chunk, thread, &first, &count);
+    if (!count) return;
+
+    view->data = slot->data + (thread * run->span * run->row_size);
+    view->num_objects = count;
+    view->cluster_assignments = (run->assignments_fd >= 0)
+        ? slot->assignments + (thread * run->span)
+        : run->meta->cluster_assignments + first;
+
+    (kmeans_engine_lloyd.assign)(&(run->lloyds[thread]), thread, 0, count,
+                                 &(run->lloyd.partials[thread]));
+}
+
+
+/*
+ * Size the chunks to the memory budget. Whatever the budget leaves after the
+ *  fixed costs is split between two buffers of num_threads stretches each,
+ *  unless a single buffer holds the whole dataset.
+ */
+static
+kmeans_result
+ooc_plan(ooc_run *run)
+{
+    const kmeans_ooc_meta *meta = run->meta;
+    const size_t k = meta->num_centroids;
+    const size_t dim = run->header.dim;
+    const size_t threads = run->num_threads;
+    const size_t stride = kmeans_block_stride(k);
+    const size_t budget = meta->memory_budget
+        ? meta->memory_budget
+        : KMEANS_OOC_DEFAULT_BUDGET;
+
+    /* Per thread partials, views and scratch, then the centroid copies. */
+    size_t fixed = threads * (sizeof(kmeans_partial) + sizeof(kmeans_run)
+                              + sizeof(kmeans_dense_meta)
+                              + (sizeof(double) * ((k * dim) + dim + stride))
+                              + (sizeof(size_t) * k) + (sizeof(float) * dim));
+    fixed += (sizeof(double) + sizeof(float)) * stride * dim;
+    fixed += sizeof(double) * ((k * dim) + k);
+
+    const size_t point = run->row_size
+        + ((run->assignments_fd >= 0) ? sizeof(int) : 0);
+    const size_t widest = (meta->num_objects + threads - 1) / threads;
+
+    if (budget <= fixed) return KMEANS_NO_MEMORY;
+
+    const size_t fits = (budget - fixed) / (threads * point);
+
+    if (fits >= widest) {
+        run->span = widest;
+        run->num_chunks = 1;
+        return KMEANS_OK;
+    }
+
+    run->span = fits / 2;
+    if (!run->span) return KMEANS_NO_MEMORY;
+
+    run->num_chunks = (widest + run->span - 1) / run->span;
+    return KMEANS_OK;
+}
+
+
+/* Allocate a slot's buffers. */
+static
+kmeans_result
+ooc_slot_create(ooc_run *run,
+                ooc_slot *slot)
+{
+    slot->data = malloc(run->num_threads * run->span * run->row_size);
+    if (run->assignments_fd >= 0)
+        slot->assignments = malloc(sizeof(int) * run->num_threads * run->span);
+
+    if (!slot->data || (run->assignments_fd >= 0 && !slot->assignments))
+        return KMEANS_NO_MEMORY;
+
+    return KMEANS_OK;
+}
+
+
+/* Allocate the per-thread partials and views, and the centroid blocks. */
+static
+kmeans_result
+ooc_create(ooc_run *run)
+{
+    kmeans_ooc_meta *meta = run->meta;
+    const size_t dim = run->header.dim;
+    kmeans_run *lloyd = &(run->lloyd);
+
+    run->whole = (kmeans_dense_meta){
+            .num_objects = meta->num_objects,
+            .dim = dim,
+            .centroids = meta->centroids,
+            .num_centroids = meta->num_centroids,
+    };
+
+    lloyd->meta = &(run->whole);
+    lloyd->engine = &kmeans_engine_lloyd;
+    lloyd->num_threads = run->num_threads;
+    lloyd->kernels = kmeans_kernels_for(dim);
+    lloyd->stride = kmeans_block_stride(meta->num_centroids);
+    lloyd->partials = calloc(run->num_threads, sizeof(kmeans_partial));
+    lloyd->centroids_t = kmeans_block_alloc(meta->num_centroids, dim);
+    lloyd->previous = malloc(sizeof(double) * meta->num_centroids * dim);
+    lloyd->shifts = malloc(sizeof(double) * meta->num_centroids);
+    if (KMEANS_FLOAT64 != run->header.dtype)
+        lloyd->centroids_f = kmeans_block_alloc_f32(meta->num_centroids, dim);
+
+    run->lloyds = calloc(run->num_threads, sizeof(kmeans_run));
+    run->views = calloc(run->num_threads, sizeof(kmeans_dense_meta));
+
+    if (!lloyd->partials
+        || !lloyd->centroids_t
+        || !lloyd->previous
+        || !lloyd->shifts
+        || (KMEANS_FLOAT64 != run->header.dtype && !lloyd->centroids_f)
+        || !run->lloyds
+        || !run->views)
+        return KMEANS_NO_MEMORY;
+
+    for (size_t t = 0; t < run->num_threads; ++t) {
+        if (KMEANS_OK != kmeans_partial_create(&(lloyd->partials[t]),
+                                               meta->num_centroids, dim,
+                                               lloyd->stride))
+            return KMEANS_NO_MEMORY;
+
+        run->views[t] = (kmeans_dense_meta){
+                .dim = dim,
+                .layout = (kmeans_layout)run->header.layout,
+                .dtype = (kmeans_dtype)run->header.dtype,
+                .scale = meta->scale ? meta->scale : run->header.scale,
+                .centroids = meta->centroids,
+                .num_centroids = meta->num_centroids,
+        };
+
+        run->lloyds[t] = *lloyd;
+        run->lloyds[t].meta = &(run->views[t]);
+    }
+
+    return KMEANS_OK;
+}
+
+
+/* Open the dataset and, when spilling, a zeroed assignments file. */
+static
+kmeans_result
+ooc_open(ooc_run *run)
+{
+    kmeans_ooc_meta *meta = run->meta;
+    kmeans_result result;
+
+    if ((run->fd = open(meta->path, O_RDONLY)) < 0) return KMEANS_IO_ERROR;
+
+    if (KMEANS_OK != (result = kmeans_dataset_read_header(run->fd, &(run->header))))
+        return result;
+
+    meta->num_objects = run->header.num_objects;
+    meta->dim = run->header.dim;
+    run->row_size = meta->dim * kmeans_dtype_size((kmeans_dtype)run->header.dtype);
+
+    if (meta->num_centroids > meta->num_objects) return KMEANS_BAD_LENGTH;
+
+    /* Every pass reads each thread's slice front to back. */
+    posix_fadvise(run->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (!meta->assignments_path) return KMEANS_OK;
+
+    run->assignments_fd =
+        open(meta->assignments_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (run->assignments_fd < 0
+        || ftruncate(run->assignments_fd, sizeof(int) * meta->num_objects) < 0)
+        return KMEANS_IO_ERROR;
+
+    return KMEANS_OK;
+}
+
+
+kmeans_result
+compute_kmeans_ooc(kmeans_ooc_meta *meta)
+{
+    assert(meta);
+
+    assert(meta->path);
+    assert(meta->centroids);
+    assert(meta->cluster_assignments || meta->assignments_path);
+
+    assert(meta->num_centroids);
+    assert(meta->iterations > 0);
+
+    /* Local variables. */
+    kmeans_pool *pool = NULL;
+    ooc_run run = {
+            .meta = meta,
+            .fd = -1,
+            .assignments_fd = -1,
+            .num_threads = meta->num_threads ? meta->num_threads : 1,
+    };
+    ooc_io io = { .result = KMEANS_OK };
+    kmeans_result result;
+
+    meta->bytes_read = 0;
+
+    if (KMEANS_OK != (result = ooc_open(&run))) goto break_out;
+
+    if (run.num_threads > meta->num_objects) run.num_threads = meta->num_objects;
+
+    if (KMEANS_OK != (result = ooc_plan(&run))
+        || KMEANS_OK != (result = ooc_create(&run))
+        || KMEANS_OK != (result = ooc_slot_create(&run, &(run.slots[0])))
+        || (run.num_chunks > 1
+            && KMEANS_OK != (result = ooc_slot_create(&run, &(run.slots[1])))))
+        goto break_out;
+
+    if (!(pool = kmeans_pool_create(run.num_threads))) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    /* Initialize all cluster assignments to 0, as the spill file already is. */
+    if (run.assignments_fd < 0)
+        memset(meta->cluster_assignments, 0, sizeof(int) * meta->num_objects);
+
+    kmeans_block_transpose(meta->centroids, meta->num_centroids, meta->dim,
+                           run.lloyd.centroids_t);
+    if (run.lloyd.centroids_f)
+        kmeans_block_transpose_f32(meta->centroids, meta->num_centroids,
+                                   meta->dim, run.lloyd.centroids_f);
+
+    while (1) {
+        for (size_t t = 0; t < run.num_threads; ++t)
+            kmeans_partial_reset(&(run.lloyd.partials[t]), meta->num_centroids,
+                                 meta->dim);
+
+        /* A dataset which fits in one buffer stays there after the first read. */
+        if (run.num_chunks > 1 || 0 == run.lloyd.iteration)
+            ooc_io_start(&io, &run, &(run.slots[0]), 0);
+
+        /*
+         * Each thread keeps adding its points to the same partial sums from
+         * chunk to chunk, in ascending order, exactly as it would in memory.
+         */
+        for (size_t chunk = 0; chunk < run.num_chunks; ++chunk) {
+            if (KMEANS_OK != (result = ooc_io_finish(&io))) goto break_out;
+
+            run.current = &(run.slots[chunk % 2]);
+
+            if (chunk + 1 < run.num_chunks)
+                ooc_io_start(&io, &run, &(run.slots[(chunk + 1) % 2]), chunk + 1);
+
+            kmeans_pool_run(pool, ooc_job_assign, &run);
+            if (run.assignments_fd >= 0) run.current->dirty = 1;
+        }
+
+        kmeans_run_reduce(&run.lloyd);
+        kmeans_run_update(&run.lloyd);
+
+        if (!run.lloyd.partials[0].changed) {
+            result = KMEANS_OK;
+            goto break_out;
+        }
+
+        if (run.lloyd.iteration++ > meta->iterations) {
+            result = KMEANS_LIMIT;
+            goto break_out;
+        }
+    }
+
+    /* No matter the result, always perform these actions. */
+break_out:
+    if (KMEANS_OK != ooc_io_finish(&io) && KMEANS_OK == result)
+        result = KMEANS_IO_ERROR;
+
+    /* Write back whatever the reader thread has not already. */
+    for (int s = 0; s < 2; ++s) {
+        if (run.slots[s].dirty
+            && KMEANS_OK != ooc_flush(&run, &(run.slots[s]))
+            && (KMEANS_OK == result || KMEANS_LIMIT == result))
+            result = KMEANS_IO_ERROR;
+    }
+
+    kmeans_pool_destroy(pool);
+    if (run.lloyd.partials) {
+        for (size_t t = 0; t < run.num_threads; ++t)
+            kmeans_partial_destroy(&(run.lloyd.partials[t]));
+        free(run.lloyd.partials);
+    }
+    free(run.lloyd.centroids_t);
+    free(run.lloyd.centroids_f);
+    free(run.lloyd.previous);
+    free(run.lloyd.shifts);
+    free(run.lloyds);
+    free(run.views);
+    for (int s = 0; s < 2; ++s) {
+        free(run.slots[s].data);
+        free(run.slots[s].assignments);
+    }
+    if (run.fd >= 0) close(run.fd);
+    if (run.assignments_fd >= 0 && close(run.assignments_fd) < 0
+        && (KMEANS_OK == result || KMEANS_LIMIT == result))
+        result = KMEANS_IO_ERROR;
+    meta->current_iterations = run.lloyd.iteration;
+    return result;
+}
+
+
+kmeans_result
+kmeans_ooc_seed(kmeans_ooc_meta *meta,
+                kmeans_rng *rng,
+                double **centroids)
+{
+    assert(meta);
+    assert(meta->path);
+    assert(meta->num_centroids);
+    assert(rng);
+    assert(centroids);
+
+    kmeans_dataset_header header;
+    unsigned long long bytes_read = 0;
+    size_t *picks = NULL;
+    char *row = NULL;
+    double *result_centroids = NULL;
+    kmeans_result result;
+    int fd;
+
+    *centroids = NULL;
+
+    if ((fd = open(meta->path, O_RDONLY)) < 0) return KMEANS_IO_ERROR;
+
+    if (KMEANS_OK != (result = kmeans_dataset_read_header(fd, &header)))
+        goto break_out;
+
+    meta->num_objects = header.num_objects;
+    meta->dim = header.dim;
+
+    const size_t n = meta->num_objects;
+    const size_t k = meta->num_centroids;
+    const size_t element = kmeans_dtype_size((kmeans_dtype)header.dtype);
+
+    if (k > n) {
+        result = KMEANS_BAD_LENGTH;
+        goto break_out;
+    }
+
+    picks = malloc(sizeof(size_t) * k);
+    row = malloc(element * meta->dim);
+    result_centroids = malloc(sizeof(double) * k * meta->dim);
+
+    if (!picks || !row || !result_centroids) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    /*
+     * Floyd's algorithm: k distinct indices from k draws. Each draw among the
+     * first j + 1 indices which was already picked takes index j instead.
+     */
+    for (size_t j = n - k, c = 0; j < n; ++j, ++c) {
+        size_t pick = kmeans_rng_below(rng, j + 1);
+
+        for (size_t p = 0; p < c; ++p) {
+            if (picks[p] == pick) {
+                pick = j;
+                break;
+            }
+        }
+
+        picks[c] = pick;
+    }
+
+    /* Read each pick as a one point matrix, and widen it like the engines do. */
+    kmeans_dense_meta view = {
+            .data = row,
+            .num_objects = 1,
+            .dim = meta->dim,
+            .dtype = (kmeans_dtype)header.dtype,
+            .scale = meta->scale ? meta->scale : header.scale,
+    };
+
+    for (size_t c = 0; c < k && KMEANS_OK == result; ++c) {
+        if (KMEANS_ROW_MAJOR == header.layout) {
+            result = ooc_read(fd, row, element * meta->dim,
+                              header.data_offset + (picks[c] * element * meta->dim),
+                              &bytes_read);
+        } else {
+            for (size_t d = 0; d < meta->dim && KMEANS_OK == result; ++d)
+                result = ooc_read(fd, row + (d * element), element,
+                                  header.data_offset
+                                    + (((d * n) + picks[c]) * element),
+                                  &bytes_read);
+        }
+
+        double *centroid = result_centroids + (c * meta->dim);
+        const double *values = kmeans_dense_row(&view, 0, centroid);
+
+        if (values != centroid)
+            memcpy(centroid, values, sizeof(double) * meta->dim);
+    }
+
+    if (KMEANS_OK == result) {
+        *centroids = result_centroids;
+        result_centroids = NULL;
+    }
+
+break_out:
+    close(fd);
+    free(picks);
+    free(row);
+    free(result_centroids);
+    return result;
+}
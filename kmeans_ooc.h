@@ -0,0 +1,112 @@
+/*
+ * kmeans_ooc.h
+ *
+ * Out-of-core K-Means Clustering over dataset files larger than memory. Every
+ *  Lloyd iteration streams the matrix from disk in large chunks, reading the
+ *  next chunk while the current one is assigned, so the disk and the threads
+ *  stay busy together. Memory is bounded by a budget instead of the data size.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_OOC_H
+#define CIS579_TERMPROJECT_KMEANS_OOC_H
+
+#include <stdlib.h>
+
+#include "kmeans.h"
+#include "kmeans_seed.h"
+
+
+/* Memory budget used when the user does not set one: 256 MiB. */
+#define KMEANS_OOC_DEFAULT_BUDGET ((size_t)256 << 20)
+
+
+/* Meta-structure for clustering a dataset file out of core. */
+typedef struct
+{
+    /* A dataset file, as written by kmeans_dataset_write() and friends. */
+    const char *path;
+
+    /*
+     * Value of one quantization step of int8/uint8 data. Zero takes the
+     * scale stored in the dataset header, which in turn means 1 when zero.
+     */
+    double scale;
+
+    /*
+     * A row-major matrix of num_centroids x dim initial centroid values,
+     * which is updated in place. User is responsible for seeding this (see
+     * kmeans_ooc_seed) and for its memory management.
+     */
+    double *centroids;
+
+    /* The amount of centroids, AKA 'k'. */
+    size_t num_centroids;
+
+    /* How many times the algorithm should run to check convergence. */
+    unsigned long iterations;
+
+    /* Current iterations counter. */
+    unsigned long current_iterations;
+
+    /*
+     * Array of num_objects ints to fill with the cluster of every point.
+     * User responsible. Unused (and may be null) when spilling to a file.
+     */
+    int *cluster_assignments;
+
+    /*
+     * Optional file to keep the assignments in instead, so not even they
+     * need to fit in memory. It is created or truncated, read and rewritten
+     * chunk by chunk alongside the data, and ends up holding raw int32
+     * labels: the same bytes kmeans_output_labels() writes.
+     */
+    const char *assignments_path;
+
+    /* How many threads share the assignment step (0 or 1 runs serially). */
+    size_t num_threads;
+
+    /*
+     * Bytes the run may allocate in total: both chunk buffers plus the
+     * per-thread sums and centroid copies. Zero means the default budget.
+     * Pages the kernel caches for the file are not counted, since it can
+     * drop them at will. The run fails with KMEANS_NO_MEMORY when not even
+     * one point per thread fits next to the fixed costs.
+     */
+    size_t memory_budget;
+
+    /* Shape of the dataset, filled from its header. Output only. */
+    size_t num_objects;
+    size_t dim;
+
+    /* Bytes read from the dataset and assignment files. Output only. */
+    unsigned long long bytes_read;
+} kmeans_ooc_meta;
+
+
+/*
+ * Cluster meta->path with Lloyd's algorithm. The data is never held in full:
+ *  each thread reads its own stretch of the slice it would own in memory, so
+ *  points are summed in the same order as compute_kmeans_dense() with the
+ *  Lloyd engine and the same thread count, and the results are identical.
+ *  A dataset which fits the budget is read once and kept for every iteration.
+ */
+kmeans_result
+compute_kmeans_ooc(
+    kmeans_ooc_meta *meta IN OUT
+);
+
+/*
+ * Fill in meta->num_objects and meta->dim from the header of meta->path, and
+ *  pick meta->num_centroids distinct points uniformly at random as the initial
+ *  centroids. Only the picked rows are read. The row-major num_centroids x dim
+ *  result is allocated here, and owned by the user.
+ */
+kmeans_result
+kmeans_ooc_seed(
+    kmeans_ooc_meta  *meta      IN OUT,
+    kmeans_rng       *rng       IN OUT,
+    double          **centroids OUT
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_OOC_H */
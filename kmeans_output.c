@@ -0,0 +1,395 @@
+/*
+ * kmeans_output.c
+ *
+ * Implementation of the result writers. Numbers are formatted by hand into a
+ *  ring of large buffers, and once every buffer is full they are all written
+ *  with a single writev(), so millions of rows cost a few hundred syscalls.
+ */
+
+#include "kmeans_output.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+
+/* Room reserved for one formatted value on the fast path. */
+#define OUTPUT_MAX_FIELD 48
+
+/* Room reserved when printf has to format a very large value. */
+#define OUTPUT_MAX_FALLBACK 512
+
+/* Beyond this magnitude the integer part no longer fits the fast path. */
+#define OUTPUT_FAST_LIMIT 1e15
+
+
+typedef struct
+{
+    int fd;
+
+    /* KMEANS_OUTPUT_BUFFERS buffers of KMEANS_OUTPUT_BUFFER bytes each. */
+    char *buffers;
+    size_t lengths[KMEANS_OUTPUT_BUFFERS];
+    size_t current;
+
+    /* The first error met, after which nothing more is written. */
+    kmeans_result result;
+} output_writer;
+
+
+/* Write every byte of an I/O vector, retrying short and interrupted writes. */
+static
+kmeans_result
+output_writev(int fd,
+              struct iovec *iov,
+              int count)
+{
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+
+        if (written < 0) {
+            if (EINTR == errno) continue;
+            return KMEANS_IO_ERROR;
+        }
+
+        /* Skip the vectors which went out in full, and trim the next one. */
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return KMEANS_OK;
+}
+
+
+/* Write out every filled buffer, and start over at the first one. */
+static
+void
+output_flush(output_writer *w)
+{
+    struct iovec iov[KMEANS_OUTPUT_BUFFERS];
+    int count = 0;
+
+    for (size_t b = 0; b <= w->current; ++b) {
+        if (!w->lengths[b]) continue;
+
+        iov[count].iov_base = w->buffers + (b * KMEANS_OUTPUT_BUFFER);
+        iov[count].iov_len = w->lengths[b];
+        ++count;
+    }
+
+    if (KMEANS_OK == w->result && count)
+        w->result = output_writev(w->fd, iov, count);
+
+    memset(w->lengths, 0, sizeof(w->lengths));
+    w->current = 0;
+}
+
+
+/* Get a cursor with room for at least 'length' bytes. */
+static inline
+char *
+output_reserve(output_writer *w,
+               size_t length)
+{
+    if (w->lengths[w->current] + length > KMEANS_OUTPUT_BUFFER) {
+        if (w->current + 1 == KMEANS_OUTPUT_BUFFERS)
+            output_flush(w);
+        else
+            ++w->current;
+    }
+
+    return w->buffers + (w->current * KMEANS_OUTPUT_BUFFER)
+        + w->lengths[w->current];
+}
+
+
+/* Mark everything up to 'cursor' as written. */
+static inline
+void
+output_commit(output_writer *w,
+              const char *cursor)
+{
+    w->lengths[w->current] =
+        cursor - (w->buffers + (w->current * KMEANS_OUTPUT_BUFFER));
+}
+
+
+static
+kmeans_result
+output_open(output_writer *w,
+            int fd)
+{
+    memset(w, 0, sizeof(output_writer));
+    w->fd = fd;
+    w->buffers = malloc((size_t)KMEANS_OUTPUT_BUFFER * KMEANS_OUTPUT_BUFFERS);
+
+    return w->buffers ? KMEANS_OK : KMEANS_NO_MEMORY;
+}
+
+
+static
+kmeans_result
+output_close(output_writer *w)
+{
+    if (w->buffers) output_flush(w);
+    free(w->buffers);
+    w->buffers = NULL;
+
+    return w->result;
+}
+
+
+/* Format an unsigned integer, with at least 'width' digits. */
+static inline
+char *
+output_unsigned(char *out,
+                uint64_t value,
+                int width)
+{
+    char digits[24];
+    int count = 0;
+
+    do {
+        digits[count++] = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value);
+
+    while (count < width) digits[count++] = '0';
+    while (count) *(out++) = digits[--count];
+
+    return out;
+}
+
+
+static inline
+char *
+output_int(char *out,
+           long value)
+{
+    if (value < 0) {
+        *(out++) = '-';
+        return output_unsigned(out, -(uint64_t)value, 1);
+    }
+
+    return output_unsigned(out, (uint64_t)value, 1);
+}
+
+
+/* Format a double with a fixed amount of decimals, like "%.*f" does. */
+static inline
+char *
+output_double(output_writer *w,
+              char *out,
+              double value,
+              int precision,
+              uint64_t scale)
+{
+    double magnitude = fabs(value);
+
+    if (!(magnitude < OUTPUT_FAST_LIMIT)) {
+        output_commit(w, out);
+        out = output_reserve(w, OUTPUT_MAX_FALLBACK);
+        return out + snprintf(out, OUTPUT_MAX_FALLBACK, "%.*f", precision, value);
+    }
+
+    /*
+     * Both the whole part and the remaining fraction are exact. The scaled
+     * fraction is rounded once, and fma() recovers that rounding error, so
+     * halfway cases are told apart exactly and go to even like printf's.
+     */
+    uint64_t whole = (uint64_t)magnitude;
+    double rest = magnitude - (double)whole;
+    double scaled = rest * (double)scale;
+    double floor_scaled = floor(scaled);
+    double above = scaled - floor_scaled;
+    uint64_t fraction = (uint64_t)floor_scaled;
+
+    if (above > 0.5) {
+        ++fraction;
+    } else if (0.5 == above) {
+        double error = fma(rest, (double)scale, -scaled);
+        uint64_t last = precision ? fraction : whole;
+
+        if (error > 0.0 || (0.0 == error && (last & 1))) ++fraction;
+    }
+
+    if (fraction >= scale) {
+        ++whole;
+        fraction -= scale;
+    }
+
+    if (signbit(value)) *(out++) = '-';
+    out = output_unsigned(out, whole, 1);
+
+    if (precision) {
+        *(out++) = '.';
+        out = output_unsigned(out, fraction, precision);
+    }
+
+    return out;
+}
+
+
+/* Get 10 to the power of a clamped precision. */
+static
+uint64_t
+output_scale(int *precision)
+{
+    uint64_t scale = 1;
+
+    if (*precision < 0) *precision = 0;
+    if (*precision > KMEANS_OUTPUT_MAX_PRECISION)
+        *precision = KMEANS_OUTPUT_MAX_PRECISION;
+
+    for (int p = 0; p < *precision; ++p) scale *= 10;
+    return scale;
+}
+
+
+/* Write the values of a row-major matrix row, or a column-major point. */
+static inline
+char *
+output_values(output_writer *w,
+              char *out,
+              const double *values,
+              size_t dim,
+              size_t step,
+              int precision,
+              uint64_t scale)
+{
+    for (size_t d = 0; d < dim; ++d) {
+        out = output_double(w, out, values[d * step], precision, scale);
+        if (d + 1 < dim) {
+            *(out++) = ',';
+            *(out++) = ' ';
+        }
+
+        output_commit(w, out);
+        out = output_reserve(w, OUTPUT_MAX_FIELD);
+    }
+
+    return out;
+}
+
+
+kmeans_result
+kmeans_output_csv(int fd,
+                  const char *header,
+                  const double *data,
+                  size_t num_objects,
+                  size_t dim,
+                  kmeans_layout layout,
+                  const int *assignments,
+                  int precision)
+{
+    output_writer w;
+    uint64_t scale = output_scale(&precision);
+
+    if (!data || !assignments) return KMEANS_NO_DATA;
+    if (KMEANS_OK != output_open(&w, fd)) return KMEANS_NO_MEMORY;
+
+    if (header) {
+        size_t length = strlen(header);
+        struct iovec iov[2] = {
+                { .iov_base = (void *)header, .iov_len = length },
+                { .iov_base = "\n", .iov_len = 1 },
+        };
+
+        w.result = output_writev(fd, iov, 2);
+    }
+
+    for (size_t i = 0; i < num_objects && KMEANS_OK == w.result; ++i) {
+        const double *values = (KMEANS_ROW_MAJOR == layout)
+            ? data + (i * dim)
+            : data + i;
+        const size_t step = (KMEANS_ROW_MAJOR == layout) ? 1 : num_objects;
+        char *out = output_reserve(&w, OUTPUT_MAX_FIELD);
+
+        out = output_values(&w, out, values, dim, step, precision, scale);
+
+        *(out++) = ',';
+        *(out++) = ' ';
+        out = output_int(out, assignments[i]);
+        *(out++) = '\n';
+        output_commit(&w, out);
+    }
+
+    return output_close(&w);
+}
+
+
+kmeans_result
+kmeans_output_labels(int fd,
+                     const int *assignments,
+                     size_t num_objects,
+                     kmeans_label_type type)
+{
+    if (!assignments) return KMEANS_NO_DATA;
+
+    /* The assignments already are int32 labels in memory; send them as-is. */
+    if (KMEANS_LABELS_INT32 == type) {
+        struct iovec iov = {
+                .iov_base = (void *)assignments,
+                .iov_len = sizeof(int32_t) * num_objects,
+        };
+
+        return output_writev(fd, &iov, 1);
+    }
+
+    output_writer w;
+    if (KMEANS_OK != output_open(&w, fd)) return KMEANS_NO_MEMORY;
+
+    for (size_t i = 0; i < num_objects && KMEANS_OK == w.result; ++i) {
+        if (assignments[i] < 0 || assignments[i] > UINT16_MAX) {
+            w.result = KMEANS_BAD_LENGTH;
+            break;
+        }
+
+        uint16_t label = (uint16_t)assignments[i];
+        char *out = output_reserve(&w, sizeof(uint16_t));
+
+        memcpy(out, &label, sizeof(uint16_t));
+        output_commit(&w, out + sizeof(uint16_t));
+    }
+
+    return output_close(&w);
+}
+
+
+kmeans_result
+kmeans_output_centroids(int fd,
+                        const double *centroids,
+                        size_t num_centroids,
+                        size_t dim,
+                        int precision)
+{
+    output_writer w;
+    uint64_t scale = output_scale(&precision);
+
+    if (!centroids) return KMEANS_NO_DATA;
+    if (KMEANS_OK != output_open(&w, fd)) return KMEANS_NO_MEMORY;
+
+    for (size_t c = 0; c < num_centroids && KMEANS_OK == w.result; ++c) {
+        char *out = output_reserve(&w, OUTPUT_MAX_FIELD);
+
+        out = output_values(&w, out, centroids + (c * dim), dim, 1,
+                            precision, scale);
+        *(out++) = '\n';
+        output_commit(&w, out);
+    }
+
+    return output_close(&w);
+}
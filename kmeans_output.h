@@ -0,0 +1,75 @@
+/*
+ * kmeans_output.h
+ *
+ * Writers for clustering results: full CSV rows, binary labels only, or the
+ *  centroids only. Every writer formats into large buffers of its own and
+ *  hands them to the kernel a few at a time with writev().
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_OUTPUT_H
+#define CIS579_TERMPROJECT_KMEANS_OUTPUT_H
+
+#include <stdlib.h>
+
+#include "kmeans.h"
+
+
+/* Size of each output buffer, and how many fill up before one writev(). */
+#define KMEANS_OUTPUT_BUFFER (256 * 1024)
+#define KMEANS_OUTPUT_BUFFERS 8
+
+/* The most decimals accepted for formatted values. */
+#define KMEANS_OUTPUT_MAX_PRECISION 9
+
+
+/* Element types for binary label output. */
+typedef enum
+{
+    KMEANS_LABELS_INT32 = 0,   /* native-endian int32_t per point */
+    KMEANS_LABELS_UINT16       /* native-endian uint16_t per point, k <= 65536 */
+} kmeans_label_type;
+
+
+/*
+ * Write every point as a CSV row of its values followed by its cluster, like
+ *  "1.500000, -2.000000, 3". Values get 'precision' decimals and exactly the
+ *  digits of printf("%.*f"), including halfway rounding. Very large
+ *  magnitudes and non-finite values are handed to printf itself. The
+ *  optional 'header' line is written first.
+ */
+kmeans_result
+kmeans_output_csv(
+    int                fd          IN,
+    const char        *header      IN,
+    const double      *data        IN,
+    size_t             num_objects IN,
+    size_t             dim         IN,
+    kmeans_layout      layout      IN,
+    const int         *assignments IN,
+    int                precision   IN
+);
+
+/*
+ * Write only the cluster of every point as raw binary labels. Int32 labels are
+ *  written straight from the assignments without any copy.
+ */
+kmeans_result
+kmeans_output_labels(
+    int                fd          IN,
+    const int         *assignments IN,
+    size_t             num_objects IN,
+    kmeans_label_type  type        IN
+);
+
+/* Write only the row-major centroids as CSV rows, one centroid per line. */
+kmeans_result
+kmeans_output_centroids(
+    int                fd            IN,
+    const double      *centroids     IN,
+    size_t             num_centroids IN,
+    size_t             dim           IN,
+    int                precision     IN
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_OUTPUT_H */
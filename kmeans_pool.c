@@ -0,0 +1,230 @@
+/*
+ * kmeans_pool.c
+ *
+ * Implementation of the persistent thread pool.
+ */
+
+#include "kmeans_pool.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+
+struct _kmeans_pool
+{
+    /* Worker threads. The calling thread acts as thread 0 and is not here. */
+    pthread_t *threads;
+
+    /* Total amount of threads running each job, including the caller. */
+    size_t num_threads;
+
+    /* Guards every field below. */
+    pthread_mutex_t lock;
+
+    /* Signalled when a new job is published (or the pool is stopping). */
+    pthread_cond_t job_ready;
+
+    /* Signalled when the last worker finishes the current job. */
+    pthread_cond_t job_done;
+
+    /* The current job, and a counter which changes on every publish. */
+    func_pool_job_t job;
+    void *context;
+    unsigned long generation;
+
+    /* Workers which have not finished the current job yet. */
+    size_t pending;
+
+    /* Set when the pool is being destroyed. */
+    int stopping;
+};
+
+
+/* Arguments handed to each worker on creation. */
+typedef struct
+{
+    kmeans_pool *pool;
+    size_t index;
+} pool_worker;
+
+
+static
+void *
+pool_worker_main(void *argument)
+{
+    pool_worker *worker = (pool_worker *)argument;
+    kmeans_pool *pool = worker->pool;
+    size_t index = worker->index;
+    unsigned long seen = 0;
+
+    free(worker);
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stopping && pool->generation == seen)
+            pthread_cond_wait(&pool->job_ready, &pool->lock);
+
+        if (pool->stopping) break;
+
+        seen = pool->generation;
+        func_pool_job_t job = pool->job;
+        void *context = pool->context;
+        pthread_mutex_unlock(&pool->lock);
+
+        job(context, index, pool->num_threads);
+
+        pthread_mutex_lock(&pool->lock);
+        if (0 == --pool->pending)
+            pthread_cond_signal(&pool->job_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+
+kmeans_pool *
+kmeans_pool_create(size_t num_threads)
+{
+    if (!num_threads) num_threads = 1;
+
+    kmeans_pool *pool = calloc(1, sizeof(kmeans_pool));
+    if (!pool) return NULL;
+
+    pool->num_threads = num_threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+
+    if (num_threads > 1) {
+        pool->threads = calloc(num_threads - 1, sizeof(pthread_t));
+        if (!pool->threads) goto fail;
+    }
+
+    size_t created = 0;
+
+    for (size_t i = 1; i < num_threads; ++i, ++created) {
+        pool_worker *worker = malloc(sizeof(pool_worker));
+        if (!worker) goto fail_join;
+
+        worker->pool = pool;
+        worker->index = i;
+
+        if (0 != pthread_create(&pool->threads[i - 1], NULL,
+                                pool_worker_main, worker)) {
+            free(worker);
+            goto fail_join;
+        }
+    }
+
+    return pool;
+
+    /*
+     * Only the threads created so far need to be stopped. A failed
+     * pthread_create() leaves its handle undefined, so they are counted.
+     */
+fail_join:
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < created; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+fail:
+    pthread_cond_destroy(&pool->job_done);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+    return NULL;
+}
+
+
+void
+kmeans_pool_run(kmeans_pool *pool,
+                func_pool_job_t job,
+                void *context)
+{
+    assert(pool);
+    assert(job);
+
+    if (pool->num_threads > 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->job = job;
+        pool->context = context;
+        pool->pending = pool->num_threads - 1;
+        ++pool->generation;
+        pthread_cond_broadcast(&pool->job_ready);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    /* The calling thread always takes the first share of the work. */
+    job(context, 0, pool->num_threads);
+
+    if (pool->num_threads > 1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending)
+            pthread_cond_wait(&pool->job_done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+
+void
+kmeans_pool_partition(const size_t *offsets,
+                      size_t count,
+                      size_t num_threads,
+                      size_t *bounds)
+{
+    const size_t total = (offsets[count] - offsets[0]) + count;
+
+    bounds[0] = 0;
+    bounds[num_threads] = count;
+
+    for (size_t t = 1; t < num_threads; ++t) {
+        const size_t target = (size_t)(((double)total * t) / num_threads);
+        size_t lo = bounds[t - 1], hi = count;
+
+        /* The running weight before item 'mid' is its offset plus 'mid'. */
+        while (lo < hi) {
+            const size_t mid = lo + ((hi - lo) / 2);
+
+            if ((offsets[mid] - offsets[0]) + mid < target) lo = mid + 1;
+            else hi = mid;
+        }
+
+        bounds[t] = lo;
+    }
+}
+
+
+size_t
+kmeans_pool_size(const kmeans_pool *pool)
+{
+    assert(pool);
+    return pool->num_threads;
+}
+
+
+void
+kmeans_pool_destroy(kmeans_pool *pool)
+{
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 1; i < pool->num_threads; ++i)
+        pthread_join(pool->threads[i - 1], NULL);
+
+    pthread_cond_destroy(&pool->job_done);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
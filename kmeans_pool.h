@@ -0,0 +1,91 @@
+/*
+ * kmeans_pool.h
+ *
+ * A small persistent pool of threads for running data-parallel jobs.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_POOL_H
+#define CIS579_TERMPROJECT_KMEANS_POOL_H
+
+#include <stdlib.h>
+
+#include "kmeans.h"
+
+
+/* Opaque pool type. */
+typedef struct _kmeans_pool kmeans_pool;
+
+/*
+ * Prototypical job run by every thread of a pool. Each thread receives its
+ *  own index in [0, num_threads) alongside the shared context.
+ */
+typedef void (*func_pool_job_t) (
+    void         *context     IN OUT,   /* shared state of the job */
+    const size_t  thread      IN,   /* index of the running thread */
+    const size_t  num_threads IN   /* how many threads run the job */
+);
+
+
+/*
+ * Create a pool of 'num_threads' threads, where the calling thread counts as
+ *  thread 0. A pool of a single thread runs every job inline.
+ */
+kmeans_pool *
+kmeans_pool_create(
+    size_t num_threads IN
+);
+
+/* Run a job on every thread of the pool and wait for all of them to finish. */
+void
+kmeans_pool_run(
+    kmeans_pool     *pool    IN,
+    func_pool_job_t  job     IN,
+    void            *context IN OUT
+);
+
+/* Get the amount of threads (including the caller) which run each job. */
+size_t
+kmeans_pool_size(
+    const kmeans_pool *pool IN
+);
+
+/* Stop and join all threads, then free the pool. */
+void
+kmeans_pool_destroy(
+    kmeans_pool *pool IN
+);
+
+
+/*
+ * Get the static slice [*lo, *hi) of 'count' items owned by a thread. The
+ *  same thread always receives the same slice, which keeps the pages it
+ *  touched first local to it across iterations.
+ */
+static inline
+void
+kmeans_pool_slice(size_t count,
+                  size_t thread,
+                  size_t num_threads,
+                  size_t *lo,
+                  size_t *hi)
+{
+    *lo = (count * thread) / num_threads;
+    *hi = (count * (thread + 1)) / num_threads;
+}
+
+/*
+ * Split 'count' items of uneven cost between the threads. Item 'i' weighs
+ *  offsets[i + 1] - offsets[i] plus one, and thread 't' starts at the first
+ *  item where the running weight reaches t / num_threads of the total. Fills
+ *  num_threads + 1 bounds: thread 't' owns [bounds[t], bounds[t + 1]).
+ */
+void
+kmeans_pool_partition(
+    const size_t *offsets     IN,   /* count + 1 ascending offsets */
+    size_t        count       IN,
+    size_t        num_threads IN,
+    size_t       *bounds      OUT
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_POOL_H */
@@ -0,0 +1,259 @@
+/*
+ * kmeans_restart.c
+ *
+ * Implementation of restarted clustering. A pool thread per concurrent run
+ *  takes every num_threads-th run in turn, reusing one working set for all of
+ *  them, and hands each finished run over to the shared best under a lock.
+ */
+
+#include "kmeans_restart.h"
+#include "kmeans_seed.h"
+#include "kmeans_pool.h"
+#include "kmeans_kernels.h"
+#include "kmeans_kdtree.h"
+#include "kmeans_internal.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+
+/* State shared by every run. */
+typedef struct
+{
+    kmeans_restart_meta *meta;
+
+    /* Threads of each run's own pool. */
+    size_t run_threads;
+
+    /* Trees every KMEANS_KDTREE run shares, or NULL. */
+    const kmeans_kdtree *kdtree;
+
+    /* Everything below is guarded by the lock. */
+    pthread_mutex_t lock;
+
+    /* Final inertia and index of the best run so far, and how it ended. */
+    double best;
+    size_t best_run;
+    kmeans_result best_result;
+    unsigned long best_iterations;
+
+    /* The first outright failure of any run, or KMEANS_OK. */
+    kmeans_result failure;
+
+    unsigned long long evaluations;
+    size_t num_aborted;
+} restart_state;
+
+
+/* Stop a run which fell too far behind the best finished one. */
+static
+int
+restart_observe(const kmeans_iteration_stats *stats,
+                void *context)
+{
+    restart_state *state = (restart_state *)context;
+    double best;
+
+    pthread_mutex_lock(&state->lock);
+    best = state->best;
+    pthread_mutex_unlock(&state->lock);
+
+    return stats->inertia > best * (1.0 + state->meta->abort_margin);
+}
+
+
+/*
+ * Sum the squared distances of every point to its final centroid, weighted
+ *  like the engine's own inertia when the run has weights.
+ */
+static
+double
+restart_inertia(const kmeans_dense_meta *run,
+                double *scratch)
+{
+    const kmeans_kernels *kernels = kmeans_kernels_for(run->dim);
+    double inertia = 0.0;
+
+    for (size_t i = 0; i < run->num_objects; ++i) {
+        const double *row = kmeans_dense_row(run, i, scratch);
+        const double *centroid =
+            run->centroids + ((size_t)run->cluster_assignments[i] * run->dim);
+
+        const double distance = kernels->pair(row, centroid, run->dim);
+
+        inertia += run->weights ? run->weights[i] * distance : distance;
+    }
+
+    return inertia;
+}
+
+
+/* Record a failure, unless an earlier one was already recorded. */
+static
+void
+restart_fail(restart_state *state,
+             kmeans_result result)
+{
+    pthread_mutex_lock(&state->lock);
+    if (KMEANS_OK == state->failure) state->failure = result;
+    pthread_mutex_unlock(&state->lock);
+}
+
+
+/* Make runs thread, thread + num_threads, ... with one working set. */
+static
+void
+restart_job(void *context,
+            const size_t thread,
+            const size_t num_threads)
+{
+    restart_state *state = (restart_state *)context;
+    kmeans_restart_meta *meta = state->meta;
+    kmeans_dense_meta *dense = meta->dense;
+    kmeans_dense_meta run = *dense;
+    double *centroids = NULL;
+    double *scratch = malloc(sizeof(double) * dense->dim);
+    kmeans_result result;
+
+    run.cluster_assignments = malloc(sizeof(int) * dense->num_objects);
+    run.num_threads = state->run_threads;
+    run.kdtree = state->kdtree;
+    run.observer = (meta->abort_margin > 0.0) ? restart_observe : NULL;
+    run.observer_context = state;
+
+    if (!scratch || !run.cluster_assignments) {
+        restart_fail(state, KMEANS_NO_MEMORY);
+        goto break_out;
+    }
+
+    for (size_t r = thread; r < meta->num_runs; r += num_threads) {
+        kmeans_rng rng;
+
+        /* There is no point in going on once the call is bound to fail. */
+        pthread_mutex_lock(&state->lock);
+        result = state->failure;
+        pthread_mutex_unlock(&state->lock);
+        if (KMEANS_OK != result) break;
+
+        free(centroids);
+        centroids = NULL;
+
+        kmeans_rng_seed(&rng, meta->seed + r);
+        if (KMEANS_OK != (result = kmeans_seed_plusplus(&run, &rng, &centroids))) {
+            restart_fail(state, result);
+            break;
+        }
+
+        run.centroids = centroids;
+        result = compute_kmeans_dense(&run);
+
+        if (KMEANS_STOPPED == result) {
+            pthread_mutex_lock(&state->lock);
+            state->evaluations += run.distance_evaluations;
+            ++state->num_aborted;
+            pthread_mutex_unlock(&state->lock);
+            continue;
+        }
+
+        if (KMEANS_OK != result && KMEANS_LIMIT != result) {
+            restart_fail(state, result);
+            break;
+        }
+
+        const double inertia = restart_inertia(&run, scratch);
+
+        pthread_mutex_lock(&state->lock);
+        state->evaluations += run.distance_evaluations;
+
+        if (inertia < state->best || (inertia == state->best && r < state->best_run)) {
+            state->best = inertia;
+            state->best_run = r;
+            state->best_result = result;
+            state->best_iterations = run.current_iterations;
+
+            memcpy(dense->centroids, centroids,
+                   sizeof(double) * dense->num_centroids * dense->dim);
+            memcpy(dense->cluster_assignments, run.cluster_assignments,
+                   sizeof(int) * dense->num_objects);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+
+break_out:
+    /* No matter the result, always perform these actions. */
+    free(centroids);
+    free(scratch);
+    free(run.cluster_assignments);
+}
+
+
+kmeans_result
+compute_kmeans_restarts(kmeans_restart_meta *meta)
+{
+    assert(meta);
+    assert(meta->dense);
+    assert(meta->num_runs);
+
+    kmeans_dense_meta *dense = meta->dense;
+
+    assert(dense->data);
+    assert(dense->centroids);
+    assert(dense->cluster_assignments);
+    assert(dense->num_centroids <= dense->num_objects);
+
+    const size_t num_threads = dense->num_threads ? dense->num_threads : 1;
+    const size_t concurrent =
+        (meta->num_runs < num_threads) ? meta->num_runs : num_threads;
+    restart_state state = {
+            .meta = meta,
+            .run_threads = num_threads / concurrent,
+            .best = HUGE_VAL,
+            .best_run = meta->num_runs,
+            .failure = KMEANS_OK,
+    };
+    kmeans_dense_meta shape = *dense;
+    kmeans_kdtree *kdtree = NULL;
+    kmeans_result result;
+    kmeans_pool *pool;
+
+    meta->best_run = meta->num_runs;
+    meta->inertia = NAN;
+    meta->num_aborted = 0;
+
+    /* Build the trees once for all runs unless the caller's already fit. */
+    shape.num_threads = state.run_threads;
+    if (KMEANS_KDTREE == dense->algorithm) {
+        if (dense->kdtree && kmeans_kdtree_fits(dense->kdtree, &shape)) {
+            state.kdtree = dense->kdtree;
+        } else {
+            if (KMEANS_OK != (result = kmeans_kdtree_build(&shape, &kdtree)))
+                return result;
+            state.kdtree = kdtree;
+        }
+    }
+
+    if (!(pool = kmeans_pool_create(concurrent))) {
+        kmeans_kdtree_destroy(kdtree);
+        return KMEANS_NO_MEMORY;
+    }
+
+    pthread_mutex_init(&state.lock, NULL);
+    kmeans_pool_run(pool, restart_job, &state);
+    pthread_mutex_destroy(&state.lock);
+    kmeans_pool_destroy(pool);
+    kmeans_kdtree_destroy(kdtree);
+
+    dense->distance_evaluations = state.evaluations;
+    meta->num_aborted = state.num_aborted;
+
+    if (KMEANS_OK != state.failure) return state.failure;
+
+    /* The first run to finish is never stopped, so there always is a best. */
+    meta->best_run = state.best_run;
+    meta->inertia = state.best;
+    dense->current_iterations = state.best_iterations;
+    return state.best_result;
+}
@@ -0,0 +1,72 @@
+/*
+ * kmeans_restart.h
+ *
+ * Several independently seeded K-Means Clustering runs over one dataset,
+ *  keeping the run with the lowest inertia. Runs go on concurrently over the
+ *  same read-only matrix, each with a working set of its own: centroids,
+ *  assignments, and whatever bounds its engine keeps.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_RESTART_H
+#define CIS579_TERMPROJECT_KMEANS_RESTART_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "kmeans.h"
+
+
+/* Meta-structure for a clustering restarted from several seedings. */
+typedef struct
+{
+    /*
+     * Template for every run: the data and its shape, num_centroids,
+     * iterations, algorithm, num_groups, weights and the stopping
+     * tolerances. Runs are ranked by their weighted inertia then. Its
+     * centroids (num_centroids x dim, row-major) and cluster_assignments
+     * receive the best run, and need not be seeded. Its num_threads are
+     * shared among the concurrent runs. Its observer is not used. Runs of
+     * KMEANS_KDTREE share one set of trees, its kdtree if that fits them.
+     *
+     * Afterwards, current_iterations is that of the best run, while
+     * distance_evaluations counts every run.
+     */
+    kmeans_dense_meta *dense;
+
+    /* How many runs to make, AKA 'n_init'. */
+    size_t num_runs;
+
+    /* Run 'r' is seeded with k-means++ from a generator seeded with seed + r. */
+    uint64_t seed;
+
+    /*
+     * Stop a run once its inertia is worse than the best finished run by
+     * more than this fraction of it, since a run rarely catches up from far
+     * behind. Zero lets every run finish. Which runs get stopped depends on
+     * timing, and watching the inertia costs an extra pass per iteration.
+     * Otherwise the outcome only depends on the seed and num_threads.
+     */
+    double abort_margin;
+
+    /* Index of the winning run, and its inertia. Output only. */
+    size_t best_run;
+    double inertia;
+
+    /* How many runs were stopped for falling behind. Output only. */
+    size_t num_aborted;
+} kmeans_restart_meta;
+
+
+/*
+ * Cluster meta->dense num_runs times and keep the run of the lowest inertia,
+ *  measured with its final centroids; ties go to the lower run. Returns the
+ *  result of that run: KMEANS_OK, or KMEANS_LIMIT when it ran out of
+ *  iterations. Any run failing outright fails the whole call.
+ */
+kmeans_result
+compute_kmeans_restarts(
+    kmeans_restart_meta *meta IN OUT
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_RESTART_H */
@@ -0,0 +1,663 @@
+/*
+ * kmeans_seed.c
+ *
+ * Implementation of the k-means++ and k-means|| seeding routines. Both keep
+ *  the squared distance from every point to its closest pick so far, and
+ *  refresh it on the thread pool after each new batch of picks.
+ */
+
+#include "kmeans_seed.h"
+#include "kmeans_pool.h"
+#include "kmeans_kernels.h"
+#include "kmeans_internal.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+
+/* Sampling passes of k-means||, and candidates drawn per pass per centroid. */
+#define SEED_ROUNDS 5
+#define SEED_OVERSAMPLING 2
+
+/* Weighted Lloyd steps spent reducing the k-means|| candidates to k. */
+#define SEED_REDUCE_ITERATIONS 10
+
+
+/* State shared by every thread of a seeding pass. */
+typedef struct
+{
+    const kmeans_dense_meta *meta;
+    const kmeans_kernels *kernels;
+
+    /*
+     * Squared distance from each point to its closest pick, and block sums.
+     * With point weights, each distance times its weight goes to 'scores',
+     * and the block sums add those instead.
+     */
+    double *nearest;
+    double *scores;
+    double *block_sums;
+    size_t num_blocks;
+
+    /* The picks to fold into 'nearest', as a single row or as a block. */
+    const double *pick;
+    const double *picks_t;
+    size_t stride;
+
+    /* k-means|| sampling: the stream for this pass, and the l / psi factor. */
+    uint64_t stream;
+    double factor;
+
+    /*
+     * Per-thread sampled points, and per-thread candidate weights. With point
+     * weights, the closest candidate of every point goes to 'closest'
+     * instead, so their weights are summed in point order.
+     */
+    size_t **sampled;
+    size_t *num_sampled;
+    size_t *cap_sampled;
+    size_t **weights;
+    int *closest;
+
+    /* Per-thread gathered rows for column-major data. */
+    double *rows;
+
+    /* Set by any thread which runs out of memory. */
+    int failed;
+} seed_context;
+
+
+/* Get point 'i' as a contiguous row, gathering it into 'scratch' if needed. */
+static inline
+const double *
+seed_row(const kmeans_dense_meta *meta,
+         size_t i,
+         double *scratch)
+{
+    return kmeans_dense_row(meta, i, scratch);
+}
+
+
+/* Get the bounds of one fixed block of points. */
+static inline
+void
+seed_block(const seed_context *context,
+           size_t b,
+           size_t *lo,
+           size_t *hi)
+{
+    *lo = b * KMEANS_DRAW_BLOCK;
+    *hi = *lo + KMEANS_DRAW_BLOCK;
+    if (*hi > context->meta->num_objects) *hi = context->meta->num_objects;
+}
+
+
+/*
+ * Fold the latest picks into every point's closest distance, and sum those
+ *  distances per block. Each thread owns a static slice of the blocks.
+ */
+static
+void
+seed_job_update(void *context,
+                const size_t thread,
+                const size_t num_threads)
+{
+    seed_context *c = (seed_context *)context;
+    const kmeans_dense_meta *meta = c->meta;
+    double *scratch = c->rows + (thread * meta->dim);
+    size_t first, last;
+
+    kmeans_pool_slice(c->num_blocks, thread, num_threads, &first, &last);
+
+    for (size_t b = first; b < last; ++b) {
+        double sum = 0.0;
+        size_t lo, hi;
+
+        seed_block(c, b, &lo, &hi);
+        for (size_t i = lo; i < hi; ++i) {
+            const double *row = seed_row(meta, i, scratch);
+            double distance;
+
+            if (c->pick)
+                distance = c->kernels->pair(row, c->pick, meta->dim);
+            else
+                c->kernels->nearest(row, c->picks_t, c->stride,
+                                    meta->dim, &distance);
+
+            if (distance < c->nearest[i]) c->nearest[i] = distance;
+
+            if (c->scores) {
+                c->scores[i] = meta->weights[i] * c->nearest[i];
+                sum += c->scores[i];
+            } else {
+                sum += c->nearest[i];
+            }
+        }
+
+        c->block_sums[b] = sum;
+    }
+}
+
+
+/*
+ * Sample every point independently with probability l * w(x) * D(x)^2 / psi,
+ *  where w(x) is 1 without weights. Each point draws from a generator keyed
+ *  by its own index, so the sample does not depend on how points are split
+ *  between threads.
+ */
+static
+void
+seed_job_sample(void *context,
+                const size_t thread,
+                const size_t num_threads)
+{
+    seed_context *c = (seed_context *)context;
+    const double *scores = c->scores ? c->scores : c->nearest;
+    size_t lo, hi;
+
+    kmeans_pool_slice(c->meta->num_objects, thread, num_threads, &lo, &hi);
+
+    for (size_t i = lo; i < hi; ++i) {
+        uint64_t key = c->stream + i;
+        double u = (kmeans_rng_mix(&key) >> 11) * (1.0 / 9007199254740992.0);
+
+        if (!(u < c->factor * scores[i])) continue;
+
+        if (c->num_sampled[thread] == c->cap_sampled[thread]) {
+            size_t cap = c->cap_sampled[thread] ? 2 * c->cap_sampled[thread] : 64;
+            size_t *grown = realloc(c->sampled[thread], sizeof(size_t) * cap);
+
+            if (!grown) {
+                c->failed = 1;
+                return;
+            }
+
+            c->sampled[thread] = grown;
+            c->cap_sampled[thread] = cap;
+        }
+
+        c->sampled[thread][c->num_sampled[thread]++] = i;
+    }
+}
+
+
+/*
+ * Count how many points are closest to each candidate, or with weights,
+ *  record the closest candidate of every point.
+ */
+static
+void
+seed_job_weigh(void *context,
+               const size_t thread,
+               const size_t num_threads)
+{
+    seed_context *c = (seed_context *)context;
+    const kmeans_dense_meta *meta = c->meta;
+    double *scratch = c->rows + (thread * meta->dim);
+    size_t lo, hi;
+
+    kmeans_pool_slice(meta->num_objects, thread, num_threads, &lo, &hi);
+
+    for (size_t i = lo; i < hi; ++i) {
+        const double *row = seed_row(meta, i, scratch);
+        int candidate = c->kernels->nearest(row, c->picks_t, c->stride,
+                                            meta->dim, NULL);
+
+        if (c->closest) c->closest[i] = candidate;
+        else ++c->weights[thread][candidate];
+    }
+}
+
+
+size_t
+kmeans_draw(kmeans_rng *rng,
+            const double *scores,
+            size_t n,
+            const double *block_sums)
+{
+    size_t num_blocks = (n + KMEANS_DRAW_BLOCK - 1) / KMEANS_DRAW_BLOCK;
+    double total = 0.0;
+    size_t last = n;
+
+    if (block_sums) {
+        for (size_t b = 0; b < num_blocks; ++b) total += block_sums[b];
+    } else {
+        for (size_t i = 0; i < n; ++i) total += scores[i];
+    }
+
+    /* When every point sits on a pick already, any point will do. */
+    if (!(total > 0.0)) return kmeans_rng_below(rng, n);
+
+    double target = kmeans_rng_uniform(rng) * total;
+    size_t b = 0;
+
+    /* Skip the blocks which end before the target. */
+    if (block_sums) {
+        for (; b + 1 < num_blocks && target >= block_sums[b]; ++b)
+            target -= block_sums[b];
+    }
+
+    for (size_t i = b * KMEANS_DRAW_BLOCK; i < n; ++i) {
+        if (scores[i] > 0.0) {
+            last = i;
+            if (target < scores[i]) return i;
+            target -= scores[i];
+        }
+    }
+
+    /* Rounding left the target just past the end; take the last candidate. */
+    return last;
+}
+
+
+void
+kmeans_plusplus(const kmeans_kernels *kernels,
+                const double *points,
+                const double *weights,
+                size_t m,
+                size_t dim,
+                size_t k,
+                kmeans_rng *rng,
+                double *nearest,
+                double *scores,
+                double *centroids)
+{
+    size_t first = weights ? kmeans_draw(rng, weights, m, NULL)
+                           : kmeans_rng_below(rng, m);
+
+    for (size_t i = 0; i < m; ++i) nearest[i] = HUGE_VAL;
+    memcpy(centroids, points + (first * dim), sizeof(double) * dim);
+
+    for (size_t c = 1; c < k; ++c) {
+        const double *pick = centroids + ((c - 1) * dim);
+
+        for (size_t i = 0; i < m; ++i) {
+            const double distance = kernels->pair(points + (i * dim), pick, dim);
+
+            if (distance < nearest[i]) nearest[i] = distance;
+            if (weights) scores[i] = weights[i] * nearest[i];
+        }
+
+        const size_t i = kmeans_draw(rng, weights ? scores : nearest, m, NULL);
+        memcpy(centroids + (c * dim), points + (i * dim), sizeof(double) * dim);
+    }
+}
+
+
+/* Allocate the shared context of a seeding run. */
+static
+kmeans_result
+seed_context_create(seed_context *c,
+                    const kmeans_dense_meta *meta,
+                    size_t num_threads)
+{
+    memset(c, 0, sizeof(seed_context));
+
+    c->meta = meta;
+    c->kernels = kmeans_kernels_for(meta->dim);
+    c->num_blocks = (meta->num_objects + KMEANS_DRAW_BLOCK - 1) / KMEANS_DRAW_BLOCK;
+    c->nearest = malloc(sizeof(double) * meta->num_objects);
+    c->block_sums = malloc(sizeof(double) * c->num_blocks);
+    c->rows = malloc(sizeof(double) * num_threads * meta->dim);
+
+    if (!c->nearest || !c->block_sums || !c->rows) return KMEANS_NO_MEMORY;
+
+    if (meta->weights
+        && !(c->scores = malloc(sizeof(double) * meta->num_objects)))
+        return KMEANS_NO_MEMORY;
+
+    for (size_t i = 0; i < meta->num_objects; ++i) c->nearest[i] = HUGE_VAL;
+    return KMEANS_OK;
+}
+
+
+static
+void
+seed_context_destroy(seed_context *c)
+{
+    free(c->nearest);
+    free(c->scores);
+    free(c->block_sums);
+    free(c->rows);
+}
+
+
+/* Draw the first pick: uniformly, or in proportion to the point weights. */
+static inline
+size_t
+seed_first(const kmeans_dense_meta *meta,
+           kmeans_rng *rng)
+{
+    if (meta->weights)
+        return kmeans_draw(rng, meta->weights, meta->num_objects, NULL);
+
+    return kmeans_rng_below(rng, meta->num_objects);
+}
+
+
+/* Copy point 'i' into a row-major centroid. */
+static inline
+void
+seed_copy(const kmeans_dense_meta *meta,
+          size_t i,
+          double *centroid)
+{
+    const double *row = kmeans_dense_row(meta, i, centroid);
+
+    if (row != centroid)
+        memcpy(centroid, row, sizeof(double) * meta->dim);
+}
+
+
+static
+void
+seed_assert(const kmeans_dense_meta *meta,
+            kmeans_rng *rng,
+            double **centroids)
+{
+    assert(meta);
+    assert(rng);
+    assert(centroids);
+
+    assert(meta->data);
+    assert(meta->num_objects);
+    assert(meta->dim);
+    assert(meta->num_centroids);
+    assert(meta->num_centroids <= meta->num_objects);
+}
+
+
+kmeans_result
+kmeans_seed_plusplus(const kmeans_dense_meta *meta,
+                     kmeans_rng *rng,
+                     double **centroids)
+{
+    seed_assert(meta, rng, centroids);
+
+    const size_t n = meta->num_objects;
+    const size_t dim = meta->dim;
+    size_t num_threads = meta->num_threads ? meta->num_threads : 1;
+    kmeans_pool *pool = NULL;
+    seed_context c;
+    kmeans_result result;
+
+    *centroids = malloc(sizeof(double) * meta->num_centroids * dim);
+
+    if (KMEANS_OK != (result = seed_context_create(&c, meta, num_threads))
+        || !*centroids
+        || !(pool = kmeans_pool_create(num_threads))) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    seed_copy(meta, seed_first(meta, rng), *centroids);
+
+    for (size_t k = 1; k < meta->num_centroids; ++k) {
+        c.pick = *centroids + ((k - 1) * dim);
+        kmeans_pool_run(pool, seed_job_update, &c);
+
+        seed_copy(meta,
+                  kmeans_draw(rng, c.scores ? c.scores : c.nearest, n,
+                              c.block_sums),
+                  *centroids + (k * dim));
+    }
+
+    result = KMEANS_OK;
+
+break_out:
+    if (KMEANS_OK != result) {
+        free(*centroids);
+        *centroids = NULL;
+    }
+    kmeans_pool_destroy(pool);
+    seed_context_destroy(&c);
+    return result;
+}
+
+
+/*
+ * Reduce weighted candidates to k centroids: weighted k-means++ followed by
+ *  a few weighted Lloyd steps. There are only O(k) candidates, so this runs
+ *  serially.
+ */
+static
+kmeans_result
+seed_reduce(const kmeans_kernels *kernels,
+            const double *candidates,
+            const double *weights,
+            size_t m,
+            size_t dim,
+            size_t k,
+            kmeans_rng *rng,
+            double *centroids)
+{
+    kmeans_result result = KMEANS_NO_MEMORY;
+    double *nearest = malloc(sizeof(double) * m);
+    double *scores = malloc(sizeof(double) * m);
+    double *sums = malloc(sizeof(double) * k * dim);
+    double *counts = malloc(sizeof(double) * k);
+    int *assignments = malloc(sizeof(int) * m);
+    double *centroids_t = kmeans_block_alloc(k, dim);
+    const size_t stride = kmeans_block_stride(k);
+
+    if (!nearest
+        || !scores
+        || !sums
+        || !counts
+        || !assignments
+        || !centroids_t)
+        goto break_out;
+
+    kmeans_plusplus(kernels, candidates, weights, m, dim, k, rng,
+                    nearest, scores, centroids);
+
+    for (size_t iteration = 0; iteration < SEED_REDUCE_ITERATIONS; ++iteration) {
+        size_t changed = 0;
+
+        memset(sums, 0, sizeof(double) * k * dim);
+        memset(counts, 0, sizeof(double) * k);
+        kmeans_block_transpose(centroids, k, dim, centroids_t);
+
+        for (size_t i = 0; i < m; ++i) {
+            const double *row = candidates + (i * dim);
+            int cluster = kernels->nearest(row, centroids_t, stride, dim, NULL);
+
+            if (iteration && assignments[i] != cluster) ++changed;
+            assignments[i] = cluster;
+
+            for (size_t d = 0; d < dim; ++d)
+                sums[(cluster * dim) + d] += weights[i] * row[d];
+            counts[cluster] += weights[i];
+        }
+
+        /* Empty clusters keep their pick, like in the main loop. */
+        for (size_t c = 0; c < k; ++c)
+            if (counts[c] > 0.0)
+                for (size_t d = 0; d < dim; ++d)
+                    centroids[(c * dim) + d] = sums[(c * dim) + d] / counts[c];
+
+        if (iteration && !changed) break;
+    }
+
+    result = KMEANS_OK;
+
+break_out:
+    free(nearest);
+    free(scores);
+    free(sums);
+    free(counts);
+    free(assignments);
+    free(centroids_t);
+    return result;
+}
+
+
+kmeans_result
+kmeans_seed_parallel(const kmeans_dense_meta *meta,
+                     kmeans_rng *rng,
+                     double **centroids)
+{
+    seed_assert(meta, rng, centroids);
+
+    const size_t n = meta->num_objects;
+    const size_t dim = meta->dim;
+    const size_t k = meta->num_centroids;
+    size_t num_threads = meta->num_threads ? meta->num_threads : 1;
+    kmeans_pool *pool = NULL;
+    double *candidates = NULL;
+    double *weights = NULL;
+    double *picks_t = NULL;
+    size_t num_candidates = 1;
+    seed_context c;
+    kmeans_result result;
+
+    *centroids = NULL;
+
+    if (num_threads > n) num_threads = n;
+    if (KMEANS_OK != (result = seed_context_create(&c, meta, num_threads)))
+        goto break_out;
+
+    c.sampled = calloc(num_threads, sizeof(size_t *));
+    c.num_sampled = calloc(num_threads, sizeof(size_t));
+    c.cap_sampled = calloc(num_threads, sizeof(size_t));
+    c.weights = calloc(num_threads, sizeof(size_t *));
+    candidates = malloc(sizeof(double) * dim);
+
+    if (!c.sampled
+        || !c.num_sampled
+        || !c.cap_sampled
+        || !c.weights
+        || !candidates
+        || !(pool = kmeans_pool_create(num_threads))) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    seed_copy(meta, seed_first(meta, rng), candidates);
+    c.pick = candidates;
+    kmeans_pool_run(pool, seed_job_update, &c);
+
+    for (size_t round = 0; round < SEED_ROUNDS; ++round) {
+        double psi = 0.0;
+        size_t added = 0;
+
+        for (size_t b = 0; b < c.num_blocks; ++b) psi += c.block_sums[b];
+        if (!(psi > 0.0)) break;
+
+        c.stream = kmeans_rng_next(rng);
+        c.factor = (double)(SEED_OVERSAMPLING * k) / psi;
+        memset(c.num_sampled, 0, sizeof(size_t) * num_threads);
+        kmeans_pool_run(pool, seed_job_sample, &c);
+
+        if (c.failed) {
+            result = KMEANS_NO_MEMORY;
+            goto break_out;
+        }
+
+        for (size_t t = 0; t < num_threads; ++t) added += c.num_sampled[t];
+        if (!added) continue;
+
+        /* Append the new candidates in point order, whatever the threads. */
+        double *grown = realloc(candidates,
+                                sizeof(double) * (num_candidates + added) * dim);
+        if (!grown) {
+            result = KMEANS_NO_MEMORY;
+            goto break_out;
+        }
+        candidates = grown;
+
+        const size_t start = num_candidates;
+        for (size_t t = 0; t < num_threads; ++t)
+            for (size_t j = 0; j < c.num_sampled[t]; ++j)
+                seed_copy(meta, c.sampled[t][j],
+                          candidates + ((num_candidates++) * dim));
+
+        /* The last round's distances are never sampled from again. */
+        if (round + 1 == SEED_ROUNDS) break;
+
+        /* Fold this round's candidates into the closest distances at once. */
+        free(picks_t);
+        if (!(picks_t = kmeans_block_alloc(added, dim))) {
+            result = KMEANS_NO_MEMORY;
+            goto break_out;
+        }
+        kmeans_block_transpose(candidates + (start * dim), added, dim, picks_t);
+
+        c.pick = NULL;
+        c.picks_t = picks_t;
+        c.stride = kmeans_block_stride(added);
+        kmeans_pool_run(pool, seed_job_update, &c);
+    }
+
+    /* Too few distinct candidates to reduce; fall back to plain k-means++. */
+    if (num_candidates <= k) {
+        result = kmeans_seed_plusplus(meta, rng, centroids);
+        goto break_out;
+    }
+
+    /* Weigh each candidate by the points closest to it, or by their weights. */
+    free(picks_t);
+    weights = calloc(num_candidates, sizeof(double));
+    *centroids = malloc(sizeof(double) * k * dim);
+
+    if (!(picks_t = kmeans_block_alloc(num_candidates, dim))
+        || !weights
+        || !*centroids) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    if (meta->weights) {
+        if (!(c.closest = malloc(sizeof(int) * n))) {
+            result = KMEANS_NO_MEMORY;
+            goto break_out;
+        }
+    } else {
+        for (size_t t = 0; t < num_threads; ++t) {
+            if (!(c.weights[t] = calloc(num_candidates, sizeof(size_t)))) {
+                result = KMEANS_NO_MEMORY;
+                goto break_out;
+            }
+        }
+    }
+
+    kmeans_block_transpose(candidates, num_candidates, dim, picks_t);
+    c.picks_t = picks_t;
+    c.stride = kmeans_block_stride(num_candidates);
+    kmeans_pool_run(pool, seed_job_weigh, &c);
+
+    if (meta->weights) {
+        for (size_t i = 0; i < n; ++i)
+            weights[c.closest[i]] += meta->weights[i];
+    } else {
+        for (size_t t = 0; t < num_threads; ++t)
+            for (size_t j = 0; j < num_candidates; ++j)
+                weights[j] += (double)c.weights[t][j];
+    }
+
+    result = seed_reduce(c.kernels, candidates, weights, num_candidates,
+                         dim, k, rng, *centroids);
+
+break_out:
+    if (KMEANS_OK != result) {
+        free(*centroids);
+        *centroids = NULL;
+    }
+    kmeans_pool_destroy(pool);
+    for (size_t t = 0; t < num_threads; ++t) {
+        if (c.sampled) free(c.sampled[t]);
+        if (c.weights) free(c.weights[t]);
+    }
+    free(c.sampled);
+    free(c.num_sampled);
+    free(c.cap_sampled);
+    free(c.weights);
+    free(c.closest);
+    free(candidates);
+    free(weights);
+    free(picks_t);
+    seed_context_destroy(&c);
+    return result;
+}
@@ -0,0 +1,134 @@
+/*
+ * kmeans_seed.h
+ *
+ * Seeding routines which pick initial centroids for a dense clustering run,
+ *  and the small random number generator they draw from.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_SEED_H
+#define CIS579_TERMPROJECT_KMEANS_SEED_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "kmeans.h"
+
+
+/*
+ * A xoshiro256** generator. All of its state lives in this structure, so
+ *  separate generators can be used from separate threads without locking,
+ *  and equal seeds always give equal sequences on every platform.
+ */
+typedef struct
+{
+    uint64_t s[4];
+} kmeans_rng;
+
+
+/* One step of splitmix64, which spreads any seed over the whole state. */
+static inline
+uint64_t
+kmeans_rng_mix(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+/* Seed a generator. */
+static inline
+void
+kmeans_rng_seed(kmeans_rng *rng,
+                uint64_t seed)
+{
+    for (int i = 0; i < 4; ++i) rng->s[i] = kmeans_rng_mix(&seed);
+}
+
+
+/* Get the next 64 random bits. */
+static inline
+uint64_t
+kmeans_rng_next(kmeans_rng *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t result = s[1] * 5;
+    uint64_t t = s[1] << 17;
+
+    result = ((result << 7) | (result >> 57)) * 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+
+    return result;
+}
+
+
+/* Get a uniform double in [0, 1). */
+static inline
+double
+kmeans_rng_uniform(kmeans_rng *rng)
+{
+    return (kmeans_rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/* Get a uniform integer in [0, n), for any n > 0. */
+static inline
+size_t
+kmeans_rng_below(kmeans_rng *rng,
+                 size_t n)
+{
+    /* Reject the short last stretch of values which would bias the result. */
+    uint64_t limit = UINT64_MAX - (UINT64_MAX % n);
+    uint64_t x;
+
+    do {
+        x = kmeans_rng_next(rng);
+    } while (x >= limit);
+
+    return x % n;
+}
+
+
+/*
+ * Pick meta->num_centroids initial centroids with k-means++: the first one
+ *  uniformly among the points, and each next one with a probability
+ *  proportional to its squared distance from the closest pick so far. Uses
+ *  meta->data, num_objects, dim, layout, num_threads and weights. With
+ *  weights, every probability is also scaled by the weight of its point, the
+ *  first pick included. The row-major num_centroids x dim result is allocated
+ *  here, and owned by the user. Distances are summed in fixed blocks of
+ *  points, so the picks only depend on the generator and never on the thread
+ *  count.
+ */
+kmeans_result
+kmeans_seed_plusplus(
+    const kmeans_dense_meta  *meta      IN,
+    kmeans_rng               *rng       IN OUT,
+    double                  **centroids OUT
+);
+
+/*
+ * Pick initial centroids with k-means|| (scalable k-means++). Each of a few
+ *  passes over the data samples about 2 * k candidates at once, in parallel.
+ *  The candidates are weighted by how many points (or how much point weight)
+ *  they attract and reduced to k centroids with a weighted k-means++ and a
+ *  few Lloyd steps. This is far fewer passes over the data than k-means++ for
+ *  large k. Same parameters and guarantees as above.
+ */
+kmeans_result
+kmeans_seed_parallel(
+    const kmeans_dense_meta  *meta      IN,
+    kmeans_rng               *rng       IN OUT,
+    double                  **centroids OUT
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_SEED_H */
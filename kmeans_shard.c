@@ -0,0 +1,500 @@
+/*
+ * kmeans_shard.c
+ *
+ * Implementation of the sharded run: the coordinator, the worker loop, and a
+ *  local runner which forks the workers. Every message is a fixed number of
+ *  64-bit integers and doubles, which both ends work out from the header.
+ */
+
+#include "kmeans_shard.h"
+#include "kmeans_pool.h"
+#include "kmeans_kernels.h"
+#include "kmeans_internal.h"
+#include "kmeans_dataset.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+
+/* What the coordinator asks of a worker. */
+typedef enum
+{
+    SHARD_ASSIGN = 1,   /* followed by the centroids; answered with a partial */
+    SHARD_FINISH,       /* answered with the assignments, if asked for */
+    SHARD_ABORT
+} shard_command;
+
+/* Every message from the coordinator starts with one of these. */
+typedef struct
+{
+    uint64_t command;
+    uint64_t argument;   /* for SHARD_FINISH, whether to send the assignments */
+} shard_order;
+
+/* The first message of every worker, describing its slice. */
+typedef struct
+{
+    uint64_t num_objects;
+    uint64_t dim;
+    uint64_t num_centroids;
+} shard_hello;
+
+/*
+ * A partial is sent as 2 + k integers (changed, evaluations and each count),
+ *  then k * dim doubles of sums.
+ */
+#define SHARD_TALLIES(k) (2 + (k))
+
+
+/* Send an order to a worker. */
+static
+kmeans_result
+shard_order_send(kmeans_channel *channel,
+                 shard_command command,
+                 uint64_t argument)
+{
+    shard_order order = { .command = command, .argument = argument };
+
+    return kmeans_channel_send(channel, &order, sizeof(order));
+}
+
+
+/* Receive a worker's partial sums into a partial of the coordinator's run. */
+static
+kmeans_result
+shard_partial_receive(kmeans_channel *channel,
+                      kmeans_partial *partial,
+                      uint64_t *tallies,
+                      size_t num_centroids,
+                      size_t dim)
+{
+    kmeans_result result;
+
+    result = kmeans_channel_receive(channel, tallies,
+                                    sizeof(uint64_t) * SHARD_TALLIES(num_centroids));
+    if (KMEANS_OK != result) return result;
+
+    partial->changed = tallies[0];
+    partial->evaluations = tallies[1];
+    for (size_t c = 0; c < num_centroids; ++c)
+        partial->counts[c] = tallies[2 + c];
+
+    return kmeans_channel_receive(channel, partial->sums,
+                                  sizeof(double) * num_centroids * dim);
+}
+
+
+/* Send a worker's partial sums to the coordinator. */
+static
+kmeans_result
+shard_partial_send(kmeans_channel *channel,
+                   const kmeans_partial *partial,
+                   uint64_t *tallies,
+                   size_t num_centroids,
+                   size_t dim)
+{
+    kmeans_result result;
+
+    tallies[0] = partial->changed;
+    tallies[1] = partial->evaluations;
+    for (size_t c = 0; c < num_centroids; ++c)
+        tallies[2 + c] = partial->counts[c];
+
+    result = kmeans_channel_send(channel, tallies,
+                                 sizeof(uint64_t) * SHARD_TALLIES(num_centroids));
+    if (KMEANS_OK != result) return result;
+
+    return kmeans_channel_send(channel, partial->sums,
+                               sizeof(double) * num_centroids * dim);
+}
+
+
+kmeans_result
+kmeans_shard_coordinate(kmeans_dense_meta *meta,
+                        kmeans_channel **channels,
+                        size_t num_workers)
+{
+    assert(meta);
+    assert(channels);
+
+    assert(meta->centroids);
+
+    assert(meta->num_objects);
+    assert(meta->dim);
+    assert(meta->num_centroids);
+    assert(meta->num_centroids <= meta->num_objects);
+    assert(num_workers);
+    assert(num_workers <= meta->num_objects);
+
+    assert(meta->iterations > 0);
+
+    /* Local variables. */
+    const size_t k = meta->num_centroids;
+    const size_t dim = meta->dim;
+    kmeans_run run = {
+            .meta = meta,
+            .num_threads = num_workers,
+            .kernels = kmeans_kernels_for(dim),
+            .stride = kmeans_block_stride(k),
+    };
+    uint64_t *tallies = malloc(sizeof(uint64_t) * SHARD_TALLIES(k));
+    kmeans_result result = KMEANS_OK;
+
+    meta->distance_evaluations = 0;
+
+    run.partials = calloc(num_workers, sizeof(kmeans_partial));
+    run.centroids_t = kmeans_block_alloc(k, dim);
+    run.previous = malloc(sizeof(double) * k * dim);
+    run.shifts = malloc(sizeof(double) * k);
+
+    if (!tallies
+        || !run.partials
+        || !run.centroids_t
+        || !run.previous
+        || !run.shifts) {
+        result = KMEANS_NO_MEMORY;
+        goto abort;
+    }
+
+    for (size_t w = 0; w < num_workers; ++w) {
+        if (KMEANS_OK != (result = kmeans_partial_create(&(run.partials[w]),
+                                                         k, dim, run.stride)))
+            goto abort;
+    }
+
+    /* Check that every worker holds the slice this run expects of it. */
+    for (size_t w = 0; w < num_workers; ++w) {
+        shard_hello hello;
+        size_t lo, hi;
+
+        result = kmeans_channel_receive(channels[w], &hello, sizeof(hello));
+        if (KMEANS_OK != result) goto abort;
+
+        kmeans_pool_slice(meta->num_objects, w, num_workers, &lo, &hi);
+        if (hello.num_objects != hi - lo
+            || hello.dim != dim
+            || hello.num_centroids != k) {
+            result = KMEANS_MALFORMED_INPUT;
+            goto abort;
+        }
+    }
+
+    while (1) {
+        /* Hand out the centroids first, so every worker runs at once. */
+        for (size_t w = 0; w < num_workers; ++w) {
+            if (KMEANS_OK != (result = shard_order_send(channels[w], SHARD_ASSIGN, 0))
+                || KMEANS_OK != (result = kmeans_channel_send(
+                                     channels[w], meta->centroids,
+                                     sizeof(double) * k * dim)))
+                goto abort;
+        }
+
+        for (size_t w = 0; w < num_workers; ++w) {
+            result = shard_partial_receive(channels[w], &(run.partials[w]),
+                                           tallies, k, dim);
+            if (KMEANS_OK != result) goto abort;
+        }
+
+        kmeans_run_reduce(&run);
+        kmeans_run_update(&run);
+        meta->distance_evaluations += run.partials[0].evaluations;
+
+        if (!run.partials[0].changed) {
+            result = KMEANS_OK;
+            break;
+        }
+
+        if (run.iteration++ > meta->iterations) {
+            result = KMEANS_LIMIT;
+            break;
+        }
+    }
+
+    /* Collect every worker's slice of the assignments, in order. */
+    for (size_t w = 0; w < num_workers; ++w) {
+        kmeans_result sent = shard_order_send(channels[w], SHARD_FINISH,
+                                              NULL != meta->cluster_assignments);
+        if (KMEANS_OK != sent) {
+            result = sent;
+            goto break_out;
+        }
+    }
+
+    for (size_t w = 0; meta->cluster_assignments && w < num_workers; ++w) {
+        kmeans_result received;
+        size_t lo, hi;
+
+        kmeans_pool_slice(meta->num_objects, w, num_workers, &lo, &hi);
+        received = kmeans_channel_receive(channels[w],
+                                          meta->cluster_assignments + lo,
+                                          sizeof(int) * (hi - lo));
+        if (KMEANS_OK != received) {
+            result = received;
+            goto break_out;
+        }
+    }
+
+    goto break_out;
+
+    /* Tell the workers to give up; some may not be listening anymore. */
+abort:
+    for (size_t w = 0; w < num_workers; ++w)
+        shard_order_send(channels[w], SHARD_ABORT, 0);
+
+    /* No matter the result, always perform these actions. */
+break_out:
+    if (run.partials) {
+        for (size_t w = 0; w < num_workers; ++w)
+            kmeans_partial_destroy(&(run.partials[w]));
+        free(run.partials);
+    }
+    free(run.centroids_t);
+    free(run.previous);
+    free(run.shifts);
+    free(tallies);
+    meta->current_iterations = run.iteration;
+    return result;
+}
+
+
+kmeans_result
+kmeans_shard_work(const kmeans_dense_meta *meta,
+                  kmeans_channel *channel)
+{
+    assert(meta);
+    assert(channel);
+
+    assert(meta->data);
+    assert(meta->cluster_assignments);
+
+    assert(meta->num_objects);
+    assert(meta->dim);
+    assert(meta->num_centroids);
+
+    /* Local variables. */
+    const size_t k = meta->num_centroids;
+    const size_t dim = meta->dim;
+    kmeans_dense_meta view = *meta;
+    kmeans_partial partial = { 0 };
+    kmeans_run run = {
+            .meta = &view,
+            .engine = &kmeans_engine_lloyd,
+            .partials = &partial,
+            .num_threads = 1,
+            .kernels = kmeans_kernels_for(dim),
+            .stride = kmeans_block_stride(k),
+    };
+    shard_hello hello = {
+            .num_objects = meta->num_objects,
+            .dim = dim,
+            .num_centroids = k,
+    };
+    uint64_t *tallies = malloc(sizeof(uint64_t) * SHARD_TALLIES(k));
+    kmeans_result result;
+
+    view.centroids = malloc(sizeof(double) * k * dim);
+    run.centroids_t = kmeans_block_alloc(k, dim);
+    if (KMEANS_FLOAT64 != meta->dtype)
+        run.centroids_f = kmeans_block_alloc_f32(k, dim);
+
+    if (!tallies
+        || !view.centroids
+        || !run.centroids_t
+        || (KMEANS_FLOAT64 != meta->dtype && !run.centroids_f)
+        || KMEANS_OK != kmeans_partial_create(&partial, k, dim, run.stride)) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    memset(meta->cluster_assignments, 0, sizeof(int) * meta->num_objects);
+
+    if (KMEANS_OK != (result = kmeans_channel_send(channel, &hello, sizeof(hello))))
+        goto break_out;
+
+    while (1) {
+        shard_order order;
+
+        result = kmeans_channel_receive(channel, &order, sizeof(order));
+        if (KMEANS_OK != result) goto break_out;
+
+        switch (order.command) {
+            case SHARD_ASSIGN:
+                result = kmeans_channel_receive(channel, view.centroids,
+                                                sizeof(double) * k * dim);
+                if (KMEANS_OK != result) goto break_out;
+
+                kmeans_block_transpose(view.centroids, k, dim, run.centroids_t);
+                if (run.centroids_f)
+                    kmeans_block_transpose_f32(view.centroids, k, dim,
+                                               run.centroids_f);
+
+                /* One pass over the whole slice, exactly like one dense thread. */
+                kmeans_partial_reset(&partial, k, dim);
+                (run.engine->assign)(&run, 0, 0, meta->num_objects, &partial);
+
+                result = shard_partial_send(channel, &partial, tallies, k, dim);
+                if (KMEANS_OK != result) goto break_out;
+                break;
+
+            case SHARD_FINISH:
+                if (order.argument)
+                    result = kmeans_channel_send(channel, meta->cluster_assignments,
+                                                 sizeof(int) * meta->num_objects);
+                goto break_out;
+
+            case SHARD_ABORT:
+                result = KMEANS_STOPPED;
+                goto break_out;
+
+            default:
+                result = KMEANS_MALFORMED_INPUT;
+                goto break_out;
+        }
+    }
+
+    /* No matter the result, always perform these actions. */
+break_out:
+    kmeans_partial_destroy(&partial);
+    free(view.centroids);
+    free(run.centroids_t);
+    free(run.centroids_f);
+    free(tallies);
+    return result;
+}
+
+
+/*
+ * Body of a forked worker: serve slice 'worker' of the parent's matrix. A
+ *  column-major slice is not a matrix of its own, so it is gathered first.
+ */
+static
+kmeans_result
+shard_worker_main(const kmeans_dense_meta *meta,
+                  size_t worker,
+                  size_t num_workers,
+                  kmeans_channel *channel)
+{
+    const size_t element = kmeans_dtype_size(meta->dtype);
+    kmeans_dense_meta slice = *meta;
+    char *gathered = NULL;
+    kmeans_result result;
+    size_t lo, hi;
+
+    kmeans_pool_slice(meta->num_objects, worker, num_workers, &lo, &hi);
+
+    slice.num_objects = hi - lo;
+    slice.cluster_assignments = malloc(sizeof(int) * slice.num_objects);
+    if (!slice.cluster_assignments) return KMEANS_NO_MEMORY;
+
+    if (KMEANS_ROW_MAJOR == meta->layout) {
+        slice.data = (const char *)meta->data + (lo * meta->dim * element);
+    } else {
+        gathered = malloc(element * slice.num_objects * meta->dim);
+        if (!gathered) {
+            free(slice.cluster_assignments);
+            return KMEANS_NO_MEMORY;
+        }
+
+        for (size_t d = 0; d < meta->dim; ++d)
+            memcpy(gathered + (d * slice.num_objects * element),
+                   (const char *)meta->data + (((d * meta->num_objects) + lo) * element),
+                   slice.num_objects * element);
+        slice.data = gathered;
+    }
+
+    result = kmeans_shard_work(&slice, channel);
+
+    free(gathered);
+    free(slice.cluster_assignments);
+    return result;
+}
+
+
+kmeans_result
+compute_kmeans_sharded(kmeans_dense_meta *meta,
+                       size_t num_workers,
+                       kmeans_transport transport)
+{
+    assert(meta);
+
+    assert(meta->data);
+    assert(meta->num_objects);
+    assert(num_workers);
+
+    /* Local variables. */
+    kmeans_channel **channels = NULL;
+    pid_t *pids = NULL;
+    size_t started = 0;
+    kmeans_result result = KMEANS_OK;
+
+    if (num_workers > meta->num_objects) num_workers = meta->num_objects;
+
+    channels = calloc(num_workers, sizeof(kmeans_channel *));
+    pids = calloc(num_workers, sizeof(pid_t));
+    if (!channels || !pids) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    for (size_t w = 0; w < num_workers; ++w) {
+        result = kmeans_channel_create(transport, 0, &(channels[w]));
+        if (KMEANS_OK != result) goto break_out;
+    }
+
+    /* Buffered output would otherwise be written once more by every worker. */
+    fflush(NULL);
+
+    for (; started < num_workers; ++started) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            result = KMEANS_NO_MEMORY;
+            goto break_out;
+        }
+
+        if (0 == pid) {
+            /* A worker keeps its own channel, and none of the others. */
+            for (size_t w = 0; w < num_workers; ++w)
+                if (w != started) kmeans_channel_destroy(channels[w]);
+
+            kmeans_channel_attach(channels[started], KMEANS_CHANNEL_WORKER);
+            result = shard_worker_main(meta, started, num_workers,
+                                       channels[started]);
+            _exit(KMEANS_OK == result ? 0 : 1);
+        }
+
+        pids[started] = pid;
+    }
+
+    for (size_t w = 0; w < num_workers; ++w)
+        kmeans_channel_attach(channels[w], KMEANS_CHANNEL_COORDINATOR);
+
+    result = kmeans_shard_coordinate(meta, channels, num_workers);
+
+    /* No matter the result, always perform these actions. */
+break_out:
+    for (size_t w = 0; w < started; ++w) {
+        int status;
+
+        /* A worker can only be stuck if the run failed; don't wait on it. */
+        if (KMEANS_OK != result && KMEANS_LIMIT != result) kill(pids[w], SIGTERM);
+
+        if (waitpid(pids[w], &status, 0) == pids[w]
+            && (!WIFEXITED(status) || WEXITSTATUS(status))
+            && (KMEANS_OK == result || KMEANS_LIMIT == result))
+            result = KMEANS_IO_ERROR;
+    }
+
+    for (size_t w = 0; channels && w < num_workers; ++w)
+        kmeans_channel_destroy(channels[w]);
+    free(channels);
+    free(pids);
+    return result;
+}
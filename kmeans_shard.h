@@ -0,0 +1,64 @@
+/*
+ * kmeans_shard.h
+ *
+ * Sharded K-Means Clustering across processes. Each worker owns one slice of
+ *  the points and answers every iteration with its per-cluster sums, counts
+ *  and change count. The coordinator merges them and sends the new centroids
+ *  back, so only O(num_centroids * dim) bytes cross a channel per iteration.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_SHARD_H
+#define CIS579_TERMPROJECT_KMEANS_SHARD_H
+
+#include <stdlib.h>
+
+#include "kmeans.h"
+#include "kmeans_transport.h"
+
+
+/*
+ * Coordinate a sharded run over one channel per worker. Worker 'w' must own
+ *  slice 'w' of the points, as kmeans_pool_slice() splits meta->num_objects
+ *  among num_workers, and the sums are merged in the same tree order as the
+ *  threads of compute_kmeans_dense(). So the results are identical to a Lloyd
+ *  run with num_threads equal to num_workers.
+ *
+ * Of 'meta', only num_objects, dim, centroids, num_centroids and iterations
+ *  are used, and the data stays with the workers. When cluster_assignments is
+ *  set, every worker sends its slice of them once the run is over. On failure
+ *  the workers are told to stop, if they can still be reached.
+ */
+kmeans_result
+kmeans_shard_coordinate(
+    kmeans_dense_meta  *meta        IN OUT,
+    kmeans_channel    **channels    IN,
+    size_t              num_workers IN
+);
+
+/*
+ * Serve a coordinator as one worker. 'meta' describes the worker's own slice
+ *  as a matrix of its own: data, num_objects, dim, layout, dtype and scale,
+ *  with num_centroids and room for the slice's cluster_assignments. The
+ *  centroids are received from the coordinator. Returns KMEANS_OK once the run
+ *  is over, or KMEANS_STOPPED when the coordinator gave up on it.
+ */
+kmeans_result
+kmeans_shard_work(
+    const kmeans_dense_meta *meta    IN,
+    kmeans_channel          *channel IN
+);
+
+/*
+ * Run a sharded clustering of 'meta' on this machine: fork num_workers worker
+ *  processes, each serving its slice of meta->data over a channel of the given
+ *  transport, and coordinate them from the calling process.
+ */
+kmeans_result
+compute_kmeans_sharded(
+    kmeans_dense_meta *meta        IN OUT,
+    size_t             num_workers IN,
+    kmeans_transport   transport   IN
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_SHARD_H */
@@ -0,0 +1,478 @@
+/*
+ * kmeans_sparse.c
+ *
+ * Implementation of sparse clustering. The centroids are also kept transposed,
+ *  one row of k values per dimension, so every non-zero of a point adds its
+ *  contribution to the scores of all centroids in one contiguous sweep. The
+ *  score of a centroid is ||c||² - 2 x·c, whose smallest value picks the
+ *  nearest one, while ||x||² only matters for the reported distance.
+ */
+
+#include "kmeans_sparse.h"
+#include "kmeans_pool.h"
+#include "kmeans_internal.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+
+/* State shared by every thread of a sparse clustering run. */
+typedef struct
+{
+    kmeans_sparse_meta *meta;
+    size_t num_threads;
+
+    /* Thread 't' owns the points [bounds[t], bounds[t + 1]). */
+    size_t *bounds;
+
+    /* Squared norm of every point, and of every centroid. */
+    double *norms;
+    double *centroid_norms;
+
+    /* The centroids as dim x k, row-major. */
+    double *columns;
+
+    /* Centroid positions before the latest update, and how far each moved. */
+    double *previous;
+    double *shifts;
+
+    /*
+     * The partials are merged by the dense driver's reduction, which only
+     * needs the shape of the run from its meta.
+     */
+    kmeans_dense_meta shape;
+    kmeans_run run;
+} sparse_run;
+
+
+/*
+ * Check the offsets and column indices of a CSR matrix. Each column remembers
+ *  the last point (plus one) which used it, so a repeat within a point shows
+ *  up in the same pass.
+ */
+static
+kmeans_result
+sparse_validate(const kmeans_sparse_meta *meta)
+{
+    size_t *seen = NULL;
+    kmeans_result result = KMEANS_MALFORMED_INPUT;
+
+    if (0 != meta->offsets[0]) return KMEANS_MALFORMED_INPUT;
+    if (!(seen = calloc(meta->dim, sizeof(size_t)))) return KMEANS_NO_MEMORY;
+
+    for (size_t i = 0; i < meta->num_objects; ++i) {
+        if (meta->offsets[i + 1] < meta->offsets[i]) goto break_out;
+
+        for (size_t j = meta->offsets[i]; j < meta->offsets[i + 1]; ++j) {
+            const uint32_t column = meta->indices[j];
+
+            if (column >= meta->dim || seen[column] == i + 1) goto break_out;
+            seen[column] = i + 1;
+        }
+    }
+
+    result = KMEANS_OK;
+
+break_out:
+    free(seen);
+    return result;
+}
+
+
+/* Squared norm of point 'i'. */
+static inline
+double
+sparse_norm(const kmeans_sparse_meta *meta,
+            size_t i)
+{
+    double norm = 0.0;
+
+    for (size_t j = meta->offsets[i]; j < meta->offsets[i + 1]; ++j)
+        norm += meta->values[j] * meta->values[j];
+
+    return norm;
+}
+
+
+/* Refresh the transposed centroids and the centroid norms. */
+static
+void
+sparse_transpose(sparse_run *run)
+{
+    const kmeans_sparse_meta *meta = run->meta;
+    const size_t k = meta->num_centroids;
+    const size_t dim = meta->dim;
+
+    for (size_t c = 0; c < k; ++c) {
+        const double *centroid = meta->centroids + (c * dim);
+        double norm = 0.0;
+
+        for (size_t d = 0; d < dim; ++d) {
+            run->columns[(d * k) + c] = centroid[d];
+            norm += centroid[d] * centroid[d];
+        }
+
+        run->centroid_norms[c] = norm;
+    }
+}
+
+
+/*
+ * Set up a thread's partial sums and point norms, and zero its assignments,
+ *  from within that thread so the pages land on its NUMA node.
+ */
+static
+void
+sparse_job_init(void *context,
+                const size_t thread,
+                const size_t num_threads)
+{
+    sparse_run *run = (sparse_run *)context;
+    kmeans_sparse_meta *meta = run->meta;
+    const size_t lo = run->bounds[thread], hi = run->bounds[thread + 1];
+
+    (void)num_threads;
+
+    memset(meta->cluster_assignments + lo, 0, sizeof(int) * (hi - lo));
+    for (size_t i = lo; i < hi; ++i) run->norms[i] = sparse_norm(meta, i);
+
+    kmeans_partial_create(&(run->run.partials[thread]), meta->num_centroids,
+                          meta->dim, meta->num_centroids);
+}
+
+
+/* Assign one thread's points and gather its partial sums. */
+static
+void
+sparse_job_assign(void *context,
+                  const size_t thread,
+                  const size_t num_threads)
+{
+    sparse_run *run = (sparse_run *)context;
+    kmeans_sparse_meta *meta = run->meta;
+    kmeans_partial *partial = &(run->run.partials[thread]);
+    const size_t k = meta->num_centroids;
+    const size_t dim = meta->dim;
+    const size_t lo = run->bounds[thread], hi = run->bounds[thread + 1];
+    double *scores = partial->distances;
+    double inertia = 0.0;
+
+    (void)num_threads;
+
+    kmeans_partial_reset(partial, k, dim);
+
+    for (size_t i = lo; i < hi; ++i) {
+        const size_t first = meta->offsets[i], last = meta->offsets[i + 1];
+        int nearest = 0;
+
+        memcpy(scores, run->centroid_norms, sizeof(double) * k);
+
+        for (size_t j = first; j < last; ++j) {
+            const double weight = -2.0 * meta->values[j];
+            const double *column = run->columns + (meta->indices[j] * k);
+
+            for (size_t c = 0; c < k; ++c) scores[c] += weight * column[c];
+        }
+
+        for (size_t c = 1; c < k; ++c)
+            if (scores[c] < scores[nearest]) nearest = c;
+
+        /* Cancellation can leave a tiny negative distance for a close match. */
+        const double distance = run->norms[i] + scores[nearest];
+        inertia += (distance > 0.0) ? distance : 0.0;
+
+        kmeans_partial_assign(partial, &(meta->cluster_assignments[i]), nearest);
+
+        double *sum = partial->sums + (nearest * dim);
+        for (size_t j = first; j < last; ++j) sum[meta->indices[j]] += meta->values[j];
+        ++partial->counts[nearest];
+    }
+
+    partial->evaluations += (hi - lo) * k;
+    partial->inertia = inertia;
+}
+
+
+/* Move every centroid to the mean of its members, and record how far it moved. */
+static
+void
+sparse_update(sparse_run *run)
+{
+    kmeans_sparse_meta *meta = run->meta;
+    const double *sums = run->run.partials[0].sums;
+    const size_t *counts = run->run.partials[0].counts;
+    const size_t dim = meta->dim;
+
+    memcpy(run->previous, meta->centroids,
+           sizeof(double) * meta->num_centroids * dim);
+
+    for (size_t cluster = 0; cluster < meta->num_centroids; ++cluster) {
+        double *centroid = meta->centroids + (cluster * dim);
+        const double *previous = run->previous + (cluster * dim);
+        double shift = 0.0;
+
+        /* Clusters which lost all of their members keep their previous location. */
+        if (!counts[cluster]) {
+            run->shifts[cluster] = 0.0;
+            continue;
+        }
+
+        for (size_t d = 0; d < dim; ++d) {
+            centroid[d] = sums[(cluster * dim) + d] / counts[cluster];
+            shift += (centroid[d] - previous[d]) * (centroid[d] - previous[d]);
+        }
+
+        run->shifts[cluster] = sqrt(shift);
+    }
+
+    sparse_transpose(run);
+}
+
+
+kmeans_result
+compute_kmeans_sparse(kmeans_sparse_meta *meta)
+{
+    assert(meta);
+
+    assert(meta->offsets);
+    assert(meta->indices || !meta->offsets[meta->num_objects]);
+    assert(meta->values || !meta->offsets[meta->num_objects]);
+    assert(meta->centroids);
+    assert(meta->cluster_assignments);
+
+    assert(meta->num_objects);
+    assert(meta->dim);
+    assert(meta->num_centroids);
+    assert(meta->num_centroids <= meta->num_objects);
+
+    assert(meta->iterations > 0);
+
+    /* Local variables. */
+    kmeans_pool *pool = NULL;
+    sparse_run run = {
+            .meta = meta,
+            .num_threads = meta->num_threads ? meta->num_threads : 1,
+            .shape = {
+                    .num_objects = meta->num_objects,
+                    .dim = meta->dim,
+                    .centroids = meta->centroids,
+                    .num_centroids = meta->num_centroids,
+            },
+    };
+    kmeans_iteration_stats stats = { 0 };
+    double previous_inertia = HUGE_VAL;
+    unsigned long long start = 0;
+    kmeans_result result;
+
+    const size_t k = meta->num_centroids;
+    const int measure = meta->observer
+        || meta->reassign_tolerance > 0.0
+        || meta->inertia_tolerance > 0.0
+        || meta->shift_tolerance > 0.0;
+
+    meta->distance_evaluations = 0;
+
+    if (KMEANS_OK != (result = sparse_validate(meta))) goto break_out;
+
+    if (run.num_threads > meta->num_objects) run.num_threads = meta->num_objects;
+
+    run.run.meta = &(run.shape);
+    run.run.num_threads = run.num_threads;
+    run.run.partials = calloc(run.num_threads, sizeof(kmeans_partial));
+    run.bounds = malloc(sizeof(size_t) * (run.num_threads + 1));
+    run.norms = malloc(sizeof(double) * meta->num_objects);
+    run.centroid_norms = malloc(sizeof(double) * k);
+    run.columns = malloc(sizeof(double) * meta->dim * k);
+    run.previous = malloc(sizeof(double) * k * meta->dim);
+    run.shifts = malloc(sizeof(double) * k);
+
+    if (!run.run.partials
+        || !run.bounds
+        || !run.norms
+        || !run.centroid_norms
+        || !run.columns
+        || !run.previous
+        || !run.shifts
+        || !(pool = kmeans_pool_create(run.num_threads))) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    /*
+     * A point costs k for its scores plus k per non-zero, so the threads
+     * split the points by their non-zeros.
+     */
+    kmeans_pool_partition(meta->offsets, meta->num_objects, run.num_threads,
+                          run.bounds);
+
+    /* Zero the assignments, take the point norms and set up the partials. */
+    kmeans_pool_run(pool, sparse_job_init, &run);
+    for (size_t t = 0; t < run.num_threads; ++t) {
+        if (!run.run.partials[t].sums) {
+            result = KMEANS_NO_MEMORY;
+            goto break_out;
+        }
+    }
+
+    sparse_transpose(&run);
+
+    while (1) {
+        if (meta->observer) start = kmeans_clock_ns();
+
+        kmeans_pool_run(pool, sparse_job_assign, &run);
+
+        /* The inertia is summed in thread order, ahead of the reduction. */
+        stats.inertia = 0.0;
+        for (size_t t = 0; t < run.num_threads; ++t)
+            stats.inertia += run.run.partials[t].inertia;
+
+        kmeans_run_reduce(&(run.run));
+
+        if (meta->observer) {
+            stats.assign_ns = kmeans_clock_ns() - start;
+            start = kmeans_clock_ns();
+        }
+
+        sparse_update(&run);
+        meta->distance_evaluations += run.run.partials[0].evaluations;
+
+        int stop = 0;
+        if (measure) {
+            if (meta->observer) stats.update_ns = kmeans_clock_ns() - start;
+
+            stats.iteration = run.run.iteration;
+            stats.reassigned = run.run.partials[0].changed;
+            stats.max_shift = 0.0;
+            for (size_t c = 0; c < k; ++c)
+                if (run.shifts[c] > stats.max_shift) stats.max_shift = run.shifts[c];
+
+            if (meta->observer)
+                stop = (meta->observer)(&stats, meta->observer_context);
+        }
+
+        if (!run.run.partials[0].changed
+            || (measure && kmeans_tolerance_met(&stats, meta->num_objects,
+                                                previous_inertia,
+                                                meta->reassign_tolerance,
+                                                meta->inertia_tolerance,
+                                                meta->shift_tolerance))) {
+            result = KMEANS_OK;
+            goto break_out;
+        }
+        previous_inertia = stats.inertia;
+
+        if (stop) {
+            ++run.run.iteration;
+            result = KMEANS_STOPPED;
+            goto break_out;
+        }
+
+        if (run.run.iteration++ > meta->iterations) {
+            result = KMEANS_LIMIT;
+            goto break_out;
+        }
+    }
+
+    /* No matter the result, always perform these actions. */
+break_out:
+    kmeans_pool_destroy(pool);
+    if (run.run.partials) {
+        for (size_t t = 0; t < run.num_threads; ++t)
+            kmeans_partial_destroy(&(run.run.partials[t]));
+        free(run.run.partials);
+    }
+    free(run.bounds);
+    free(run.norms);
+    free(run.centroid_norms);
+    free(run.columns);
+    free(run.previous);
+    free(run.shifts);
+    meta->current_iterations = run.run.iteration;
+    return result;
+}
+
+
+/* Scatter point 'i' into a zeroed dense row. */
+static inline
+void
+sparse_scatter(const kmeans_sparse_meta *meta,
+               size_t i,
+               double *row)
+{
+    for (size_t j = meta->offsets[i]; j < meta->offsets[i + 1]; ++j)
+        row[meta->indices[j]] = meta->values[j];
+}
+
+
+kmeans_result
+kmeans_sparse_seed(const kmeans_sparse_meta *meta,
+                   kmeans_rng *rng,
+                   double **centroids)
+{
+    assert(meta);
+    assert(rng);
+    assert(centroids);
+
+    assert(meta->offsets);
+    assert(meta->num_objects);
+    assert(meta->dim);
+    assert(meta->num_centroids);
+    assert(meta->num_centroids <= meta->num_objects);
+
+    const size_t n = meta->num_objects;
+    const size_t dim = meta->dim;
+    double *norms = malloc(sizeof(double) * n);
+    double *nearest = malloc(sizeof(double) * n);
+    kmeans_result result;
+
+    *centroids = calloc(meta->num_centroids * dim, sizeof(double));
+
+    if (!norms || !nearest || !*centroids) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    if (KMEANS_OK != (result = sparse_validate(meta))) goto break_out;
+
+    for (size_t i = 0; i < n; ++i) {
+        norms[i] = sparse_norm(meta, i);
+        nearest[i] = HUGE_VAL;
+    }
+
+    sparse_scatter(meta, kmeans_rng_below(rng, n), *centroids);
+
+    for (size_t k = 1; k < meta->num_centroids; ++k) {
+        const double *pick = *centroids + ((k - 1) * dim);
+        double pick_norm = 0.0;
+
+        for (size_t d = 0; d < dim; ++d) pick_norm += pick[d] * pick[d];
+
+        for (size_t i = 0; i < n; ++i) {
+            double dot = 0.0;
+
+            for (size_t j = meta->offsets[i]; j < meta->offsets[i + 1]; ++j)
+                dot += meta->values[j] * pick[meta->indices[j]];
+
+            double distance = norms[i] - (2.0 * dot) + pick_norm;
+            if (distance < 0.0) distance = 0.0;
+            if (distance < nearest[i]) nearest[i] = distance;
+        }
+
+        sparse_scatter(meta, kmeans_draw(rng, nearest, n, NULL),
+                       *centroids + (k * dim));
+    }
+
+    result = KMEANS_OK;
+
+break_out:
+    if (KMEANS_OK != result) {
+        free(*centroids);
+        *centroids = NULL;
+    }
+    free(norms);
+    free(nearest);
+    return result;
+}
@@ -0,0 +1,114 @@
+/*
+ * kmeans_sparse.h
+ *
+ * K-Means Clustering of sparse points in compressed sparse row (CSR) form,
+ *  around dense centroids. Distances expand into ||x||² - 2 x·c + ||c||²:
+ *  point norms are computed once per run and centroid norms once per
+ *  iteration, so only the dot products are left, and each one only visits the
+ *  non-zeros of its point. An iteration then costs O(nnz * k) for the
+ *  assignments plus O(k * dim) for the update, rather than O(n * k * dim).
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_SPARSE_H
+#define CIS579_TERMPROJECT_KMEANS_SPARSE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "kmeans.h"
+#include "kmeans_seed.h"
+
+
+/* Meta-structure for clustering a CSR matrix of real-valued points. */
+typedef struct
+{
+    /*
+     * The input matrix: the non-zeros of point 'i' are values[j] in column
+     * indices[j], for offsets[i] <= j < offsets[i + 1]. There are num_objects
+     * + 1 offsets, starting at zero and never decreasing. Columns within a
+     * point need not be sorted, but must be below dim and may not repeat. The
+     * user is responsible for this memory.
+     */
+    const size_t   *offsets;
+    const uint32_t *indices;
+    const double   *values;
+
+    /* Amount of points in the matrix. */
+    size_t num_objects;
+
+    /* Dimensionality of each point (and each centroid). */
+    size_t dim;
+
+    /*
+     * A dense row-major matrix of num_centroids x dim initial centroid
+     * values, which is updated in place. User is responsible for seeding
+     * this (see kmeans_sparse_seed) and for its memory management.
+     */
+    double *centroids;
+
+    /* The amount of centroids, AKA 'k'. */
+    size_t num_centroids;
+
+    /* How many times the algorithm should run to check convergence. */
+    unsigned long iterations;
+
+    /* Current iterations counter. */
+    unsigned long current_iterations;
+
+    /* Amount of point-to-centroid distances the run computed. Output only. */
+    unsigned long long distance_evaluations;
+
+    /* Array to fill with cluster as assigned to objects. User responsible. */
+    int *cluster_assignments;
+
+    /*
+     * How many threads share the assignment step (0 or 1 runs serially).
+     * Each thread owns a run of consecutive points holding about the same
+     * amount of non-zeros, and partial sums are merged in a fixed order, so
+     * results are reproducible for a given thread count.
+     */
+    size_t num_threads;
+
+    /*
+     * Optional method called after every iteration, with its context. The
+     * reported inertia is that of the assignment pass, against the centroids
+     * the points were assigned to, and comes at no extra cost.
+     */
+    kmeans_observer_t observer;
+    void *observer_context;
+
+    /* Optional stopping tolerances, as in the dense meta. */
+    double reassign_tolerance;
+    double inertia_tolerance;
+    double shift_tolerance;
+} kmeans_sparse_meta;
+
+
+/*
+ * Cluster a CSR matrix with Lloyd's algorithm. The expanded distances round
+ *  differently than summing squared differences, so near-ties may settle
+ *  differently than in compute_kmeans_dense() over the same points. Returns
+ *  KMEANS_MALFORMED_INPUT when the offsets or column indices are invalid,
+ *  including a column repeated within one point.
+ */
+kmeans_result
+compute_kmeans_sparse(
+    kmeans_sparse_meta *meta IN OUT
+);
+
+/*
+ * Pick meta->num_centroids initial centroids with k-means++, like
+ *  kmeans_seed_plusplus() does for dense data. Every pick costs one pass over
+ *  the non-zeros. Uses offsets, indices, values, num_objects, dim and
+ *  num_centroids. The dense row-major num_centroids x dim result is allocated
+ *  here, and owned by the user. Malformed input fails as above.
+ */
+kmeans_result
+kmeans_sparse_seed(
+    const kmeans_sparse_meta  *meta      IN,
+    kmeans_rng                *rng       IN OUT,
+    double                   **centroids OUT
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_SPARSE_H */
@@ -0,0 +1,569 @@
+/*
+ * kmeans_state.c
+ *
+ * Implementation of incrementally maintained clusterings. Bounds are stored
+ *  relative to how far the centroids drifted since the state was created: the
+ *  upper bound of a point net of the drift of its own centroid, and its lower
+ *  bound plus the sum of the largest shift of every update. So moving the
+ *  centroids never touches a point. Each cluster keeps its points in a heap
+ *  by the slack between the two stored bounds, and an update only pops the
+ *  points whose slack its cluster's drift has used up.
+ */
+
+#include "kmeans_state.h"
+#include "kmeans_kernels.h"
+#include "kmeans_internal.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+
+/* Room for this many points is made the first time. */
+#define STATE_MIN_CAPACITY 64
+
+
+/* A binary min-heap of point ids, ordered by their bound slack. */
+typedef struct
+{
+    size_t *ids;
+    size_t length;
+    size_t capacity;
+} state_heap;
+
+
+struct _kmeans_state
+{
+    kmeans_state_meta *meta;
+    const kmeans_kernels *kernels;
+
+    /* The centroids in the layout of the kernels, and a row of distances. */
+    double *centroids_t;
+    size_t stride;
+    double *distances;
+
+    /* Per id: the point, its cluster or -1, its bounds and heap position. */
+    size_t num_ids;
+    size_t capacity;
+    double *points;
+    int *assignments;
+    double *upper;
+    double *lower;
+    size_t *positions;
+
+    /* Ids free to hand out again, and the points popped by one update. */
+    size_t *free_ids;
+    size_t num_free;
+    size_t *pending;
+
+    /* Per cluster: the sums and counts of its points, and its heap. */
+    double *sums;
+    size_t *counts;
+    state_heap *heaps;
+
+    /* How far each centroid moved in total, and the sum of the largest moves. */
+    double *drifts;
+    double drift;
+
+    /* Whether the sums changed since the centroids were last moved. */
+    int dirty;
+
+    /*
+     * Points added to or taken from the sums since they were last summed
+     * from scratch. Once that is more than the points held, the sums are
+     * summed again, which keeps rounding from piling up at amortized O(1).
+     */
+    size_t touched;
+};
+
+
+/* Slack of a point: how much its cluster may drift before it is revisited. */
+static inline
+double
+state_key(const kmeans_state *state,
+          size_t id)
+{
+    return state->lower[id] - state->upper[id];
+}
+
+
+static inline
+void
+state_heap_set(kmeans_state *state,
+               state_heap *heap,
+               size_t position,
+               size_t id)
+{
+    heap->ids[position] = id;
+    state->positions[id] = position;
+}
+
+
+static
+void
+state_heap_sift_up(kmeans_state *state,
+                   state_heap *heap,
+                   size_t position)
+{
+    const size_t id = heap->ids[position];
+    const double key = state_key(state, id);
+
+    while (position) {
+        size_t parent = (position - 1) / 2;
+        if (!(key < state_key(state, heap->ids[parent]))) break;
+
+        state_heap_set(state, heap, position, heap->ids[parent]);
+        position = parent;
+    }
+
+    state_heap_set(state, heap, position, id);
+}
+
+
+static
+void
+state_heap_sift_down(kmeans_state *state,
+                     state_heap *heap,
+                     size_t position)
+{
+    const size_t id = heap->ids[position];
+    const double key = state_key(state, id);
+
+    while (1) {
+        size_t child = (2 * position) + 1;
+        if (child >= heap->length) break;
+
+        if (child + 1 < heap->length
+            && state_key(state, heap->ids[child + 1]) < state_key(state, heap->ids[child]))
+            ++child;
+        if (!(state_key(state, heap->ids[child]) < key)) break;
+
+        state_heap_set(state, heap, position, heap->ids[child]);
+        position = child;
+    }
+
+    state_heap_set(state, heap, position, id);
+}
+
+
+static
+kmeans_result
+state_heap_push(kmeans_state *state,
+                state_heap *heap,
+                size_t id)
+{
+    if (heap->length == heap->capacity) {
+        size_t capacity = heap->capacity ? (2 * heap->capacity) : STATE_MIN_CAPACITY;
+        size_t *ids = realloc(heap->ids, sizeof(size_t) * capacity);
+
+        if (!ids) return KMEANS_NO_MEMORY;
+        heap->ids = ids;
+        heap->capacity = capacity;
+    }
+
+    heap->ids[heap->length] = id;
+    state_heap_sift_up(state, heap, heap->length++);
+    return KMEANS_OK;
+}
+
+
+static
+void
+state_heap_remove(kmeans_state *state,
+                  state_heap *heap,
+                  size_t position)
+{
+    if (position == --heap->length) return;
+
+    /* The last id takes the gap, and moves whichever way its key says. */
+    const size_t id = heap->ids[heap->length];
+
+    state_heap_set(state, heap, position, id);
+    state_heap_sift_up(state, heap, position);
+    if (state->positions[id] == position) state_heap_sift_down(state, heap, position);
+}
+
+
+/* Make room for 'extra' more ids than are handed out now. */
+static
+kmeans_result
+state_reserve(kmeans_state *state,
+              size_t extra)
+{
+    const size_t dim = state->meta->dim;
+    size_t capacity = state->capacity ? state->capacity : STATE_MIN_CAPACITY;
+
+    if (state->num_ids + extra <= state->capacity) return KMEANS_OK;
+
+    while (capacity < state->num_ids + extra) capacity *= 2;
+
+    if (capacity > (SIZE_MAX / sizeof(double)) / dim || capacity > INT_MAX)
+        return KMEANS_BAD_LENGTH;
+
+    /* Each array is kept as soon as it grew; a larger one does no harm. */
+#define STATE_GROW(array, type, count) do { \
+        type *grown = realloc(state->array, sizeof(type) * (count)); \
+        if (!grown) return KMEANS_NO_MEMORY; \
+        state->array = grown; \
+    } while (0)
+
+    STATE_GROW(points, double, capacity * dim);
+    STATE_GROW(assignments, int, capacity);
+    STATE_GROW(upper, double, capacity);
+    STATE_GROW(lower, double, capacity);
+    STATE_GROW(positions, size_t, capacity);
+    STATE_GROW(free_ids, size_t, capacity);
+    STATE_GROW(pending, size_t, capacity);
+
+#undef STATE_GROW
+
+    state->capacity = capacity;
+    return KMEANS_OK;
+}
+
+
+/*
+ * Compare a point against every centroid, and reset both of its bounds. Ties
+ *  go to the lowest cluster, like everywhere else.
+ */
+static
+int
+state_full(kmeans_state *state,
+           size_t id)
+{
+    const kmeans_state_meta *meta = state->meta;
+    const size_t k = meta->num_centroids;
+    double *distances = state->distances;
+    int nearest = 0;
+    double second = HUGE_VAL;
+
+    state->kernels->distances(state->points + (id * meta->dim), state->centroids_t,
+                              state->stride, meta->dim, distances);
+    state->meta->distance_evaluations += k;
+
+    for (size_t c = 1; c < k; ++c) {
+        if (distances[c] < distances[nearest]) {
+            second = distances[nearest];
+            nearest = c;
+        } else if (distances[c] < second) {
+            second = distances[c];
+        }
+    }
+
+    state->upper[id] = sqrt(distances[nearest]) * (1.0 + KMEANS_BOUND_SLACK)
+        - state->drifts[nearest];
+    state->lower[id] = sqrt(second) * (1.0 - KMEANS_BOUND_SLACK) + state->drift;
+
+    return nearest;
+}
+
+
+/* Add a point into the sums of a cluster, or take it out with a negative sign. */
+static inline
+void
+state_sum(kmeans_state *state,
+          size_t id,
+          int cluster,
+          double sign)
+{
+    const size_t dim = state->meta->dim;
+    const double *row = state->points + (id * dim);
+    double *sum = state->sums + (cluster * dim);
+
+    for (size_t d = 0; d < dim; ++d) sum[d] += sign * row[d];
+
+    if (sign > 0.0) ++state->counts[cluster];
+    else --state->counts[cluster];
+
+    ++state->touched;
+    state->dirty = 1;
+}
+
+
+/*
+ * Sum every cluster again from scratch, and rebase all bounds on zero drift.
+ *  Rebasing shifts every key of a heap by the same amount, so no heap needs
+ *  to be rebuilt.
+ */
+static
+void
+state_refresh(kmeans_state *state)
+{
+    const kmeans_state_meta *meta = state->meta;
+    const size_t dim = meta->dim;
+
+    memset(state->sums, 0, sizeof(double) * meta->num_centroids * dim);
+
+    for (size_t id = 0; id < state->num_ids; ++id) {
+        const int cluster = state->assignments[id];
+        if (cluster < 0) continue;
+
+        const double *row = state->points + (id * dim);
+        double *sum = state->sums + (cluster * dim);
+
+        for (size_t d = 0; d < dim; ++d) sum[d] += row[d];
+
+        state->upper[id] += state->drifts[cluster];
+        state->lower[id] -= state->drift;
+    }
+
+    memset(state->drifts, 0, sizeof(double) * meta->num_centroids);
+    state->drift = 0.0;
+    state->touched = 0;
+}
+
+
+/* Move every centroid to the mean of its points and record the drifts. */
+static
+void
+state_recentre(kmeans_state *state)
+{
+    const kmeans_state_meta *meta = state->meta;
+    const size_t dim = meta->dim;
+    double largest = 0.0;
+
+    for (size_t c = 0; c < meta->num_centroids; ++c) {
+        double *centroid = meta->centroids + (c * dim);
+        const double *sum = state->sums + (c * dim);
+        double shift = 0.0;
+
+        if (!state->counts[c]) continue;
+
+        for (size_t d = 0; d < dim; ++d) {
+            const double value = sum[d] / state->counts[c];
+            const double delta = value - centroid[d];
+
+            shift += delta * delta;
+            centroid[d] = value;
+        }
+
+        shift = sqrt(shift) * (1.0 + KMEANS_BOUND_SLACK);
+        state->drifts[c] += shift;
+        if (shift > largest) largest = shift;
+    }
+
+    state->drift += largest;
+    kmeans_block_transpose(meta->centroids, meta->num_centroids, dim,
+                           state->centroids_t);
+}
+
+
+kmeans_result
+kmeans_state_create(kmeans_state_meta *meta,
+                    kmeans_state **state)
+{
+    assert(meta);
+    assert(state);
+
+    assert(meta->centroids);
+    assert(meta->num_centroids);
+    assert(meta->dim);
+
+    const size_t k = meta->num_centroids;
+    kmeans_state *s = calloc(1, sizeof(kmeans_state));
+
+    *state = NULL;
+    if (!s) return KMEANS_NO_MEMORY;
+
+    s->meta = meta;
+    s->kernels = kmeans_kernels_for(meta->dim);
+    s->stride = kmeans_block_stride(k);
+    s->centroids_t = kmeans_block_alloc(k, meta->dim);
+    s->distances = malloc(sizeof(double) * s->stride);
+    s->sums = calloc(k * meta->dim, sizeof(double));
+    s->counts = calloc(k, sizeof(size_t));
+    s->heaps = calloc(k, sizeof(state_heap));
+    s->drifts = calloc(k, sizeof(double));
+
+    if (!s->centroids_t || !s->distances || !s->sums
+        || !s->counts || !s->heaps || !s->drifts) {
+        kmeans_state_destroy(s);
+        return KMEANS_NO_MEMORY;
+    }
+
+    kmeans_block_transpose(meta->centroids, k, meta->dim, s->centroids_t);
+
+    meta->current_iterations = 0;
+    meta->num_objects = 0;
+    meta->distance_evaluations = 0;
+
+    *state = s;
+    return KMEANS_OK;
+}
+
+
+kmeans_result
+kmeans_state_append(kmeans_state *state,
+                    const double *points,
+                    size_t n,
+                    size_t *ids)
+{
+    kmeans_state_meta *meta = state->meta;
+    const size_t dim = meta->dim;
+    kmeans_result result;
+
+    if (n > state->num_free
+        && KMEANS_OK != (result = state_reserve(state, n - state->num_free)))
+        return result;
+
+    for (size_t j = 0; j < n; ++j) {
+        const size_t id = state->num_free
+            ? state->free_ids[--state->num_free]
+            : state->num_ids++;
+
+        memcpy(state->points + (id * dim), points + (j * dim), sizeof(double) * dim);
+
+        const int cluster = state_full(state, id);
+
+        state->assignments[id] = cluster;
+        state_sum(state, id, cluster, 1.0);
+        ++meta->num_objects;
+
+        if (ids) ids[j] = id;
+
+        if (KMEANS_OK != (result = state_heap_push(state, &(state->heaps[cluster]), id)))
+            return result;
+    }
+
+    return KMEANS_OK;
+}
+
+
+kmeans_result
+kmeans_state_remove(kmeans_state *state,
+                    const size_t *ids,
+                    size_t n)
+{
+    for (size_t j = 0; j < n; ++j) {
+        const size_t id = ids[j];
+
+        if (id >= state->num_ids || state->assignments[id] < 0)
+            return KMEANS_MALFORMED_INPUT;
+
+        const int cluster = state->assignments[id];
+
+        state_sum(state, id, cluster, -1.0);
+        state_heap_remove(state, &(state->heaps[cluster]), state->positions[id]);
+
+        state->assignments[id] = -1;
+        state->free_ids[state->num_free++] = id;
+        --state->meta->num_objects;
+    }
+
+    return KMEANS_OK;
+}
+
+
+kmeans_result
+kmeans_state_update(kmeans_state *state)
+{
+    kmeans_state_meta *meta = state->meta;
+    const size_t dim = meta->dim;
+    kmeans_result result;
+
+    meta->current_iterations = 0;
+
+    while (state->dirty) {
+        size_t num_pending = 0;
+
+        if (meta->current_iterations >= meta->iterations) return KMEANS_LIMIT;
+        ++meta->current_iterations;
+
+        if (state->touched > meta->num_objects) state_refresh(state);
+
+        state_recentre(state);
+        state->dirty = 0;
+
+        /*
+         * Pop every point whose upper bound may have passed its lower bound.
+         * They are only pushed back once all heaps were swept, so a point
+         * sitting on a tie is still visited once per iteration at most.
+         */
+        for (size_t c = 0; c < meta->num_centroids; ++c) {
+            state_heap *heap = &(state->heaps[c]);
+            const double threshold = state->drifts[c] + state->drift;
+
+            while (heap->length && state_key(state, heap->ids[0]) < threshold) {
+                const size_t id = heap->ids[0];
+                const double *row = state->points + (id * dim);
+
+                state_heap_remove(state, heap, 0);
+                state->pending[num_pending++] = id;
+
+                /* Tighten the upper bound before giving up on the point. */
+                const double upper = sqrt(state->kernels->pair(
+                    row, meta->centroids + (c * dim), dim))
+                    * (1.0 + KMEANS_BOUND_SLACK);
+                ++meta->distance_evaluations;
+
+                if (upper < state->lower[id] - state->drift) {
+                    state->upper[id] = upper - state->drifts[c];
+                    continue;
+                }
+
+                const int cluster = state_full(state, id);
+                if (cluster == state->assignments[id]) continue;
+
+                state_sum(state, id, state->assignments[id], -1.0);
+                state_sum(state, id, cluster, 1.0);
+                state->assignments[id] = cluster;
+            }
+        }
+
+        for (size_t p = 0; p < num_pending; ++p) {
+            const size_t id = state->pending[p];
+            state_heap *heap = &(state->heaps[state->assignments[id]]);
+
+            if (KMEANS_OK != (result = state_heap_push(state, heap, id)))
+                return result;
+        }
+    }
+
+    return KMEANS_OK;
+}
+
+
+int
+kmeans_state_cluster(const kmeans_state *state,
+                     size_t id)
+{
+    return (id < state->num_ids) ? state->assignments[id] : -1;
+}
+
+
+const int *
+kmeans_state_assignments(const kmeans_state *state,
+                         size_t *num_ids)
+{
+    *num_ids = state->num_ids;
+    return state->assignments;
+}
+
+
+void
+kmeans_state_destroy(kmeans_state *state)
+{
+    if (!state) return;
+
+    if (state->heaps)
+        for (size_t c = 0; c < state->meta->num_centroids; ++c)
+            free(state->heaps[c].ids);
+
+    free(state->centroids_t);
+    free(state->distances);
+    free(state->points);
+    free(state->assignments);
+    free(state->upper);
+    free(state->lower);
+    free(state->positions);
+    free(state->free_ids);
+    free(state->pending);
+    free(state->sums);
+    free(state->counts);
+    free(state->heaps);
+    free(state->drifts);
+    free(state);
+}
@@ -0,0 +1,124 @@
+/*
+ * kmeans_state.h
+ *
+ * A clustering that is kept up to date while points come and go. The state
+ *  holds the points, their clusters, the per-cluster sums and Hamerly-style
+ *  distance bounds between calls, so re-clustering after a change starts from
+ *  the previous solution and only revisits the points whose bounds the moving
+ *  centroids invalidated. The cost follows the size of the change, not of the
+ *  dataset.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_STATE_H
+#define CIS579_TERMPROJECT_KMEANS_STATE_H
+
+#include <stdlib.h>
+
+#include "kmeans.h"
+
+
+/* Opaque state type. */
+typedef struct _kmeans_state kmeans_state;
+
+
+/* Meta-structure describing an incrementally maintained clustering. */
+typedef struct
+{
+    /*
+     * A row-major matrix of num_centroids x dim initial centroid values,
+     * which is updated in place by every kmeans_state_update(). User is
+     * responsible for seeding this and for its memory management. A cluster
+     * which loses all of its points keeps its last centroid.
+     */
+    double *centroids;
+
+    /* The amount of centroids, AKA 'k'. */
+    size_t num_centroids;
+
+    /* Dimensionality of each point (and each centroid). */
+    size_t dim;
+
+    /* How many iterations one update may take to converge. */
+    unsigned long iterations;
+
+    /* Iterations the last update took. Output only. */
+    unsigned long current_iterations;
+
+    /* Amount of points held right now. Output only. */
+    size_t num_objects;
+
+    /* Amount of point-to-centroid distances computed so far. Output only. */
+    unsigned long long distance_evaluations;
+} kmeans_state_meta;
+
+
+/* Create an empty state which clusters around the centroids of 'meta'. */
+kmeans_result
+kmeans_state_create(
+    kmeans_state_meta  *meta  IN OUT,
+    kmeans_state      **state OUT
+);
+
+/*
+ * Copy a row-major batch of n points into the state and assign each to its
+ *  nearest current centroid. Every point gets an id, written to 'ids' when it
+ *  is not null, which stays its own until it is removed. Ids of removed
+ *  points are handed out again. After KMEANS_NO_MEMORY here or from an update,
+ *  the state is only fit to be destroyed.
+ */
+kmeans_result
+kmeans_state_append(
+    kmeans_state *state  IN OUT,
+    const double *points IN,
+    size_t        n      IN,
+    size_t       *ids    OUT   /* optional */
+);
+
+/*
+ * Take n points out of the state by id. Stops with KMEANS_MALFORMED_INPUT at
+ *  the first id which is not a point held right now, keeping the removals
+ *  made before it.
+ */
+kmeans_result
+kmeans_state_remove(
+    kmeans_state *state IN OUT,
+    const size_t *ids   IN,
+    size_t        n     IN
+);
+
+/*
+ * Converge from the current solution: move the centroids to the means of
+ *  their points, reassign the points whose bounds no longer hold, and repeat
+ *  until nothing changes. Returns KMEANS_LIMIT when meta->iterations ran out
+ *  first, which leaves a valid state to continue from later.
+ */
+kmeans_result
+kmeans_state_update(
+    kmeans_state *state IN OUT
+);
+
+/* Get the cluster of the point with an id, or -1 if there is no such point. */
+int
+kmeans_state_cluster(
+    const kmeans_state *state IN,
+    size_t              id    IN
+);
+
+/*
+ * Get the cluster of every id handed out so far, with -1 for the removed
+ *  ones. The array holds *num_ids entries and is valid until the next append.
+ */
+const int *
+kmeans_state_assignments(
+    const kmeans_state *state   IN,
+    size_t             *num_ids OUT
+);
+
+/* Free a state. The centroids of its meta remain with the user. */
+void
+kmeans_state_destroy(
+    kmeans_state *state IN
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_STATE_H */
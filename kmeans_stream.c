@@ -0,0 +1,196 @@
+/*
+ * kmeans_stream.c
+ *
+ * Implementation of mini-batch K-Means Clustering. Every batch is assigned
+ *  against fixed centroids with the vectorized nearest kernel, and then each
+ *  centroid takes the per-center step of Sculley's mini-batch update.
+ */
+
+#include "kmeans_stream.h"
+#include "kmeans_kernels.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+
+struct _kmeans_stream
+{
+    kmeans_stream_meta *meta;
+    const kmeans_kernels *kernels;
+
+    /* The centroids in the layout of the kernels. */
+    double *centroids_t;
+    size_t stride;
+
+    /* How many points each centroid has absorbed, capped at count_limit. */
+    unsigned long *counts;
+
+    /* Sums and counts of the points each centroid received from one batch. */
+    double *sums;
+    size_t *batch_counts;
+};
+
+
+kmeans_result
+kmeans_stream_create(kmeans_stream_meta *meta,
+                     kmeans_stream **stream)
+{
+    assert(meta);
+    assert(stream);
+
+    assert(meta->centroids);
+    assert(meta->num_centroids);
+    assert(meta->dim);
+
+    const size_t k = meta->num_centroids;
+    kmeans_stream *s = calloc(1, sizeof(kmeans_stream));
+
+    *stream = NULL;
+    if (!s) return KMEANS_NO_MEMORY;
+
+    s->meta = meta;
+    s->kernels = kmeans_kernels_for(meta->dim);
+    s->stride = kmeans_block_stride(k);
+    s->centroids_t = kmeans_block_alloc(k, meta->dim);
+    s->counts = calloc(k, sizeof(unsigned long));
+    s->sums = malloc(sizeof(double) * k * meta->dim);
+    s->batch_counts = malloc(sizeof(size_t) * k);
+
+    if (!s->centroids_t || !s->counts || !s->sums || !s->batch_counts) {
+        kmeans_stream_destroy(s);
+        return KMEANS_NO_MEMORY;
+    }
+
+    meta->batches = 0;
+    meta->points = 0;
+    kmeans_block_transpose(meta->centroids, k, meta->dim, s->centroids_t);
+
+    *stream = s;
+    return KMEANS_OK;
+}
+
+
+kmeans_result
+kmeans_stream_push(kmeans_stream *stream,
+                   const double *batch,
+                   size_t n)
+{
+    assert(stream);
+
+    if (!n) return KMEANS_OK;
+    if (!batch) return KMEANS_NO_DATA;
+
+    kmeans_stream_meta *meta = stream->meta;
+    const size_t k = meta->num_centroids;
+    const size_t dim = meta->dim;
+
+    memset(stream->sums, 0, sizeof(double) * k * dim);
+    memset(stream->batch_counts, 0, sizeof(size_t) * k);
+
+    /* Assign the whole batch against the centroids as they were before it. */
+    for (size_t i = 0; i < n; ++i) {
+        const double *row = batch + (i * dim);
+        int cluster = stream->kernels->nearest(row, stream->centroids_t,
+                                               stream->stride, dim, NULL);
+        double *sum = stream->sums + (cluster * dim);
+
+        for (size_t d = 0; d < dim; ++d) sum[d] += row[d];
+        ++stream->batch_counts[cluster];
+    }
+
+    /*
+     * Stepping a centroid towards each of its m new points in turn, by
+     * 1 / count every time, lands exactly on the weighted mean of the old
+     * centroid (weighted by its count) and those points. That is applied in
+     * one step here, so only the batch sums need to be kept.
+     *
+     * Once the count is capped, every further step keeps only 1 - 1 / limit
+     * of the distance left, and the result depends on the order of the
+     * points. Those steps are taken towards the batch mean instead: the old
+     * centroid keeps the product of every step's factor, exactly as if each
+     * point had sat at the mean.
+     */
+    for (size_t c = 0; c < k; ++c) {
+        const size_t m = stream->batch_counts[c];
+        if (!m) continue;
+
+        double *centroid = meta->centroids + (c * dim);
+        const double *sum = stream->sums + (c * dim);
+        const size_t count = stream->counts[c];
+        const size_t limit = meta->count_limit;
+        const size_t free_steps = !limit ? m
+            : (count >= limit) ? 0
+            : (m < limit - count) ? m : limit - count;
+
+        if (free_steps == m) {
+            const double weight = (double)count;
+            const double total = weight + (double)m;
+
+            for (size_t d = 0; d < dim; ++d)
+                centroid[d] = ((centroid[d] * weight) + sum[d]) / total;
+        } else {
+            const double keep = ((double)count / (double)(count + free_steps))
+                * pow(1.0 - (1.0 / (double)limit), (double)(m - free_steps));
+
+            for (size_t d = 0; d < dim; ++d) {
+                const double mean = sum[d] / (double)m;
+                centroid[d] = mean + ((centroid[d] - mean) * keep);
+            }
+        }
+
+        stream->counts[c] += m;
+        if (limit && stream->counts[c] > limit) stream->counts[c] = limit;
+    }
+
+    kmeans_block_transpose(meta->centroids, k, dim, stream->centroids_t);
+
+    ++meta->batches;
+    meta->points += n;
+    return KMEANS_OK;
+}
+
+
+kmeans_result
+kmeans_stream_assign(const kmeans_stream *stream,
+                     const double *data,
+                     size_t n,
+                     int *assignments,
+                     double *inertia)
+{
+    assert(stream);
+
+    const size_t dim = stream->meta->dim;
+    double total = 0.0;
+
+    if (inertia) *inertia = 0.0;
+    if (!n) return KMEANS_OK;
+    if (!data || !assignments) return KMEANS_NO_DATA;
+
+    for (size_t i = 0; i < n; ++i) {
+        double distance;
+
+        assignments[i] = stream->kernels->nearest(data + (i * dim),
+                                                  stream->centroids_t,
+                                                  stream->stride, dim,
+                                                  &distance);
+        total += distance;
+    }
+
+    if (inertia) *inertia = total;
+    return KMEANS_OK;
+}
+
+
+void
+kmeans_stream_destroy(kmeans_stream *stream)
+{
+    if (!stream) return;
+
+    free(stream->centroids_t);
+    free(stream->counts);
+    free(stream->sums);
+    free(stream->batch_counts);
+    free(stream);
+}
@@ -0,0 +1,94 @@
+/*
+ * kmeans_stream.h
+ *
+ * Mini-batch K-Means Clustering over a stream of points. Batches are pushed
+ *  as they arrive and folded into the centroids straight away, so memory stays
+ *  proportional to num_centroids * dim no matter how many points go by.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_STREAM_H
+#define CIS579_TERMPROJECT_KMEANS_STREAM_H
+
+#include <stdlib.h>
+
+#include "kmeans.h"
+
+
+/* Opaque stream type. */
+typedef struct _kmeans_stream kmeans_stream;
+
+
+/* Meta-structure describing a streaming clustering run. */
+typedef struct
+{
+    /*
+     * A row-major matrix of num_centroids x dim initial centroid values,
+     * which is updated in place after every pushed batch. User is
+     * responsible for seeding this and for its memory management.
+     */
+    double *centroids;
+
+    /* The amount of centroids, AKA 'k'. */
+    size_t num_centroids;
+
+    /* Dimensionality of each point (and each centroid). */
+    size_t dim;
+
+    /*
+     * Each centroid moves towards a new point by 1 / n, where n counts the
+     * points it has absorbed so far. Capping n keeps every learning rate at
+     * or above 1 / count_limit, so centroids can follow a drifting feed.
+     * The capped steps of a batch are taken towards the mean of the points
+     * it brought, since their order within the batch is not kept. Zero
+     * leaves the rates to decay forever, which converges to the mean.
+     */
+    unsigned long count_limit;
+
+    /* Amount of batches and points pushed so far. */
+    unsigned long batches;
+    unsigned long points;
+} kmeans_stream_meta;
+
+
+/* Create a stream which updates the centroids of 'meta'. */
+kmeans_result
+kmeans_stream_create(
+    kmeans_stream_meta  *meta   IN OUT,
+    kmeans_stream      **stream OUT
+);
+
+/*
+ * Assign a row-major batch of n points to the current centroids, then move
+ *  every centroid towards the points it received with its own learning rate.
+ *  The batch is not retained and can be reused as soon as this returns.
+ */
+kmeans_result
+kmeans_stream_push(
+    kmeans_stream *stream IN OUT,
+    const double  *batch  IN,
+    size_t         n      IN
+);
+
+/*
+ * Optional full assignment pass: assign a row-major matrix of n points to
+ *  the final centroids without moving them. The sum of squared distances is
+ *  written to 'inertia' when it is not null. A long feed can be replayed
+ *  through this in pieces of any size.
+ */
+kmeans_result
+kmeans_stream_assign(
+    const kmeans_stream *stream      IN,
+    const double        *data        IN,
+    size_t               n           IN,
+    int                 *assignments OUT,
+    double              *inertia     OUT
+);
+
+/* Free a stream. The centroids of its meta remain with the user. */
+void
+kmeans_stream_destroy(
+    kmeans_stream *stream IN
+);
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_STREAM_H */
@@ -0,0 +1,391 @@
+/*
+ * kmeans_transport.c
+ *
+ * Implementation of the built-in channels: a Unix domain socket pair, and a
+ *  pair of shared memory mailboxes guarded by process-shared semaphores.
+ */
+
+#include "kmeans_transport.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+
+/* Mailbox size used when the user does not pick one: 1 MiB. */
+#define TRANSPORT_DEFAULT_CAPACITY ((size_t)1 << 20)
+
+/* How long a shared memory wait lasts before checking on the other end. */
+#define TRANSPORT_POLL_NS 100000000L
+
+
+/* A socket pair: the coordinator uses fds[0] and the worker fds[1]. */
+typedef struct
+{
+    kmeans_channel base;
+    int fds[2];
+} socket_channel;
+
+
+static
+kmeans_result
+socket_send(kmeans_channel *channel,
+            const void *message,
+            size_t length)
+{
+    socket_channel *self = (socket_channel *)channel;
+    const char *cursor = (const char *)message;
+
+    while (length) {
+        /* A vanished peer is reported as an error, not with SIGPIPE. */
+        ssize_t put = send(self->fds[channel->side], cursor, length, MSG_NOSIGNAL);
+
+        if (put < 0) {
+            if (EINTR == errno) continue;
+            return KMEANS_IO_ERROR;
+        }
+
+        cursor += put;
+        length -= put;
+    }
+
+    return KMEANS_OK;
+}
+
+
+static
+kmeans_result
+socket_receive(kmeans_channel *channel,
+               void *message,
+               size_t length)
+{
+    socket_channel *self = (socket_channel *)channel;
+    char *cursor = (char *)message;
+
+    while (length) {
+        ssize_t got = recv(self->fds[channel->side], cursor, length, 0);
+
+        if (got < 0) {
+            if (EINTR == errno) continue;
+            return KMEANS_IO_ERROR;
+        }
+
+        /* The other end closed the channel mid-message. */
+        if (!got) return KMEANS_IO_ERROR;
+
+        cursor += got;
+        length -= got;
+    }
+
+    return KMEANS_OK;
+}
+
+
+static
+void
+socket_attach(kmeans_channel *channel,
+              kmeans_channel_side side)
+{
+    socket_channel *self = (socket_channel *)channel;
+    const int other = (KMEANS_CHANNEL_COORDINATOR == side) ? 1 : 0;
+
+    if (self->fds[other] >= 0) close(self->fds[other]);
+    self->fds[other] = -1;
+}
+
+
+static
+void
+socket_destroy(kmeans_channel *channel)
+{
+    socket_channel *self = (socket_channel *)channel;
+
+    for (int i = 0; i < 2; ++i)
+        if (self->fds[i] >= 0) close(self->fds[i]);
+    free(self);
+}
+
+
+static const kmeans_channel_ops socket_ops = {
+    .send = socket_send,
+    .receive = socket_receive,
+    .attach = socket_attach,
+    .destroy = socket_destroy,
+};
+
+
+/*
+ * One direction of a shared memory channel. The writer waits for 'empty',
+ *  fills the data and posts 'full'; the reader does the opposite. Its data
+ *  follows the header, at the next multiple of 64 bytes.
+ */
+typedef struct
+{
+    sem_t empty;
+    sem_t full;
+    size_t length;
+} shm_mailbox;
+
+/* Start of the shared mapping, followed by the two mailboxes. */
+typedef struct
+{
+    /* The process holding each end, once it attached. */
+    pid_t pids[2];
+} shm_shared;
+
+/*
+ * A shared memory channel. Mailbox 0 carries messages to the worker, and
+ *  mailbox 1 carries them to the coordinator. Each process keeps its own copy
+ *  of this struct, so the read position in the current piece is private.
+ */
+typedef struct
+{
+    kmeans_channel base;
+
+    void *mapping;
+    size_t mapping_length;
+    size_t capacity;
+
+    shm_shared *shared;
+    shm_mailbox *boxes[2];
+
+    /* How much of the piece in the incoming mailbox was already read. */
+    size_t consumed;
+    int holding;
+} shm_channel;
+
+
+/* Round a size up to a multiple of 64 bytes. */
+static inline
+size_t
+shm_align(size_t size)
+{
+    return (size + 63) & ~(size_t)63;
+}
+
+
+static inline
+char *
+shm_data(shm_mailbox *box)
+{
+    return (char *)box + shm_align(sizeof(shm_mailbox));
+}
+
+
+/*
+ * Check whether the process at the other end has gone. A child which exited
+ *  is still found by kill() until it is reaped, so it is looked for with
+ *  waitid() first, without reaping it.
+ */
+static
+int
+shm_peer_gone(const shm_channel *self)
+{
+    const pid_t pid = self->shared->pids[1 - self->base.side];
+    siginfo_t info;
+
+    /* The other end has not attached yet. */
+    if (!pid) return 0;
+
+    memset(&info, 0, sizeof(info));
+    if (0 == waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT)
+        && pid == info.si_pid)
+        return 1;
+
+    return kill(pid, 0) < 0 && ESRCH == errno;
+}
+
+
+/* Wait on a semaphore, giving up once the other end has gone. */
+static
+kmeans_result
+shm_wait(const shm_channel *self,
+         sem_t *semaphore)
+{
+    while (1) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TRANSPORT_POLL_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_nsec -= 1000000000L;
+            ++deadline.tv_sec;
+        }
+
+        if (0 == sem_timedwait(semaphore, &deadline)) return KMEANS_OK;
+
+        if (EINTR == errno) continue;
+        if (ETIMEDOUT != errno || shm_peer_gone(self)) return KMEANS_IO_ERROR;
+    }
+}
+
+
+static
+kmeans_result
+shm_send(kmeans_channel *channel,
+         const void *message,
+         size_t length)
+{
+    shm_channel *self = (shm_channel *)channel;
+    shm_mailbox *box = self->boxes[channel->side];
+    const char *cursor = (const char *)message;
+    kmeans_result result;
+
+    while (length) {
+        size_t piece = length < self->capacity ? length : self->capacity;
+
+        if (KMEANS_OK != (result = shm_wait(self, &(box->empty)))) return result;
+
+        memcpy(shm_data(box), cursor, piece);
+        box->length = piece;
+        sem_post(&(box->full));
+
+        cursor += piece;
+        length -= piece;
+    }
+
+    return KMEANS_OK;
+}
+
+
+static
+kmeans_result
+shm_receive(kmeans_channel *channel,
+            void *message,
+            size_t length)
+{
+    shm_channel *self = (shm_channel *)channel;
+    shm_mailbox *box = self->boxes[1 - channel->side];
+    char *cursor = (char *)message;
+    kmeans_result result;
+
+    while (length) {
+        if (!self->holding) {
+            if (KMEANS_OK != (result = shm_wait(self, &(box->full))))
+                return result;
+
+            self->holding = 1;
+            self->consumed = 0;
+        }
+
+        size_t piece = box->length - self->consumed;
+        if (piece > length) piece = length;
+
+        memcpy(cursor, shm_data(box) + self->consumed, piece);
+        self->consumed += piece;
+        cursor += piece;
+        length -= piece;
+
+        /* Hand the mailbox back once its piece is used up. */
+        if (self->consumed == box->length) {
+            self->holding = 0;
+            sem_post(&(box->empty));
+        }
+    }
+
+    return KMEANS_OK;
+}
+
+
+static
+void
+shm_attach(kmeans_channel *channel,
+           kmeans_channel_side side)
+{
+    shm_channel *self = (shm_channel *)channel;
+
+    self->shared->pids[side] = getpid();
+}
+
+
+static
+void
+shm_destroy(kmeans_channel *channel)
+{
+    shm_channel *self = (shm_channel *)channel;
+
+    /* The semaphores go away with the last mapping of them. */
+    munmap(self->mapping, self->mapping_length);
+    free(self);
+}
+
+
+static const kmeans_channel_ops shm_ops = {
+    .send = shm_send,
+    .receive = shm_receive,
+    .attach = shm_attach,
+    .destroy = shm_destroy,
+};
+
+
+static
+kmeans_result
+shm_create(size_t capacity,
+           kmeans_channel **channel)
+{
+    shm_channel *self = calloc(1, sizeof(shm_channel));
+    const size_t box_length =
+        shm_align(sizeof(shm_mailbox)) + shm_align(capacity);
+
+    if (!self) return KMEANS_NO_MEMORY;
+
+    self->capacity = capacity;
+    self->mapping_length = shm_align(sizeof(shm_shared)) + (2 * box_length);
+    self->mapping = mmap(NULL, self->mapping_length, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (MAP_FAILED == self->mapping) {
+        free(self);
+        return KMEANS_NO_MEMORY;
+    }
+
+    self->shared = (shm_shared *)self->mapping;
+    for (int i = 0; i < 2; ++i) {
+        self->boxes[i] = (shm_mailbox *)((char *)self->mapping
+            + shm_align(sizeof(shm_shared)) + (i * box_length));
+
+        if (sem_init(&(self->boxes[i]->empty), 1, 1) < 0
+            || sem_init(&(self->boxes[i]->full), 1, 0) < 0) {
+            shm_destroy(&(self->base));
+            return KMEANS_IO_ERROR;
+        }
+    }
+
+    self->base.ops = &shm_ops;
+    *channel = &(self->base);
+    return KMEANS_OK;
+}
+
+
+kmeans_result
+kmeans_channel_create(kmeans_transport transport,
+                      size_t capacity,
+                      kmeans_channel **channel)
+{
+    *channel = NULL;
+
+    if (KMEANS_TRANSPORT_SHM == transport)
+        return shm_create(capacity ? capacity : TRANSPORT_DEFAULT_CAPACITY,
+                          channel);
+
+    socket_channel *self = calloc(1, sizeof(socket_channel));
+    if (!self) return KMEANS_NO_MEMORY;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, self->fds) < 0) {
+        free(self);
+        return KMEANS_IO_ERROR;
+    }
+
+    self->base.ops = &socket_ops;
+    *channel = &(self->base);
+    return KMEANS_OK;
+}
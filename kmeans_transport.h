@@ -0,0 +1,120 @@
+/*
+ * kmeans_transport.h
+ *
+ * Duplex message channels between a sharded run's coordinator and each of its
+ *  workers. A channel is a small table of methods, so any transport can carry
+ *  a run: Unix domain sockets and shared memory come built in, for several
+ *  processes on one machine.
+ */
+
+#ifndef CIS579_TERMPROJECT_KMEANS_TRANSPORT_H
+#define CIS579_TERMPROJECT_KMEANS_TRANSPORT_H
+
+#include <stdlib.h>
+
+#include "kmeans.h"
+
+
+/* Which end of a channel a process holds. */
+typedef enum
+{
+    KMEANS_CHANNEL_COORDINATOR = 0,
+    KMEANS_CHANNEL_WORKER
+} kmeans_channel_side;
+
+/* Built-in transports. */
+typedef enum
+{
+    KMEANS_TRANSPORT_SOCKET = 0,   /* a Unix domain socket pair */
+    KMEANS_TRANSPORT_SHM           /* shared memory mailboxes and semaphores */
+} kmeans_transport;
+
+
+typedef struct _kmeans_channel kmeans_channel;
+
+/*
+ * Methods of a channel. Messages are plain bytes of lengths both sides agree
+ *  on in advance, so a transport only has to move them in order; it may split
+ *  or join them as it likes.
+ */
+typedef struct
+{
+    /* Send 'length' bytes to the other end. */
+    kmeans_result (*send)(kmeans_channel *channel,
+                          const void *message,
+                          size_t length);
+
+    /* Receive exactly 'length' bytes from the other end. */
+    kmeans_result (*receive)(kmeans_channel *channel,
+                             void *message,
+                             size_t length);
+
+    /*
+     * Take one end of the channel. Channels are created before the workers
+     * are started, and each process then keeps the end it uses. Optional.
+     */
+    void (*attach)(kmeans_channel *channel,
+                   kmeans_channel_side side);
+
+    /* Release this process's end of the channel and free it. */
+    void (*destroy)(kmeans_channel *channel);
+} kmeans_channel_ops;
+
+/* Every transport embeds this at the start of its own channel type. */
+struct _kmeans_channel
+{
+    const kmeans_channel_ops *ops;
+    kmeans_channel_side side;
+};
+
+
+/*
+ * Create a channel over one of the built-in transports. Shared memory
+ *  mailboxes hold 'capacity' bytes (zero picks 1 MiB), and longer messages go
+ *  through in pieces. Sockets ignore the capacity.
+ */
+kmeans_result
+kmeans_channel_create(
+    kmeans_transport   transport IN,
+    size_t             capacity  IN,
+    kmeans_channel   **channel   OUT
+);
+
+
+/* Shorthands for calling the methods of a channel. */
+static inline
+kmeans_result
+kmeans_channel_send(kmeans_channel *channel,
+                    const void *message,
+                    size_t length)
+{
+    return (channel->ops->send)(channel, message, length);
+}
+
+static inline
+kmeans_result
+kmeans_channel_receive(kmeans_channel *channel,
+                       void *message,
+                       size_t length)
+{
+    return (channel->ops->receive)(channel, message, length);
+}
+
+static inline
+void
+kmeans_channel_attach(kmeans_channel *channel,
+                      kmeans_channel_side side)
+{
+    channel->side = side;
+    if (channel->ops->attach) (channel->ops->attach)(channel, side);
+}
+
+static inline
+void
+kmeans_channel_destroy(kmeans_channel *channel)
+{
+    if (channel) (channel->ops->destroy)(channel);
+}
+
+
+#endif   /* CIS579_TERMPROJECT_KMEANS_TRANSPORT_H */
@@ -0,0 +1,448 @@
+/*
+ * kmeans_yinyang.c
+ *
+ * Yinyang assignment engine for large k. Centroids are clustered into t
+ *  groups once, and each point keeps an upper bound on the distance to its
+ *  own centroid plus one lower bound per group. A global filter (the smallest
+ *  group bound) skips whole points, a group filter skips every centroid of a
+ *  group at once, and a local filter skips tiles of centroids within a group
+ *  by how far each tile moved. Each group is kept in transposed tiles of
+ *  KMEANS_BLOCK_WIDTH centroids, so the tiles left are measured by the block
+ *  kernel. Memory stays at O(N * t) instead of Elkan's O(N * k).
+ */
+
+#include "kmeans_internal.h"
+
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+
+/* Default amount of centroids per group when the user does not pick t. */
+#define YINYANG_CENTROIDS_PER_GROUP 64
+
+/* Lloyd iterations spent grouping the initial centroids. */
+#define YINYANG_GROUPING_ITERATIONS 5
+
+
+typedef struct
+{
+    size_t num_groups;
+
+    /* Per-point upper bounds, and num_groups lower bounds per point. */
+    double *upper;
+    double *lower;
+
+    /* Group of each centroid, and the centroids of each group in order. */
+    int *group_of;
+    size_t *group_start;   /* num_groups + 1 offsets into members */
+    int *members;
+
+    /* The members of each group as transposed tiles, and their positions. */
+    double *tiles;
+    size_t *tile_start;    /* num_groups + 1 offsets, in tiles */
+    int *tile_of;
+
+    /* The largest shift of any centroid in each group, and in each tile. */
+    double *drift;
+    double *tile_drift;
+
+    /* Per-thread space for four bounds and the nearest member of each group. */
+    double *scratch;
+    int *closest;
+} yinyang_state;
+
+
+/* Cluster the initial centroids into groups, using the dense engine itself. */
+static
+kmeans_result
+yinyang_group(kmeans_run *run,
+              yinyang_state *state)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    const size_t k = meta->num_centroids;
+    const size_t t = state->num_groups;
+    kmeans_result result = KMEANS_OK;
+    double *group_centroids = malloc(sizeof(double) * t * meta->dim);
+    size_t *counts = calloc(t, sizeof(size_t));
+
+    if (!group_centroids || !counts) {
+        result = KMEANS_NO_MEMORY;
+        goto break_out;
+    }
+
+    /* Seed the groups with evenly spaced centroids. */
+    for (size_t g = 0; g < t; ++g)
+        memcpy(group_centroids + (g * meta->dim),
+               meta->centroids + (((g * k) / t) * meta->dim),
+               sizeof(double) * meta->dim);
+
+    kmeans_dense_meta grouping = {
+            .data = meta->centroids,
+            .num_objects = k,
+            .dim = meta->dim,
+            .centroids = group_centroids,
+            .num_centroids = t,
+            .iterations = YINYANG_GROUPING_ITERATIONS,
+            .cluster_assignments = state->group_of,
+    };
+
+    result = compute_kmeans_dense(&grouping);
+    if (KMEANS_OK != result && KMEANS_LIMIT != result) goto break_out;
+    result = KMEANS_OK;
+
+    /* Lay the centroids out group by group. */
+    for (size_t c = 0; c < k; ++c) ++counts[state->group_of[c]];
+
+    state->group_start[0] = 0;
+    for (size_t g = 0; g < t; ++g)
+        state->group_start[g + 1] = state->group_start[g] + counts[g];
+
+    /* Each group starts a tile of its own. */
+    state->tile_start[0] = 0;
+    for (size_t g = 0; g < t; ++g)
+        state->tile_start[g + 1] = state->tile_start[g]
+            + (kmeans_block_stride(counts[g]) / KMEANS_BLOCK_WIDTH);
+
+    memset(counts, 0, sizeof(size_t) * t);
+    for (size_t c = 0; c < k; ++c) {
+        int g = state->group_of[c];
+        state->tile_of[c] =
+            state->tile_start[g] + (counts[g] / KMEANS_BLOCK_WIDTH);
+        state->members[state->group_start[g] + counts[g]++] = c;
+    }
+
+    state->tiles = kmeans_block_alloc(
+        state->tile_start[t] * KMEANS_BLOCK_WIDTH, meta->dim);
+    state->tile_drift = malloc(sizeof(double) * state->tile_start[t]);
+
+    if (!state->tiles || !state->tile_drift) result = KMEANS_NO_MEMORY;
+
+break_out:
+    free(group_centroids);
+    free(counts);
+    return result;
+}
+
+
+static
+kmeans_result
+yinyang_create(kmeans_run *run)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    const size_t k = meta->num_centroids;
+    yinyang_state *state = calloc(1, sizeof(yinyang_state));
+
+    if (!state) return KMEANS_NO_MEMORY;
+    run->state = state;
+
+    state->num_groups = meta->num_groups
+        ? meta->num_groups
+        : (k + YINYANG_CENTROIDS_PER_GROUP - 1) / YINYANG_CENTROIDS_PER_GROUP;
+    if (state->num_groups > k) state->num_groups = k;
+
+    /* Bounds are first written by the thread owning each point. */
+    state->upper = malloc(sizeof(double) * meta->num_objects);
+    state->lower = malloc(sizeof(double) * meta->num_objects * state->num_groups);
+    state->group_of = malloc(sizeof(int) * k);
+    state->group_start = malloc(sizeof(size_t) * (state->num_groups + 1));
+    state->members = malloc(sizeof(int) * k);
+    state->tile_start = malloc(sizeof(size_t) * (state->num_groups + 1));
+    state->tile_of = malloc(sizeof(int) * k);
+    state->drift = malloc(sizeof(double) * state->num_groups);
+    state->scratch =
+        malloc(sizeof(double) * run->num_threads * 4 * state->num_groups);
+    state->closest =
+        malloc(sizeof(int) * run->num_threads * state->num_groups);
+
+    if (!state->upper
+        || !state->lower
+        || !state->group_of
+        || !state->group_start
+        || !state->members
+        || !state->tile_start
+        || !state->tile_of
+        || !state->drift
+        || !state->scratch
+        || !state->closest)
+        return KMEANS_NO_MEMORY;
+
+    /* The tiles are first filled once the centroids have moved. */
+    return yinyang_group(run, state);
+}
+
+
+/* Measure every centroid once, when nothing is known about a point yet. */
+static inline
+int
+yinyang_full(const kmeans_run *run,
+             yinyang_state *state,
+             size_t i,
+             const double *row,
+             double *distances)
+{
+    const size_t k = run->meta->num_centroids;
+    double *lower = state->lower + (i * state->num_groups);
+    int nearest = 0;
+
+    run->kernels->distances(row, run->centroids_t, run->stride,
+                            run->meta->dim, distances);
+
+    for (size_t c = 1; c < k; ++c)
+        if (distances[c] < distances[nearest]) nearest = c;
+
+    for (size_t g = 0; g < state->num_groups; ++g) lower[g] = HUGE_VAL;
+    for (size_t c = 0; c < k; ++c) {
+        int g = state->group_of[c];
+        if ((int)c != nearest && distances[c] < lower[g]) lower[g] = distances[c];
+    }
+
+    for (size_t g = 0; g < state->num_groups; ++g)
+        lower[g] = sqrt(lower[g]) * (1.0 - KMEANS_BOUND_SLACK);
+    state->upper[i] = sqrt(distances[nearest]) * (1.0 + KMEANS_BOUND_SLACK);
+
+    return nearest;
+}
+
+
+/*
+ * Find the nearest centroid of a point whose bounds are about to be loosened
+ *  by the latest centroid shifts. Groups whose loosened bound exceeds the
+ *  upper bound are skipped entirely. Within every other group, a tile is
+ *  skipped when the group's bound, loosened by that tile's own drift, still
+ *  exceeds the upper bound, and the rest are measured one tile at a time.
+ *  Since the winner is only known at the end, each measured group keeps its
+ *  nearest and second nearest distances, its nearest member and the lowest
+ *  bound of its skipped tiles in 'scratch' (4 * t values) and 'closest'.
+ */
+static inline
+int
+yinyang_search(const kmeans_run *run,
+               yinyang_state *state,
+               size_t i,
+               const double *row,
+               int cluster,
+               double *scratch,
+               int *closest,
+               double *distances,
+               size_t *evaluations)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    const size_t t = state->num_groups;
+    const size_t dim = meta->dim;
+    double *lower = state->lower + (i * t);
+    double *first = scratch;
+    double *second = scratch + t;
+    double *stale = scratch + (2 * t);
+    double *skipped = scratch + (3 * t);
+    double global = HUGE_VAL;
+
+    /* Loosen the group bounds, keeping the previous ones for the tiles. */
+    for (size_t g = 0; g < t; ++g) {
+        stale[g] = lower[g];
+        lower[g] = (lower[g] - state->drift[g]) * (1.0 - KMEANS_BOUND_SLACK);
+        if (lower[g] < global) global = lower[g];
+    }
+
+    /* Global filter. */
+    if (state->upper[i] < global) return cluster;
+
+    /* Tighten the upper bound and try the global filter once more. */
+    const int previous = cluster;
+    const double previous_distance = run->kernels->pair(
+        row, meta->centroids + (cluster * dim), dim);
+    ++*evaluations;
+    double current = previous_distance;
+    double upper = sqrt(current) * (1.0 + KMEANS_BOUND_SLACK);
+    int previous_measured = 0;
+
+    if (upper < global) {
+        state->upper[i] = upper;
+        return cluster;
+    }
+
+    for (size_t g = 0; g < t; ++g) {
+        first[g] = -1.0;
+
+        /* Group filter. */
+        if (upper < lower[g]) continue;
+
+        const size_t group_end = state->group_start[g + 1];
+        double nearest = HUGE_VAL, runner_up = HUGE_VAL, bounded = HUGE_VAL;
+        int nearest_member = -1;
+
+        for (size_t j = state->tile_start[g]; j < state->tile_start[g + 1]; ++j) {
+            const size_t base = state->group_start[g]
+                + ((j - state->tile_start[g]) * KMEANS_BLOCK_WIDTH);
+            const size_t end = (base + KMEANS_BLOCK_WIDTH < group_end)
+                ? base + KMEANS_BLOCK_WIDTH
+                : group_end;
+
+            /* Local filter. */
+            const double bound = (stale[g] - state->tile_drift[j])
+                * (1.0 - KMEANS_BOUND_SLACK);
+            if (upper < bound) {
+                if (bound < bounded) bounded = bound;
+                continue;
+            }
+
+            run->kernels->distances(row,
+                                    state->tiles + (j * KMEANS_BLOCK_WIDTH * dim),
+                                    KMEANS_BLOCK_WIDTH, dim, distances);
+            *evaluations += end - base;
+
+            for (size_t m = base; m < end; ++m) {
+                const double distance = distances[m - base];
+
+                if (distance < nearest) {
+                    runner_up = nearest;
+                    nearest = distance;
+                    nearest_member = state->members[m];
+                } else if (distance < runner_up) {
+                    runner_up = distance;
+                }
+            }
+
+            if ((int)j == state->tile_of[previous]) previous_measured = 1;
+
+            /* Equal distances go to the lower index, as in the Lloyd loop. */
+            if (nearest < current
+                || (nearest == current && nearest_member < cluster)) {
+                cluster = nearest_member;
+                current = nearest;
+                upper = sqrt(nearest) * (1.0 + KMEANS_BOUND_SLACK);
+            }
+        }
+
+        first[g] = nearest;
+        second[g] = runner_up;
+        skipped[g] = bounded;
+        closest[g] = nearest_member;
+    }
+
+    /*
+     * A measured group's bound covers every member but the winner: the
+     * nearest measured member, or the second nearest when that is the winner,
+     * along with the bounds of its skipped tiles. Skipped tiles and groups
+     * did not cover the previous centroid, which must now be added to them.
+     */
+    for (size_t g = 0; g < t; ++g) {
+        if (first[g] < 0.0) continue;
+
+        const double bound = sqrt((closest[g] == cluster) ? second[g] : first[g])
+            * (1.0 - KMEANS_BOUND_SLACK);
+        lower[g] = (bound < skipped[g]) ? bound : skipped[g];
+    }
+
+    if (cluster != previous && !previous_measured) {
+        const int previous_group = state->group_of[previous];
+        double bound = sqrt(previous_distance) * (1.0 - KMEANS_BOUND_SLACK);
+        if (bound < lower[previous_group]) lower[previous_group] = bound;
+    }
+
+    state->upper[i] = upper;
+    return cluster;
+}
+
+
+static
+void
+yinyang_assign(kmeans_run *run,
+               size_t thread,
+               size_t lo,
+               size_t hi,
+               kmeans_partial *partial)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    yinyang_state *state = (yinyang_state *)run->state;
+    const size_t t = state->num_groups;
+    double *scratch = state->scratch + (thread * 4 * t);
+    int *closest = state->closest + (thread * t);
+
+    for (size_t i = lo; i < hi; ++i) {
+        const double *row = kmeans_run_row(run, i, partial->row);
+        int cluster = meta->cluster_assignments[i];
+
+        if (0 == run->iteration) {
+            cluster = yinyang_full(run, state, i, row, partial->distances);
+            partial->evaluations += meta->num_centroids;
+        } else {
+            /* Loosen the upper bound by how far its centroid just moved. */
+            state->upper[i] = (state->upper[i] + run->shifts[cluster])
+                * (1.0 + KMEANS_BOUND_SLACK);
+
+            cluster = yinyang_search(run, state, i, row, cluster, scratch,
+                                     closest, partial->distances,
+                                     &(partial->evaluations));
+        }
+
+        kmeans_partial_assign(partial, &(meta->cluster_assignments[i]), cluster);
+        kmeans_partial_add(partial, row, cluster, meta->dim);
+    }
+}
+
+
+/* Gather the drift of every group and tile, and lay the moved centroids out. */
+static
+void
+yinyang_moved(kmeans_run *run)
+{
+    const kmeans_dense_meta *meta = run->meta;
+    yinyang_state *state = (yinyang_state *)run->state;
+
+    memset(state->drift, 0, sizeof(double) * state->num_groups);
+
+    for (size_t g = 0; g < state->num_groups; ++g) {
+        const size_t base = state->group_start[g];
+        const size_t count = state->group_start[g + 1] - base;
+
+        for (size_t m = 0; m < count; ++m) {
+            const size_t j = state->tile_start[g] + (m / KMEANS_BLOCK_WIDTH);
+            double shift = run->shifts[state->members[base + m]]
+                * (1.0 + KMEANS_BOUND_SLACK);
+
+            if (0 == (m % KMEANS_BLOCK_WIDTH)) state->tile_drift[j] = 0.0;
+            if (shift > state->tile_drift[j]) state->tile_drift[j] = shift;
+            if (shift > state->drift[g]) state->drift[g] = shift;
+        }
+
+        kmeans_block_tile(meta->centroids, state->members + base, count,
+                          meta->dim,
+                          state->tiles
+                              + (state->tile_start[g] * KMEANS_BLOCK_WIDTH
+                                 * meta->dim));
+    }
+}
+
+
+static
+void
+yinyang_destroy(kmeans_run *run)
+{
+    yinyang_state *state = (yinyang_state *)run->state;
+
+    if (!state) return;
+
+    free(state->upper);
+    free(state->lower);
+    free(state->group_of);
+    free(state->group_start);
+    free(state->members);
+    free(state->tiles);
+    free(state->tile_start);
+    free(state->tile_of);
+    free(state->drift);
+    free(state->tile_drift);
+    free(state->scratch);
+    free(state->closest);
+    free(state);
+    run->state = NULL;
+}
+
+
+const kmeans_engine kmeans_engine_yinyang = {
+    .create = yinyang_create,
+    .assign = yinyang_assign,
+    .moved = yinyang_moved,
+    .destroy = yinyang_destroy,
+};
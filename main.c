@@ -10,8 +10,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "kmeans.h"
+#include "kmeans_seed.h"
+#include "kmeans_dataset.h"
+#include "kmeans_ooc.h"
+#include "kmeans_output.h"
+#include "kmeans_model.h"
+#include "kmeans_restart.h"
 
 
 /* Two-dimensional input data type as points. */
@@ -22,6 +30,18 @@ typedef struct point
 } point;
 
 
+/* Seconds on the monotonic clock, for timing the computation. */
+static
+double
+monotonic_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec * 1e-9);
+}
+
+
 /* Gets the linear distance between two point structures. */
 static
 double
@@ -38,46 +58,318 @@ point_distance(const object left,
 }
 
 
-/* Get and set the new centroid location for a given cluster ID. */
+/* Add a point into a running per-cluster sum. */
 static
 void
-calculate_centroid(kmeans_meta *self,
-                   const int cluster)
+point_accumulate(object sum,
+                 const object o)
 {
-    /* No objects? Don't do anything. */
-    if (self->num_objects <= 0) return;
+    ((point *)sum)->x += ((point *)o)->x;
+    ((point *)sum)->y += ((point *)o)->y;
+}
 
-    /* Local variables. */
-    point sum = { 0.0, 0.0 };
-    int num_in_cluster = 0;
 
-    /* Iterate all objects in the input data set. */
-    for (int i = 0; i < self->num_objects; ++i) {
-        /* Only care about objects associated with this cluster's centroid. */
-        if (self->cluster_assignments[i] != cluster) continue;
+/* Set the new centroid location from a cluster's accumulated sum. */
+static
+void
+point_finalize(object centroid,
+               object sum,
+               const size_t count)
+{
+    point *p_sum = (point *)sum;
 
-        /* Compute the sums of each dimension. */
-        sum.x += ((((point **)self->input_objects)[i])->x);
-        sum.y += ((((point **)self->input_objects)[i])->y);
+    /* If any points were present in the cluster, get an average in each dimension. */
+    if (count) {
+        ((point *)centroid)->x = p_sum->x / count;
+        ((point *)centroid)->y = p_sum->y / count;
+    }
+
+    /* Clear the sum for the next iteration. */
+    p_sum->x = 0.0;
+    p_sum->y = 0.0;
+}
 
-        /* Track how many points ended up in this cluster. */
-        ++num_in_cluster;
+
+/* What to write once clustering is done. */
+typedef enum
+{
+    OUTPUT_CSV = 0,   /* every point and its cluster */
+    OUTPUT_LABELS32,   /* binary int32 labels only */
+    OUTPUT_LABELS16,   /* binary uint16 labels only */
+    OUTPUT_CENTROIDS,   /* the centroids only */
+    OUTPUT_MODEL,   /* a model file for prediction */
+    OUTPUT_NONE
+} output_format;
+
+typedef struct
+{
+    output_format format;
+    const char *path;   /* standard output when null */
+    int precision;
+} output_options;
+
+
+/* Write the results in the selected format. */
+static
+kmeans_result
+write_results(const output_options *options,
+              const char *header,
+              const double *data,
+              size_t num_objects,
+              size_t dim,
+              kmeans_layout layout,
+              const int *assignments,
+              const double *centroids,
+              size_t num_centroids)
+{
+    kmeans_result result = KMEANS_OK;
+    int fd = STDOUT_FILENO;
+
+    if (OUTPUT_NONE == options->format) return KMEANS_OK;
+
+    /* Models are files of their own, laid out to be mapped back as-is. */
+    if (OUTPUT_MODEL == options->format) {
+        kmeans_model_info info = {
+                .num_centroids = num_centroids,
+                .dim = dim,
+                .num_objects = num_objects,
+        };
+        kmeans_model *model;
+
+        if (KMEANS_OK != (result = kmeans_model_create(centroids, &info, &model)))
+            return result;
+
+        result = kmeans_model_save(model, options->path);
+        kmeans_model_destroy(model);
+        return result;
     }
 
-    /* If any points were present in the cluster, get an average in each dimension. */
-    if (num_in_cluster) {
-        sum.x /= num_in_cluster;
-        sum.y /= num_in_cluster;
+    /* Anything printed so far must come out before the raw writes. */
+    fflush(stdout);
+
+    if (options->path
+        && (fd = open(options->path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return KMEANS_IO_ERROR;
+
+    switch (options->format) {
+        case OUTPUT_LABELS32:
+            result = kmeans_output_labels(fd, assignments, num_objects,
+                                          KMEANS_LABELS_INT32);
+            break;
+        case OUTPUT_LABELS16:
+            result = kmeans_output_labels(fd, assignments, num_objects,
+                                          KMEANS_LABELS_UINT16);
+            break;
+        case OUTPUT_CENTROIDS:
+            result = kmeans_output_centroids(fd, centroids, num_centroids, dim,
+                                             options->precision);
+            break;
+        case OUTPUT_CSV:
+        default:
+            result = kmeans_output_csv(fd, header, data, num_objects, dim,
+                                       layout, assignments, options->precision);
+            break;
+    }
+
+    if (options->path && close(fd) < 0 && KMEANS_OK == result)
+        result = KMEANS_IO_ERROR;
+
+    return result;
+}
+
+
+/*
+ * Cluster a dataset file through the dense interface. The matrix is used
+ *  straight from its read-only mapping, so nothing is copied or parsed.
+ */
+static
+int
+run_dataset(const char *path,
+            size_t k,
+            size_t num_threads,
+            size_t num_runs,
+            const output_options *options)
+{
+    double start_time, duration;
+    kmeans_dataset dataset;
+    kmeans_result result;
+    double *centroids = NULL;
 
-        /* Copy the sum result as the new centroid for this cluster ID. */
-        memcpy(self->centroids[cluster], &sum, sizeof(point));
+    printf("Mapping dataset '%s'.\n", path);
+    if (KMEANS_OK != (result = kmeans_dataset_open(path, &dataset))) {
+        printf("Could not open the dataset: %d\n\n", result);
+        return 1;
     }
+
+    if (KMEANS_FLOAT64 != dataset.dtype && OUTPUT_CSV == options->format) {
+        printf("Full CSV rows are only written for float64 datasets.\n\n");
+        kmeans_dataset_close(&dataset);
+        return 1;
+    }
+
+    if (k > dataset.num_objects) k = dataset.num_objects;
+
+    kmeans_dense_meta m_dense = {
+            .data = dataset.data,
+            .num_objects = dataset.num_objects,
+            .dim = dataset.dim,
+            .layout = dataset.layout,
+            .dtype = dataset.dtype,
+            .scale = dataset.scale,
+            .num_centroids = k,
+            .iterations = 1000,
+            .num_threads = num_threads,
+            .algorithm = KMEANS_AUTO,
+    };
+    m_dense.cluster_assignments = calloc(m_dense.num_objects, sizeof(int));
+
+    kmeans_restart_meta m_restart = {
+            .dense = &m_dense,
+            .num_runs = num_runs,
+            .seed = time(NULL),
+    };
+    kmeans_rng rng;
+    kmeans_rng_seed(&rng, m_restart.seed);
+
+    /* Restarted runs seed themselves, and only need room for the best one. */
+    printf("-- OK\nSeeding %zu centroids over %zu points of %zu dimensions.\n",
+           m_dense.num_centroids, m_dense.num_objects, m_dense.dim);
+    result = KMEANS_NO_MEMORY;
+    if (num_runs > 1) {
+        centroids = malloc(sizeof(double) * m_dense.num_centroids * m_dense.dim);
+        if (centroids) result = KMEANS_OK;
+    } else if (m_dense.cluster_assignments) {
+        result = kmeans_seed_plusplus(&m_dense, &rng, &centroids);
+    }
+
+    if (!m_dense.cluster_assignments || KMEANS_OK != result) {
+        printf("Seeding failed with code: %d\n\n", result);
+        free(m_dense.cluster_assignments);
+        kmeans_dataset_close(&dataset);
+        return 1;
+    }
+    m_dense.centroids = centroids;
+
+    printf("-- OK\nRunning K-means computation...\n");
+    start_time = monotonic_seconds();
+    if (num_runs > 1) result = compute_kmeans_restarts(&m_restart);
+    else result = compute_kmeans_dense(&m_dense);
+    duration = monotonic_seconds() - start_time;
+
+    printf("-- OK\n\nIteration count: %lu\n       Duration: %.3fs\n",
+           m_dense.current_iterations, duration);
+    if (num_runs > 1)
+        printf("       Best run: %zu of %zu, inertia %g\n",
+               m_restart.best_run + 1, num_runs, m_restart.inertia);
+
+    size_t *counts = calloc(k, sizeof(size_t));
+    if (counts) {
+        for (size_t i = 0; i < m_dense.num_objects; ++i)
+            ++counts[m_dense.cluster_assignments[i]];
+
+        printf("\nPoints per cluster:\n");
+        for (size_t c = 0; c < k; ++c)
+            printf("\tcentroid[%zu]: %zu\n", c, counts[c]);
+        free(counts);
+    }
+
+    if (KMEANS_OK != result) {
+        printf("K-Means failed with code: %d\n\n", result);
+    } else {
+        result = write_results(options, NULL, m_dense.data, m_dense.num_objects,
+                               m_dense.dim, m_dense.layout,
+                               m_dense.cluster_assignments, centroids, k);
+        if (KMEANS_OK != result)
+            fprintf(stderr, "Writing the results failed with code: %d\n", result);
+    }
+
+    free(m_dense.cluster_assignments);
+    free(centroids);
+    kmeans_dataset_close(&dataset);
+
+    return KMEANS_OK == result ? 0 : 1;
 }
 
 
-/* Main entrypoint. */
+/*
+ * Cluster a dataset file out of core, reading it in chunks which fit the
+ *  memory budget every iteration. Only the labels and centroids can be written,
+ *  since the points themselves are never all in memory.
+ */
+static
 int
-main()
+run_out_of_core(const char *path,
+                size_t k,
+                size_t num_threads,
+                size_t budget,
+                const output_options *options)
+{
+    double start_time, duration;
+    kmeans_result result;
+    double *centroids = NULL;
+
+    if (OUTPUT_CSV == options->format) {
+        printf("Full CSV rows are not written out of core.\n\n");
+        return 1;
+    }
+
+    kmeans_ooc_meta m_ooc = {
+            .path = path,
+            .num_centroids = k,
+            .iterations = 1000,
+            .num_threads = num_threads,
+            .memory_budget = budget,
+    };
+
+    kmeans_rng rng;
+    kmeans_rng_seed(&rng, time(NULL));
+
+    printf("Seeding %zu random centroids from '%s'.\n", k, path);
+    if (KMEANS_OK != (result = kmeans_ooc_seed(&m_ooc, &rng, &centroids))) {
+        printf("Seeding failed with code: %d\n\n", result);
+        return 1;
+    }
+    m_ooc.centroids = centroids;
+
+    m_ooc.cluster_assignments = malloc(sizeof(int) * m_ooc.num_objects);
+    if (!m_ooc.cluster_assignments) {
+        printf("Out of memory.\n\n");
+        free(centroids);
+        return 1;
+    }
+
+    printf("-- OK\nRunning K-means over %zu points of %zu dimensions"
+           " within %zu bytes...\n", m_ooc.num_objects, m_ooc.dim,
+           budget ? budget : KMEANS_OOC_DEFAULT_BUDGET);
+    start_time = monotonic_seconds();
+    result = compute_kmeans_ooc(&m_ooc);
+    duration = monotonic_seconds() - start_time;
+
+    printf("-- OK\n\nIteration count: %lu\n       Duration: %.3fs\n"
+           "     Bytes read: %llu\n",
+           m_ooc.current_iterations, duration, m_ooc.bytes_read);
+
+    if (KMEANS_OK != result) {
+        printf("K-Means failed with code: %d\n\n", result);
+    } else {
+        result = write_results(options, NULL, NULL, m_ooc.num_objects,
+                               m_ooc.dim, KMEANS_ROW_MAJOR,
+                               m_ooc.cluster_assignments, centroids, k);
+        if (KMEANS_OK != result)
+            fprintf(stderr, "Writing the results failed with code: %d\n", result);
+    }
+
+    free(m_ooc.cluster_assignments);
+    free(centroids);
+
+    return KMEANS_OK == result ? 0 : 1;
+}
+
+
+/* Run the built-in experiment over randomly generated 2D points. */
+static
+int
+run_demo(const output_options *options)
 {
     /* Choose different values here to control the experiment. */
     int k = 13;   /* Amount of clusters. */
@@ -85,7 +377,7 @@ main()
     int points_per_cluster = 180000;   /* How many points are generated per cluster. */
 
     /* Other local variables. */
-    unsigned long start_time, duration;
+    double start_time, duration;
     kmeans_result result;
 
     /* Wire up the meta structure to track details about the K-Means computation. */
@@ -93,7 +385,8 @@ main()
             .num_centroids = k,
             .num_objects = k * points_per_cluster,
             .iterations = 1000,   /* Set a maximum amount of iterations for convergence. */
-            .get_centroid = calculate_centroid,
+            .accumulate = point_accumulate,
+            .finalize = point_finalize,
             .linear_distance = point_distance,
     };
 
@@ -101,8 +394,15 @@ main()
     m_point.input_objects = calloc(m_point.num_objects, sizeof(object));
     m_point.cluster_assignments = calloc(m_point.num_objects, sizeof(int));
     m_point.centroids = calloc(m_point.num_centroids, sizeof(object));
+    m_point.accumulators = calloc(m_point.num_centroids, sizeof(object));
 
     point *pts = calloc(m_point.num_objects, sizeof(point));
+    point *sums = calloc(m_point.num_centroids, sizeof(point));
+    point *centers = calloc(m_point.num_centroids, sizeof(point));
+    double *seeds = NULL;
+
+    for (int i = 0; i < m_point.num_centroids; ++i)
+        m_point.accumulators[i] = &(sums[i]);
 
     /* Seed the random number generator with the current time. */
     srand(time(NULL));
@@ -135,12 +435,30 @@ main()
         }
     }
 
-    /* Populate initial centroids with random start positions. */
-    printf("-- OK\nInitializing %zu random centroids.\n",
+    /*
+     * Seed the initial centroids with k-means++. The picks are copies, so the
+     * centroid updates never write over the input points themselves.
+     */
+    printf("-- OK\nInitializing %zu k-means++ centroids.\n",
            m_point.num_centroids);
+    kmeans_dense_meta m_seed = {
+            .data = (const double *)pts,
+            .num_objects = m_point.num_objects,
+            .dim = sizeof(point) / sizeof(double),
+            .num_centroids = m_point.num_centroids,
+    };
+
+    kmeans_rng rng;
+    kmeans_rng_seed(&rng, time(NULL));
+
+    if (KMEANS_OK != (result = kmeans_seed_plusplus(&m_seed, &rng, &seeds))) {
+        printf("Seeding failed with code: %d\n\n", result);
+        return 1;
+    }
+
     for (int i = 0; i < m_point.num_centroids; ++i) {
-        int r = lround(m_point.num_objects * (1.0 * rand() / RAND_MAX));
-        m_point.centroids[i] = m_point.input_objects[r];
+        memcpy(&(centers[i]), seeds + (i * m_seed.dim), sizeof(point));
+        m_point.centroids[i] = &(centers[i]);
         printf("centroid[%d]\t%f\t%f\n",
                i,
                ((point *)(m_point.centroids[i]))->x,
@@ -149,12 +467,12 @@ main()
 
     /* Start the computation and track its duration. */
     printf("-- OK\nRunning K-means computation...\n");
-    start_time = time(NULL);
+    start_time = monotonic_seconds();
     result = compute_kmeans(&m_point);
-    duration = (time(NULL) - start_time);
+    duration = monotonic_seconds() - start_time;
 
     /* Output some runtime details. */
-    printf("-- OK\n\nIteration count: %lu\n       Duration: %lu\n",
+    printf("-- OK\n\nIteration count: %lu\n       Duration: %.3fs\n",
            m_point.current_iterations, duration);
     printf("           Pace: %.3f iterations every second\n\n",
            duration > 0
@@ -175,22 +493,102 @@ main()
         return 1;
     }
 
-    /* Finally, print the full results in a comma-separated value (CSV) format. */
-    printf("X, Y, Cluster\n");
-    for (int i = 0; i < m_point.num_objects; ++i) {
-        point *p = (point *)(m_point.input_objects[i]);
-
-        if (p)
-            printf("%f, %f, %d\n", p->x, p->y, m_point.cluster_assignments[i]);
-        else
-            printf("X, X, %d\n", m_point.cluster_assignments[i]);
-    }
+    /* Finally, write the full results; comma-separated values (CSV) by default. */
+    result = write_results(options, "X, Y, Cluster", (const double *)pts,
+                           m_point.num_objects, sizeof(point) / sizeof(double),
+                           KMEANS_ROW_MAJOR, m_point.cluster_assignments,
+                           (const double *)centers, m_point.num_centroids);
+    if (KMEANS_OK != result)
+        fprintf(stderr, "Writing the results failed with code: %d\n", result);
 
     /* Free allocated heap space. Not necessary (since this is the end of main), but clean. */
     free(m_point.input_objects);
     free(m_point.centroids);
     free(m_point.cluster_assignments);
+    free(m_point.accumulators);
     free(pts);
+    free(sums);
+    free(centers);
+    free(seeds);
+
+    return KMEANS_OK == result ? 0 : 1;
+}
+
+
+/* Main entrypoint. */
+int
+main(int argc,
+     char **argv)
+{
+    size_t k = 13;
+    size_t num_threads = 1;
+    size_t num_runs = 1;
+    size_t budget_mib = 0;
+    output_options options = { .format = OUTPUT_CSV, .precision = 6 };
+    int option;
+
+    while (-1 != (option = getopt(argc, argv, "k:t:n:f:o:p:m:"))) {
+        switch (option) {
+            case 'k':
+                k = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                num_threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                num_runs = strtoul(optarg, NULL, 10);
+                if (!num_runs) goto usage;
+                break;
+            case 'm':
+                budget_mib = strtoul(optarg, NULL, 10);
+                if (!budget_mib) goto usage;
+                break;
+            case 'o':
+                options.path = optarg;
+                break;
+            case 'p':
+                options.precision = atoi(optarg);
+                break;
+            case 'f':
+                if (!strcmp(optarg, "csv")) options.format = OUTPUT_CSV;
+                else if (!strcmp(optarg, "labels32")) options.format = OUTPUT_LABELS32;
+                else if (!strcmp(optarg, "labels16")) options.format = OUTPUT_LABELS16;
+                else if (!strcmp(optarg, "centroids")) options.format = OUTPUT_CENTROIDS;
+                else if (!strcmp(optarg, "model")) options.format = OUTPUT_MODEL;
+                else if (!strcmp(optarg, "none")) options.format = OUTPUT_NONE;
+                else goto usage;
+                break;
+            default:
+                goto usage;
+        }
+    }
+
+    if (OUTPUT_MODEL == options.format && !options.path) {
+        fprintf(stderr, "Models can only be written to a file given with -o.\n");
+        return 1;
+    }
+
+    /* Without a dataset file, run the built-in experiment. */
+    if (optind >= argc) return run_demo(&options);
+
+    if (!k) {
+        fprintf(stderr, "At least one cluster is needed.\n");
+        return 1;
+    }
 
-    return 0;
+    if (budget_mib)
+        return run_out_of_core(argv[optind], k, num_threads, budget_mib << 20,
+                               &options);
+
+    return run_dataset(argv[optind], k, num_threads, num_runs, &options);
+
+usage:
+    fprintf(stderr,
+            "Usage: %s [-k clusters] [-t threads] [-n runs] [-f format]"
+            " [-o file] [-p precision] [-m MiB] [dataset.kmd]\n"
+            "  formats: csv (default), labels32, labels16, centroids, model, none\n"
+            "  -n keeps the best of that many differently seeded runs\n"
+            "  -m clusters the dataset out of core within that much memory\n",
+            argv[0]);
+    return 1;
 }
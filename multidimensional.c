@@ -2,10 +2,11 @@
  * multidimensional.c
  *
  * Main executable for running k-means against a multi-dimensional set of inputs.
- * 
- * IMPORTANT NOTE: Code from this executable is pretty much the same as main.c,
- *  except the dimensionality of the randomly-generated input data is adjusted to
- *  8 instead of 2.
+ *
+ * The points live in one row-major matrix which is clustered with the dense
+ *  interface, so any dimensionality works without a point structure of its
+ *  own: pass it with -d (8 by default). Common dimensionalities run on
+ *  kernels specialized for them at compile time.
  */
 
 #include <math.h>
@@ -14,202 +15,152 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "kmeans.h"
+#include "kmeans_seed.h"
+#include "kmeans_output.h"
 
 
-/* An 8-dimensional point structure. */
-typedef struct hyperpoint
-{
-    double s;
-    double t;
-    double u;
-    double v;
-    double w;
-    double x;
-    double y;
-    double z;
-} hyperpoint;
-
-
+/* Seconds on the monotonic clock, for timing the computation. */
 static
 double
-hyperpoint_distance(const object left,
-                    const object right)
+monotonic_seconds(void)
 {
-    hyperpoint *p_left  = (hyperpoint *)left;
-    hyperpoint *p_right = (hyperpoint *)right;
-
-    double delta_s = (p_left->s - p_right->s);
-    double delta_t = (p_left->t - p_right->t);
-    double delta_u = (p_left->u - p_right->u);
-    double delta_v = (p_left->v - p_right->v);
-    double delta_w = (p_left->w - p_right->w);
-    double delta_x = (p_left->x - p_right->x);
-    double delta_y = (p_left->y - p_right->y);
-    double delta_z = (p_left->z - p_right->z);
-
-    return (delta_s * delta_s) +
-           (delta_t * delta_t) +
-           (delta_u * delta_u) +
-           (delta_v * delta_v) +
-           (delta_w * delta_w) +
-           (delta_x * delta_x) +
-           (delta_y * delta_y) +
-           (delta_z * delta_z);
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec * 1e-9);
 }
 
 
+/* The most dimensions accepted, which keeps the CSV header reasonable. */
+#define MULTI_MAX_DIM 1024
+
+
+/* Build a CSV header naming every dimension, like "D1, D2, Cluster". */
 static
-void
-calculate_centroid(kmeans_meta *self,
-                   const int cluster)
+char *
+multi_header(size_t dim)
 {
-    if (self->num_objects <= 0) return;
-
-    hyperpoint sum;
-    memset(&sum, 0, sizeof(hyperpoint));
-
-    int num_in_cluster = 0;
-
-    for (int i = 0; i < self->num_objects; ++i) {
-        /* Only care about objects associated with this cluster's centroid. */
-        if (self->cluster_assignments[i] != cluster) continue;
-
-        sum.s += ((((hyperpoint **)self->input_objects)[i])->s);
-        sum.t += ((((hyperpoint **)self->input_objects)[i])->t);
-        sum.u += ((((hyperpoint **)self->input_objects)[i])->u);
-        sum.v += ((((hyperpoint **)self->input_objects)[i])->v);
-        sum.w += ((((hyperpoint **)self->input_objects)[i])->w);
-        sum.x += ((((hyperpoint **)self->input_objects)[i])->x);
-        sum.y += ((((hyperpoint **)self->input_objects)[i])->y);
-        sum.z += ((((hyperpoint **)self->input_objects)[i])->z);
-        ++num_in_cluster;
-    }
+    char *header = malloc((dim + 1) * 16);
+    char *cursor = header;
 
-    if (!num_in_cluster) return;
+    if (!header) return NULL;
 
-    sum.s /= num_in_cluster;
-    sum.t /= num_in_cluster;
-    sum.u /= num_in_cluster;
-    sum.v /= num_in_cluster;
-    sum.w /= num_in_cluster;
-    sum.x /= num_in_cluster;
-    sum.y /= num_in_cluster;
-    sum.z /= num_in_cluster;
+    for (size_t d = 0; d < dim; ++d)
+        cursor += sprintf(cursor, "D%zu, ", d + 1);
+    strcpy(cursor, "Cluster");
 
-    memcpy(self->centroids[cluster], &sum, sizeof(hyperpoint));
+    return header;
 }
 
 
 int
-main()
+main(int argc,
+     char **argv)
 {
-    int k = 5;
+    size_t k = 5;
+    size_t dim = 8;
     int spread = 20;
-    int points_per_cluster = 3;
-    unsigned long start_time, duration;
+    size_t points_per_cluster = 3;
+    double start_time, duration;
     kmeans_result result;
+    int option;
+
+    while (-1 != (option = getopt(argc, argv, "d:k:n:"))) {
+        switch (option) {
+            case 'd': dim = strtoul(optarg, NULL, 10); break;
+            case 'k': k = strtoul(optarg, NULL, 10); break;
+            case 'n': points_per_cluster = strtoul(optarg, NULL, 10); break;
+            default: goto usage;
+        }
+    }
 
-    kmeans_meta m_point = {
-            .num_centroids = k,
+    if (!dim || dim > MULTI_MAX_DIM || !k || !points_per_cluster) goto usage;
+
+    kmeans_dense_meta m_dense = {
             .num_objects = k * points_per_cluster,
+            .dim = dim,
+            .num_centroids = k,
             .iterations = 1000,
-            .get_centroid = calculate_centroid,
-            .linear_distance = hyperpoint_distance,
+            .algorithm = KMEANS_AUTO,
     };
-    m_point.input_objects = calloc(m_point.num_objects, sizeof(object));
-    m_point.cluster_assignments = calloc(m_point.num_objects, sizeof(int));
-    m_point.centroids = calloc(m_point.num_centroids, sizeof(object));
+    double *pts = malloc(sizeof(double) * m_dense.num_objects * dim);
+    double *centroids = NULL;
+
+    m_dense.data = pts;
+    m_dense.cluster_assignments = calloc(m_dense.num_objects, sizeof(int));
 
-    hyperpoint *pts = calloc(m_point.num_objects, sizeof(hyperpoint));
+    if (!pts || !m_dense.cluster_assignments) {
+        printf("Out of memory.\n\n");
+        return 1;
+    }
 
     srand(time(NULL));
 
     /* Initialize groups of points as inputs to the algorithm. */
-    printf("Initializing %zu input points.\n", m_point.num_objects);
-    for (int i = 0; i < m_point.num_centroids; ++i) {
-        for (int j = 0; j < points_per_cluster; ++j) {
+    printf("Initializing %zu input points of %zu dimensions.\n",
+           m_dense.num_objects, dim);
+    for (size_t i = 0; i < k; ++i) {
+        for (size_t j = 0; j < points_per_cluster; ++j) {
             /* This fancy-looking bit keeps this set of points constrained
              * to the area where the cluster will appear, based on spread. */
             double u1 = 1.0 * rand() / RAND_MAX;
             double u2 = 1.0 * rand() / RAND_MAX;
+            double *row = pts + (((i * points_per_cluster) + j) * dim);
 
-            double z1 = spread * i + sqrt(-2 * log2(u1)) * cos(2 * 3.14159265 * u2);
-            double z2 = spread * i + sqrt(-2 * log2(u1)) * cos(2 * 3.14159265 * u2);
-            double z3 = spread * i + sqrt(-2 * log2(u1)) * cos(2 * 3.14159265 * u2);
-            double z4 = spread * i + sqrt(-2 * log2(u1)) * cos(2 * 3.14159265 * u2);
-            double z5 = spread * i + sqrt(-2 * log2(u1)) * cos(2 * 3.14159265 * u2);
-            double z6 = spread * i + sqrt(-2 * log2(u1)) * cos(2 * 3.14159265 * u2);
-            double z7 = spread * i + sqrt(-2 * log2(u1)) * cos(2 * 3.14159265 * u2);
-            double z8 = spread * i + sqrt(-2 * log2(u1)) * sin(2 * 3.14159265 * u2);
-
-            int n = (i * points_per_cluster) + j;
-            pts[n].s = z1;
-            pts[n].t = z2;
-            pts[n].u = z3;
-            pts[n].v = z4;
-            pts[n].w = z5;
-            pts[n].x = z6;
-            pts[n].y = z7;
-            pts[n].z = z8;
-
-            m_point.input_objects[n] = &(pts[n]);
+            for (size_t d = 0; d < dim; ++d)
+                row[d] = spread * i + sqrt(-2 * log2(u1))
+                    * ((d + 1 < dim) ? cos(2 * 3.14159265 * u2)
+                                     : sin(2 * 3.14159265 * u2));
         }
     }
 
     /* DEMO: Uncomment this for a more random point distribution. */
-    for (int i = 0; i < m_point.num_centroids; ++i) {
-        for (int j = 0; j < points_per_cluster; ++j) {
-            int n = (i * points_per_cluster) + j;
-            pts[n].s = spread * 1.0 * rand() / RAND_MAX;
-            pts[n].t = spread * 1.0 * rand() / RAND_MAX;
-            pts[n].u = spread * 1.0 * rand() / RAND_MAX;
-            pts[n].v = spread * 1.0 * rand() / RAND_MAX;
-            pts[n].w = spread * 1.0 * rand() / RAND_MAX;
-            pts[n].x = spread * 1.0 * rand() / RAND_MAX;
-            pts[n].y = spread * 1.0 * rand() / RAND_MAX;
-            pts[n].z = spread * 1.0 * rand() / RAND_MAX;
-            m_point.input_objects[n] = &(pts[n]);
-        }
+    for (size_t n = 0; n < m_dense.num_objects * dim; ++n)
+        pts[n] = spread * 1.0 * rand() / RAND_MAX;
+
+    /*
+     * Seed the initial centroids with k-means++. The picks are copies, so the
+     * centroid updates never write over the input points themselves.
+     */
+    printf("-- OK\nInitializing %zu k-means++ centroids.\n", k);
+
+    kmeans_rng rng;
+    kmeans_rng_seed(&rng, time(NULL));
+
+    if (KMEANS_OK != (result = kmeans_seed_plusplus(&m_dense, &rng, &centroids))) {
+        printf("Seeding failed with code: %d\n\n", result);
+        return 1;
     }
+    m_dense.centroids = centroids;
 
-    /* Populate initial centroids with random start positions. */
-    printf("-- OK\nInitializing %zu random centroids.\n",
-           m_point.num_centroids);
-    for (int i = 0; i < m_point.num_centroids; ++i) {
-        int r = lround(m_point.num_objects * (1.0 * rand() / RAND_MAX));
-        m_point.centroids[i] = m_point.input_objects[r];
-        printf("centroid[%d]\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%f\n",
-               i,
-               ((hyperpoint *)(m_point.centroids[i]))->s,
-               ((hyperpoint *)(m_point.centroids[i]))->t,
-               ((hyperpoint *)(m_point.centroids[i]))->u,
-               ((hyperpoint *)(m_point.centroids[i]))->v,
-               ((hyperpoint *)(m_point.centroids[i]))->w,
-               ((hyperpoint *)(m_point.centroids[i]))->x,
-               ((hyperpoint *)(m_point.centroids[i]))->y,
-               ((hyperpoint *)(m_point.centroids[i]))->z);
+    for (size_t i = 0; i < k; ++i) {
+        printf("centroid[%zu]", i);
+        for (size_t d = 0; d < dim; ++d)
+            printf("\t%f", centroids[(i * dim) + d]);
+        printf("\n");
     }
 
     printf("-- OK\nRunning K-means computation...\n");
-    start_time = time(NULL);
-    result = compute_kmeans(&m_point);
-    duration = (time(NULL) - start_time);
+    start_time = monotonic_seconds();
+    result = compute_kmeans_dense(&m_dense);
+    duration = monotonic_seconds() - start_time;
 
-    printf("-- OK\n\nIteration count: %lu\n       Duration: %lu\n",
-           m_point.current_iterations, duration);
+    printf("-- OK\n\nIteration count: %lu\n       Duration: %.3fs\n",
+           m_dense.current_iterations, duration);
     printf("           Pace: %.3f iterations every second\n\n",
            duration > 0
-            ? ((1.0 * m_point.current_iterations) / duration)
-            : m_point.current_iterations);
+            ? ((1.0 * m_dense.current_iterations) / duration)
+            : m_dense.current_iterations);
 
     printf("Points per cluster:\n");
-    for (int i = 0; i < m_point.num_centroids; ++i) {
-        int numpts = 0;
-        for (int j = 0; j < m_point.num_objects; ++j)
-            if (m_point.cluster_assignments[j] == i) ++numpts;
-        printf("\tcentroid[%d]: %d\n", i, numpts);
+    for (size_t i = 0; i < k; ++i) {
+        size_t numpts = 0;
+        for (size_t j = 0; j < m_dense.num_objects; ++j)
+            if (m_dense.cluster_assignments[j] == (int)i) ++numpts;
+        printf("\tcentroid[%zu]: %zu\n", i, numpts);
     }
 
     /* If the exit code is not OK, stop. */
@@ -219,29 +170,22 @@ main()
     }
 
     /* Finally, print the full results. */
-    printf("S, T, U, V, W, X, Y, Z, Cluster\n");
-    for (int i = 0; i < m_point.num_objects; ++i) {
-        hyperpoint *p = (hyperpoint *)(m_point.input_objects[i]);
-
-        if (p)
-            printf("%f, %f, %f, %f, %f, %f, %f, %f, %d\n",
-                p->s,
-                p->t,
-                p->u,
-                p->v,
-                p->w,
-                p->x,
-                p->y,
-                p->z,
-                m_point.cluster_assignments[i]);
-        else
-            printf("X, X, X, X, X, X, X, X, %d\n", m_point.cluster_assignments[i]);
-    }
+    char *header = multi_header(dim);
+
+    fflush(stdout);
+    result = kmeans_output_csv(STDOUT_FILENO, header, pts, m_dense.num_objects,
+                               dim, KMEANS_ROW_MAJOR,
+                               m_dense.cluster_assignments, 6);
 
-    free(m_point.input_objects);
-    free(m_point.centroids);
-    free(m_point.cluster_assignments);
+    free(header);
+    free(m_dense.cluster_assignments);
     free(pts);
+    free(centroids);
+
+    return KMEANS_OK == result ? 0 : 1;
 
-    return 0;
+usage:
+    fprintf(stderr, "Usage: %s [-d dimensions] [-k clusters] [-n points per cluster]\n",
+            argv[0]);
+    return 1;
 }